@@ -0,0 +1,78 @@
+/*
+ * WinTypes.h
+ * Windows types used by ftd2xx.h on Linux, as shipped with the FTDI D2XX
+ * driver package. Only needed when building against d2xx_sim.c without the
+ * driver package installed.
+ */
+
+#ifndef __WINDOWS_TYPES__
+#define __WINDOWS_TYPES__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+typedef unsigned int DWORD;
+typedef unsigned int ULONG;
+typedef unsigned short USHORT;
+typedef unsigned short SHORT;
+typedef unsigned char UCHAR;
+typedef unsigned short WORD;
+typedef unsigned char BYTE;
+typedef BYTE *LPBYTE;
+typedef unsigned int BOOL;
+typedef unsigned char BOOLEAN;
+typedef unsigned char CHAR;
+typedef BOOL *LPBOOL;
+typedef UCHAR *PUCHAR;
+typedef const char *LPCSTR;
+typedef char *PCHAR;
+typedef void *PVOID;
+typedef void *HANDLE;
+typedef unsigned int LONG;
+typedef int INT;
+typedef unsigned int UINT;
+typedef char *LPSTR;
+typedef char *LPTSTR;
+typedef const char *LPCTSTR;
+typedef DWORD *LPDWORD;
+typedef WORD *LPWORD;
+typedef ULONG *PULONG;
+typedef LONG *LPLONG;
+typedef PVOID LPVOID;
+typedef void VOID;
+typedef unsigned long long int ULONGLONG;
+
+typedef struct _OVERLAPPED {
+    DWORD Internal;
+    DWORD InternalHigh;
+    DWORD Offset;
+    DWORD OffsetHigh;
+    HANDLE hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+typedef struct _SECURITY_ATTRIBUTES {
+    DWORD nLength;
+    LPVOID lpSecurityDescriptor;
+    BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES, *LPSECURITY_ATTRIBUTES;
+
+typedef struct timeval SYSTEMTIME;
+typedef struct timeval FILETIME;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+#define WINAPI
+
+// Event object passed to FT_SetEventNotification
+typedef struct _EVENT_HANDLE {
+    pthread_cond_t eCondVar;
+    pthread_mutex_t eMutex;
+    int iVar;
+} EVENT_HANDLE;
+
+#endif // __WINDOWS_TYPES__
@@ -1,17 +1,36 @@
+/*
+ * Basic FT232H SPI Receiver
+ * Reads DATA_COUNT frames with CS toggled around each one, then writes SPIBin.txt
+ * Usage: basic_spi_receiver [serial number], the first FT232H if none is given
+ *
+ * Compile with: gcc -o basic_spi_receiver basic_spi_receiver.c pmu_spi.c pmu_mpsse.c pmu_calib.c pmu_time.c pmu_mem.c pmu_transport.c ftd2xx.dll
+ * Linux: gcc -o basic_spi_receiver basic_spi_receiver.c pmu_spi.c pmu_mpsse.c pmu_calib.c pmu_time.c pmu_mem.c pmu_transport.c -lftd2xx -lpthread -lm
+ * Without hardware: gcc -I. -o basic_spi_receiver_sim basic_spi_receiver.c pmu_spi.c pmu_mpsse.c pmu_calib.c pmu_time.c pmu_mem.c pmu_transport.c d2xx_sim.c -lpthread -lm
+ *
+ * Device handling, MPSSE setup and the batch reads are the shared acquisition
+ * code in pmu_spi.c, configured here for SPI mode 2 with CS toggled per frame.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <windows.h>
-#include "ftd2xx.h"
+#include "pmu_spi.h"
+#include "pmu_time.h"
 
 #define DATA_COUNT 10000
 #define BITS_PER_DATA 160
 #define BYTES_PER_DATA 20  // 160 bits = 20 bytes
 #define OUTPUT_FILE "SPIBin.txt"
 
-// Optimize buffer sizes for high-speed operation
-#define USB_BUFFER_SIZE 65536  // 64KB USB buffer
 #define BATCH_SIZE 100         // Read multiple packets in one operation
+#define BATCHES_IN_FLIGHT 2    // Batches queued in the device ahead of the one being read
+
+// Read commands per packet for SPI Mode 2: CS low (asserted), read on the
+// falling edge, CS high again. ADBUS3 = CS, SCLK idles high.
+static const MpsseFrame packet_frame = {
+    .mode = 2, .csToggle = true, .csActiveHigh = false, .csPin = 0x08, .direction = 0x0B,
+    .frameBytes = BYTES_PER_DATA, .sendImmediate = true, .dataReady = MPSSE_READY_NONE
+};
 
 // Function to convert byte array to binary string
 void bytes_to_binary_string(unsigned char* bytes, int num_bytes, char* binary_str) {
@@ -24,107 +43,8 @@ void bytes_to_binary_string(unsigned char* bytes, int num_bytes, char* binary_st
     binary_str[bit_index] = '\0';
 }
 
-// Send command without error checking for speed
-FT_STATUS send_command_fast(FT_HANDLE ftHandle, unsigned char* buffer, int length) {
-    DWORD bytesWritten;
-    return FT_Write(ftHandle, buffer, length, &bytesWritten);
-}
-
-// Initialize MPSSE mode for SPI - optimized version
-FT_STATUS initialize_mpsse_fast(FT_HANDLE ftHandle) {
-    FT_STATUS ftStatus;
-    DWORD bytesWritten, bytesRead;
-    unsigned char buffer[16];
-    
-    // Reset and enable MPSSE mode
-    FT_SetBitMode(ftHandle, 0x00, 0x00);
-    FT_SetBitMode(ftHandle, 0x00, 0x02);
-    Sleep(50);
-    
-    // Synchronize MPSSE
-    buffer[0] = 0xAA;
-    FT_Write(ftHandle, buffer, 1, &bytesWritten);
-    buffer[0] = 0xAB;
-    FT_Write(ftHandle, buffer, 1, &bytesWritten);
-    
-    Sleep(10);
-    DWORD bytesAvailable;
-    FT_GetQueueStatus(ftHandle, &bytesAvailable);
-    if (bytesAvailable > 0) {
-        unsigned char dummy[64];
-        FT_Read(ftHandle, dummy, bytesAvailable > 64 ? 64 : bytesAvailable, &bytesRead);
-    }
-    
-    // Configure clock divisor for 6MHz
-    // Clock = 60MHz / ((1 + divisor) * 2)
-    // For 6MHz: divisor = 4 (60MHz / ((1+4)*2) = 6MHz)
-    buffer[0] = 0x86;  // Set clock divisor command
-    buffer[1] = 0x04;  // Divisor low byte (4)
-    buffer[2] = 0x00;  // Divisor high byte
-    ftStatus = send_command_fast(ftHandle, buffer, 3);
-    if (ftStatus != FT_OK) return ftStatus;
-    
-    // Configure I/O pins for SPI Mode 2 with active-high CS
-    // ADBUS0 = SCLK (output, idle HIGH for CPOL=1), ADBUS1 = MOSI (output), 
-    // ADBUS2 = MISO (input), ADBUS3 = CS (output, start HIGH for active-high)
-    buffer[0] = 0x80;  // Set low byte pins command
-    buffer[1] = 0x09;  // Value: SCLK=HIGH(bit0=1), CS=HIGH(bit3=1) = 0x09
-    buffer[2] = 0x0B;  // Direction: SCLK(0), MOSI(1), CS(3) as outputs = 0x0B
-    ftStatus = send_command_fast(ftHandle, buffer, 3);
-    
-    return FT_OK;
-}
-
-// High-speed batch SPI read operation
-FT_STATUS spi_read_batch(FT_HANDLE ftHandle, unsigned char* data, int num_packets) {
-    FT_STATUS ftStatus;
-    DWORD bytesWritten, bytesRead;
-    unsigned char commandBuffer[1024];  // Large command buffer
-    int cmdIndex = 0;
-    int totalBytes = num_packets * BYTES_PER_DATA;
-    
-    // Build batch command for multiple packets
-    for (int i = 0; i < num_packets; i++) {
-        // Assert CS (active high - set CS LOW to activate)
-        commandBuffer[cmdIndex++] = 0x80;  // Set pins
-        commandBuffer[cmdIndex++] = 0x01;  // CS=LOW, SCLK=HIGH
-        commandBuffer[cmdIndex++] = 0x0B;  // Direction
-        
-        // Read command for SPI Mode 2 (falling edge)
-        commandBuffer[cmdIndex++] = 0x24;  // Read on falling edge
-        commandBuffer[cmdIndex++] = (BYTES_PER_DATA - 1) & 0xFF;
-        commandBuffer[cmdIndex++] = ((BYTES_PER_DATA - 1) >> 8) & 0xFF;
-        
-        // Deassert CS (set CS HIGH to deactivate)
-        commandBuffer[cmdIndex++] = 0x80;  // Set pins
-        commandBuffer[cmdIndex++] = 0x09;  // CS=HIGH, SCLK=HIGH  
-        commandBuffer[cmdIndex++] = 0x0B;  // Direction
-    }
-    
-    // Send immediate command
-    commandBuffer[cmdIndex++] = 0x87;
-    
-    // Send all commands at once
-    ftStatus = FT_Write(ftHandle, commandBuffer, cmdIndex, &bytesWritten);
-    if (ftStatus != FT_OK) return ftStatus;
-    
-    // Read all data at once
-    ftStatus = FT_Read(ftHandle, data, totalBytes, &bytesRead);
-    if (ftStatus != FT_OK) return ftStatus;
-    
-    if (bytesRead != totalBytes) {
-        printf("Warning: Expected %d bytes, got %d bytes\n", totalBytes, bytesRead);
-        return FT_OTHER_ERROR;
-    }
-    
-    return FT_OK;
-}
-
-int main() {
-    FT_HANDLE ftHandle;
-    FT_STATUS ftStatus;
+int main(int argc, char* argv[]) {
     FILE* output_file;
-    DWORD numDevices;
     
     // Allocate large buffer for all data in memory
     unsigned char* all_data = malloc(DATA_COUNT * BYTES_PER_DATA);
@@ -135,59 +55,24 @@ int main() {
         return -1;
     }
 
-    printf("SPI Mode: 2, CS Active High, Clock Rate: 6 MHz\n");
-    
-    // Find FTDI devices
-    ftStatus = FT_CreateDeviceInfoList(&numDevices);
-    if (ftStatus != FT_OK || numDevices == 0) {
-        printf("Error: No FTDI devices found\n");
-        free(all_data);
-        free(all_binary_strings);
-        return -1;
-    }
-    
-    // Find FT232H device
-    int ft232h_index = -1;
-    for (DWORD i = 0; i < numDevices; i++) {
-        char description[256];
-        if (FT_GetDeviceInfoDetail(i, NULL, NULL, NULL, NULL, NULL, description, NULL) == FT_OK) {
-            if (strstr(description, "FT232H") != NULL) {
-                ft232h_index = i;
-                printf("Found FT232H at device index %d\n", i);
-                break;
-            }
-        }
-    }
-    
-    if (ft232h_index == -1) {
-        printf("Error: FT232H device not found\n");
-        free(all_data);
-        free(all_binary_strings);
-        return -1;
-    }
-    
-    // Open device
-    ftStatus = FT_Open(ft232h_index, &ftHandle);
-    if (ftStatus != FT_OK) {
-        printf("Error: Failed to open FT232H device\n");
-        free(all_data);
-        free(all_binary_strings);
-        return -1;
+    printf("SPI Mode: %d, CS active %s toggled per frame, Clock Rate: 6 MHz\n", packet_frame.mode,
+           packet_frame.csActiveHigh ? "high" : "low");
+    
+    // 6 MHz as the FPGA expects, not a clock calibrated for the other reader's framing
+    SpiConfig config;
+    SPI_DefaultConfig(&config, &packet_frame, BATCH_SIZE);
+    config.useCalibration = false;
+    config.latencyMs = 1;
+    config.timeoutMs = 1000;
+    
+    // Optional serial number, to pick one of several adapters
+    if (argc > 1) {
+        snprintf(config.serial, sizeof(config.serial), "%s", argv[1]);
     }
     
-    printf("FT232H opened successfully\n");
-    
-    // Optimize device settings for high speed
-    FT_SetUSBParameters(ftHandle, USB_BUFFER_SIZE, USB_BUFFER_SIZE);  // Large USB buffers
-    FT_SetLatencyTimer(ftHandle, 1);        // Minimum latency (1ms)
-    FT_SetTimeouts(ftHandle, 1000, 1000);   // Reasonable timeouts
-    FT_Purge(ftHandle, FT_PURGE_RX | FT_PURGE_TX);
-    
-    // Initialize MPSSE
-    ftStatus = initialize_mpsse_fast(ftHandle);
-    if (ftStatus != FT_OK) {
-        printf("Error: Failed to initialize MPSSE\n");
-        FT_Close(ftHandle);
+    SpiDevice device;
+    if (!SPI_Open(&device, &config)) {
+        printf("Error: Failed to open and initialize the FT232H\n");
         free(all_data);
         free(all_binary_strings);
         return -1;
@@ -197,27 +82,40 @@ int main() {
     printf("Starting high-speed data reception...\n\n");
     
     // Record start time
-    LARGE_INTEGER frequency, start, end;
-    QueryPerformanceFrequency(&frequency);
-    QueryPerformanceCounter(&start);
+    unsigned long long start = Time_NowNs();
     
     int packets_received = 0;
-    int batch_size = BATCH_SIZE;
+    int packets_queued = 0;
+    int queued[BATCHES_IN_FLIGHT];
+    int queued_head = 0, queued_count = 0;
     
-    // Main high-speed reception loop
+    // Main high-speed reception loop: keep the next batches queued while the
+    // oldest one is read
     while (packets_received < DATA_COUNT) {
-        // Adjust batch size for remaining packets
-        if (packets_received + batch_size > DATA_COUNT) {
-            batch_size = DATA_COUNT - packets_received;
+        while (queued_count < BATCHES_IN_FLIGHT && packets_queued < DATA_COUNT) {
+            // Adjust batch size for remaining packets
+            int batch_size = DATA_COUNT - packets_queued < BATCH_SIZE ? DATA_COUNT - packets_queued : BATCH_SIZE;
+            if (!SPI_QueueBatch(&device, batch_size)) break;
+            queued[(queued_head + queued_count) % BATCHES_IN_FLIGHT] = batch_size;
+            queued_count++;
+            packets_queued += batch_size;
+        }
+        if (queued_count == 0) {
+            printf("Error: Batch read failed at packet %d\n", packets_received + 1);
+            break;
         }
         
         // Read batch of packets
-        ftStatus = spi_read_batch(ftHandle, 
-                                 all_data + (packets_received * BYTES_PER_DATA), 
-                                 batch_size);
+        int batch_size = queued[queued_head];
+        int received = SPI_CollectBatch(&device, batch_size,
+                                        all_data + (packets_received * BYTES_PER_DATA),
+                                        batch_size * BYTES_PER_DATA);
+        queued_head = (queued_head + 1) % BATCHES_IN_FLIGHT;
+        queued_count--;
         
-        if (ftStatus != FT_OK) {
-            printf("Error: Batch read failed at packet %d\n", packets_received + 1);
+        if (received != batch_size) {
+            printf("Error: Batch read failed at packet %d (%s)\n", packets_received + 1,
+                   SPI_StatusName(device.lastStatus));
             break;
         }
         
@@ -234,18 +132,19 @@ int main() {
     }
     
     // Record end time
-    QueryPerformanceCounter(&end);
-    double elapsed = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    double elapsed = (Time_NowNs() - start) / 1e9;
     
     printf("\nData reception completed!\n");
     printf("Total packets received: %d\n", packets_received);
     printf("Reception time: %.3f seconds\n", elapsed);
     printf("Effective rate: %.1f packets/second\n", packets_received / elapsed);
+    printf("Batch latency:\n");
+    SPI_PrintLatency(&device);
     
     // Now convert all data to binary strings in memory
     printf("Converting data to binary format...\n");
     
-    QueryPerformanceCounter(&start);
+    start = Time_NowNs();
     
     char* string_ptr = all_binary_strings;
     for (int i = 0; i < packets_received; i++) {
@@ -255,19 +154,18 @@ int main() {
     }
     *(string_ptr - 1) = '\0';  // Replace last newline with null terminator
     
-    QueryPerformanceCounter(&end);
-    double conversion_time = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    double conversion_time = (Time_NowNs() - start) / 1e9;
     printf("Conversion time: %.3f seconds\n", conversion_time);
     
     // Write all data to file at once
     printf("Writing data to file...\n");
     
-    QueryPerformanceCounter(&start);
+    start = Time_NowNs();
     
     output_file = fopen(OUTPUT_FILE, "w");
     if (!output_file) {
         printf("Error: Cannot create output file\n");
-        FT_Close(ftHandle);
+        SPI_Close(&device);
         free(all_data);
         free(all_binary_strings);
         return -1;
@@ -276,12 +174,11 @@ int main() {
     fwrite(all_binary_strings, 1, strlen(all_binary_strings), output_file);
     fclose(output_file);
     
-    QueryPerformanceCounter(&end);
-    double write_time = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    double write_time = (Time_NowNs() - start) / 1e9;
     printf("File write time: %.3f seconds\n", write_time);
     
     // Cleanup
-    FT_Close(ftHandle);
+    SPI_Close(&device);
     free(all_data);
     free(all_binary_strings);
     
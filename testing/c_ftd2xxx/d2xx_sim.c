@@ -0,0 +1,1322 @@
+/*
+ * d2xx_sim.c
+ * Simulated FTDI D2XX library for hardware-free testing of the SPI readers
+ *
+ * Link this file instead of libftd2xx to run the readers on any Linux box.
+ * It emulates an FT232H (or the MPSSE channels of an FT2232H or FT4232H) in
+ * MPSSE mode wired to the PMU FPGA: the MPSSE command stream written with
+ * FT_Write is interpreted against a wall-clock model of SCK, the 1 KB on-chip
+ * RX FIFO and 510-byte USB packets, and the clock-in commands return synthetic
+ * 160-bit PMU frames (4 bit counter, six 24 bit words, 12 bit checksum as
+ * checked by USBSPI_CSData6x24Bin.m).
+ *
+ * Compile with the "Without hardware" line in the header of
+ * ft232h_spi_reader.c or basic_spi_receiver.c, which lists the sources that
+ * reader needs.
+ *
+ * Environment variables:
+ *   PMU_SIM_DEVICES      Number of chips to enumerate (default 1)
+ *   PMU_SIM_CHIP         "232H" (default), "2232H" or "4232H". The channels of a
+ *                        two- or four-channel chip enumerate as devices of their own,
+ *                        serial number plus A, B, ..., like with the FTDI driver; A
+ *                        and B have an MPSSE, all channels of a chip see the same
+ *                        FPGA frame counter and are unplugged together
+ *   PMU_SIM_FRAME_RATE   FPGA frame rate in frames/s (default 10000). The FPGA's
+ *                        data-ready strobe on GPIOL1 (ADBUS5) rises as each frame is
+ *                        latched and falls half a frame period later; the MPSSE
+ *                        wait-on-I/O commands 0x88/0x89 stall on it. A 1PPS pulse
+ *                        on GPIOL0 (ADBUS4) is high for the first 100 ms of every
+ *                        FPGA second, for reading back with 0x81
+ *   PMU_SIM_BIT_OFFSET   Frame bit the FPGA starts shifting when CS asserts (default 0)
+ *   PMU_SIM_SLIP_EVERY   Drop or repeat one SCK edge every N frames (default 0, never)
+ *   PMU_SIM_BER          Random bit error rate on MISO (default 0)
+ *   PMU_SIM_MISO_DELAY   MISO settling time after the FPGA shifts, in ns (default 30).
+ *                        Sampled sooner than that, bits flip at SIM_TIMING_BER, so
+ *                        SCK above ~15 MHz (~20 MHz with three-phase clocking) fails
+ *                        when sampling on the rising edge; on the falling edge the
+ *                        bit has had a whole period to settle
+ *   PMU_SIM_PATTERN      "prbs" or "counter" sends the link test frames of
+ *                        pmu_ber.h instead of samples (default samples)
+ *   PMU_SIM_FAULT        USB fault to inject: "io" fails one call with FT_IO_ERROR and
+ *                        loses the data in flight, "unplug" also drops the device off
+ *                        the bus for PMU_SIM_FAULT_MS (default none)
+ *   PMU_SIM_FAULT_EVERY  Milliseconds between faults on an open device (default 1000)
+ *   PMU_SIM_FAULT_MS     Time an unplugged device stays away (default 500)
+ *
+ * Only the D2XX calls used by the programs in this directory are implemented.
+ * WinTypes.h supplies the Windows types ftd2xx.h expects on Linux, in case the
+ * FTDI driver package is not installed.
+ *
+ * sim_check.py builds both readers with this file and checks what
+ * ft232h_spi_reader writes against the simulated frames, with and without
+ * injected faults; it exits with 1 on a regression.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ftd2xx.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define SIM_MAX_DEVICES         16          // Channels of all chips together
+#define SIM_FRAME_BITS          160
+#define SIM_FRAME_BYTES         (SIM_FRAME_BITS / 8)
+#define SIM_CHIP_FIFO           1024        // FT232H on-chip RX FIFO
+#define SIM_PACKET_PAYLOAD      510         // 512-byte HS packet minus 2 status bytes
+#define SIM_CMD_QUEUE           (1 << 20)   // Host TX buffer for MPSSE commands
+#define SIM_MIN_HOST_RX         65536       // Host RX buffer lower bound
+#define SIM_MASTER_CLOCK        60000000.0  // MPSSE clock with divide-by-5 disabled
+#define SIM_ENGINE_MAX_SLEEP_NS 1000000     // Engine thread wakes at least every 1 ms
+#define SIM_ENGINE_MIN_SLEEP_NS 20000
+#define SIM_TIMING_BER          1e-3        // MISO error rate when sampled before it settles
+
+// ADBUS pin assignment used by both readers
+#define PIN_SCK     0x01
+#define PIN_MOSI    0x02
+#define PIN_MISO    0x04
+#define PIN_CS      0x08
+#define PIN_GPIOL0  0x10        // FPGA 1PPS output
+#define PIN_GPIOL1  0x20        // FPGA data-ready strobe
+#define SIM_PPS_HIGH_NS 100000000LL     // 1PPS pulse width
+
+typedef struct {
+    int channels;               // Per chip: 1 (FT232H), 2 (FT2232H) or 4 (FT4232H)
+    DWORD chipType;
+    int frameRate;
+    int bitOffset;
+    int slipEvery;
+    double bitErrorRate;
+    double misoDelayNs;
+    int pattern;
+    int fault;
+    long faultEveryMs;
+    long faultMs;
+} SimConfig;
+
+// What the FPGA sends
+enum {
+    SIM_PATTERN_SAMPLES,        // Sine waves on the six words
+    SIM_PATTERN_PRBS,           // Frame number, then PRBS-31 continuing from frame to frame
+    SIM_PATTERN_COUNTER         // Frame number, then the five numbers after it
+};
+
+// Injected faults
+enum {
+    SIM_FAULT_NONE,
+    SIM_FAULT_IO,               // One call fails, the data in flight is lost
+    SIM_FAULT_UNPLUG            // The handle dies and the device is gone for a while
+};
+
+typedef struct SimDeviceInfo {
+    char serial[16];
+    char description[64];
+    DWORD locId;
+    int channel;                // 0 for A, 1 for B, ...
+    struct SimDeviceInfo* chip; // Channel A of the chip, which holds the state below
+    struct SimHandle* handle;   // Non-NULL while opened
+    int64_t fpgaStartNs;        // The FPGA keeps running while the device is closed
+    int64_t absentUntilNs;      // Unplugged until then
+    int64_t unpluggedNs;        // Last time the chip went off the bus
+} SimDeviceInfo;
+
+// Kinds of MPSSE operation that take SCK time
+enum {
+    OP_NONE,
+    OP_SHIFT,           // Data shifting command (0x10-0x3F), in and/or out
+    OP_WAIT             // Wait on I/O (0x88/0x89) for a GPIOL1 level
+};
+
+typedef struct SimHandle {
+    SimDeviceInfo* info;
+    pthread_mutex_t lock;
+    pthread_cond_t rxChanged;   // Signalled when host-visible RX data grows
+    pthread_cond_t wake;        // Wakes the engine thread
+    pthread_t engine;
+    bool running;
+
+    // Host side settings
+    DWORD readTimeoutMs;
+    DWORD writeTimeoutMs;
+    UCHAR latencyMs;
+    ULONG inTransferSize;
+    UCHAR bitMode;
+    DWORD eventMask;
+    EVENT_HANDLE* event;
+    uint64_t eventVisible;      // rxVisible when the event was last signalled
+
+    // Host -> chip command queue
+    UCHAR* cmd;
+    size_t cmdHead;             // Next byte to parse
+    size_t cmdTail;             // End of written bytes
+
+    // Chip -> host RX ring: [rxTail, rxVisible) is readable by the host,
+    // [rxVisible, rxHead) is still in the chip FIFO waiting for a USB packet
+    UCHAR* rx;
+    size_t rxCap;
+    size_t hostCap;
+    uint64_t rxHead, rxVisible, rxTail;
+    int64_t chipFirstNs;        // When the oldest byte entered the chip FIFO
+    bool flushRequested;        // 0x87 seen
+
+    // MPSSE state
+    int64_t engineNs;           // Emulated MPSSE time cursor
+    int divisor;
+    bool divideBy5;
+    bool threePhase;
+    bool sampleFalling;         // The last shift-in command read MISO on the falling edge
+    bool loopback;
+    UCHAR lowValue, lowDir, highValue, highDir;
+    int opKind;
+    UCHAR opCode;
+    long opRemaining;           // Bytes (or bits for bit commands) still to shift
+
+    // FPGA model
+    SimConfig config;
+    int64_t startNs;
+    uint64_t bitPos;            // Position in the back-to-back frame stream
+    uint64_t latchedSlot;
+    UCHAR frame[SIM_FRAME_BYTES];
+    uint32_t prbs;              // PRBS-31 state after the payload of prbsSample
+    uint64_t prbsSample;        // Sample the payload in prbsWords is for, plus one; 0 for none
+    unsigned int prbsWords[5];
+    uint64_t framesClocked;
+    uint64_t slipCount;
+    uint64_t bitsClocked;
+    uint64_t nextErrorBit;
+    double bitErrorRate;        // PMU_SIM_BER plus timing errors at the current SCK
+    uint64_t rng;
+    int64_t nextFaultNs;
+    int64_t openNs;
+    bool lost;                  // Unplugged, every call fails until closed
+} SimHandle;
+
+static SimDeviceInfo Devices[SIM_MAX_DEVICES];
+static int DeviceCount;
+static SimConfig Config;
+static pthread_once_t ConfigOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t DeviceLock = PTHREAD_MUTEX_INITIALIZER;
+
+// ---------------------------------------------------------------------------
+// Helpers
+// ---------------------------------------------------------------------------
+
+static int64_t Sim_NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void Sim_Deadline(struct timespec* ts, int64_t ns)
+{
+    ts->tv_sec = ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+static long Sim_EnvLong(const char* name, long fallback)
+{
+    const char* value = getenv(name);
+    return value && *value ? strtol(value, NULL, 0) : fallback;
+}
+
+static double Sim_EnvDouble(const char* name, double fallback)
+{
+    const char* value = getenv(name);
+    return value && *value ? strtod(value, NULL) : fallback;
+}
+
+static void Sim_LoadConfig(void)
+{
+    Config.frameRate = (int)Sim_EnvLong("PMU_SIM_FRAME_RATE", 10000);
+    Config.bitOffset = (int)(Sim_EnvLong("PMU_SIM_BIT_OFFSET", 0) % SIM_FRAME_BITS);
+    Config.slipEvery = (int)Sim_EnvLong("PMU_SIM_SLIP_EVERY", 0);
+    Config.bitErrorRate = Sim_EnvDouble("PMU_SIM_BER", 0.0);
+    Config.misoDelayNs = Sim_EnvDouble("PMU_SIM_MISO_DELAY", 30.0);
+    const char* pattern = getenv("PMU_SIM_PATTERN");
+    Config.pattern = !pattern ? SIM_PATTERN_SAMPLES : strcmp(pattern, "prbs") == 0 ? SIM_PATTERN_PRBS
+                   : strcmp(pattern, "counter") == 0 ? SIM_PATTERN_COUNTER : SIM_PATTERN_SAMPLES;
+    const char* fault = getenv("PMU_SIM_FAULT");
+    Config.fault = !fault ? SIM_FAULT_NONE : strcmp(fault, "io") == 0 ? SIM_FAULT_IO
+                 : strcmp(fault, "unplug") == 0 ? SIM_FAULT_UNPLUG : SIM_FAULT_NONE;
+    Config.faultEveryMs = Sim_EnvLong("PMU_SIM_FAULT_EVERY", 1000);
+    Config.faultMs = Sim_EnvLong("PMU_SIM_FAULT_MS", 500);
+    if (Config.faultEveryMs <= 0) Config.fault = SIM_FAULT_NONE;
+    if (Config.frameRate <= 0) Config.frameRate = 10000;
+
+    const char* chip = getenv("PMU_SIM_CHIP");
+    Config.channels = 1;
+    Config.chipType = FT_DEVICE_232H;
+    if (chip && strcmp(chip, "2232H") == 0) {
+        Config.channels = 2;
+        Config.chipType = FT_DEVICE_2232H;
+    } else if (chip && strcmp(chip, "4232H") == 0) {
+        Config.channels = 4;
+        Config.chipType = FT_DEVICE_4232H;
+    }
+
+    int chips = (int)Sim_EnvLong("PMU_SIM_DEVICES", 1);
+    if (chips < 0) chips = 0;
+    if (chips > SIM_MAX_DEVICES / Config.channels) chips = SIM_MAX_DEVICES / Config.channels;
+    DeviceCount = chips * Config.channels;
+
+    for (int i = 0; i < DeviceCount; i++) {
+        SimDeviceInfo* info = &Devices[i];
+        int channel = i % Config.channels;
+        info->channel = channel;
+        info->chip = &Devices[i - channel];
+        info->locId = 0x1000 + i;
+        if (Config.channels == 1) {
+            snprintf(info->serial, sizeof(info->serial), "SIM%05d", i + 1);
+            snprintf(info->description, sizeof(info->description), "FT232H Simulated");
+        } else {
+            snprintf(info->serial, sizeof(info->serial), "SIM%05d%c", i / Config.channels + 1, 'A' + channel);
+            snprintf(info->description, sizeof(info->description), "%s RS232-HS %c",
+                     Config.channels == 2 ? "Dual" : "Quad", 'A' + channel);
+        }
+    }
+}
+
+static uint64_t Sim_Random(SimHandle* h)
+{
+    // xorshift64*
+    h->rng ^= h->rng >> 12;
+    h->rng ^= h->rng << 25;
+    h->rng ^= h->rng >> 27;
+    return h->rng * 2685821657736338717ULL;
+}
+
+// Distance in bits to the next injected bit error (geometric distribution)
+static uint64_t Sim_NextErrorGap(SimHandle* h)
+{
+    double ber = h->bitErrorRate;
+    if (ber <= 0.0) return UINT64_MAX;
+    if (ber >= 1.0) return 1;
+    double u = ((Sim_Random(h) >> 11) + 1.0) / 9007199254740993.0;
+    return 1 + (uint64_t)(log(u) / log(1.0 - ber));
+}
+
+static double Sim_SckHz(const SimHandle* h)
+{
+    double master = h->divideBy5 ? SIM_MASTER_CLOCK / 5.0 : SIM_MASTER_CLOCK;
+    double sck = master / ((1.0 + h->divisor) * 2.0);
+    // Three-phase clocking stretches each bit to 1.5 periods
+    return h->threePhase ? sck * 2.0 / 3.0 : sck;
+}
+
+static int64_t Sim_BitNs(const SimHandle* h)
+{
+    int64_t ns = (int64_t)(1e9 / Sim_SckHz(h));
+    return ns > 0 ? ns : 1;
+}
+
+// The FPGA shifts MISO on the falling edge; the FT232H samples half a bit
+// later, or two thirds of a bit later with three-phase clocking, or a whole
+// bit later on the falling edge
+static void Sim_ClockChanged(SimHandle* h)
+{
+    double windowNs = 1e9 / Sim_SckHz(h) * (h->sampleFalling ? 1.0 : h->threePhase ? 2.0 / 3.0 : 0.5);
+    h->bitErrorRate = h->config.bitErrorRate;
+    if (windowNs < h->config.misoDelayNs) {
+        h->bitErrorRate += SIM_TIMING_BER;
+    }
+    uint64_t gap = Sim_NextErrorGap(h);
+    h->nextErrorBit = gap == UINT64_MAX ? UINT64_MAX : h->bitsClocked + gap;
+}
+
+static bool Sim_CsActive(const SimHandle* h)
+{
+    return (h->lowDir & PIN_CS) && !(h->lowValue & PIN_CS);
+}
+
+// ---------------------------------------------------------------------------
+// FPGA frame model
+// ---------------------------------------------------------------------------
+
+// Next 24 bits of the PRBS-31 sequence (x^31 + x^28 + 1), one bit at a time
+// as the FPGA's shift register would
+static unsigned int Sim_PrbsWord(uint32_t* state)
+{
+    unsigned int word = 0;
+    for (int i = 0; i < 24; i++) {
+        unsigned int bit = ((*state >> 30) ^ (*state >> 27)) & 1;
+        *state = ((*state << 1) | bit) & 0x7FFFFFFF;
+        word = (word << 1) | bit;
+    }
+    return word;
+}
+
+// Link test payload of a sample: the PRBS runs on through every sample,
+// whether it is read or not
+static void Sim_PatternWords(SimHandle* h, uint64_t sample, unsigned int* words)
+{
+    words[0] = (unsigned int)(sample & 0xFFFFFF);
+    if (h->config.pattern == SIM_PATTERN_COUNTER) {
+        for (int i = 1; i < 6; i++) words[i] = (unsigned int)((sample + i) & 0xFFFFFF);
+        return;
+    }
+    if (h->prbsSample == 0 || sample + 1 < h->prbsSample) {
+        h->prbs = 0x7FFFFFFF;
+        h->prbsSample = 0;
+    }
+    while (h->prbsSample <= sample) {
+        for (int i = 0; i < 5; i++) h->prbsWords[i] = Sim_PrbsWord(&h->prbs);
+        h->prbsSample++;
+    }
+    memcpy(words + 1, h->prbsWords, sizeof(h->prbsWords));
+}
+
+// Each channel of a chip carries other signals of the same FPGA sample
+static void Sim_BuildFrame(SimHandle* h, uint64_t sample)
+{
+    static const double phase[6] = { 0.0, -2.0943951, 2.0943951, -0.5, -2.5943951, 1.5943951 };
+    double t = (double)sample / h->config.frameRate;
+    double channelPhase = h->info->channel * 0.25;
+    unsigned int words[6];
+    unsigned int checksum = sample & 0xF;
+
+    if (h->config.pattern != SIM_PATTERN_SAMPLES) {
+        Sim_PatternWords(h, sample, words);
+    }
+    for (int i = 0; i < 6; i++) {
+        double amplitude = i < 3 ? 0x3FFFFF : 0x1FFFFF;
+        if (h->config.pattern == SIM_PATTERN_SAMPLES) {
+            words[i] = (unsigned int)(0x800000 + amplitude * sin(2.0 * M_PI * 50.0 * t + phase[i] + channelPhase))
+                       & 0xFFFFFF;
+        }
+        checksum += (words[i] >> 12) + (words[i] & 0xFFF);
+    }
+    checksum &= 0xFFF;
+
+    // Pack counter, words and checksum MSB first into 40 nibbles
+    UCHAR* f = h->frame;
+    memset(f, 0, SIM_FRAME_BYTES);
+    int nibble = 0;
+    f[0] = (UCHAR)((sample & 0xF) << 4);
+    nibble = 1;
+    for (int i = 0; i < 6; i++) {
+        for (int shift = 20; shift >= 0; shift -= 4, nibble++) {
+            UCHAR value = (words[i] >> shift) & 0xF;
+            f[nibble / 2] |= (nibble & 1) ? value : (UCHAR)(value << 4);
+        }
+    }
+    for (int shift = 8; shift >= 0; shift -= 4, nibble++) {
+        UCHAR value = (checksum >> shift) & 0xF;
+        f[nibble / 2] |= (nibble & 1) ? value : (UCHAR)(value << 4);
+    }
+}
+
+// Latch the newest FPGA sample when the shift register starts a new frame
+static void Sim_LatchFrame(SimHandle* h, int64_t nowNs)
+{
+    uint64_t slot = h->bitPos / SIM_FRAME_BITS;
+    if (slot == h->latchedSlot) return;
+    h->latchedSlot = slot;
+
+    int64_t elapsed = nowNs - h->startNs;
+    uint64_t sample = elapsed > 0 ? (uint64_t)((double)elapsed * h->config.frameRate / 1e9) : 0;
+    Sim_BuildFrame(h, sample);
+}
+
+// Data-ready strobe level at nowNs: high for the first half of each frame period
+static bool Sim_ReadyLevel(const SimHandle* h, int64_t nowNs)
+{
+    if (nowNs < h->startNs) return false;
+    double frames = (double)(nowNs - h->startNs) * h->config.frameRate / 1e9;
+    return frames - floor(frames) < 0.5;
+}
+
+// 1PPS level at nowNs, counted from the FPGA's start like its frames
+static bool Sim_PpsLevel(const SimHandle* h, int64_t nowNs)
+{
+    return nowNs >= h->startNs && (nowNs - h->startNs) % 1000000000LL < SIM_PPS_HIGH_NS;
+}
+
+// First time at or after fromNs the strobe is at the level wanted. An edge is
+// placed 1 ns late, so Sim_LatchFrame sees the new sample at a rising edge.
+static int64_t Sim_ReadyNs(const SimHandle* h, int64_t fromNs, bool high)
+{
+    if (Sim_ReadyLevel(h, fromNs) == high) return fromNs;
+    if (fromNs < h->startNs) return h->startNs + 1;
+
+    double periodNs = 1e9 / h->config.frameRate;
+    double frame = floor((double)(fromNs - h->startNs) / periodNs);
+    double edge = high ? frame + 1.0 : frame + 0.5;
+    return h->startNs + (int64_t)ceil(edge * periodNs) + 1;
+}
+
+// Called after the last bit of a frame has been shifted out
+static void Sim_FrameDone(SimHandle* h)
+{
+    h->framesClocked++;
+    if (h->config.slipEvery > 0 && h->framesClocked % h->config.slipEvery == 0) {
+        // Alternate an extra SCK edge seen only by the FPGA and a dropped one
+        if (h->slipCount++ & 1) {
+            h->bitPos--;
+        } else {
+            h->bitPos++;
+        }
+    }
+}
+
+// Shift nbits (1..8) in from MISO, MSB first
+static UCHAR Sim_ShiftIn(SimHandle* h, int nbits, int64_t nowNs)
+{
+    UCHAR value = 0;
+
+    if (!Sim_CsActive(h)) {
+        h->bitsClocked += nbits;
+        return (UCHAR)(0xFF << (8 - nbits));    // MISO pulled up while deselected
+    }
+
+    Sim_LatchFrame(h, nowNs);
+    unsigned int within = h->bitPos % SIM_FRAME_BITS;
+
+    if (nbits == 8 && (within & 7) == 0 && h->bitsClocked + 8 < h->nextErrorBit) {
+        // Byte-aligned fast path
+        value = h->frame[within >> 3];
+        h->bitPos += 8;
+        h->bitsClocked += 8;
+        if (within + 8 == SIM_FRAME_BITS) Sim_FrameDone(h);
+        return value;
+    }
+
+    for (int i = 0; i < nbits; i++) {
+        Sim_LatchFrame(h, nowNs);
+        within = h->bitPos % SIM_FRAME_BITS;
+        int bit = (h->frame[within >> 3] >> (7 - (within & 7))) & 1;
+        if (++h->bitsClocked >= h->nextErrorBit) {
+            bit ^= 1;
+            h->nextErrorBit = h->bitsClocked + Sim_NextErrorGap(h);
+        }
+        value |= (UCHAR)(bit << (7 - i));
+        h->bitPos++;
+        if (within == SIM_FRAME_BITS - 1) Sim_FrameDone(h);
+    }
+
+    return value;
+}
+
+// ---------------------------------------------------------------------------
+// MPSSE engine
+// ---------------------------------------------------------------------------
+
+static size_t Sim_ChipPending(const SimHandle* h)
+{
+    return (size_t)(h->rxHead - h->rxVisible);
+}
+
+static size_t Sim_HostVisible(const SimHandle* h)
+{
+    return (size_t)(h->rxVisible - h->rxTail);
+}
+
+static void Sim_PushRx(SimHandle* h, UCHAR value, int64_t nowNs)
+{
+    if (Sim_ChipPending(h) == 0) h->chipFirstNs = nowNs;
+    h->rx[h->rxHead % h->rxCap] = value;
+    h->rxHead++;
+}
+
+// Move chip FIFO contents to the host in USB packets
+static void Sim_Deliver(SimHandle* h, int64_t nowNs)
+{
+    size_t pending = Sim_ChipPending(h);
+
+    while (pending >= SIM_PACKET_PAYLOAD && h->hostCap - Sim_HostVisible(h) >= SIM_PACKET_PAYLOAD) {
+        h->rxVisible += SIM_PACKET_PAYLOAD;
+        pending -= SIM_PACKET_PAYLOAD;
+        h->chipFirstNs = nowNs;
+    }
+
+    // Short packet on latency timer expiry or send-immediate
+    bool latencyExpired = nowNs - h->chipFirstNs >= (int64_t)h->latencyMs * 1000000LL;
+    if (pending > 0 && (h->flushRequested || latencyExpired) &&
+        h->hostCap - Sim_HostVisible(h) >= pending) {
+        h->rxVisible += pending;
+        h->flushRequested = false;
+    } else if (pending == 0) {
+        h->flushRequested = false;
+    }
+}
+
+static size_t Sim_CmdAvailable(const SimHandle* h)
+{
+    return h->cmdTail - h->cmdHead;
+}
+
+static UCHAR Sim_CmdByte(const SimHandle* h, size_t offset)
+{
+    return h->cmd[h->cmdHead + offset];
+}
+
+static void Sim_SetLowPins(SimHandle* h, UCHAR value, UCHAR dir)
+{
+    bool wasActive = Sim_CsActive(h);
+    h->lowValue = value;
+    h->lowDir = dir;
+
+    // Asserting CS restarts the FPGA shift register at the configured frame bit
+    if (!wasActive && Sim_CsActive(h)) {
+        h->bitPos = (h->bitPos / SIM_FRAME_BITS + 1) * SIM_FRAME_BITS + h->config.bitOffset;
+    }
+}
+
+static void Sim_ResetMpsse(SimHandle* h)
+{
+    h->divisor = 0xFFFF;
+    h->divideBy5 = true;
+    h->threePhase = false;
+    h->loopback = false;
+    h->lowValue = h->lowDir = 0;
+    h->highValue = h->highDir = 0;
+    h->opKind = OP_NONE;
+    h->opRemaining = 0;
+    Sim_ClockChanged(h);
+}
+
+// Parse one command from the queue. Returns false if more bytes are needed.
+static bool Sim_FetchCommand(SimHandle* h, int64_t nowNs)
+{
+    size_t avail = Sim_CmdAvailable(h);
+    if (avail == 0) return false;
+
+    UCHAR op = Sim_CmdByte(h, 0);
+
+    if (h->bitMode != FT_BITMODE_MPSSE) {
+        // Not in MPSSE mode: bytes would go out of the UART, drop them
+        h->cmdHead = h->cmdTail;
+        return true;
+    }
+
+    // Data shifting commands
+    if (op < 0x40 && (op & 0x30)) {
+        bool bitMode = (op & 0x02) != 0;
+        if (avail < (size_t)(bitMode ? 2 : 3)) return false;
+        long length = bitMode ? Sim_CmdByte(h, 1) + 1
+                              : (Sim_CmdByte(h, 1) | (Sim_CmdByte(h, 2) << 8)) + 1;
+        h->cmdHead += bitMode ? 2 : 3;
+        h->opKind = OP_SHIFT;
+        h->opCode = op;
+        h->opRemaining = length;
+        if ((op & 0x20) && ((op & 0x04) != 0) != h->sampleFalling) {
+            h->sampleFalling = (op & 0x04) != 0;
+            Sim_ClockChanged(h);
+        }
+        return true;
+    }
+
+    switch (op) {
+    case 0x80:
+    case 0x82:
+        if (avail < 3) return false;
+        if (op == 0x80) {
+            Sim_SetLowPins(h, Sim_CmdByte(h, 1), Sim_CmdByte(h, 2));
+        } else {
+            h->highValue = Sim_CmdByte(h, 1);
+            h->highDir = Sim_CmdByte(h, 2);
+        }
+        h->cmdHead += 3;
+        return true;
+
+    case 0x81: {
+        UCHAR inputs = (UCHAR)~PIN_MISO & (Sim_ReadyLevel(h, nowNs) ? 0xFF : (UCHAR)~PIN_GPIOL1) &
+                       (Sim_PpsLevel(h, nowNs) ? 0xFF : (UCHAR)~PIN_GPIOL0);
+        Sim_PushRx(h, (UCHAR)((h->lowValue & h->lowDir) | (~h->lowDir & inputs)), nowNs);
+        h->cmdHead += 1;
+        return true;
+    }
+
+    case 0x83:
+        Sim_PushRx(h, (UCHAR)((h->highValue & h->highDir) | ~h->highDir), nowNs);
+        h->cmdHead += 1;
+        return true;
+
+    case 0x84: h->loopback = true; h->cmdHead += 1; return true;
+    case 0x85: h->loopback = false; h->cmdHead += 1; return true;
+
+    case 0x86:
+        if (avail < 3) return false;
+        h->divisor = Sim_CmdByte(h, 1) | (Sim_CmdByte(h, 2) << 8);
+        h->cmdHead += 3;
+        Sim_ClockChanged(h);
+        return true;
+
+    case 0x87: h->flushRequested = true; h->cmdHead += 1; return true;
+
+    case 0x88:
+    case 0x89:
+        h->opKind = OP_WAIT;
+        h->opCode = op;
+        h->cmdHead += 1;
+        return true;
+    case 0x8A: h->divideBy5 = false; h->cmdHead += 1; Sim_ClockChanged(h); return true;
+    case 0x8B: h->divideBy5 = true; h->cmdHead += 1; Sim_ClockChanged(h); return true;
+    case 0x8C: h->threePhase = true; h->cmdHead += 1; Sim_ClockChanged(h); return true;
+    case 0x8D: h->threePhase = false; h->cmdHead += 1; Sim_ClockChanged(h); return true;
+    case 0x96:
+    case 0x97: h->cmdHead += 1; return true;   // Adaptive clocking has no effect here
+
+    default:
+        // Bad command: the MPSSE echoes 0xFA followed by the opcode
+        Sim_PushRx(h, 0xFA, nowNs);
+        Sim_PushRx(h, op, nowNs);
+        h->cmdHead += 1;
+        return true;
+    }
+}
+
+// Run the MPSSE up to nowNs. Caller holds the lock.
+static void Sim_Advance(SimHandle* h, int64_t nowNs)
+{
+    while (h->engineNs < nowNs) {
+        if (h->opKind == OP_NONE) {
+            if (Sim_ChipPending(h) + 2 > SIM_CHIP_FIFO) {
+                Sim_Deliver(h, h->engineNs);
+                if (Sim_ChipPending(h) + 2 > SIM_CHIP_FIFO) { h->engineNs = nowNs; break; }
+            }
+            if (!Sim_FetchCommand(h, h->engineNs)) {
+                h->engineNs = nowNs;   // Idle: SCK stopped
+                break;
+            }
+            continue;
+        }
+
+        if (h->opKind == OP_WAIT) {
+            int64_t readyNs = Sim_ReadyNs(h, h->engineNs, h->opCode == 0x88);
+            if (readyNs > nowNs) {
+                // SCK stopped until the strobe changes
+                h->engineNs = nowNs;
+                break;
+            }
+            h->engineNs = readyNs;
+            h->opKind = OP_NONE;
+            continue;
+        }
+
+        // Shift operation in progress
+        bool bitMode = (h->opCode & 0x02) != 0;
+        bool shiftsIn = (h->opCode & 0x20) != 0;
+        bool shiftsOut = (h->opCode & 0x10) != 0;
+        int64_t bitNs = Sim_BitNs(h);
+        int64_t unitNs = bitMode ? bitNs * h->opRemaining : bitNs * 8;
+
+        if (h->engineNs + unitNs > nowNs) break;   // Next unit not finished yet
+
+        if (shiftsOut && Sim_CmdAvailable(h) == 0) {
+            // Output payload has not arrived from the host yet
+            h->engineNs = nowNs;
+            break;
+        }
+
+        if (shiftsIn && Sim_ChipPending(h) >= SIM_CHIP_FIFO) {
+            Sim_Deliver(h, h->engineNs);
+            if (Sim_ChipPending(h) >= SIM_CHIP_FIFO) {
+                // RX FIFO full: the MPSSE stalls SCK until the host reads
+                h->engineNs = nowNs;
+                break;
+            }
+        }
+
+        int nbits = bitMode ? (int)h->opRemaining : 8;
+        UCHAR out = shiftsOut ? Sim_CmdByte(h, 0) : 0;
+        if (shiftsOut) h->cmdHead++;
+
+        UCHAR in = h->loopback ? out : Sim_ShiftIn(h, nbits, h->engineNs);
+        if (h->opCode & 0x08) {
+            // LSB first: reverse the bit order of what was shifted in
+            UCHAR reversed = 0;
+            for (int i = 0; i < 8; i++) if (in & (0x80 >> i)) reversed |= (UCHAR)(1 << i);
+            in = reversed;
+        }
+        h->engineNs += unitNs;
+        if (shiftsIn) Sim_PushRx(h, in, h->engineNs);
+
+        h->opRemaining -= bitMode ? h->opRemaining : 1;
+        if (h->opRemaining == 0) h->opKind = OP_NONE;
+
+        if (Sim_ChipPending(h) >= SIM_PACKET_PAYLOAD) Sim_Deliver(h, h->engineNs);
+    }
+
+    Sim_Deliver(h, nowNs);
+}
+
+static void Sim_Update(SimHandle* h)
+{
+    uint64_t visibleBefore = h->rxVisible;
+    Sim_Advance(h, Sim_NowNs());
+    if (h->rxVisible != visibleBefore) pthread_cond_broadcast(&h->rxChanged);
+}
+
+// Signal the application's FT_EVENT_RXCHAR event. Called without h->lock held,
+// as the application may hold eMutex while calling back into the library.
+static void Sim_SignalEvent(EVENT_HANDLE* event)
+{
+    pthread_mutex_lock(&event->eMutex);
+    event->iVar = 1;
+    pthread_cond_signal(&event->eCondVar);
+    pthread_mutex_unlock(&event->eMutex);
+}
+
+static void* Sim_EngineThread(void* arg)
+{
+    SimHandle* h = (SimHandle*)arg;
+
+    pthread_mutex_lock(&h->lock);
+    while (h->running) {
+        Sim_Update(h);
+
+        if ((h->eventMask & FT_EVENT_RXCHAR) && h->event && h->rxVisible != h->eventVisible) {
+            EVENT_HANDLE* event = h->event;
+            h->eventVisible = h->rxVisible;
+            pthread_mutex_unlock(&h->lock);
+            Sim_SignalEvent(event);
+            pthread_mutex_lock(&h->lock);
+            continue;
+        }
+
+        // Sleep until the next USB packet could be complete, or a latency tick
+        int64_t sleepNs = SIM_ENGINE_MAX_SLEEP_NS;
+        if (h->opKind != OP_NONE || Sim_CmdAvailable(h) > 0) {
+            int64_t packetNs = Sim_BitNs(h) * 8 *
+                (int64_t)(SIM_PACKET_PAYLOAD - Sim_ChipPending(h) % SIM_PACKET_PAYLOAD);
+            if (packetNs < sleepNs) sleepNs = packetNs;
+        }
+        if (sleepNs < SIM_ENGINE_MIN_SLEEP_NS) sleepNs = SIM_ENGINE_MIN_SLEEP_NS;
+
+        struct timespec deadline;
+        Sim_Deadline(&deadline, Sim_NowNs() + sleepNs);
+        pthread_cond_timedwait(&h->wake, &h->lock, &deadline);
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Handle management
+// ---------------------------------------------------------------------------
+
+static SimHandle* Sim_Handle(FT_HANDLE ftHandle)
+{
+    SimHandle* h = (SimHandle*)ftHandle;
+    return (h && h->running) ? h : NULL;
+}
+
+static FT_STATUS Sim_Open(SimDeviceInfo* info, FT_HANDLE* pHandle)
+{
+    if (!pHandle) return FT_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&DeviceLock);
+    if (info->handle) {
+        pthread_mutex_unlock(&DeviceLock);
+        return FT_DEVICE_NOT_OPENED;
+    }
+    if (Sim_NowNs() < info->chip->absentUntilNs) {
+        pthread_mutex_unlock(&DeviceLock);
+        return FT_DEVICE_NOT_FOUND;
+    }
+
+    SimHandle* h = (SimHandle*)calloc(1, sizeof(SimHandle));
+    if (!h) {
+        pthread_mutex_unlock(&DeviceLock);
+        return FT_INSUFFICIENT_RESOURCES;
+    }
+
+    h->info = info;
+    h->config = Config;
+    h->latencyMs = 16;
+    h->inTransferSize = 4096;
+    h->hostCap = SIM_MIN_HOST_RX;
+    h->rxCap = 4 * 65536 + SIM_CHIP_FIFO;
+    h->rx = (UCHAR*)malloc(h->rxCap);
+    h->cmd = (UCHAR*)malloc(SIM_CMD_QUEUE);
+    h->engineNs = Sim_NowNs();
+    h->openNs = h->engineNs;
+    if (info->chip->fpgaStartNs == 0) info->chip->fpgaStartNs = h->engineNs;
+    h->startNs = info->chip->fpgaStartNs;
+    h->nextFaultNs = h->engineNs + h->config.faultEveryMs * 1000000LL;
+    h->bitPos = h->config.bitOffset;
+    h->latchedSlot = UINT64_MAX;
+    h->rng = 0x9E3779B97F4A7C15ULL ^ (uint64_t)(info - Devices);
+    Sim_ResetMpsse(h);
+
+    // All waits use CLOCK_MONOTONIC deadlines
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->rxChanged, &attr);
+    pthread_cond_init(&h->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    h->running = true;
+
+    if (!h->rx || !h->cmd || pthread_create(&h->engine, NULL, Sim_EngineThread, h) != 0) {
+        free(h->rx);
+        free(h->cmd);
+        free(h);
+        pthread_mutex_unlock(&DeviceLock);
+        return FT_INSUFFICIENT_RESOURCES;
+    }
+
+    info->handle = h;
+    pthread_mutex_unlock(&DeviceLock);
+
+    *pHandle = h;
+    return FT_OK;
+}
+
+static void Sim_PurgeRx(SimHandle* h)
+{
+    h->rxHead = h->rxVisible = h->rxTail = h->eventVisible = 0;
+    h->flushRequested = false;
+}
+
+// Drop the commands not yet executed. FT_Purge cannot stop a clock-in the
+// MPSSE has started, it runs to its end; a lost device stops everything.
+static void Sim_PurgeTx(SimHandle* h, bool keepClockIn)
+{
+    h->cmdHead = h->cmdTail = 0;
+    if (keepClockIn && h->opKind == OP_SHIFT && !(h->opCode & 0x10)) return;
+    h->opKind = OP_NONE;
+    h->opRemaining = 0;
+}
+
+// Injected USB faults for the calls that go to the device, h->lock held
+static FT_STATUS Sim_Fault(SimHandle* h)
+{
+    if (h->lost) return FT_IO_ERROR;
+
+    // Another channel of the chip may have been unplugged
+    pthread_mutex_lock(&DeviceLock);
+    h->lost = h->info->chip->unpluggedNs > h->openNs;
+    pthread_mutex_unlock(&DeviceLock);
+    if (h->lost) {
+        Sim_PurgeRx(h);
+        Sim_PurgeTx(h, false);
+        return FT_IO_ERROR;
+    }
+    if (h->config.fault == SIM_FAULT_NONE) return FT_OK;
+
+    int64_t now = Sim_NowNs();
+    if (now < h->nextFaultNs) return FT_OK;
+    h->nextFaultNs = now + h->config.faultEveryMs * 1000000LL;
+
+    // Whatever was on its way over USB is gone either way; a clock-in the
+    // MPSSE has started runs on unless the device went off the bus
+    Sim_PurgeRx(h);
+    Sim_PurgeTx(h, h->config.fault == SIM_FAULT_IO);
+    if (h->config.fault == SIM_FAULT_UNPLUG) {
+        h->lost = true;
+        pthread_mutex_lock(&DeviceLock);
+        h->info->chip->unpluggedNs = now;
+        h->info->chip->absentUntilNs = now + h->config.faultMs * 1000000LL;
+        pthread_mutex_unlock(&DeviceLock);
+    }
+    return FT_IO_ERROR;
+}
+
+// ---------------------------------------------------------------------------
+// D2XX API
+// ---------------------------------------------------------------------------
+
+FT_STATUS WINAPI FT_CreateDeviceInfoList(LPDWORD lpdwNumDevs)
+{
+    pthread_once(&ConfigOnce, Sim_LoadConfig);
+    if (!lpdwNumDevs) return FT_INVALID_PARAMETER;
+    *lpdwNumDevs = DeviceCount;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetDeviceInfoDetail(DWORD dwIndex, LPDWORD lpdwFlags, LPDWORD lpdwType,
+                                        LPDWORD lpdwID, LPDWORD lpdwLocId, LPVOID lpSerialNumber,
+                                        LPVOID lpDescription, FT_HANDLE* pftHandle)
+{
+    pthread_once(&ConfigOnce, Sim_LoadConfig);
+    if (dwIndex >= (DWORD)DeviceCount) return FT_DEVICE_NOT_FOUND;
+
+    SimDeviceInfo* info = &Devices[dwIndex];
+    if (lpdwFlags) *lpdwFlags = FT_FLAGS_HISPEED | (info->handle ? FT_FLAGS_OPENED : 0);
+    if (lpdwType) *lpdwType = Config.chipType;
+    if (lpdwID) *lpdwID = 0x04036014;
+    if (lpdwLocId) *lpdwLocId = info->locId;
+    if (lpSerialNumber) strcpy((char*)lpSerialNumber, info->serial);
+    if (lpDescription) strcpy((char*)lpDescription, info->description);
+    if (pftHandle) *pftHandle = info->handle;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetDeviceInfoList(FT_DEVICE_LIST_INFO_NODE* pDest, LPDWORD lpdwNumDevs)
+{
+    pthread_once(&ConfigOnce, Sim_LoadConfig);
+    if (!pDest || !lpdwNumDevs) return FT_INVALID_PARAMETER;
+
+    for (int i = 0; i < DeviceCount; i++) {
+        DWORD flags = 0, type = 0, id = 0, locId = 0;
+        FT_GetDeviceInfoDetail(i, &flags, &type, &id, &locId,
+                               pDest[i].SerialNumber, pDest[i].Description, &pDest[i].ftHandle);
+        pDest[i].Flags = flags;
+        pDest[i].Type = type;
+        pDest[i].ID = id;
+        pDest[i].LocId = locId;
+    }
+    *lpdwNumDevs = DeviceCount;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_ListDevices(PVOID pvArg1, PVOID pvArg2, DWORD dwFlags)
+{
+    pthread_once(&ConfigOnce, Sim_LoadConfig);
+    (void)pvArg2;
+
+    if (dwFlags & FT_LIST_NUMBER_ONLY) {
+        if (!pvArg1) return FT_INVALID_PARAMETER;
+        *(LPDWORD)pvArg1 = DeviceCount;
+        return FT_OK;
+    }
+    return FT_NOT_SUPPORTED;
+}
+
+FT_STATUS WINAPI FT_Open(int deviceNumber, FT_HANDLE* pHandle)
+{
+    pthread_once(&ConfigOnce, Sim_LoadConfig);
+    if (deviceNumber < 0 || deviceNumber >= DeviceCount) return FT_DEVICE_NOT_FOUND;
+    return Sim_Open(&Devices[deviceNumber], pHandle);
+}
+
+FT_STATUS WINAPI FT_OpenEx(PVOID pvArg1, DWORD dwFlags, FT_HANDLE* pHandle)
+{
+    pthread_once(&ConfigOnce, Sim_LoadConfig);
+
+    for (int i = 0; i < DeviceCount; i++) {
+        SimDeviceInfo* info = &Devices[i];
+        bool match = false;
+        if (dwFlags & FT_OPEN_BY_SERIAL_NUMBER) {
+            match = pvArg1 && strcmp((const char*)pvArg1, info->serial) == 0;
+        } else if (dwFlags & FT_OPEN_BY_DESCRIPTION) {
+            match = pvArg1 && strcmp((const char*)pvArg1, info->description) == 0;
+        } else if (dwFlags & FT_OPEN_BY_LOCATION) {
+            match = (DWORD)(uintptr_t)pvArg1 == info->locId;
+        }
+        if (match) return Sim_Open(info, pHandle);
+    }
+    return FT_DEVICE_NOT_FOUND;
+}
+
+FT_STATUS WINAPI FT_Close(FT_HANDLE ftHandle)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+
+    pthread_mutex_lock(&h->lock);
+    h->running = false;
+    pthread_cond_broadcast(&h->wake);
+    pthread_cond_broadcast(&h->rxChanged);
+    pthread_mutex_unlock(&h->lock);
+    pthread_join(h->engine, NULL);
+
+    pthread_mutex_lock(&DeviceLock);
+    h->info->handle = NULL;
+    pthread_mutex_unlock(&DeviceLock);
+
+    pthread_cond_destroy(&h->wake);
+    pthread_cond_destroy(&h->rxChanged);
+    pthread_mutex_destroy(&h->lock);
+    free(h->rx);
+    free(h->cmd);
+    free(h);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetDeviceInfo(FT_HANDLE ftHandle, FT_DEVICE* lpftDevice, LPDWORD lpdwID,
+                                  PCHAR pcSerialNumber, PCHAR pcDescription, LPVOID pvDummy)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    (void)pvDummy;
+    if (!h) return FT_INVALID_HANDLE;
+    if (lpftDevice) *lpftDevice = Config.chipType;
+    if (lpdwID) *lpdwID = 0x04036014;
+    if (pcSerialNumber) strcpy(pcSerialNumber, h->info->serial);
+    if (pcDescription) strcpy(pcDescription, h->info->description);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_ResetDevice(FT_HANDLE ftHandle)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+
+    pthread_mutex_lock(&h->lock);
+    Sim_PurgeRx(h);
+    Sim_PurgeTx(h, false);
+    h->bitMode = FT_BITMODE_RESET;
+    Sim_ResetMpsse(h);
+    h->engineNs = Sim_NowNs();
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_Purge(FT_HANDLE ftHandle, ULONG ulMask)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+
+    pthread_mutex_lock(&h->lock);
+    FT_STATUS fault = Sim_Fault(h);
+    if (fault != FT_OK) {
+        pthread_mutex_unlock(&h->lock);
+        return fault;
+    }
+
+    Sim_Update(h);
+    if (ulMask & FT_PURGE_RX) Sim_PurgeRx(h);
+    if (ulMask & FT_PURGE_TX) Sim_PurgeTx(h, true);
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetQueueStatus(FT_HANDLE ftHandle, DWORD* lpdwAmountInRxQueue)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+    if (!lpdwAmountInRxQueue) return FT_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&h->lock);
+    FT_STATUS fault = Sim_Fault(h);
+    if (fault != FT_OK) {
+        pthread_mutex_unlock(&h->lock);
+        return fault;
+    }
+
+    Sim_Update(h);
+    *lpdwAmountInRxQueue = (DWORD)Sim_HostVisible(h);
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetStatus(FT_HANDLE ftHandle, DWORD* lpdwAmountInRxQueue,
+                              DWORD* lpdwAmountInTxQueue, DWORD* lpdwEventStatus)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+
+    pthread_mutex_lock(&h->lock);
+    Sim_Update(h);
+    if (lpdwAmountInRxQueue) *lpdwAmountInRxQueue = (DWORD)Sim_HostVisible(h);
+    if (lpdwAmountInTxQueue) *lpdwAmountInTxQueue = (DWORD)Sim_CmdAvailable(h);
+    if (lpdwEventStatus) *lpdwEventStatus = Sim_HostVisible(h) ? FT_EVENT_RXCHAR : 0;
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_Read(FT_HANDLE ftHandle, LPVOID lpBuffer, DWORD dwBytesToRead,
+                         LPDWORD lpdwBytesReturned)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+    if (!lpBuffer || !lpdwBytesReturned) return FT_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&h->lock);
+    FT_STATUS fault = Sim_Fault(h);
+    if (fault != FT_OK) {
+        pthread_mutex_unlock(&h->lock);
+        *lpdwBytesReturned = 0;
+        return fault;
+    }
+
+    int64_t deadline = Sim_NowNs() + (int64_t)h->readTimeoutMs * 1000000LL;
+
+    Sim_Update(h);
+    while (h->running && Sim_HostVisible(h) < dwBytesToRead) {
+        int64_t now = Sim_NowNs();
+        if (h->readTimeoutMs && now >= deadline) break;
+
+        struct timespec wait;
+        int64_t until = now + SIM_ENGINE_MAX_SLEEP_NS;
+        if (h->readTimeoutMs && until > deadline) until = deadline;
+        Sim_Deadline(&wait, until);
+        pthread_cond_timedwait(&h->rxChanged, &h->lock, &wait);
+    }
+
+    size_t count = Sim_HostVisible(h);
+    if (count > dwBytesToRead) count = dwBytesToRead;
+    for (size_t i = 0; i < count; i++) {
+        ((UCHAR*)lpBuffer)[i] = h->rx[(h->rxTail + i) % h->rxCap];
+    }
+    h->rxTail += count;
+    pthread_cond_signal(&h->wake);   // Space freed: a stalled MPSSE may resume
+    pthread_mutex_unlock(&h->lock);
+
+    *lpdwBytesReturned = (DWORD)count;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_Write(FT_HANDLE ftHandle, LPVOID lpBuffer, DWORD dwBytesToWrite,
+                          LPDWORD lpdwBytesWritten)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+    if (!lpBuffer || !lpdwBytesWritten) return FT_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&h->lock);
+    FT_STATUS fault = Sim_Fault(h);
+    if (fault != FT_OK) {
+        pthread_mutex_unlock(&h->lock);
+        *lpdwBytesWritten = 0;
+        return fault;
+    }
+
+    Sim_Update(h);
+
+    // Compact consumed commands, then wait for space like a full TX buffer would
+    int64_t deadline = Sim_NowNs() + (int64_t)h->writeTimeoutMs * 1000000LL;
+    for (;;) {
+        if (h->cmdHead > 0) {
+            memmove(h->cmd, h->cmd + h->cmdHead, h->cmdTail - h->cmdHead);
+            h->cmdTail -= h->cmdHead;
+            h->cmdHead = 0;
+        }
+        if (SIM_CMD_QUEUE - h->cmdTail >= dwBytesToWrite) break;
+
+        int64_t now = Sim_NowNs();
+        if (h->writeTimeoutMs && now >= deadline) {
+            pthread_mutex_unlock(&h->lock);
+            *lpdwBytesWritten = 0;
+            return FT_OK;
+        }
+        struct timespec wait;
+        Sim_Deadline(&wait, now + SIM_ENGINE_MAX_SLEEP_NS);
+        pthread_cond_timedwait(&h->rxChanged, &h->lock, &wait);
+        Sim_Update(h);
+    }
+
+    memcpy(h->cmd + h->cmdTail, lpBuffer, dwBytesToWrite);
+    h->cmdTail += dwBytesToWrite;
+    pthread_cond_signal(&h->wake);
+    pthread_mutex_unlock(&h->lock);
+
+    *lpdwBytesWritten = dwBytesToWrite;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_SetUSBParameters(FT_HANDLE ftHandle, ULONG ulInTransferSize,
+                                     ULONG ulOutTransferSize)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    (void)ulOutTransferSize;
+    if (!h) return FT_INVALID_HANDLE;
+    if (ulInTransferSize < 64 || ulInTransferSize > 65536) return FT_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&h->lock);
+    h->inTransferSize = ulInTransferSize;
+    // The driver keeps several IN transfers queued
+    h->hostCap = 4 * (size_t)ulInTransferSize;
+    if (h->hostCap < SIM_MIN_HOST_RX) h->hostCap = SIM_MIN_HOST_RX;
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_SetChars(FT_HANDLE ftHandle, UCHAR uEventChar, UCHAR uEventCharEnabled,
+                             UCHAR uErrorChar, UCHAR uErrorCharEnabled)
+{
+    (void)uEventChar; (void)uEventCharEnabled; (void)uErrorChar; (void)uErrorCharEnabled;
+    return Sim_Handle(ftHandle) ? FT_OK : FT_INVALID_HANDLE;
+}
+
+FT_STATUS WINAPI FT_SetFlowControl(FT_HANDLE ftHandle, USHORT usFlowControl,
+                                   UCHAR uXonChar, UCHAR uXoffChar)
+{
+    (void)usFlowControl; (void)uXonChar; (void)uXoffChar;
+    return Sim_Handle(ftHandle) ? FT_OK : FT_INVALID_HANDLE;
+}
+
+FT_STATUS WINAPI FT_SetTimeouts(FT_HANDLE ftHandle, ULONG dwReadTimeout, ULONG dwWriteTimeout)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+
+    pthread_mutex_lock(&h->lock);
+    h->readTimeoutMs = dwReadTimeout;
+    h->writeTimeoutMs = dwWriteTimeout;
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_SetLatencyTimer(FT_HANDLE ftHandle, UCHAR ucLatency)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+    if (ucLatency < 1) return FT_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&h->lock);
+    h->latencyMs = ucLatency;
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetLatencyTimer(FT_HANDLE ftHandle, PUCHAR pucLatency)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+    if (!pucLatency) return FT_INVALID_PARAMETER;
+    *pucLatency = h->latencyMs;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_SetBitMode(FT_HANDLE ftHandle, UCHAR ucMask, UCHAR ucEnable)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    (void)ucMask;
+    if (!h) return FT_INVALID_HANDLE;
+
+    // Channels C and D of an FT4232H have no MPSSE
+    if (ucEnable == FT_BITMODE_MPSSE && h->info->channel >= 2) return FT_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&h->lock);
+    Sim_Update(h);
+    h->bitMode = ucEnable;
+    Sim_PurgeTx(h, false);
+    Sim_ResetMpsse(h);
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetBitMode(FT_HANDLE ftHandle, PUCHAR pucMode)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+    if (!pucMode) return FT_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&h->lock);
+    *pucMode = h->lowValue;
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_SetEventNotification(FT_HANDLE ftHandle, DWORD dwEventMask, PVOID pvArg)
+{
+    SimHandle* h = Sim_Handle(ftHandle);
+    if (!h) return FT_INVALID_HANDLE;
+
+    pthread_mutex_lock(&h->lock);
+    h->eventMask = dwEventMask;
+    h->event = (EVENT_HANDLE*)pvArg;
+    pthread_mutex_unlock(&h->lock);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetLibraryVersion(LPDWORD lpdwDLLVersion)
+{
+    if (!lpdwDLLVersion) return FT_INVALID_PARAMETER;
+    *lpdwDLLVersion = 0x00010400;   // Reports itself as 1.4.0
+    return FT_OK;
+}
@@ -2,8 +2,28 @@
  * High-Performance FT232H SPI Reader
  * Optimized for maximum throughput using FTDI D2XX library
  * 
- * Compile with: gcc -o ft232h_spi_reader ft232h_spi_reader.c ftd2xx.dll (.dll file must be in the same directory)
- * Windows: Link with ftd2xx.lib
+ * Compile with: gcc -o ft232h_spi_reader ft232h_spi_reader.c spsc_ring.c pmu_frame.c pmu_capture.c pmu_time.c pmu_clock.c pmu_calib.c pmu_mem.c pmu_mpsse.c pmu_spi.c pmu_thread.c pmu_trigger.c pmu_ber.c pmu_control.c pmu_transport.c read_ring.c pmu_merge.c pmu_daemon.c pmu_tools.c ftd2xx.dll (.dll file must be in the same directory)
+ * Windows: Link with ftd2xx.lib and ws2_32.lib (MinGW: -lws2_32)
+ * Linux: gcc -o ft232h_spi_reader ft232h_spi_reader.c spsc_ring.c pmu_frame.c pmu_capture.c pmu_time.c pmu_clock.c pmu_calib.c pmu_mem.c pmu_mpsse.c pmu_spi.c pmu_thread.c pmu_trigger.c pmu_ber.c pmu_control.c pmu_transport.c read_ring.c pmu_merge.c pmu_daemon.c pmu_tools.c -lftd2xx -lpthread -lm
+ * Without hardware: gcc -I. -o ft232h_spi_reader_sim ft232h_spi_reader.c spsc_ring.c pmu_frame.c pmu_capture.c pmu_time.c pmu_clock.c pmu_calib.c pmu_mem.c pmu_mpsse.c pmu_spi.c pmu_thread.c pmu_trigger.c pmu_ber.c pmu_control.c pmu_transport.c read_ring.c pmu_merge.c pmu_daemon.c pmu_tools.c d2xx_sim.c -lpthread -lm
+ *   (simulated FT232H and FPGA behind the d2xx transport, see d2xx_sim.c)
+ *
+ * Acquisition, decoding and file output run on separate threads connected by
+ * rings, so the FT232H keeps being read while the previous batches are
+ * formatted and written. FT_Read fills page-aligned read ring slots in place,
+ * which the decoder and the recorder then share without copying
+ * (read_ring.h). Every frame boundary is checked by its checksum before
+ * decoding; a dropped or extra SCK edge is detected from consecutive failures
+ * and the stream re-framed at the new offset.
+ * Opening, MPSSE setup and the batch reads themselves are the acquisition
+ * code in pmu_spi.c, shared with basic_spi_receiver.c; here it is configured
+ * for SPI mode 0 with CS held low.
+ * The daemon (--daemon), the merge of several devices and the device
+ * measurements (--bench-wait, --sweep, --calibrate, --ber) are in
+ * pmu_daemon.c, pmu_merge.c and pmu_tools.c, sharing pmu_pipeline.h.
+ *
+ * Run with --help for the options; README.md describes the capture modes and
+ * the output files.
  */
 
 #include <stdio.h>
@@ -11,491 +31,2133 @@
 #include <string.h>
 #include <time.h>
 #include <stdbool.h>
+#include <signal.h>
 
 #ifdef _WIN32
     #include <windows.h>
     #include "ftd2xx.h"
     #define SLEEP_MS(ms) Sleep(ms)
-    #define GET_TIME() GetTickCount()
 #else
     #include <unistd.h>
+    #include <pthread.h>
     #include <ftd2xx.h>
     #define SLEEP_MS(ms) usleep((ms) * 1000)
-    #define GET_TIME() (clock() * 1000 / CLOCKS_PER_SEC)
 #endif
 
-// MPSSE Commands for SPI
-#define MSB_RISING_EDGE_CLOCK_BYTE_OUT  0x10
-#define MSB_FALLING_EDGE_CLOCK_BYTE_OUT 0x11
-#define MSB_RISING_EDGE_CLOCK_BIT_OUT   0x12
-#define MSB_FALLING_EDGE_CLOCK_BIT_OUT  0x13
-#define MSB_RISING_EDGE_CLOCK_BYTE_IN   0x20
-#define MSB_RISING_EDGE_CLOCK_BIT_IN    0x22
-#define MSB_FALLING_EDGE_CLOCK_BYTE_IN  0x24
-#define MSB_FALLING_EDGE_CLOCK_BIT_IN   0x26
-
-// Configuration
-#define CLOCK_DIVISOR           4       // For 6MHz: 60/((1+4)*2) = 6MHz
-#define BYTES_PER_SAMPLE        20      // 160 bits = 20 bytes
-#define USB_BUFFER_SIZE         65536   // Maximum USB buffer size
-#define CMD_BUFFER_SIZE         32768   // Command buffer size
-#define DATA_BUFFER_SIZE        131072  // Data buffer size
-
-// Calculate optimal batch size based on USB buffer limits
-#define BYTES_PER_CMD           3       // Each read command is 3 bytes
-#define MAX_BATCH_SIZE          ((USB_BUFFER_SIZE - 1024) / (BYTES_PER_CMD + BYTES_PER_SAMPLE))
-#define OPTIMAL_BATCH_SIZE      2000    // Conservative batch size
+#include "pmu_pipeline.h"
+#include "pmu_mem.h"
+#include "pmu_mpsse.h"
+#include "pmu_time.h"
+#include "pmu_ber.h"
+#include "pmu_tools.h"
+#include "pmu_daemon.h"
+
+// Wall-clock milliseconds from the monotonic clock
+#define GET_TIME() ((DWORD)(Time_NowNs() / 1000000))
+
+// Real-time scheduling of the acquisition thread
+#define DEFAULT_RT_PRIORITY     40      // Below the USB interrupt threads of PREEMPT_RT kernels
+#define DEADLINE_SLACK          1.5     // Of the line time, before a batch counts as late
+
+#define REPLAY_PROGRESS_MS      100     // Progress line interval while replaying
+
+// Consumers of the read ring
+#define CONSUMER_DECODER        0
+#define CONSUMER_RECORDER       1
+
+// Recovery from USB and device errors
+#define REOPEN_RETRY_MIN_MS     100     // First wait for a lost device, doubled per attempt
+#define REOPEN_RETRY_MAX_MS     5000
+#define GAP_LINE_LENGTH         128
+
+// Triggered capture (--trigger)
+#define TRIGGER_LINE_LENGTH     128
+
+static const char* const RecoverNames[RECOVER_ACTIONS] = { "retry", "resync", "reopen" };
+
+// Gap marker action for data the reader overwrote itself, not a device recovery
+#define GAP_RING_FULL           (RECOVER_FATAL + 1)
+
+// What the reader does when the read ring is full (--backpressure)
+enum {
+    BACKPRESSURE_BLOCK,         // Wait for the consumers, the FT232H idles meanwhile
+    BACKPRESSURE_DROP,          // Overwrite the oldest slot no consumer is reading
+    BACKPRESSURE_SPILL          // Write reads to a temporary file, back into the ring as it frees up
+};
+
+static const char* const BackpressureNames[] = { "block", "drop", "spill" };
 
 // Global variables
-static FT_HANDLE ftHandle = NULL;
-static UCHAR OutputBuffer[CMD_BUFFER_SIZE];
-static UCHAR InputBuffer[DATA_BUFFER_SIZE];
+SpiDevice Devices[MAX_DEVICES];
+int DeviceCount = 0;
+static SpiConfig DeviceConfig;              // Settings they are opened with
+Pipeline Pipelines[MAX_DEVICES];
+static char BinaryDigits[256][8];
+volatile sig_atomic_t StopRequested = 0;
+static volatile sig_atomic_t ReportRequested = 0;
+static volatile sig_atomic_t ExternalTriggerRequested = 0;
+static int AcquisitionCpu = -1;             // --cpu, -1 leaves placement to the scheduler
+static int RealtimePriority = 0;            // --rt, 0 keeps normal scheduling
+static bool LockBuffers = false;            // --mlock
+static int Backpressure = BACKPRESSURE_BLOCK;   // --backpressure
+int MarkerBytes = 0;
+int RecordBytes = BYTES_PER_SAMPLE;
+
+// Options, as README.md lists them
+static const char Usage[] =
+    "Usage: ft232h_spi_reader [totalSamples] [batchSize] [options]\n"
+    "  totalSamples     Frames to capture, 0 runs until Ctrl+C (default 10000)\n"
+    "  batchSize        Frames read per batch (default 2000)\n"
+    "  --wait=event     Sleep on FT_EVENT_RXCHAR until a batch has arrived (default)\n"
+    "  --wait=poll      Legacy fixed sleep followed by queue polling\n"
+    "  --stream         Continuous 65536-byte clock-in commands, frames located by checksum\n"
+    "  --data-ready[=rising|falling]\n"
+    "                   Start every frame read on that edge (default rising) of the FPGA's\n"
+    "                   data-ready strobe on GPIOL1 (ADBUS5), so each frame is read once;\n"
+    "                   give --frame-rate for exact timeouts and deadlines\n"
+    "  --markers=low|high|both\n"
+    "                   Read the ADBUS (GPIOL0-3 on ADBUS4-7), ACBUS (GPIOH0-7) or both\n"
+    "                   pin states right after every frame and write them to Markers.txt\n"
+    "  --inflight=N     Batches kept queued in the FT232H while reading (default 2)\n"
+    "  --bench-wait     Measure the batch-to-batch gap of both wait modes and exit\n"
+    "  --sweep[=MS]     Measure every combination of USB transfer size, latency timer,\n"
+    "                   batch size and in-flight count for MS each (default 500), write\n"
+    "                   USBSweep.csv and print the recommended setting, then exit\n"
+    "  --usb-transfer=N USB IN transfer size in bytes, 64-65536 (default 65536)\n"
+    "  --latency=MS     FT232H latency timer, 1-255 ms (default 2)\n"
+    "  --record=FILE    Also save the raw FT_Read stream with host timestamps (see pmu_capture.h)\n"
+    "  --replay=FILE    Decode a recorded capture instead of reading the device; all\n"
+    "                   frames in the file unless totalSamples is given\n"
+    "  --pace=max       Replay as fast as possible (default)\n"
+    "  --pace=realtime  Replay at the timing the capture was recorded with\n"
+    "  --no-output      Skip writing the text files, e.g. to measure decode throughput\n"
+    "  --frame-rate=HZ  Nominal FPGA frame rate, to report the FPGA clock drift in ppm\n"
+    "  --calibrate      Find the fastest error-free SPI clock for this device, save it and exit\n"
+    "  --ber[=MS]       Link test with the FPGA sending pattern frames: measure the bit error\n"
+    "                   rate at every clock setting of --calibrate on both SCK edges for MS\n"
+    "                   each (default 1000), write BERTest.csv and exit\n"
+    "  --ber-pattern=prbs|counter\n"
+    "                   Pattern the FPGA sends for --ber (default prbs, see pmu_ber.h)\n"
+    "  --cpu=N          Pin the acquisition thread to CPU N\n"
+    "  --rt[=PRIO]      Run the acquisition thread SCHED_FIFO at PRIO (default 40), or\n"
+    "                   time-critical on Windows\n"
+    "  --mlock          Lock the ring buffers in memory\n"
+    "  --backpressure=block|drop|spill\n"
+    "                   With the read ring full, wait for the decoder (default), overwrite\n"
+    "                   the oldest slot or set reads aside in a temporary file\n"
+    "  --device=SERIAL  Read the FT232H with this serial number; repeat for up to 4\n"
+    "                   devices read in parallel (default: the first FT232H). The\n"
+    "                   serial number of an FT2232H or FT4232H without the channel\n"
+    "                   letter reads both MPSSE channels (A and B) as two links\n"
+    "  --merge=time     Order the frames of several devices by host frame time\n"
+    "                   (default, unless the devices are the channels of one chip)\n"
+    "  --merge=counter  Order them by FPGA frame counter, for links of one FPGA\n"
+    "  --trigger=COND   Write only the frames around a trigger (see pmu_trigger.h);\n"
+    "                   repeat for up to 8 conditions, any of which fires:\n"
+    "                   above:CH:LEVEL, below:CH:LEVEL, slope:CH:DELTA, checksum:N,\n"
+    "                   counter[:STEP] or external (SIGUSR2)\n"
+    "  --pre-trigger=MS Time kept before a trigger (default 500)\n"
+    "  --post-trigger=MS Time written after it (default 500)\n"
+    "  --daemon[=PATH]  Stay resident with the devices open and capture on request from\n"
+    "                   the control socket at PATH (default ft232h_spi_reader.sock)\n"
+    "  --help           Print this list and exit\n";
+
+// SPI mode 0, CS held low throughout, one read command per frame
+static const MpsseFrame BatchFrame = {
+    .mode = 0, .csToggle = false, .csActiveHigh = false, .csPin = 0x08, .direction = 0x0B,
+    .frameBytes = BYTES_PER_SAMPLE, .sendImmediate = true, .dataReady = MPSSE_READY_NONE
+};
 
 #define OUT_PATH "SPIBin.txt"   // Full binary and hex output
 #define CNT_OUT_PATH "CounterOutput.txt"    // Counter output (bits 124-147)
+#define TIME_OUT_PATH "FrameTimes.txt"      // Host time (Unix s) and FPGA frame index per frame
+#define GAP_OUT_PATH "Gaps.txt"     // Acquisition gaps: position, time, length, frames lost, cause
+#define TRIGGER_OUT_PATH "Triggers.txt"     // Trigger windows: position, time, frame index, condition
+#define MARKER_OUT_PATH "Markers.txt"       // GPIO pin states read after each frame (--markers)
 
 // Function prototypes
-bool SPI_Initialize(void);
-bool SPI_SynchronizeMPSSE(void);
-bool SPI_ConfigureSPI(void);
-int SPI_ReceiveBatch(int numSamples, UCHAR* dataBuffer, int bufferSize);
-void SPI_Close(void);
-void PrintBinaryData(const UCHAR* data, int length, FILE* file);
-double GetElapsedTime(DWORD startTime);
+void InitBinaryDigits(void);
+char* FormatBinaryData(const UCHAR* data, int length, char* out);
+PMU_THREAD_RET PMU_THREAD_CALL ReaderThread(void* arg);
+PMU_THREAD_RET PMU_THREAD_CALL StreamReaderThread(void* arg);
+PMU_THREAD_RET PMU_THREAD_CALL DecoderThread(void* arg);
+PMU_THREAD_RET PMU_THREAD_CALL WriterThread(void* arg);
+PMU_THREAD_RET PMU_THREAD_CALL RecorderThread(void* arg);
+PMU_THREAD_RET PMU_THREAD_CALL ReplayThread(void* arg);
+static void EndOfStream(Pipeline* pipeline);
+static void EndOfText(Pipeline* pipeline);
+static void Supervisor_PrintStats(const Supervisor* supervisor);
+static void PrintBackpressureStats(const Pipeline* pipeline);
 
-int main(int argc, char* argv[])
+static void HandleInterrupt(int signum)
 {
-    printf("High-Performance FT232H SPI Reader (C Implementation)\n");
-    printf("=====================================================\n");
+    (void)signum;
+    StopRequested = 1;
+}
+
+static void HandleReportRequest(int signum)
+{
+    ReportRequested = 1;
+    signal(signum, HandleReportRequest);    // Windows resets the handler on delivery
+}
+
+static void HandleTriggerRequest(int signum)
+{
+    ExternalTriggerRequested = 1;
+    signal(signum, HandleTriggerRequest);
+}
+
+// Buffers the acquisition and decoding hot path works on. Pre-faulted and, with
+// --mlock, locked before the capture starts (prepare), unlocked after it.
+static void PrepareRingMemory(Pipeline* pipeline, bool prepare)
+{
+    struct { void* block; size_t size; } buffers[] = {
+        { pipeline->readRing.storage, (size_t)pipeline->readRing.slotCount * pipeline->readRing.slotSize },
+        { pipeline->textRing.storage, (size_t)pipeline->textRing.slotCount * pipeline->textRing.slotSize },
+        { pipeline->frameIndex, pipeline->batchSize * sizeof(unsigned long long) },
+        { pipeline->frameTimeNs, pipeline->batchSize * sizeof(unsigned long long) },
+        { pipeline->frameScratch, (size_t)pipeline->batchSize * BYTES_PER_SAMPLE },
+        { pipeline->spill.slot.data, pipeline->spill.slot.data ? pipeline->readRing.slotSize : 0 },
+        { pipeline->trigger.frames, (size_t)pipeline->trigger.capacity * BYTES_PER_SAMPLE },
+        { pipeline->trigger.timeNs, pipeline->trigger.capacity * sizeof(unsigned long long) },
+        { pipeline->trigger.index, pipeline->trigger.capacity * sizeof(unsigned long long) },
+        { pipeline->trigger.markers, pipeline->trigger.capacity * sizeof(unsigned short) },
+        { pipeline->markerFrames, pipeline->markerFrames ? pipeline->markerCapacity * BYTES_PER_SAMPLE : 0 },
+        { pipeline->markers, pipeline->markerCapacity * sizeof(unsigned short) },
+        { pipeline->frameStarts, pipeline->frameStarts ? pipeline->batchSize * sizeof(unsigned long long) : 0 },
+        { pipeline->frameMarkers, pipeline->frameMarkers ? pipeline->batchSize * sizeof(unsigned short) : 0 },
+    };
+    int count = sizeof(buffers) / sizeof(buffers[0]);
+    size_t total = 0;
     
-    // Parse command line arguments
-    int totalSamples = 10000;
-    int batchSize = OPTIMAL_BATCH_SIZE;
+    if (!prepare) {
+        for (int i = 0; i < count && pipeline->memoryLocked; i++) {
+            Mem_Unlock(buffers[i].block, buffers[i].size);
+        }
+        pipeline->memoryLocked = false;
+        return;
+    }
     
-    if (argc > 1) {
-        totalSamples = atoi(argv[1]);
-        if (totalSamples <= 0) totalSamples = 10000;
+    for (int i = 0; i < count; i++) {
+        Mem_Prefault(buffers[i].block, buffers[i].size);
+        total += buffers[i].size;
     }
+    if (!LockBuffers) return;
     
-    if (argc > 2) {
-        batchSize = atoi(argv[2]);
-        if (batchSize <= 0 || batchSize > MAX_BATCH_SIZE) {
-            printf("Warning: Invalid batch size %d, using %d\n", batchSize, OPTIMAL_BATCH_SIZE);
-            batchSize = OPTIMAL_BATCH_SIZE;
+    int locked = 0;
+    while (locked < count && Mem_Lock(buffers[locked].block, buffers[locked].size)) {
+        locked++;
+    }
+    if (locked < count) {
+        while (locked > 0) {
+            locked--;
+            Mem_Unlock(buffers[locked].block, buffers[locked].size);
         }
+        printf("Warning: Cannot lock %.1f MB of ring buffers (needs CAP_IPC_LOCK or a higher "
+               "memlock limit), continuing unlocked\n", total / 1048576.0);
+        return;
     }
+    pipeline->memoryLocked = true;
+    printf("Locked %.1f MB of ring buffers in memory\n", total / 1048576.0);
+}
+
+// Pinning and priority of the calling (acquisition) thread, each optional;
+// each device's thread gets a CPU of its own
+static void SetAcquisitionScheduling(const Pipeline* pipeline)
+{
+    int cpu = AcquisitionCpu + pipeline->deviceIndex;
+    if (AcquisitionCpu >= 0 && !Thread_PinToCpu(cpu)) {
+        printf("Warning: %sCannot pin the acquisition thread to CPU %d, continuing unpinned\n",
+               pipeline->label, cpu);
+    }
+    if (RealtimePriority > 0 && !Thread_SetRealtime(RealtimePriority)) {
+        printf("Warning: No real-time priority for the acquisition thread (needs CAP_SYS_NICE "
+               "or an rtprio limit), continuing at normal priority\n");
+    }
+}
+
+// A batch is due one line time (with slack) after the previous one completed,
+// plus the latency timer for its last partial packet; later, the FT232H had
+// run out of queued commands. A pause or a gap restarts the check.
+static void Deadline_Check(DeadlineStats* stats, const SpiDevice* device, int bytes,
+                           unsigned long long doneNs)
+{
+    if (stats->lastDoneNs != 0) {
+        unsigned long long lineNs = SPI_LineNs(device, bytes);
+        unsigned long long deadlineNs = (unsigned long long)(lineNs * DEADLINE_SLACK) +
+                                        device->config.latencyMs * 1000000ULL;
+        unsigned long long cycleNs = doneNs - stats->lastDoneNs;
+        
+        stats->batches++;
+        if (cycleNs > deadlineNs) {
+            stats->misses++;
+            if (stats->ringFull) stats->ringFullMisses++;
+            if (cycleNs - deadlineNs > stats->worstLateNs) {
+                stats->worstLateNs = cycleNs - deadlineNs;
+            }
+        }
+    }
+    stats->lastDoneNs = doneNs;
+}
+
+// Misses with the read ring full were the host's doing, the others the USB
+// side's (latency timer, bus contention, the device itself)
+static void Deadline_PrintStats(const DeadlineStats* stats)
+{
+    printf("  Deadline misses: %lu of %lu batches (%.2f%%), %lu with the read ring full, worst %.3f ms late\n",
+           stats->misses, stats->batches,
+           stats->batches ? stats->misses * 100.0 / stats->batches : 0.0, stats->ringFullMisses,
+           stats->worstLateNs / 1e6);
+}
+
+static void PrintLatencyReport(void)
+{
+    for (int d = 0; d < DeviceCount; d++) {
+        if (DeviceCount > 1) printf("  Device %s:\n", Devices[d].serial);
+        SPI_PrintLatency(&Devices[d]);
+    }
+}
+
+void CloseDevices(void)
+{
+    while (DeviceCount > 0) {
+        SPI_Close(&Devices[--DeviceCount]);
+    }
+}
+
+// Rings and decoder scratch of one pipeline, all allocated before the capture.
+// FT_Read fills the read ring slots in place; the decoder and the recorder share
+// them. Merged text slots also carry every frame's host time and FPGA frame
+// index for the merge. A triggered capture's history holds the pre-trigger
+// time at the line rate, the fastest frames can come, plus two batches. GPIO
+// markers are kept for the frame reads of a slot plus those the framer can
+// still hold.
+static bool AllocatePipelineBuffers(Pipeline* pipeline, int readSlotBytes)
+{
+    int batchSize = pipeline->batchSize;
+    int textSlotBytes = batchSize * (TEXT_FRAME_BYTES +
+                                     (pipeline->merged ? 2 * (int)sizeof(unsigned long long) : 0));
+    bool ok = ReadRing_Create(&pipeline->readRing, "read", RING_SLOTS, readSlotBytes,
+                              pipeline->recordFile ? 2 : 1);
+    pipeline->readRing.markerFlags = CAPTURE_GAP;
+    ok = Ring_Create(&pipeline->textRing, "text", RING_SLOTS, textSlotBytes) && ok;
+    pipeline->frameIndex = (unsigned long long*)Mem_Alloc(batchSize * sizeof(unsigned long long));
+    pipeline->frameTimeNs = (unsigned long long*)Mem_Alloc(batchSize * sizeof(unsigned long long));
+    pipeline->frameScratch = (UCHAR*)Mem_Alloc(batchSize * BYTES_PER_SAMPLE);
+    if (pipeline->spill.file) {
+        pipeline->spill.slot.data = (UCHAR*)Mem_AllocPages(readSlotBytes);
+        ok = pipeline->spill.slot.data != NULL && ok;
+    }
+    if (MarkerBytes > 0) {
+        pipeline->markerCapacity = readSlotBytes / RecordBytes + FRAMER_BUFFER_SIZE / BYTES_PER_SAMPLE + 1;
+        pipeline->markerFrames = (UCHAR*)Mem_Alloc(pipeline->markerCapacity * BYTES_PER_SAMPLE);
+        pipeline->markers = (unsigned short*)Mem_Alloc(pipeline->markerCapacity * sizeof(unsigned short));
+        pipeline->frameStarts = (unsigned long long*)Mem_Alloc(batchSize * sizeof(unsigned long long));
+        pipeline->frameMarkers = (unsigned short*)Mem_Alloc(batchSize * sizeof(unsigned short));
+        pipeline->framer.frameStarts = pipeline->frameStarts;
+        ok = pipeline->markerFrames && pipeline->markers && pipeline->frameStarts &&
+             pipeline->frameMarkers && ok;
+    }
+    if (pipeline->triggered) {
+        double lineRate = pipeline->spiClockHz / (double)(RecordBytes * 8);
+        unsigned long capacity = (unsigned long)(pipeline->trigger.preNs / 1e9 * lineRate) + 2 * batchSize;
+        ok = Trigger_Create(&pipeline->trigger, capacity) && ok;
+    }
+    return ok && pipeline->frameIndex && pipeline->frameTimeNs && pipeline->frameScratch;
+}
+
+static void FreePipelineBuffers(Pipeline* pipeline)
+{
+    ReadRing_Destroy(&pipeline->readRing);
+    Ring_Destroy(&pipeline->textRing);
+    Mem_Free(pipeline->frameIndex);
+    Mem_Free(pipeline->frameTimeNs);
+    Mem_Free(pipeline->frameScratch);
+    pipeline->frameIndex = NULL;
+    pipeline->frameTimeNs = NULL;
+    pipeline->frameScratch = NULL;
+    Mem_Free(pipeline->markerFrames);
+    Mem_Free(pipeline->markers);
+    Mem_Free(pipeline->frameStarts);
+    Mem_Free(pipeline->frameMarkers);
+    pipeline->markerFrames = NULL;
+    pipeline->markers = NULL;
+    pipeline->frameStarts = NULL;
+    pipeline->frameMarkers = NULL;
+    pipeline->framer.frameStarts = NULL;
+    Mem_FreePages(pipeline->spill.slot.data);
+    pipeline->spill.slot.data = NULL;
+    Trigger_Destroy(&pipeline->trigger);
+}
+
+// The settings a run starts with, as given or adjusted on the command line
+static void PrintConfiguration(const CaptureSettings* settings, const char* replayPath,
+                               const char* daemonPath, char serials[][CALIB_SERIAL_LENGTH])
+{
+    bool dataReady = DeviceConfig.frame.dataReady != MPSSE_READY_NONE;
     
     printf("Configuration:\n");
-    printf("  Total samples: %d\n", totalSamples);
-    printf("  Batch size: %d\n", batchSize);
+    if (settings->totalSamples > 0) {
+        printf("  Total samples: %d\n", settings->totalSamples);
+    } else {
+        printf("  Total samples: unlimited (until Ctrl+C)\n");
+    }
+    printf("  Batch size: %d\n", settings->batchSize);
+    printf("  %s in flight: %d\n", settings->stream ? "Stream chunks" : "Batches", settings->inflight);
     printf("  Bytes per sample: %d\n", BYTES_PER_SAMPLE);
-    printf("  SPI clock: 6 MHz\n");
-    printf("  Mode: Half-duplex receive only\n\n");
-    
-    // Initialize SPI interface
-    if (!SPI_Initialize()) {
-        printf("Failed to initialize SPI interface\n");
-        return 1;
+    if (settings->replayFile) {
+        printf("  Mode: Replay of %s (%s capture), %s\n", replayPath,
+               settings->stream ? "stream" : dataReady ? "data-ready" : "batch",
+               settings->replayRealtime ? "recorded timing" : "maximum speed");
+    } else if (settings->stream) {
+        printf("  Mode: Continuous stream, %d-byte clock-in commands, software framing\n",
+               STREAM_CHUNK_BYTES);
+    } else {
+        printf("  Mode: Half-duplex receive only\n");
     }
-    
-    printf("SPI interface initialized successfully\n");
-    
-    // Open output files
-    FILE* outputFile = fopen(OUT_PATH, "w");
-    FILE* counterFile = fopen(CNT_OUT_PATH, "w");
-    
-    if (!outputFile || !counterFile) {
+    if (dataReady && !settings->replayFile) {
+        printf("  Frame sync: %s edge of the data-ready strobe on GPIOL1, %.0f Hz%s\n",
+               DeviceConfig.frame.dataReady == MPSSE_READY_FALLING ? "falling" : "rising",
+               DeviceConfig.readyHz, settings->nominalFrameRate > 0.0 ? "" : " assumed for timeouts");
+    }
+    if (MarkerBytes > 0) {
+        printf("  Markers: %s%s%s read after every frame, to %s\n",
+               (DeviceConfig.frame.gpioMarkers & MPSSE_GPIO_LOW) ? "ADBUS" : "",
+               MarkerBytes > 1 ? " and " : "",
+               (DeviceConfig.frame.gpioMarkers & MPSSE_GPIO_HIGH) ? "ACBUS" : "", MARKER_OUT_PATH);
+    }
+    if (settings->recordPath) {
+        printf("  Recording raw stream to: %s\n", settings->recordPath);
+    }
+    if (daemonPath) {
+        printf("  Daemon: captures on request from %s\n", daemonPath);
+    }
+    printf("  Wait mode: %s\n", DeviceConfig.waitMode == WAIT_EVENT ? "event" : "poll");
+    if (!settings->replayFile) {
+        printf("  Read ring full: %s\n", Backpressure == BACKPRESSURE_DROP ? "drop the oldest slot" :
+               Backpressure == BACKPRESSURE_SPILL ? "spill to a temporary file" : "block the reader");
+    }
+    if (settings->triggered) {
+        printf("  Triggered: %.3f s before to %.3f s after any of", settings->trigger.preNs / 1e9,
+               settings->trigger.postNs / 1e9);
+        for (int c = 0; c < settings->trigger.conditionCount; c++) {
+            printf(" %s", settings->trigger.conditions[c].spec);
+        }
+        printf("\n");
+    }
+    if (settings->pipelineCount > 1) {
+        printf("  Devices: %d", settings->pipelineCount);
+        for (int d = 0; d < settings->pipelineCount; d++) {
+            printf("%s%s", d == 0 ? " (" : ", ", serials[d]);
+        }
+        printf("), merged by %s\n", settings->mergeBy == MERGE_COUNTER ? "FPGA frame counter" : "frame time");
+        printf("  Pipeline: reader -> decoder per device -> merge writer, %d slots per ring\n",
+               RING_SLOTS);
+    } else {
+        printf("  Pipeline: reader -> decoder -> writer, %d slots per ring\n", RING_SLOTS);
+    }
+    if (!settings->replayFile && (AcquisitionCpu >= 0 || RealtimePriority > 0)) {
+        printf("  Acquisition thread: ");
+        if (AcquisitionCpu >= 0) printf("CPU %d%s", AcquisitionCpu, RealtimePriority > 0 ? ", " : "");
+        if (RealtimePriority > 0) printf("real-time priority %d", RealtimePriority);
+        printf("\n");
+    }
+    printf("\n");
+}
+
+// Open the devices, by serial number if any were given, SPI mode 0 with CS held low
+static bool OpenDevices(char serials[][CALIB_SERIAL_LENGTH], int count, bool bySerial)
+{
+    for (int d = 0; d < count; d++) {
+        SpiConfig config = DeviceConfig;
+        if (bySerial) {
+            memcpy(config.serial, serials[d], CALIB_SERIAL_LENGTH);
+        }
+        if (!SPI_Open(&Devices[d], &config)) {
+            printf("Failed to initialize SPI interface\n");
+            CloseDevices();
+            return false;
+        }
+        DeviceCount++;
+        
+        SpiDevice* device = &Devices[d];
+        printf("SPI interface initialized successfully\n");
+        printf("SPI clock: %.3f MHz (divisor %u%s, %s)\n", device->clockHz / 1e6, device->clock.divisor,
+               device->clock.threePhase ? ", three-phase" : "",
+               device->clockCalibrated ? "calibrated for this device" : "default");
+    }
+    return true;
+}
+
+// One capture from the command line, to the end or Ctrl+C; 1 if a device could not be read
+static int RunCapture(const CaptureSettings* settings)
+{
+    InitPipelines(settings, false);
+    Pipeline* pipeline = &Pipelines[0];
+    if (!OpenOutputFiles(settings)) {
         printf("Failed to open output files\n");
-        SPI_Close();
+        ClosePipelineFiles(pipeline);
+        CloseDevices();
         return 1;
     }
-    
-    // Allocate data buffer
-    UCHAR* dataBuffer = (UCHAR*)malloc(batchSize * BYTES_PER_SAMPLE);
-    if (!dataBuffer) {
-        printf("Failed to allocate data buffer\n");
-        fclose(outputFile);
-        fclose(counterFile);
-        SPI_Close();
+    if (!AllocatePipelines(settings)) {
+        printf("Failed to allocate ring buffers\n");
+        ClosePipelineFiles(pipeline);
+        CloseDevices();
         return 1;
     }
     
     printf("Starting high-speed data collection...\n");
     printf("(Press Ctrl+C to stop)\n\n");
+    InstallSignalHandlers();
     
-    // Performance tracking
-    DWORD startTime = GET_TIME();
-    int totalSamplesCollected = 0;
-    int batchCount = 0;
+    CaptureRun run;
+    if (!StartCapture(&run, settings)) {
+        printf("Failed to start pipeline threads\n");
+        FreePipelines(settings);
+        ClosePipelineFiles(pipeline);
+        CloseDevices();
+        return 1;
+    }
+    JoinCapture(&run);
+    bool readError = PrintCaptureResults(&run);
     
-    // Main data collection loop
-    while (totalSamplesCollected < totalSamples) {
-        // Calculate samples for this batch
-        int samplesThisBatch = (totalSamples - totalSamplesCollected);
-        if (samplesThisBatch > batchSize) {
-            samplesThisBatch = batchSize;
-        }
-        
-        // Perform batch read
-        DWORD batchStartTime = GET_TIME();
-        int samplesReceived = SPI_ReceiveBatch(samplesThisBatch, dataBuffer, 
-                                             samplesThisBatch * BYTES_PER_SAMPLE);
-        DWORD batchTime = GET_TIME() - batchStartTime;
-        
-        if (samplesReceived <= 0) {
-            printf("Error: Failed to receive data in batch %d\n", batchCount + 1);
-            break;
+    // Cleanup
+    FreePipelines(settings);
+    ClosePipelineFiles(pipeline);
+    CloseDevices();
+    
+    return readError ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    printf("High-Performance FT232H SPI Reader (C Implementation)\n");
+    printf("=====================================================\n");
+    
+    SPI_DefaultConfig(&DeviceConfig, &BatchFrame, MAX_BATCH_SIZE);
+    
+    // Parse command line arguments: [totalSamples] [batchSize] [--options]
+    int totalSamples = 10000;
+    int batchSize = OPTIMAL_BATCH_SIZE;
+    int inflight = DEFAULT_INFLIGHT;
+    bool stream = false;
+    bool benchWait = false;
+    int sweepMs = 0;
+    bool calibrate = false;
+    const char* daemonPath = NULL;
+    int berMs = 0;
+    int berPattern = BER_PATTERN_PRBS;
+    const char* recordPath = NULL;
+    const char* replayPath = NULL;
+    bool replayRealtime = false;
+    bool writeOutput = true;
+    double nominalFrameRate = 0.0;
+    const char* serials[MAX_DEVICES];
+    int serialCount = 0;
+    int mergeBy = MERGE_AUTO;
+    Trigger triggerConfig;
+    Trigger_Init(&triggerConfig);
+    int positional = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            fputs(Usage, stdout);
+            return 0;
         }
-        
-        // Process and write data
-        for (int i = 0; i < samplesReceived; i++) {
-            const UCHAR* sampleData = &dataBuffer[i * BYTES_PER_SAMPLE];
-            
-            // Write full binary data to output file
-            PrintBinaryData(sampleData, BYTES_PER_SAMPLE, outputFile);
-            
-            // Extract bits 124-147 (24 bits) for counter output
-            // Bit 124 is in byte 15, bit 4 (124 = 15*8 + 4)
-            // Bit 147 is in byte 18, bit 3 (147 = 18*8 + 3)
-            if (BYTES_PER_SAMPLE >= 19) { // Make sure we have enough bytes
-                // Extract 24 bits starting from bit 124
-                UCHAR counterBytes[3] = {0};
-                
-                // Extract bits carefully - this is byte/bit manipulation
-                int startBit = 124;
-                for (int bit = 0; bit < 24; bit++) {
-                    int globalBit = startBit + bit;
-                    int byteIndex = globalBit / 8;
-                    int bitIndex = globalBit % 8;
-                    
-                    if (byteIndex < BYTES_PER_SAMPLE) {
-                        int counterByteIndex = bit / 8;
-                        int counterBitIndex = bit % 8;
-                        
-                        if (sampleData[byteIndex] & (1 << bitIndex)) {
-                            counterBytes[counterByteIndex] |= (1 << counterBitIndex);
-                        }
-                    }
+        if (strncmp(argv[i], "--", 2) == 0) {
+            if (strcmp(argv[i], "--wait=poll") == 0) {
+                DeviceConfig.waitMode = WAIT_POLL;
+            } else if (strcmp(argv[i], "--wait=event") == 0) {
+                DeviceConfig.waitMode = WAIT_EVENT;
+            } else if (strncmp(argv[i], "--inflight=", 11) == 0) {
+                inflight = atoi(argv[i] + 11);
+                if (inflight < 1 || inflight > MAX_INFLIGHT_BATCHES) {
+                    printf("Warning: Invalid in-flight count %d, using %d\n", inflight, DEFAULT_INFLIGHT);
+                    inflight = DEFAULT_INFLIGHT;
+                }
+            } else if (strcmp(argv[i], "--stream") == 0) {
+                stream = true;
+            } else if (strcmp(argv[i], "--data-ready") == 0 || strcmp(argv[i], "--data-ready=rising") == 0) {
+                DeviceConfig.frame.dataReady = MPSSE_READY_RISING;
+            } else if (strcmp(argv[i], "--data-ready=falling") == 0) {
+                DeviceConfig.frame.dataReady = MPSSE_READY_FALLING;
+            } else if (strcmp(argv[i], "--markers=low") == 0) {
+                DeviceConfig.frame.gpioMarkers = MPSSE_GPIO_LOW;
+            } else if (strcmp(argv[i], "--markers=high") == 0) {
+                DeviceConfig.frame.gpioMarkers = MPSSE_GPIO_HIGH;
+            } else if (strcmp(argv[i], "--markers=both") == 0) {
+                DeviceConfig.frame.gpioMarkers = MPSSE_GPIO_LOW | MPSSE_GPIO_HIGH;
+            } else if (strcmp(argv[i], "--bench-wait") == 0) {
+                benchWait = true;
+            } else if (strcmp(argv[i], "--sweep") == 0) {
+                sweepMs = SWEEP_DEFAULT_MS;
+            } else if (strncmp(argv[i], "--sweep=", 8) == 0) {
+                sweepMs = atoi(argv[i] + 8);
+                if (sweepMs <= 0) sweepMs = SWEEP_DEFAULT_MS;
+            } else if (strncmp(argv[i], "--usb-transfer=", 15) == 0) {
+                int size = atoi(argv[i] + 15);
+                if (size < 64 || size > SPI_USB_TRANSFER_MAX || size % 64 != 0) {
+                    printf("Warning: Invalid USB transfer size %d, using %d\n", size, SPI_USB_TRANSFER_MAX);
+                } else {
+                    DeviceConfig.usbTransferSize = size;
                 }
-                
-                // Write 24-bit counter data
-                PrintBinaryData(counterBytes, 3, counterFile);
+            } else if (strncmp(argv[i], "--latency=", 10) == 0) {
+                int latency = atoi(argv[i] + 10);
+                if (latency < 1 || latency > 255) {
+                    printf("Warning: Invalid latency timer %d ms, using %d\n", latency, SPI_DEFAULT_LATENCY_MS);
+                } else {
+                    DeviceConfig.latencyMs = (UCHAR)latency;
+                }
+            } else if (strcmp(argv[i], "--calibrate") == 0) {
+                calibrate = true;
+            } else if (strcmp(argv[i], "--ber") == 0) {
+                berMs = BER_DEFAULT_MS;
+            } else if (strncmp(argv[i], "--ber=", 6) == 0) {
+                berMs = atoi(argv[i] + 6);
+                if (berMs <= 0) berMs = BER_DEFAULT_MS;
+            } else if (strncmp(argv[i], "--ber-pattern=", 14) == 0) {
+                if (!Ber_ParsePattern(argv[i] + 14, &berPattern)) {
+                    printf("Warning: Unknown test pattern %s, using prbs\n", argv[i] + 14);
+                    berPattern = BER_PATTERN_PRBS;
+                }
+            } else if (strcmp(argv[i], "--daemon") == 0) {
+                daemonPath = DAEMON_SOCKET_PATH;
+            } else if (strncmp(argv[i], "--daemon=", 9) == 0) {
+                daemonPath = argv[i] + 9;
+            } else if (strncmp(argv[i], "--record=", 9) == 0) {
+                recordPath = argv[i] + 9;
+            } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+                replayPath = argv[i] + 9;
+            } else if (strcmp(argv[i], "--pace=realtime") == 0) {
+                replayRealtime = true;
+            } else if (strcmp(argv[i], "--pace=max") == 0) {
+                replayRealtime = false;
+            } else if (strcmp(argv[i], "--no-output") == 0) {
+                writeOutput = false;
+            } else if (strncmp(argv[i], "--frame-rate=", 13) == 0) {
+                nominalFrameRate = atof(argv[i] + 13);
+            } else if (strncmp(argv[i], "--cpu=", 6) == 0) {
+                AcquisitionCpu = atoi(argv[i] + 6);
+            } else if (strcmp(argv[i], "--rt") == 0) {
+                RealtimePriority = DEFAULT_RT_PRIORITY;
+            } else if (strncmp(argv[i], "--rt=", 5) == 0) {
+                RealtimePriority = atoi(argv[i] + 5);
+                if (RealtimePriority <= 0) {
+                    printf("Warning: Invalid real-time priority %s, using %d\n", argv[i] + 5,
+                           DEFAULT_RT_PRIORITY);
+                    RealtimePriority = DEFAULT_RT_PRIORITY;
+                }
+            } else if (strcmp(argv[i], "--mlock") == 0) {
+                LockBuffers = true;
+            } else if (strncmp(argv[i], "--device=", 9) == 0) {
+                if (serialCount < MAX_DEVICES) {
+                    serials[serialCount++] = argv[i] + 9;
+                } else {
+                    printf("Warning: At most %d devices, ignoring %s\n", MAX_DEVICES, argv[i]);
+                }
+            } else if (strcmp(argv[i], "--merge=time") == 0) {
+                mergeBy = MERGE_TIME;
+            } else if (strcmp(argv[i], "--merge=counter") == 0) {
+                mergeBy = MERGE_COUNTER;
+            } else if (strncmp(argv[i], "--backpressure=", 15) == 0) {
+                int policy = BACKPRESSURE_BLOCK;
+                while (policy <= BACKPRESSURE_SPILL && strcmp(argv[i] + 15, BackpressureNames[policy]) != 0) {
+                    policy++;
+                }
+                if (policy > BACKPRESSURE_SPILL) {
+                    printf("Warning: Unknown backpressure policy %s, using block\n", argv[i] + 15);
+                } else {
+                    Backpressure = policy;
+                }
+            } else if (strncmp(argv[i], "--trigger=", 10) == 0) {
+                if (!Trigger_AddCondition(&triggerConfig, argv[i] + 10)) {
+                    printf("Warning: Invalid trigger condition %s (or more than %d), ignoring it\n",
+                           argv[i] + 10, TRIGGER_MAX_CONDITIONS);
+                }
+            } else if (strncmp(argv[i], "--pre-trigger=", 14) == 0) {
+                triggerConfig.preNs = (unsigned long long)(atof(argv[i] + 14) * 1e6);
+            } else if (strncmp(argv[i], "--post-trigger=", 15) == 0) {
+                triggerConfig.postNs = (unsigned long long)(atof(argv[i] + 15) * 1e6);
+            } else {
+                printf("Warning: Unknown option %s (see --help)\n", argv[i]);
             }
+            continue;
         }
         
-        totalSamplesCollected += samplesReceived;
-        batchCount++;
-        
-        // Progress reporting
-        double elapsed = GetElapsedTime(startTime);
-        double samplesPerSec = totalSamplesCollected / elapsed;
-        
-        printf("Batch %d: %d samples, %lu ms, Progress: %d/%d (%.1f%%), Speed: %.0f smp/s\n",
-               batchCount, samplesReceived, batchTime,
-               totalSamplesCollected, totalSamples,
-               (double)totalSamplesCollected / totalSamples * 100.0,
-               samplesPerSec);
-        
-        // Small delay to prevent overwhelming the system
-        if (batchCount % 10 == 0) {
-            SLEEP_MS(1);
+        if (positional == 0) {
+            // 0 captures until Ctrl+C
+            totalSamples = atoi(argv[i]);
+            if (totalSamples < 0) totalSamples = 10000;
+        } else if (positional == 1) {
+            batchSize = atoi(argv[i]);
+            if (batchSize <= 0 || batchSize > MAX_BATCH_SIZE) {
+                printf("Warning: Invalid batch size %d, using %d\n", batchSize, OPTIMAL_BATCH_SIZE);
+                batchSize = OPTIMAL_BATCH_SIZE;
+            }
         }
+        positional++;
     }
     
-    // Calculate final performance
-    double totalTime = GetElapsedTime(startTime);
-    double avgSamplesPerSec = totalSamplesCollected / totalTime;
-    double dataRateMBps = (totalSamplesCollected * BYTES_PER_SAMPLE) / (totalTime * 1024 * 1024);
+    // A replay runs to the end of the capture unless a sample count was given
+    FILE* replayFile = NULL;
+    CaptureHeader replayHeader = { 0 };
+    if (replayPath) {
+        CaptureHeader header;
+        replayFile = fopen(replayPath, "rb");
+        if (!replayFile || !Capture_ReadHeader(replayFile, &header)) {
+            printf("Failed to open capture file %s\n", replayPath);
+            if (replayFile) fclose(replayFile);
+            return 1;
+        }
+        if (positional == 0) totalSamples = 0;
+        stream = (header.flags & CAPTURE_STREAM) != 0;
+        DeviceConfig.frame.dataReady = (header.flags & CAPTURE_DATA_READY) ? MPSSE_READY_RISING : MPSSE_READY_NONE;
+        DeviceConfig.frame.gpioMarkers = ((header.flags & CAPTURE_GPIO_LOW) ? MPSSE_GPIO_LOW : 0) |
+                                         ((header.flags & CAPTURE_GPIO_HIGH) ? MPSSE_GPIO_HIGH : 0);
+        replayHeader = header;
+        recordPath = NULL;
+        benchWait = false;
+        sweepMs = 0;
+        calibrate = false;
+        berMs = 0;
+    }
+    
+    // The daemon reads the devices run after run, into the same output files
+    if (daemonPath && replayFile) {
+        printf("--daemon reads devices, it does not take --replay\n");
+        fclose(replayFile);
+        return 1;
+    }
+    if (daemonPath && recordPath) {
+        printf("Warning: --record does not apply to --daemon, ignoring it\n");
+        recordPath = NULL;
+    }
+    if (daemonPath && (calibrate || benchWait || sweepMs > 0 || berMs > 0)) {
+        printf("Warning: --daemon does not apply to the tools, ignoring it\n");
+        daemonPath = NULL;
+    }
     
-    printf("\n=== PERFORMANCE RESULTS ===\n");
-    printf("Total samples collected: %d\n", totalSamplesCollected);
-    printf("Total time: %.3f seconds\n", totalTime);
-    printf("Average speed: %.0f samples/second\n", avgSamplesPerSec);
-    printf("Data rate: %.2f MB/s\n", dataRateMBps);
-    printf("Total batches: %d\n", batchCount);
-    printf("USB transactions: %d\n", batchCount);
-    printf("\nData written to files\n");
+    // Stream mode clocks continuously, there is no frame read to wait before
+    if (stream && DeviceConfig.frame.dataReady != MPSSE_READY_NONE) {
+        printf("Warning: --data-ready does not apply to --stream, ignoring it\n");
+        DeviceConfig.frame.dataReady = MPSSE_READY_NONE;
+    }
+    // The tools read whole batches of bare frames; stream chunks have no frame
+    // reads to put the GPIO reads after
+    if ((stream || calibrate || benchWait || sweepMs > 0 || berMs > 0) && DeviceConfig.frame.gpioMarkers != 0) {
+        printf("Warning: --markers applies to batch captures only, ignoring it\n");
+        DeviceConfig.frame.gpioMarkers = 0;
+    }
+    MarkerBytes = Mpsse_MarkerBytes(&DeviceConfig.frame);
+    RecordBytes = BYTES_PER_SAMPLE + MarkerBytes;
+    if (nominalFrameRate > 0.0) DeviceConfig.readyHz = nominalFrameRate;
     
-    // Cleanup
-    free(dataBuffer);
-    fclose(outputFile);
-    fclose(counterFile);
-    SPI_Close();
+    // A serial number may name a two- or four-channel chip, whose MPSSE
+    // channels are then read as separate links
+    char deviceSerials[MAX_DEVICES][CALIB_SERIAL_LENGTH];
+    int deviceCount = 0;
+    for (int s = 0; s < serialCount && !replayFile; s++) {
+        char channels[SPI_MAX_CHANNELS][CALIB_SERIAL_LENGTH];
+        int found = SPI_FindChannels(DeviceConfig.transport, serials[s], channels, SPI_MAX_CHANNELS);
+        if (found == 0) {
+            snprintf(channels[0], CALIB_SERIAL_LENGTH, "%s", serials[s]);
+            found = 1;
+        }
+        for (int c = 0; c < found; c++) {
+            if (deviceCount == MAX_DEVICES) {
+                printf("Warning: At most %d devices, ignoring %s\n", MAX_DEVICES, channels[c]);
+                continue;
+            }
+            memcpy(deviceSerials[deviceCount++], channels[c], CALIB_SERIAL_LENGTH);
+        }
+    }
+    bool oneChip = serialCount == 1 && deviceCount > 1;
+    if (mergeBy == MERGE_AUTO) {
+        mergeBy = oneChip ? MERGE_COUNTER : MERGE_TIME;
+    }
     
-    return 0;
+#ifndef SIGUSR2
+    for (int c = 0; c < triggerConfig.conditionCount; c++) {
+        if (triggerConfig.conditions[c].type == TRIGGER_EXTERNAL) {
+            printf("Warning: No signal for an external trigger on this platform\n");
+        }
+    }
+#endif
+    
+    // Recording, replay and triggered capture handle the stream of one device
+    bool triggered = triggerConfig.conditionCount > 0;
+    if (deviceCount == 0) deviceCount = 1;
+    if ((deviceCount > 1 || serialCount > 1) && (replayFile || recordPath)) {
+        printf("--record and --replay take a single device\n");
+        if (replayFile) fclose(replayFile);
+        return 1;
+    }
+    if ((deviceCount > 1 || serialCount > 1) && triggered) {
+        printf("--trigger takes a single device\n");
+        return 1;
+    }
+    
+    // Flow control: never have more bytes outstanding than the RX budget
+    int unitBytes = stream ? STREAM_CHUNK_BYTES : batchSize * RecordBytes;
+    int inflightLimit = INFLIGHT_BYTES_MAX / unitBytes;
+    if (inflightLimit < 1) inflightLimit = 1;
+    if (inflight > inflightLimit) {
+        printf("Warning: %d requests of %d bytes exceed the RX budget, using %d in flight\n",
+               inflight, unitBytes, inflightLimit);
+        inflight = inflightLimit;
+    }
+    
+    CaptureSettings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.totalSamples = totalSamples;
+    settings.batchSize = batchSize;
+    settings.inflight = inflight;
+    settings.stream = stream;
+    settings.writeOutput = writeOutput;
+    settings.recordPath = recordPath;
+    settings.replayFile = replayFile;
+    settings.replayHeader = replayHeader;
+    settings.replayRealtime = replayRealtime;
+    settings.nominalFrameRate = nominalFrameRate;
+    settings.triggered = triggered;
+    settings.trigger = triggerConfig;
+    settings.mergeBy = mergeBy;
+    settings.pipelineCount = deviceCount;
+    
+    PrintConfiguration(&settings, replayPath, daemonPath, deviceSerials);
+    if (!replayFile && !OpenDevices(deviceSerials, deviceCount, serialCount > 0)) {
+        return 1;
+    }
+    
+    // The tools run on every device in turn
+    if (calibrate || benchWait || sweepMs > 0 || berMs > 0) {
+        for (int d = 0; d < DeviceCount && !StopRequested; d++) {
+            if (DeviceCount > 1) printf("\n##### DEVICE %s #####\n", Devices[d].serial);
+            if (calibrate) {
+                Tools_CalibrateClock(&Devices[d], batchSize);
+            } else if (berMs > 0) {
+                Tools_BerTest(&Devices[d], batchSize, berMs, berPattern);
+            } else if (benchWait) {
+                Tools_WaitBenchmark(&Devices[d], batchSize);
+            } else {
+                Tools_UsbSweep(&Devices[d], sweepMs);
+            }
+        }
+        CloseDevices();
+        return 0;
+    }
+    
+    InitBinaryDigits();
+    if (daemonPath) {
+        return Daemon_Run(&settings, daemonPath);
+    }
+    return RunCapture(&settings);
 }
 
-bool SPI_Initialize(void)
+// Set up one pipeline per device (or the replay) for a capture. Timestamps of
+// a replay keep the origin they were recorded with. Several devices share one
+// origin, so their frame times can be compared directly. The daemon keeps its
+// output files, held by the first pipeline, open from run to run.
+void InitPipelines(const CaptureSettings* settings, bool keepFiles)
 {
-    FT_STATUS ftStatus;
-    DWORD numDevs;
+    Pipeline* first = &Pipelines[0];
+    FILE* files[] = { first->outputFile, first->counterFile, first->timeFile,
+                      first->gapFile, first->markerFile, first->triggerFile };
+    FILE* replayFile = settings->replayFile;
+    bool dataReady = DeviceConfig.frame.dataReady != MPSSE_READY_NONE;
+    unsigned long long startNs = Time_NowNs();
+    unsigned long long wallStartNs = replayFile ? settings->replayHeader.startTime : Time_WallNs();
+    
+    for (int d = 0; d < settings->pipelineCount; d++) {
+        Pipeline* pipeline = &Pipelines[d];
+        memset(pipeline, 0, sizeof(*pipeline));
+        pipeline->totalSamples = settings->totalSamples;
+        pipeline->batchSize = settings->batchSize;
+        pipeline->inflight = settings->inflight;
+        pipeline->stream = settings->stream;
+        pipeline->device = replayFile ? NULL : &Devices[d];
+        pipeline->deviceIndex = d;
+        pipeline->merged = settings->pipelineCount > 1;
+        if (pipeline->merged) {
+            snprintf(pipeline->label, sizeof(pipeline->label), "%s: ", Devices[d].serial);
+        }
+        pipeline->replayFile = replayFile;
+        pipeline->replayRealtime = settings->replayRealtime;
+        pipeline->triggered = settings->triggered;
+        pipeline->trigger = settings->trigger;
+        if (!replayFile && Backpressure == BACKPRESSURE_SPILL) {
+            pipeline->spill.file = tmpfile();
+            if (!pipeline->spill.file) {
+                printf("Warning: %sNo temporary file to spill to, blocking instead\n", pipeline->label);
+            }
+        }
+        Framer_Init(&pipeline->framer);
+        
+        pipeline->startNs = startNs;
+        pipeline->wallStartNs = wallStartNs;
+        pipeline->spiClockHz = replayFile ? settings->replayHeader.spiClockHz : Devices[d].clockHz;
+        ClockModel_Init(&pipeline->clock, settings->nominalFrameRate, pipeline->spiClockHz,
+                        settings->stream, dataReady);
+    }
     
-    // Check for FTDI devices
-    ftStatus = FT_CreateDeviceInfoList(&numDevs);
-    if (ftStatus != FT_OK || numDevs == 0) {
-        printf("Error: No FTDI devices found\n");
+    if (keepFiles) {
+        first->outputFile = files[0];
+        first->counterFile = files[1];
+        first->timeFile = files[2];
+        first->gapFile = files[3];
+        first->markerFile = files[4];
+        first->triggerFile = files[5];
+    }
+}
+
+// Column headers of the output files that have them
+void WriteFileHeaders(const CaptureSettings* settings)
+{
+    Pipeline* pipeline = &Pipelines[0];
+    if (pipeline->gapFile) {
+        fprintf(pipeline->gapFile, "# %sframes-before start-unix-s length-s frames-lost cause recovery\n",
+                settings->pipelineCount > 1 ? "device " : "");
+    }
+    if (pipeline->triggerFile) {
+        fprintf(pipeline->triggerFile, "# frames-before trigger-unix-s frame-index condition\n");
+    }
+}
+
+// Open the output files, the merge writes the devices' frames to the first pipeline's
+bool OpenOutputFiles(const CaptureSettings* settings)
+{
+    Pipeline* pipeline = &Pipelines[0];
+    bool filesOk = true;
+    if (settings->writeOutput) {
+        pipeline->outputFile = fopen(OUT_PATH, "w");
+        pipeline->counterFile = fopen(CNT_OUT_PATH, "w");
+        pipeline->timeFile = fopen(TIME_OUT_PATH, "w");
+        pipeline->gapFile = fopen(GAP_OUT_PATH, "w");
+        filesOk = pipeline->outputFile && pipeline->counterFile && pipeline->timeFile && pipeline->gapFile;
+        if (filesOk && MarkerBytes > 0) {
+            pipeline->markerFile = fopen(MARKER_OUT_PATH, "w");
+            filesOk = pipeline->markerFile != NULL;
+        }
+        if (filesOk && settings->triggered) {
+            pipeline->triggerFile = fopen(TRIGGER_OUT_PATH, "w");
+            filesOk = pipeline->triggerFile != NULL;
+        }
+        if (filesOk) {
+            WriteFileHeaders(settings);
+        }
+    }
+    if (settings->recordPath && filesOk) {
+        bool dataReady = DeviceConfig.frame.dataReady != MPSSE_READY_NONE;
+        unsigned int markerFlags = ((DeviceConfig.frame.gpioMarkers & MPSSE_GPIO_LOW) ? CAPTURE_GPIO_LOW : 0) |
+                                   ((DeviceConfig.frame.gpioMarkers & MPSSE_GPIO_HIGH) ? CAPTURE_GPIO_HIGH : 0);
+        CaptureHeader header = { (settings->stream ? CAPTURE_STREAM : 0) | (dataReady ? CAPTURE_DATA_READY : 0) |
+                                 markerFlags, pipeline->spiClockHz, BYTES_PER_SAMPLE, pipeline->wallStartNs };
+        pipeline->recordFile = fopen(settings->recordPath, "wb");
+        filesOk = pipeline->recordFile && Capture_WriteHeader(pipeline->recordFile, &header);
+    }
+    return filesOk;
+}
+
+// Preallocate all slots up front so the hot path never allocates
+bool AllocatePipelines(const CaptureSettings* settings)
+{
+    int readSlotBytes = settings->replayFile ? CAPTURE_MAX_CHUNK :
+                        settings->stream ? STREAM_CHUNK_BYTES : settings->batchSize * RecordBytes;
+    bool ringsOk = true;
+    for (int d = 0; d < settings->pipelineCount; d++) {
+        ringsOk = AllocatePipelineBuffers(&Pipelines[d], readSlotBytes) && ringsOk;
+    }
+    if (!ringsOk) {
+        for (int d = 0; d < settings->pipelineCount; d++) {
+            FreePipelineBuffers(&Pipelines[d]);
+        }
         return false;
     }
+    for (int d = 0; d < settings->pipelineCount; d++) {
+        PrepareRingMemory(&Pipelines[d], true);
+    }
+    return true;
+}
+
+void FreePipelines(const CaptureSettings* settings)
+{
+    for (int d = 0; d < settings->pipelineCount; d++) {
+        PrepareRingMemory(&Pipelines[d], false);
+        FreePipelineBuffers(&Pipelines[d]);
+        if (Pipelines[d].spill.file) fclose(Pipelines[d].spill.file);
+        Pipelines[d].spill.file = NULL;
+    }
+}
+
+void InstallSignalHandlers(void)
+{
+    signal(SIGINT, HandleInterrupt);
+#ifdef SIGUSR1
+    signal(SIGUSR1, HandleReportRequest);
+#elif defined(SIGBREAK)
+    signal(SIGBREAK, HandleReportRequest);
+#endif
+#ifdef SIGUSR2
+    signal(SIGUSR2, HandleTriggerRequest);
+#endif
+}
+
+// Start the threads of a prepared capture, consumers first so the readers
+// never wait on an idle pipeline. If one fails to start, those already
+// running are stopped and joined, and StopRequested is left set.
+bool StartCapture(CaptureRun* run, const CaptureSettings* settings)
+{
+    Pipeline* pipeline = &Pipelines[0];
+    int pipelineCount = settings->pipelineCount;
+    memset(run, 0, sizeof(*run));
+    run->settings = settings;
     
-    printf("Found %lu FTDI device(s)\n", numDevs);
+    // Performance tracking
+    DWORD startTime = GET_TIME();
+    for (int d = 0; d < pipelineCount; d++) {
+        Pipelines[d].startTime = startTime;
+    }
+    run->runStartNs = Time_NowNs();
+    run->allocationsBefore = Mem_Allocations();
     
-    // Open first device
-    ftStatus = FT_Open(0, &ftHandle);
-    if (ftStatus != FT_OK) {
-        printf("Error: Failed to open FTDI device\n");
-        return false;
+    PMU_THREAD_FN readerFn = settings->replayFile ? ReplayThread :
+                             settings->stream ? StreamReaderThread : ReaderThread;
+    run->merger.pipelines = Pipelines;
+    run->merger.count = pipelineCount;
+    run->merger.byCounter = settings->mergeBy == MERGE_COUNTER;
+    bool recording = pipeline->recordFile != NULL;
+    bool recorderStarted = recording && Thread_Start(&run->recorderThread, RecorderThread, pipeline);
+    bool writerStarted = (recorderStarted || !recording) &&
+        (pipelineCount > 1 ? Thread_Start(&run->writerThread, MergeWriterThread, &run->merger) :
+                             Thread_Start(&run->writerThread, WriterThread, pipeline));
+    int decoders = 0, readers = 0;
+    while (writerStarted && readers < pipelineCount) {
+        if (decoders == readers) {
+            if (!Thread_Start(&run->decoderThreads[decoders], DecoderThread, &Pipelines[decoders])) break;
+            decoders++;
+        }
+        if (!Thread_Start(&run->readerThreads[readers], readerFn, &Pipelines[readers])) break;
+        readers++;
     }
+    if (readers == pipelineCount) return true;
     
-    // Reset device
-    ftStatus = FT_ResetDevice(ftHandle);
-    if (ftStatus != FT_OK) {
-        printf("Error: Failed to reset device\n");
-        return false;
+    // Stop the readers that run, and end the streams of the ones that do not
+    // so that every consumer started finishes
+    StopRequested = 1;
+    for (int d = 0; d < pipelineCount; d++) {
+        if (d >= readers && (d < decoders || (d == 0 && recorderStarted))) {
+            EndOfStream(&Pipelines[d]);
+        }
+        if (d >= decoders && writerStarted) {
+            EndOfText(&Pipelines[d]);
+        }
+    }
+    for (int d = 0; d < readers; d++) {
+        Thread_Join(run->readerThreads[d]);
+    }
+    for (int d = 0; d < decoders; d++) {
+        Thread_Join(run->decoderThreads[d]);
+    }
+    if (writerStarted) Thread_Join(run->writerThread);
+    if (recorderStarted) Thread_Join(run->recorderThread);
+    return false;
+}
+
+void JoinCapture(CaptureRun* run)
+{
+    for (int d = 0; d < run->settings->pipelineCount; d++) {
+        Thread_Join(run->readerThreads[d]);
+        Thread_Join(run->decoderThreads[d]);
+    }
+    Thread_Join(run->writerThread);
+    if (Pipelines[0].recordFile) {
+        Thread_Join(run->recorderThread);
+    }
+    run->elapsedSec = (Time_NowNs() - run->runStartNs) / 1e9;
+    run->captureAllocations = Mem_Allocations() - run->allocationsBefore;
+}
+
+// Frames a capture has collected, over every frame read even if only the
+// trigger windows were written
+int CollectedSamples(Pipeline* pipeline)
+{
+    return pipeline->triggered ?
+        atomic_load_explicit(&pipeline->framesDecoded, memory_order_acquire) :
+        pipeline->totalSamplesCollected;
+}
+
+// Statistics of a finished capture; true if a device could not be read
+bool PrintCaptureResults(const CaptureRun* run)
+{
+    const CaptureSettings* settings = run->settings;
+    int pipelineCount = settings->pipelineCount;
+    FILE* replayFile = settings->replayFile;
+    bool readError = false;
+    for (int d = 0; d < pipelineCount; d++) {
+        Pipeline* pipeline = &Pipelines[d];
+        if (pipeline->merged) {
+            printf("\n##### DEVICE %d: %s #####\n", d, pipeline->device->serial);
+        }
+        
+        // Calculate final performance
+        int totalSamplesCollected = CollectedSamples(pipeline);
+        double totalTime = GetElapsedTime(pipeline->startTime);
+        double avgSamplesPerSec = totalSamplesCollected / totalTime;
+        double dataRateMBps = (totalSamplesCollected * RecordBytes) / (totalTime * 1024 * 1024);
+        
+        printf("\n=== PERFORMANCE RESULTS ===\n");
+        printf("Total samples collected: %d\n", totalSamplesCollected);
+        printf("Total time: %.3f seconds\n", totalTime);
+        printf("Average speed: %.0f samples/second\n", avgSamplesPerSec);
+        printf("Data rate: %.2f MB/s\n", dataRateMBps);
+        printf("Line rate utilisation: %.1f%%\n",
+               avgSamplesPerSec * RecordBytes * 8 * 100.0 / pipeline->spiClockHz);
+        printf("Total batches: %d\n", pipeline->batchCount);
+        printf("USB transactions: %d\n", pipeline->batchCount);
+        printf("\n=== PIPELINE STATISTICS ===\n");
+        printf("(producer stalls = downstream too slow, consumer stalls = upstream too slow)\n");
+        ReadRing_PrintStats(&pipeline->readRing);
+        Ring_PrintStats(&pipeline->textRing);
+        if (!replayFile) {
+            PrintBackpressureStats(pipeline);
+        }
+        printf("  Heap allocations while capturing: %lu\n", run->captureAllocations);
+        if (!replayFile && !settings->stream) {
+            printf("  Command programs: %lu batches queued, %lu programs built\n",
+                   pipeline->device->programs.uses, pipeline->device->programs.builds);
+        }
+        if (!replayFile) {
+            printf("\n=== BATCH LATENCY ===\n");
+            SPI_PrintLatency(pipeline->device);
+            Deadline_PrintStats(&pipeline->deadline);
+        }
+        printf("\n=== FRAMING STATISTICS ===\n");
+        Framer_PrintStats(&pipeline->framer);
+        printf("\n=== CLOCK MODEL ===\n");
+        ClockModel_PrintStats(&pipeline->clock);
+        printf("\n=== ACQUISITION GAPS ===\n");
+        if (!replayFile) {
+            Supervisor_PrintStats(&pipeline->supervisor);
+        }
+        printf("  Gaps: %lu, frames lost in them (estimated): %llu\n",
+               pipeline->gaps, pipeline->gapFramesLost);
+        if (pipeline->triggered) {
+            printf("\n=== TRIGGERED CAPTURE ===\n");
+            Trigger_PrintStats(&pipeline->trigger, totalSamplesCollected);
+        }
+        readError = readError || pipeline->readError;
     }
     
-    // Purge buffers
-    DWORD bytesInQueue;
-    ftStatus = FT_GetQueueStatus(ftHandle, &bytesInQueue);
-    if (ftStatus == FT_OK && bytesInQueue > 0) {
-        DWORD bytesRead;
-        FT_Read(ftHandle, InputBuffer, bytesInQueue, &bytesRead);
+    const Pipeline* pipeline = &Pipelines[0];
+    const Merger* merger = &run->merger;
+    if (pipelineCount > 1) {
+        printf("\n=== MERGED OUTPUT ===\n");
+        printf("Frames merged: %llu from %d devices\n", merger->framesMerged, pipelineCount);
+        printf("Out of order: %llu frames (after a newer one)\n", merger->outOfOrder);
+        if (merger->byCounter) {
+            printf("Correlated by FPGA frame counter: %llu frames, %llu (%.2f%%) read on every link\n",
+                   merger->sets, merger->setsComplete,
+                   merger->sets ? merger->setsComplete * 100.0 / merger->sets : 0.0);
+        }
+    }
+    if (pipeline->recordFile) {
+        printf("\nRecorded %llu raw bytes to %s%s\n", pipeline->recordBytes, settings->recordPath,
+               pipeline->recordError ? " (write error, capture incomplete)" : "");
     }
+    if (replayFile) {
+        // Wall-clock figures, covering framing, decoding and output of the whole capture
+        double elapsedSec = run->elapsedSec;
+        printf("\n=== REPLAY THROUGHPUT ===\n");
+        printf("Records: %lu, raw bytes: %llu, elapsed: %.3f s\n",
+               pipeline->replayRecords, pipeline->replayBytes, elapsedSec);
+        printf("Raw input: %.3f GB/s, frames: %.0f frames/s\n",
+               pipeline->replayBytes / elapsedSec / 1e9, pipeline->totalSamplesCollected / elapsedSec);
+        printf("Heap allocations while replaying: %lu\n", run->captureAllocations);
+    }
+    if (settings->writeOutput) {
+        printf("\nData written to files\n");
+    }
+    return readError;
+}
+
+void ClosePipelineFiles(Pipeline* pipeline)
+{
+    if (pipeline->outputFile) fclose(pipeline->outputFile);
+    if (pipeline->counterFile) fclose(pipeline->counterFile);
+    if (pipeline->timeFile) fclose(pipeline->timeFile);
+    if (pipeline->markerFile) fclose(pipeline->markerFile);
+    if (pipeline->gapFile) fclose(pipeline->gapFile);
+    if (pipeline->triggerFile) fclose(pipeline->triggerFile);
+    if (pipeline->recordFile) fclose(pipeline->recordFile);
+    if (pipeline->replayFile) fclose(pipeline->replayFile);
+}
+
+// Put spilled reads back into the read ring while it has free slots, oldest
+// first; true once the spill file is empty
+static bool Spill_Drain(Pipeline* pipeline)
+{
+    Spill* spill = &pipeline->spill;
     
-    // Set USB parameters for high performance
-    ftStatus = FT_SetUSBParameters(ftHandle, USB_BUFFER_SIZE, USB_BUFFER_SIZE);
-    if (ftStatus != FT_OK) {
-        printf("Warning: Failed to set USB parameters\n");
+    while (spill->readPos < spill->writePos) {
+        ReadSlot* slot = ReadRing_TryAcquire(&pipeline->readRing);
+        if (!slot) return false;
+        
+        CaptureRecord record;
+        int length = fseek(spill->file, spill->readPos, SEEK_SET) == 0 ?
+            Capture_ReadRecord(spill->file, &record, slot->data, pipeline->readRing.slotSize) : -1;
+        if (length <= 0) {
+            printf("Error: %sCannot read the spill file back, %ld bytes lost\n", pipeline->label,
+                   spill->writePos - spill->readPos);
+            spill->failed = true;
+            break;
+        }
+        slot->length = length;
+        slot->flags = record.flags;
+        slot->batchMs = 0;
+        slot->timeNs = record.timeUs * 1000;
+        ReadRing_Publish(&pipeline->readRing);
+        spill->readPos += CAPTURE_RECORD_BYTES + length;
     }
     
-    // Disable event and error characters
-    ftStatus = FT_SetChars(ftHandle, 0, false, 0, false);
-    if (ftStatus != FT_OK) {
-        printf("Warning: Failed to set characters\n");
+    // Caught up, the file starts over
+    spill->readPos = 0;
+    spill->writePos = 0;
+    return true;
+}
+
+static void Spill_Write(Pipeline* pipeline, const ReadSlot* slot)
+{
+    Spill* spill = &pipeline->spill;
+    CaptureRecord record = { slot->timeNs / 1000, (unsigned int)slot->length, slot->flags };
+    unsigned char header[CAPTURE_RECORD_BYTES];
+    Capture_EncodeRecord(&record, header);
+    
+    if (fseek(spill->file, spill->writePos, SEEK_SET) != 0 ||
+        fwrite(header, 1, CAPTURE_RECORD_BYTES, spill->file) != CAPTURE_RECORD_BYTES ||
+        fwrite(slot->data, 1, slot->length, spill->file) != (size_t)slot->length) {
+        printf("Error: %sCannot write the spill file, %d bytes lost, blocking from now on\n",
+               pipeline->label, slot->length);
+        spill->failed = true;
+        return;
+    }
+    spill->writePos += CAPTURE_RECORD_BYTES + slot->length;
+    spill->slots++;
+    spill->bytes += slot->length;
+    if (spill->writePos - spill->readPos > spill->highWater) {
+        spill->highWater = spill->writePos - spill->readPos;
     }
+}
+
+// Host time of a read from the capture start, in whole microseconds like the
+// capture records, so that a replay decodes exactly the same times
+static unsigned long long ReadTimeNs(const Pipeline* pipeline)
+{
+    return (Time_NowNs() - pipeline->startNs) / 1000 * 1000;
+}
+
+// Slot for the next read (or gap marker). With the read ring full it waits for
+// the consumers, overwrites the oldest slot or hands out the spill buffer, as
+// --backpressure says; while a spill backlog remains new reads join it.
+static ReadSlot* AcquireReadSlot(Pipeline* pipeline)
+{
+    ReadRing* ring = &pipeline->readRing;
+    unsigned long stalls = ring->producerStalls;
+    ReadSlot* slot;
     
-    // Set timeouts (5 seconds for large batches)
-    ftStatus = FT_SetTimeouts(ftHandle, 5000, 5000);
-    if (ftStatus != FT_OK) {
-        printf("Warning: Failed to set timeouts\n");
+    if (pipeline->spill.file && !pipeline->spill.failed) {
+        slot = Spill_Drain(pipeline) ? ReadRing_TryAcquire(ring) : NULL;
+        if (!slot) slot = &pipeline->spill.slot;
+    } else if (Backpressure == BACKPRESSURE_DROP) {
+        slot = ReadRing_Overwrite(ring);
+    } else {
+        slot = ReadRing_Acquire(ring);
     }
     
-    // Set latency timer to minimum
-    ftStatus = FT_SetLatencyTimer(ftHandle, 2);
-    if (ftStatus != FT_OK) {
-        printf("Warning: Failed to set latency timer\n");
+    pipeline->deadline.ringFull = ring->producerStalls != stalls;
+    return slot;
+}
+
+static void PublishReadSlot(Pipeline* pipeline, ReadSlot* slot)
+{
+    if (slot == &pipeline->spill.slot) {
+        Spill_Write(pipeline, slot);
+    } else {
+        ReadRing_Publish(&pipeline->readRing);
+    }
+}
+
+// Gap marker for read ring slots a consumer lost to --backpressure=drop,
+// between the last data it had and the data in next
+static CaptureGap RingFullGap(const Pipeline* pipeline, const ReadSlot* next, unsigned long long lastReadNs)
+{
+    unsigned long long endNs = lastReadNs;
+    if (next->length > 0 && !(next->flags & CAPTURE_GAP)) {
+        unsigned long long transferNs = (unsigned long long)next->length * 8 * 1000000000ULL /
+                                        pipeline->spiClockHz;
+        if (next->timeNs > lastReadNs + transferNs) endNs = next->timeNs - transferNs;
     }
+    CaptureGap gap = { lastReadNs / 1000, endNs / 1000, FT_OK, GAP_RING_FULL };
+    return gap;
+}
+
+static void PrintBackpressureStats(const Pipeline* pipeline)
+{
+    const ReadRing* ring = &pipeline->readRing;
+    const Spill* spill = &pipeline->spill;
     
-    // Reset controller
-    ftStatus = FT_SetBitMode(ftHandle, 0x00, 0x00);
-    if (ftStatus != FT_OK) {
-        printf("Error: Failed to reset bit mode\n");
-        return false;
+    printf("  Read ring full (%s): %lu times, %.1f ms waiting, %llu frames dropped, "
+           "%llu frames spilled (backlog up to %.2f MB)\n",
+           BackpressureNames[Backpressure], ring->producerStalls, ring->producerWaitNs / 1e6,
+           ring->bytesLost[CONSUMER_DECODER] / RecordBytes, spill->bytes / RecordBytes,
+           spill->highWater / 1048576.0);
+    if (ring->consumers > CONSUMER_RECORDER && ring->bytesLost[CONSUMER_RECORDER] > 0) {
+        printf("  Frames dropped from the recording: %llu\n", ring->bytesLost[CONSUMER_RECORDER] / RecordBytes);
     }
+}
+
+// First recovery step for a failure, escalated by the failures before it
+static int Supervisor_Classify(FT_STATUS status, int failures)
+{
+    int action;
     
-    // Enable MPSSE mode
-    ftStatus = FT_SetBitMode(ftHandle, 0x00, 0x02);
-    if (ftStatus != FT_OK) {
-        printf("Error: Failed to enable MPSSE mode\n");
-        return false;
+    switch (status) {
+    case FT_OK:                     // Short or empty read, the stream lost its place
+    case FT_IO_ERROR:               // A USB transfer failed, e.g. a cable glitch
+    case FT_FAILED_TO_WRITE_DEVICE:
+    case FT_OTHER_ERROR:
+        action = RECOVER_RETRY;
+        break;
+    case FT_INVALID_HANDLE:         // The device is gone, it may come back
+    case FT_DEVICE_NOT_FOUND:
+    case FT_DEVICE_NOT_OPENED:
+    case FT_INSUFFICIENT_RESOURCES:
+    case FT_DEVICE_LIST_NOT_READY:
+        action = RECOVER_REOPEN;
+        break;
+    default:
+        return RECOVER_FATAL;
     }
     
-    // Wait for MPSSE to initialize
-    SLEEP_MS(50);
+    action += failures;
+    return action < RECOVER_REOPEN ? action : RECOVER_REOPEN;
+}
+
+/*
+ * Bring the device back after a failed or short read. Everything queued in the
+ * device is lost, the caller queues it again. A step that does not work is
+ * followed by the next one; reopening is retried with a growing wait until it
+ * works or Ctrl+C, and not at all for a device without a serial number. The
+ * time without data then goes down the read ring as a gap marker, behind the
+ * data already published. Returns false if the capture has to end.
+ */
+static bool Supervisor_Recover(Pipeline* pipeline)
+{
+    Supervisor* supervisor = &pipeline->supervisor;
+    SpiDevice* device = pipeline->device;
+    FT_STATUS status = device->lastStatus;
+    int action = Supervisor_Classify(status, supervisor->failures++);
+    DWORD retryMs = REOPEN_RETRY_MIN_MS;
     
-    // Synchronize MPSSE interface
-    if (!SPI_SynchronizeMPSSE()) {
-        printf("Error: Failed to synchronize MPSSE\n");
+    if (action == RECOVER_FATAL) {
+        printf("Error: %s%s, cannot recover\n", pipeline->label, SPI_StatusName(status));
+        pipeline->readError = true;
         return false;
     }
     
-    // Configure SPI interface
-    if (!SPI_ConfigureSPI()) {
-        printf("Error: Failed to configure SPI\n");
-        return false;
+    for (;;) {
+        if (StopRequested) return false;
+        
+        bool recovered = action == RECOVER_RETRY ? SPI_FlushPipeline(device) :
+                         action == RECOVER_RESYNC ? SPI_Resync(device) : SPI_Reopen(device);
+        if (recovered) break;
+        
+        if (action < RECOVER_REOPEN) {
+            action++;
+        } else if (device->serial[0] == '\0') {
+            pipeline->readError = true;
+            return false;
+        } else {
+            SLEEP_MS(retryMs);
+            retryMs = retryMs * 2 < REOPEN_RETRY_MAX_MS ? retryMs * 2 : REOPEN_RETRY_MAX_MS;
+        }
     }
     
+    unsigned long long resumeNs = ReadTimeNs(pipeline);
+    supervisor->actions[action]++;
+    supervisor->gapNs += resumeNs - supervisor->lastDataNs;
+    printf("Warning: %s%s, recovered by %s, %.3f s without data\n", pipeline->label, SPI_StatusName(status),
+           RecoverNames[action], (resumeNs - supervisor->lastDataNs) / 1e9);
+    
+    CaptureGap gap = { supervisor->lastDataNs / 1000, resumeNs / 1000,
+                       (unsigned int)status, (unsigned int)action };
+    ReadSlot* slot = AcquireReadSlot(pipeline);
+    Capture_EncodeGap(&gap, slot->data);
+    slot->length = CAPTURE_GAP_BYTES;
+    slot->flags = CAPTURE_GAP;
+    slot->batchMs = (unsigned long)((resumeNs - supervisor->lastDataNs) / 1000000);
+    slot->timeNs = resumeNs;
+    PublishReadSlot(pipeline, slot);
+    
+    supervisor->lastDataNs = resumeNs;
+    pipeline->deadline.lastDoneNs = 0;
+    device->lastStatus = FT_OK;
     return true;
 }
 
-bool SPI_SynchronizeMPSSE(void)
+static void Supervisor_PrintStats(const Supervisor* supervisor)
 {
-    FT_STATUS ftStatus;
-    DWORD bytesWritten, bytesRead, bytesInQueue;
-    
-    // Send bad command 0xAA
-    OutputBuffer[0] = 0xAA;
-    ftStatus = FT_Write(ftHandle, OutputBuffer, 1, &bytesWritten);
-    if (ftStatus != FT_OK) return false;
-    
-    SLEEP_MS(10);
-    
-    // Read response
-    ftStatus = FT_GetQueueStatus(ftHandle, &bytesInQueue);
-    if (ftStatus == FT_OK && bytesInQueue > 0) {
-        FT_Read(ftHandle, InputBuffer, bytesInQueue, &bytesRead);
+    printf("  Recoveries: %lu retry, %lu resync, %lu reopen, %.3f s without data\n",
+           supervisor->actions[RECOVER_RETRY], supervisor->actions[RECOVER_RESYNC],
+           supervisor->actions[RECOVER_REOPEN], supervisor->gapNs / 1e9);
+}
+
+// Forget the batches queued in the device, returns the frames they would have brought
+static int DropPending(const int* pending, int head, int count)
+{
+    int samples = 0;
+    for (int i = 0; i < count; i++) {
+        samples += pending[(head + i) % MAX_INFLIGHT_BATCHES];
     }
+    return samples;
+}
+
+// Mark the end of stream for every consumer of the read ring, behind any
+// spilled reads
+static void EndOfStream(Pipeline* pipeline)
+{
+    while (pipeline->spill.file && !pipeline->spill.failed && !Spill_Drain(pipeline)) {
+        SLEEP_MS(1);
+    }
+    ReadSlot* slot = ReadRing_Acquire(&pipeline->readRing);
+    slot->length = 0;
+    ReadRing_Publish(&pipeline->readRing);
+}
+
+// A slot of no frames tells the writer that the decoder has finished
+static void EndOfText(Pipeline* pipeline)
+{
+    RingSlot* text = Ring_BeginWrite(&pipeline->textRing);
+    text->samples = 0;
+    Ring_EndWrite(&pipeline->textRing);
+}
+
+// Print the latency histograms when SIGUSR1 (Ctrl+Break) asked for them
+static void CheckReportRequest(void)
+{
+    if (ReportRequested) {
+        ReportRequested = 0;
+        printf("\n=== BATCH LATENCY (so far) ===\n");
+        PrintLatencyReport();
+    }
+}
+
+// Raw frames to read in total: the requested count plus every frame the
+// decoder could not use (re-framing, purged partial batches) or never got
+// (overwritten in a full read ring before it read them; what only the
+// recorder lost is not read again). 0 is unlimited.
+static int RawFramesWanted(Pipeline* pipeline)
+{
+    if (pipeline->totalSamples == 0) return 0;
+    return pipeline->totalSamples + atomic_load_explicit(&pipeline->framesDropped, memory_order_acquire) +
+           (int)(pipeline->readRing.bytesLost[CONSUMER_DECODER] / RecordBytes);
+}
+
+// Everything wanted so far has been read: wait for the decoder to finish it,
+// spilled reads included, then tell whether dropped frames still need replacing
+static bool MoreFramesWanted(Pipeline* pipeline, unsigned long long bytesPublished)
+{
+    while (!StopRequested &&
+           atomic_load_explicit(&pipeline->bytesDecoded, memory_order_acquire) +
+           pipeline->readRing.bytesLost[CONSUMER_DECODER] < bytesPublished) {
+        if (pipeline->spill.file && !pipeline->spill.failed) Spill_Drain(pipeline);
+        SLEEP_MS(1);
+    }
+    return !StopRequested &&
+           atomic_load_explicit(&pipeline->framesDecoded, memory_order_acquire) < pipeline->totalSamples;
+}
+
+// Acquisition stage: keeps the FT232H busy, reads every batch straight into a
+// read ring slot and never touches the disk. Failed and short batches are
+// handed to the supervisor and queued again once the device is back.
+PMU_THREAD_RET PMU_THREAD_CALL ReaderThread(void* arg)
+{
+    Pipeline* pipeline = (Pipeline*)arg;
+    int pending[MAX_INFLIGHT_BATCHES];     // Sizes of the batches queued in the device
+    int pendingHead = 0, pendingCount = 0;
+    int samplesQueued = 0;
+    unsigned long long bytesPublished = 0;
+    unsigned long batch = 0;
     
-    // Send bad command 0xAB
-    OutputBuffer[0] = 0xAB;
-    ftStatus = FT_Write(ftHandle, OutputBuffer, 1, &bytesWritten);
-    if (ftStatus != FT_OK) return false;
-    
-    SLEEP_MS(10);
+    SetAcquisitionScheduling(pipeline);
     
-    // Read response
-    ftStatus = FT_GetQueueStatus(ftHandle, &bytesInQueue);
-    if (ftStatus == FT_OK && bytesInQueue > 0) {
-        FT_Read(ftHandle, InputBuffer, bytesInQueue, &bytesRead);
+    while (!StopRequested) {
+        // Keep the command FIFO topped up before waiting on the oldest batch
+        int wanted = RawFramesWanted(pipeline);
+        while (pendingCount < pipeline->inflight && (wanted == 0 || samplesQueued < wanted)) {
+            int samplesThisBatch = wanted - samplesQueued;
+            if (wanted == 0 || samplesThisBatch > pipeline->batchSize) {
+                samplesThisBatch = pipeline->batchSize;
+            }
+            
+            if (!SPI_QueueBatch(pipeline->device, samplesThisBatch)) {
+                samplesQueued -= DropPending(pending, pendingHead, pendingCount);
+                pendingCount = 0;
+                if (!Supervisor_Recover(pipeline)) goto endOfStream;
+                continue;
+            }
+            
+            pending[(pendingHead + pendingCount) % MAX_INFLIGHT_BATCHES] = samplesThisBatch;
+            pendingCount++;
+            samplesQueued += samplesThisBatch;
+        }
+        
+        if (pendingCount == 0) {
+            if (!MoreFramesWanted(pipeline, bytesPublished)) break;
+            pipeline->deadline.lastDoneNs = 0;
+            continue;
+        }
+        
+        int samplesThisBatch = pending[pendingHead];
+        pendingHead = (pendingHead + 1) % MAX_INFLIGHT_BATCHES;
+        pendingCount--;
+        batch++;
+        
+        // Collect the oldest batch directly into the next free slot
+        ReadSlot* slot = AcquireReadSlot(pipeline);
+        DWORD batchStartTime = GET_TIME();
+        int samplesReceived = SPI_CollectBatch(pipeline->device, samplesThisBatch, slot->data,
+                                               samplesThisBatch * RecordBytes);
+        DWORD batchMs = GET_TIME() - batchStartTime;
+        unsigned long long readDoneNs = ReadTimeNs(pipeline);
+        
+        if (samplesReceived > 0) {
+            slot->length = samplesReceived * RecordBytes;
+            slot->flags = samplesReceived < samplesThisBatch ? CAPTURE_SHORT : 0;
+            slot->batchMs = batchMs;
+            slot->timeNs = readDoneNs;
+            PublishReadSlot(pipeline, slot);
+            bytesPublished += slot->length;
+            pipeline->supervisor.lastDataNs = readDoneNs;
+            Deadline_Check(&pipeline->deadline, pipeline->device, slot->length, readDoneNs);
+        }
+        
+        if (samplesReceived < samplesThisBatch) {
+            // The rest of this batch would arrive ahead of the following ones
+            samplesQueued -= DropPending(pending, pendingHead, pendingCount) +
+                             samplesThisBatch - (samplesReceived > 0 ? samplesReceived : 0);
+            pendingCount = 0;
+            if (!Supervisor_Recover(pipeline)) break;
+        } else {
+            pipeline->supervisor.failures = 0;
+        }
+        
+        CheckReportRequest();
     }
     
-    return true;
+endOfStream:
+    EndOfStream(pipeline);
+    
+    return 0;
 }
 
-bool SPI_ConfigureSPI(void)
+// Streaming acquisition stage: keeps maximum-length clock-in commands queued,
+// each read straight into a read ring slot; the decoder recovers the frame
+// boundaries in software from the checksum and counter. Errors and short
+// chunks go to the supervisor, like in batch mode.
+PMU_THREAD_RET PMU_THREAD_CALL StreamReaderThread(void* arg)
 {
-    FT_STATUS ftStatus;
-    DWORD bytesWritten;
-    int bufferIndex = 0;
+    Pipeline* pipeline = (Pipeline*)arg;
+    int chunksQueued = 0;
+    unsigned long long bytesPublished = 0;
     
-    // Disable clock divide by 5
-    OutputBuffer[bufferIndex++] = 0x8A;
+    SetAcquisitionScheduling(pipeline);
     
-    // Turn off adaptive clocking
-    OutputBuffer[bufferIndex++] = 0x97;
+    while (!StopRequested) {
+        int wanted = RawFramesWanted(pipeline);
+        if (wanted != 0 && bytesPublished / BYTES_PER_SAMPLE >= (unsigned long long)wanted) {
+            if (!MoreFramesWanted(pipeline, bytesPublished)) break;
+            pipeline->deadline.lastDoneNs = 0;
+            continue;
+        }
+        
+        while (chunksQueued < pipeline->inflight) {
+            if (!SPI_QueueStream(pipeline->device, STREAM_CHUNK_BYTES)) {
+                printf("Error: %sFailed to queue stream chunk\n", pipeline->label);
+                chunksQueued = 0;
+                if (!Supervisor_Recover(pipeline)) goto endOfStream;
+                continue;
+            }
+            chunksQueued++;
+        }
+        
+        ReadSlot* slot = AcquireReadSlot(pipeline);
+        DWORD chunkStartTime = GET_TIME();
+        int bytesReceived = SPI_CollectBytes(pipeline->device, slot->data, STREAM_CHUNK_BYTES);
+        DWORD chunkMs = GET_TIME() - chunkStartTime;
+        unsigned long long readDoneNs = ReadTimeNs(pipeline);
+        chunksQueued--;
+        
+        if (bytesReceived > 0) {
+            slot->length = bytesReceived;
+            slot->flags = bytesReceived < STREAM_CHUNK_BYTES ? CAPTURE_SHORT : 0;
+            slot->batchMs = chunkMs;
+            slot->timeNs = readDoneNs;
+            PublishReadSlot(pipeline, slot);
+            bytesPublished += bytesReceived;
+            pipeline->supervisor.lastDataNs = readDoneNs;
+            Deadline_Check(&pipeline->deadline, pipeline->device, bytesReceived, readDoneNs);
+        }
+        
+        if (bytesReceived < STREAM_CHUNK_BYTES) {
+            // Bytes are missing from the stream, the boundary must be found again
+            if (bytesReceived > 0) {
+                printf("Warning: %sShort stream chunk (%d bytes)\n", pipeline->label, bytesReceived);
+            }
+            chunksQueued = 0;
+            if (!Supervisor_Recover(pipeline)) break;
+        } else {
+            pipeline->supervisor.failures = 0;
+        }
+        
+        CheckReportRequest();
+    }
     
-    // Disable 3-phase data clock
-    OutputBuffer[bufferIndex++] = 0x8D;
+endOfStream:
+    EndOfStream(pipeline);
     
-    ftStatus = FT_Write(ftHandle, OutputBuffer, bufferIndex, &bytesWritten);
-    if (ftStatus != FT_OK) return false;
+    return 0;
+}
+
+// Replay stage: reads each capture record into a read ring slot, so it takes
+// the same framing path as the live readers
+PMU_THREAD_RET PMU_THREAD_CALL ReplayThread(void* arg)
+{
+    Pipeline* pipeline = (Pipeline*)arg;
+    unsigned long long bytesPublished = 0;
+    unsigned long long previousUs = 0;
+    unsigned long long replayStartUs = Time_NowUs();
+    CaptureRecord record;
     
-    bufferIndex = 0;
+    while (!StopRequested) {
+        int wanted = RawFramesWanted(pipeline);
+        if (wanted != 0 && bytesPublished / RecordBytes >= (unsigned long long)wanted) {
+            if (!MoreFramesWanted(pipeline, bytesPublished)) break;
+            continue;
+        }
+        
+        ReadSlot* slot = ReadRing_Acquire(&pipeline->readRing);
+        int length = Capture_ReadRecord(pipeline->replayFile, &record, slot->data,
+                                        pipeline->readRing.slotSize);
+        if (length <= 0) {
+            if (length < 0) {
+                printf("Error: Truncated or corrupt record %lu in capture file\n",
+                       pipeline->replayRecords + 1);
+                pipeline->readError = true;
+            }
+            break;
+        }
+        
+        if (pipeline->replayRealtime) {
+            unsigned long long dueUs = replayStartUs + record.timeUs;
+            unsigned long long nowUs = Time_NowUs();
+            if (dueUs > nowUs + 1000) {
+                SLEEP_MS((DWORD)((dueUs - nowUs) / 1000));
+            }
+        }
+        
+        pipeline->replayRecords++;
+        
+        // A record flagged short was followed by a flush in the live reader,
+        // one flagged as a gap holds a marker instead of raw bytes
+        slot->length = length;
+        slot->flags = record.flags;
+        slot->batchMs = (DWORD)((record.timeUs - previousUs) / 1000);
+        slot->timeNs = record.timeUs * 1000;
+        ReadRing_Publish(&pipeline->readRing);
+        if (!(record.flags & CAPTURE_GAP)) {
+            pipeline->replayBytes += length;
+            bytesPublished += length;
+        }
+        previousUs = record.timeUs;
+    }
     
-    // Set clock divisor for 6MHz
-    OutputBuffer[bufferIndex++] = 0x86; // Set clock divisor command
-    OutputBuffer[bufferIndex++] = CLOCK_DIVISOR & 0xFF;        // Low byte
-    OutputBuffer[bufferIndex++] = (CLOCK_DIVISOR >> 8) & 0xFF; // High byte
+    EndOfStream(pipeline);
+    return 0;
+}
+
+static void WriteRecord(Pipeline* pipeline, const CaptureRecord* record, const unsigned char* data)
+{
+    unsigned char header[CAPTURE_RECORD_BYTES];
+    Capture_EncodeRecord(record, header);
+    if (fwrite(header, 1, CAPTURE_RECORD_BYTES, pipeline->recordFile) != CAPTURE_RECORD_BYTES ||
+        fwrite(data, 1, record->length, pipeline->recordFile) != record->length) {
+        printf("Error: Failed to write capture file, recording stopped\n");
+        pipeline->recordError = true;
+    } else {
+        pipeline->recordBytes += record->length;
+    }
+}
+
+// Recording stage: appends every read ring slot to the capture file, straight
+// from the slot, off the acquisition thread
+PMU_THREAD_RET PMU_THREAD_CALL RecorderThread(void* arg)
+{
+    Pipeline* pipeline = (Pipeline*)arg;
+    unsigned long skipped = 0;
+    unsigned long long lastReadNs = 0;
     
-    // Configure GPIO pins for SPI (no CS toggling for continuous operation)
-    OutputBuffer[bufferIndex++] = 0x80; // Set data bits low byte
-    OutputBuffer[bufferIndex++] = 0x00; // Value: CS low for continuous operation
-    OutputBuffer[bufferIndex++] = 0x0B; // Direction: MOSI(0), SCK(1) = output, MISO(2) = input, CS(3) = output
+    for (;;) {
+        const ReadSlot* slot = ReadRing_Next(&pipeline->readRing, CONSUMER_RECORDER);
+        int length = slot->length;
+        
+        // Slots overwritten before they were recorded leave a gap in the capture
+        if (pipeline->readRing.skipped[CONSUMER_RECORDER] != skipped && !pipeline->recordError) {
+            skipped = pipeline->readRing.skipped[CONSUMER_RECORDER];
+            CaptureGap gap = RingFullGap(pipeline, slot, lastReadNs);
+            unsigned char data[CAPTURE_GAP_BYTES];
+            Capture_EncodeGap(&gap, data);
+            CaptureRecord record = { gap.endUs, CAPTURE_GAP_BYTES, CAPTURE_GAP };
+            WriteRecord(pipeline, &record, data);
+        }
+        
+        if (length == 0) {
+            ReadRing_Release(&pipeline->readRing, CONSUMER_RECORDER);
+            break;
+        }
+        
+        if (!pipeline->recordError) {
+            CaptureRecord record = { slot->timeNs / 1000, (unsigned int)length, slot->flags };
+            WriteRecord(pipeline, &record, slot->data);
+        }
+        
+        lastReadNs = slot->timeNs;
+        ReadRing_Release(&pipeline->readRing, CONSUMER_RECORDER);
+    }
     
-    // Set high byte pins
-    OutputBuffer[bufferIndex++] = 0x82; // Set data bits high byte
-    OutputBuffer[bufferIndex++] = 0x00; // Value
-    OutputBuffer[bufferIndex++] = 0x00; // Direction
+    return 0;
+}
+
+// Expand count aligned frames with their FPGA frame indexes and host times
+// into one text ring slot, followed by the times and indexes when merged.
+// timeNs is when the last of them came off the wire (from pipeline->startNs).
+static void FormatFrames(Pipeline* pipeline, const UCHAR* frames, int count,
+                         const unsigned long long* frameIndex, const unsigned long long* frameTimeNs,
+                         const unsigned short* markers, unsigned long batch, unsigned long batchMs,
+                         unsigned long long timeNs)
+{
+    RingSlot* text = Ring_BeginWrite(&pipeline->textRing);
+    text->samples = count;
+    text->batch = batch;
+    text->batchMs = batchMs;
+    text->timeNs = timeNs;
     
-    ftStatus = FT_Write(ftHandle, OutputBuffer, bufferIndex, &bytesWritten);
-    if (ftStatus != FT_OK) return false;
+    char* binText = (char*)text->data;
+    char* counterText = binText + pipeline->batchSize * BIN_LINE_LENGTH;
+    char* timeText = counterText + pipeline->batchSize * CNT_LINE_LENGTH;
+    char* markerText = timeText + pipeline->batchSize * TIME_LINE_LENGTH;
     
-    SLEEP_MS(20);
+    for (int i = 0; i < count; i++) {
+        const UCHAR* sampleData = &frames[i * BYTES_PER_SAMPLE];
+        
+        // Full binary data for the output file
+        binText = FormatBinaryData(sampleData, BYTES_PER_SAMPLE, binText);
+        
+        // Bits 124-147 counted LSB first within each byte (bit 124 is bit 4 of
+        // byte 15), packed the same way into three counter bytes
+        unsigned long counter = (unsigned long)(sampleData[15] >> 4) |
+                                ((unsigned long)sampleData[16] << 4) |
+                                ((unsigned long)sampleData[17] << 12) |
+                                ((unsigned long)(sampleData[18] & 0x0F) << 20);
+        UCHAR counterBytes[3] = { (UCHAR)counter, (UCHAR)(counter >> 8), (UCHAR)(counter >> 16) };
+        counterText = FormatBinaryData(counterBytes, 3, counterText);
+        
+        // Fixed-width line, formatted aside so the terminator stays out of the slot
+        char timeLine[64];
+        unsigned long long unixNs = pipeline->wallStartNs + frameTimeNs[i];
+        snprintf(timeLine, sizeof(timeLine), "%010llu.%09llu %012llu\n",
+                 unixNs / 1000000000ULL, unixNs % 1000000000ULL,
+                 frameIndex[i] % 1000000000000ULL);
+        memcpy(timeText + i * TIME_LINE_LENGTH, timeLine, TIME_LINE_LENGTH);
+        
+        if (markers) {
+            UCHAR markerBytes[2] = { (UCHAR)markers[i], (UCHAR)(markers[i] >> 8) };
+            markerText = FormatBinaryData(markerBytes, MarkerBytes, markerText);
+        }
+    }
     
-    // Turn off loopback
-    bufferIndex = 0;
-    OutputBuffer[bufferIndex++] = 0x85;
-    ftStatus = FT_Write(ftHandle, OutputBuffer, bufferIndex, &bytesWritten);
-    if (ftStatus != FT_OK) return false;
+    if (pipeline->merged) {
+        UCHAR* values = text->data + pipeline->batchSize * TEXT_FRAME_BYTES;
+        memcpy(values + TEXT_TIMES * pipeline->batchSize * sizeof(unsigned long long),
+               frameTimeNs, count * sizeof(unsigned long long));
+        memcpy(values + TEXT_INDEXES * pipeline->batchSize * sizeof(unsigned long long),
+               frameIndex, count * sizeof(unsigned long long));
+    }
     
-    SLEEP_MS(30);
+    Ring_EndWrite(&pipeline->textRing);
+}
+
+// A trigger opened a window: a Triggers.txt line with the number of frames
+// written before it, its time (Unix s), the FPGA frame index and the condition
+static void DecodeTrigger(Pipeline* pipeline)
+{
+    const Trigger* trigger = &pipeline->trigger;
+    const TriggerEvent* event = &trigger->event;
+    unsigned long long unixNs = pipeline->wallStartNs + event->timeNs;
     
-    return true;
+    RingSlot* text = Ring_BeginWrite(&pipeline->textRing);
+    snprintf((char*)text->data, TRIGGER_LINE_LENGTH, "%llu %010llu.%09llu %012llu %s\n",
+             event->framesBefore, unixNs / 1000000000ULL, unixNs % 1000000000ULL,
+             event->index % 1000000000000ULL, trigger->conditions[event->condition].spec);
+    text->samples = TEXT_TRIGGER_MARKER;
+    Ring_EndWrite(&pipeline->textRing);
+    
+    printf("Trigger %s at %010llu.%09llu, frame %llu\n", trigger->conditions[event->condition].spec,
+           unixNs / 1000000000ULL, unixNs % 1000000000ULL, event->index);
 }
 
-int SPI_ReceiveBatch(int numSamples, UCHAR* dataBuffer, int bufferSize)
+// Triggered capture: check the frames added to the history and write out the
+// ones the trigger windows cover, each window after its Triggers.txt line. The
+// text slots carry the window number where a batch has its batch number.
+static void WriteTriggerWindows(Pipeline* pipeline, unsigned long batchMs)
 {
-    FT_STATUS ftStatus;
-    DWORD bytesWritten, bytesRead, bytesInQueue;
-    int bufferIndex = 0;
-    int expectedBytes = numSamples * BYTES_PER_SAMPLE;
+    Trigger* trigger = &pipeline->trigger;
+    int result;
     
-    // Build command buffer for batch read
-    for (int i = 0; i < numSamples; i++) {
-        if (bufferIndex + 3 >= CMD_BUFFER_SIZE) {
-            printf("Error: Command buffer overflow\n");
-            return -1;
+    do {
+        result = Trigger_Scan(trigger);
+        if (result == TRIGGER_OPENED) {
+            DecodeTrigger(pipeline);
         }
         
-        OutputBuffer[bufferIndex++] = MSB_RISING_EDGE_CLOCK_BYTE_IN;
-        OutputBuffer[bufferIndex++] = (BYTES_PER_SAMPLE - 1) & 0xFF;        // Low byte of length
-        OutputBuffer[bufferIndex++] = ((BYTES_PER_SAMPLE - 1) >> 8) & 0xFF; // High byte of length
+        unsigned long position;
+        int count;
+        while ((count = Trigger_Pending(trigger, pipeline->batchSize, &position)) > 0) {
+            FormatFrames(pipeline, trigger->frames + (size_t)position * BYTES_PER_SAMPLE, count,
+                         trigger->index + position, trigger->timeNs + position,
+                         MarkerBytes > 0 ? trigger->markers + position : NULL, trigger->windows, batchMs,
+                         trigger->timeNs[position + count - 1]);
+            Trigger_Written(trigger, count);
+        }
+    } while (result != TRIGGER_DONE);
+}
+
+// Timestamp count aligned frames, then format them, or with --trigger keep
+// them in the history and format what the trigger windows take
+static void DecodeFrames(Pipeline* pipeline, const UCHAR* frames, int count, unsigned long batch,
+                         unsigned long batchMs, unsigned long long timeNs)
+{
+    // One model update per slot, then a host time for every frame in it
+    ClockModel_Timestamp(&pipeline->clock, frames, count, timeNs,
+                         pipeline->frameIndex, pipeline->frameTimeNs);
+    
+    if (!pipeline->triggered) {
+        FormatFrames(pipeline, frames, count, pipeline->frameIndex, pipeline->frameTimeNs,
+                     pipeline->frameMarkers, batch, batchMs, timeNs);
+        return;
+    }
+    Trigger_Append(&pipeline->trigger, frames, count, pipeline->frameIndex, pipeline->frameTimeNs,
+                   pipeline->frameMarkers);
+    WriteTriggerWindows(pipeline, batchMs);
+}
+
+// Gap marker from the reader, or for slots lost in a full read ring: the framer
+// starts over, the clock model bridges the gap from the host time and the
+// writer gets a Gaps.txt line
+static void DecodeGap(Pipeline* pipeline, const CaptureGap* gap, int samplesDecoded)
+{
+    // A gap can open a trigger window, whose frames from before it come first.
+    // Gaps.txt then counts the frames written, not the frames read.
+    if (pipeline->triggered) {
+        Trigger_Gap(&pipeline->trigger, gap->startUs * 1000, gap->endUs * 1000);
+        WriteTriggerWindows(pipeline, 0);
+        samplesDecoded = (int)pipeline->trigger.framesWritten;
     }
     
-    // Send all commands at once
-    ftStatus = FT_Write(ftHandle, OutputBuffer, bufferIndex, &bytesWritten);
-    if (ftStatus != FT_OK) {
-        printf("Error: Failed to write commands\n");
-        return -1;
+    Framer_Reset(&pipeline->framer);
+    long long framesLost = ClockModel_FramesSince(&pipeline->clock, gap->endUs * 1000);
+    ClockModel_Resume(&pipeline->clock);
+    pipeline->gaps++;
+    if (framesLost > 0) {
+        pipeline->gapFramesLost += framesLost;
     }
     
-    // Wait for data with adaptive timing
-    int baseWait = 5; // 5ms base wait
-    int scaledWait = numSamples / 100; // Scale with batch size
-    SLEEP_MS(baseWait + scaledWait);
+    // Frames written before the gap, start (Unix s), length (s), frames lost
+    // (-1 if unknown), cause, recovery; merged, the device's serial number first
+    bool ringFull = (gap->action == GAP_RING_FULL);
+    unsigned long long unixUs = pipeline->wallStartNs / 1000 + gap->startUs;
+    RingSlot* text = Ring_BeginWrite(&pipeline->textRing);
+    snprintf((char*)text->data, GAP_LINE_LENGTH, "%s%s%d %010llu.%06llu %.6f %lld %s %s\n",
+             pipeline->merged ? pipeline->device->serial : "", pipeline->merged ? " " : "",
+             samplesDecoded, unixUs / 1000000ULL, unixUs % 1000000ULL,
+             (gap->endUs - gap->startUs) / 1e6, framesLost,
+             ringFull ? "RING_FULL" : SPI_StatusName((FT_STATUS)gap->status),
+             ringFull ? "drop" : gap->action < RECOVER_ACTIONS ? RecoverNames[gap->action] : "unknown");
+    text->samples = TEXT_GAP_MARKER;
+    Ring_EndWrite(&pipeline->textRing);
+}
+
+// --markers: moves the frames of a slot together for the framer and keeps the
+// GPIO bytes read after each until its frame comes out of the framer. A
+// partial frame read at the end of a short read is dropped. Returns the frame
+// bytes.
+static int SplitMarkers(Pipeline* pipeline, const UCHAR* data, int length)
+{
+    int reads = length / RecordBytes;
     
-    // Read data with retry mechanism
-    int totalBytesRead = 0;
-    int retries = 0;
-    const int maxRetries = 10;
+    for (int r = 0; r < reads; r++) {
+        const UCHAR* read = data + r * RecordBytes;
+        memcpy(pipeline->markerFrames + r * BYTES_PER_SAMPLE, read, BYTES_PER_SAMPLE);
+        unsigned short marker = read[BYTES_PER_SAMPLE];
+        if (MarkerBytes > 1) marker |= (unsigned short)(read[BYTES_PER_SAMPLE + 1] << 8);
+        pipeline->markers[pipeline->markerReads++ % pipeline->markerCapacity] = marker;
+    }
+    return reads * BYTES_PER_SAMPLE;
+}
+
+// Every frame gets the markers of the read it starts in: the framer's stream
+// is the frame reads back to back, so a frame read off its boundary after a
+// bit slip takes the read holding most of it
+static void LookUpMarkers(Pipeline* pipeline, int count)
+{
+    for (int i = 0; i < count; i++) {
+        unsigned long long read = pipeline->frameStarts[i] / BYTES_PER_SAMPLE;
+        pipeline->frameMarkers[i] = pipeline->markers[read % pipeline->markerCapacity];
+    }
+}
+
+// Decode stage: frames the bytes of each read ring slot and expands the frames
+// into the text written by the writer stage. Aligned frames are decoded where
+// FT_Read put them; only frames the framer must shift or hold back are copied.
+PMU_THREAD_RET PMU_THREAD_CALL DecoderThread(void* arg)
+{
+    Pipeline* pipeline = (Pipeline*)arg;
+    Framer* framer = &pipeline->framer;
+    bool unlimited = (pipeline->totalSamples == 0);
+    int samplesDecoded = 0;
+    unsigned long batch = 0;
+    unsigned long long bytesIn = 0;
+    unsigned long long framesFramed = 0;
+    unsigned long skipped = 0;
+    unsigned long long lastReadNs = 0;
     
-    while (totalBytesRead < expectedBytes && retries < maxRetries) {
-        ftStatus = FT_GetQueueStatus(ftHandle, &bytesInQueue);
-        if (ftStatus != FT_OK) {
-            printf("Error: Failed to get queue status\n");
-            return -1;
+    for (;;) {
+        const ReadSlot* slot = ReadRing_Next(&pipeline->readRing, CONSUMER_DECODER);
+        int length = slot->length;
+        
+        // Slots overwritten before the decoder got to them
+        if (pipeline->readRing.skipped[CONSUMER_DECODER] != skipped) {
+            skipped = pipeline->readRing.skipped[CONSUMER_DECODER];
+            CaptureGap gap = RingFullGap(pipeline, slot, lastReadNs);
+            DecodeGap(pipeline, &gap, samplesDecoded);
+        }
+        
+        if (length == 0) {
+            ReadRing_Release(&pipeline->readRing, CONSUMER_DECODER);
+            break;
+        }
+        
+        if (slot->flags & CAPTURE_GAP) {
+            CaptureGap gap;
+            Capture_DecodeGap(slot->data, &gap);
+            DecodeGap(pipeline, &gap, samplesDecoded);
+            ReadRing_Release(&pipeline->readRing, CONSUMER_DECODER);
+            lastReadNs = slot->timeNs;
+            continue;
         }
         
-        if (bytesInQueue > 0) {
-            DWORD bytesToRead = bytesInQueue;
-            if (totalBytesRead + bytesToRead > bufferSize) {
-                bytesToRead = bufferSize - totalBytesRead;
+        // With --markers the framer gets the frames without their GPIO bytes
+        const UCHAR* data = slot->data;
+        int dataLength = length;
+        if (MarkerBytes > 0) {
+            dataLength = SplitMarkers(pipeline, slot->data, length);
+            data = pipeline->markerFrames;
+        }
+        
+        unsigned long resyncs = framer->resyncs;
+        unsigned long long checksumErrors = framer->checksumErrors;
+        int offset = 0;
+        while (offset < dataLength) {
+            const UCHAR* frames = data + offset;
+            int count = Framer_Aligned(framer, frames, dataLength - offset, pipeline->batchSize);
+            int consumed = count * BYTES_PER_SAMPLE;
+            if (count == 0) {
+                frames = pipeline->frameScratch;
+                count = Framer_Process(framer, data + offset, dataLength - offset,
+                                       pipeline->frameScratch, pipeline->batchSize, &consumed);
             }
-            
-            ftStatus = FT_Read(ftHandle, dataBuffer + totalBytesRead, bytesToRead, &bytesRead);
-            if (ftStatus != FT_OK) {
-                printf("Error: Failed to read data\n");
-                return -1;
+            offset += consumed;
+            framesFramed += count;
+            if (MarkerBytes > 0) {
+                LookUpMarkers(pipeline, count);
             }
             
-            totalBytesRead += bytesRead;
-        } else {
-            // No data available, wait a bit and retry
-            SLEEP_MS(1);
-            retries++;
+            if (!unlimited && count > pipeline->totalSamples - samplesDecoded) {
+                count = pipeline->totalSamples - samplesDecoded;
+            }
+            if (count > 0) {
+                // Bytes still buffered by the framer came off the wire after the last frame
+                unsigned long long bytesAfter = (unsigned long long)(dataLength - offset + framer->length);
+                DecodeFrames(pipeline, frames, count, ++batch, slot->batchMs,
+                             slot->timeNs - bytesAfter * 8 * 1000000000ULL / pipeline->spiClockHz);
+                samplesDecoded += count;
+            }
+            if (consumed == 0 && count == 0) break;
         }
+        
+        if (framer->resyncs != resyncs) {
+            const FramerSlip* slip = Framer_LastSlip(framer);
+            printf("\nWarning: %sFrame alignment lost at stream bit %llu, boundary moved %+d bits, "
+                   "%lu frames lost\n", pipeline->label, slip->streamBit, slip->bitShift, slip->framesLost);
+        }
+        
+        // Triggers that are not frames: a checksum error burst, SIGUSR2
+        if (pipeline->triggered) {
+            Trigger_ChecksumErrors(&pipeline->trigger, framer->checksumErrors - checksumErrors, slot->timeNs);
+            if (ExternalTriggerRequested) {
+                ExternalTriggerRequested = 0;
+                if (!Trigger_Request(&pipeline->trigger, TRIGGER_EXTERNAL)) {
+                    printf("\nWarning: External trigger ignored, no --trigger=external given\n");
+                }
+            }
+            WriteTriggerWindows(pipeline, slot->batchMs);
+        }
+        
+        // The reader flushed the device after a short read
+        if (slot->flags & CAPTURE_SHORT) {
+            Framer_Reset(framer);
+        }
+        
+        // Frames not out of the framer yet are read again; bytes it still holds
+        // count too, in batch mode they only complete once more are read
+        bytesIn += length;
+        unsigned long long framed = bytesIn / RecordBytes;
+        int dropped = framed > framesFramed ? (int)(framed - framesFramed) : 0;
+        atomic_store_explicit(&pipeline->framesDropped, dropped, memory_order_release);
+        atomic_store_explicit(&pipeline->framesDecoded, samplesDecoded, memory_order_release);
+        atomic_store_explicit(&pipeline->bytesDecoded, bytesIn, memory_order_release);
+        
+        lastReadNs = slot->timeNs;
+        ReadRing_Release(&pipeline->readRing, CONSUMER_DECODER);
     }
     
-    // Calculate number of complete samples received
-    int samplesReceived = totalBytesRead / BYTES_PER_SAMPLE;
+    EndOfText(pipeline);
+    
+    return 0;
+}
+
+// Output stage: the only thread that blocks on file I/O
+PMU_THREAD_RET PMU_THREAD_CALL WriterThread(void* arg)
+{
+    Pipeline* pipeline = (Pipeline*)arg;
+    unsigned long long lastProgressUs = 0;
     
-    if (samplesReceived < numSamples) {
-        printf("Warning: Expected %d samples (%d bytes), got %d samples (%d bytes)\n",
-               numSamples, expectedBytes, samplesReceived, totalBytesRead);
+    for (;;) {
+        RingSlot* slot = Ring_BeginRead(&pipeline->textRing);
+        int samplesReceived = slot->samples;
+        
+        if (samplesReceived == 0) {
+            Ring_EndRead(&pipeline->textRing);
+            break;
+        }
+        
+        if (samplesReceived == TEXT_GAP_MARKER) {
+            if (pipeline->gapFile) {
+                fputs((const char*)slot->data, pipeline->gapFile);
+            }
+            Ring_EndRead(&pipeline->textRing);
+            continue;
+        }
+        
+        if (samplesReceived == TEXT_TRIGGER_MARKER) {
+            if (pipeline->triggerFile) {
+                fputs((const char*)slot->data, pipeline->triggerFile);
+            }
+            Ring_EndRead(&pipeline->textRing);
+            continue;
+        }
+        
+        const char* binText = (const char*)slot->data;
+        const char* counterText = binText + pipeline->batchSize * BIN_LINE_LENGTH;
+        if (pipeline->outputFile) {
+            fwrite(binText, BIN_LINE_LENGTH, samplesReceived, pipeline->outputFile);
+        }
+        if (BYTES_PER_SAMPLE >= 19 && pipeline->counterFile) {
+            fwrite(counterText, CNT_LINE_LENGTH, samplesReceived, pipeline->counterFile);
+        }
+        if (pipeline->timeFile) {
+            const char* timeText = counterText + pipeline->batchSize * CNT_LINE_LENGTH;
+            fwrite(timeText, TIME_LINE_LENGTH, samplesReceived, pipeline->timeFile);
+        }
+        if (pipeline->markerFile) {
+            const char* markerText = counterText + pipeline->batchSize * (CNT_LINE_LENGTH + TIME_LINE_LENGTH);
+            fwrite(markerText, MarkerBytes * 8 + 1, samplesReceived, pipeline->markerFile);
+        }
+        
+        pipeline->totalSamplesCollected += samplesReceived;
+        pipeline->batchCount++;
+        
+        // A fast replay would spend its time printing, report at a fixed interval instead
+        if (pipeline->replayFile) {
+            unsigned long long nowUs = Time_NowUs();
+            if (nowUs - lastProgressUs < REPLAY_PROGRESS_MS * 1000ULL) {
+                Ring_EndRead(&pipeline->textRing);
+                continue;
+            }
+            lastProgressUs = nowUs;
+        }
+        
+        // Progress reporting, of the frames read even if only trigger windows are written
+        int progress = pipeline->triggered ?
+            atomic_load_explicit(&pipeline->framesDecoded, memory_order_acquire) :
+            pipeline->totalSamplesCollected;
+        double elapsed = GetElapsedTime(pipeline->startTime);
+        double samplesPerSec = progress / elapsed;
+        
+        // A trigger window comes in slots of its own, one or more per decoded batch
+        char written[64];
+        if (pipeline->triggered) {
+            snprintf(written, sizeof(written), "Window %lu: %d samples, %d written", slot->batch,
+                     samplesReceived, pipeline->totalSamplesCollected);
+        } else {
+            snprintf(written, sizeof(written), "Batch %lu: %d samples, %lu ms", slot->batch,
+                     samplesReceived, slot->batchMs);
+        }
+        printf("%s, Progress: %d/%d (%.1f%%), Speed: %.0f smp/s, Rings: read %u/%u text %u/%u\n",
+               written, progress, pipeline->totalSamples,
+               pipeline->totalSamples ? (double)progress / pipeline->totalSamples * 100.0 : 0.0,
+               samplesPerSec,
+               ReadRing_Occupancy(&pipeline->readRing), pipeline->readRing.slotCount,
+               Ring_Occupancy(&pipeline->textRing), pipeline->textRing.slotCount);
+        
+        Ring_EndRead(&pipeline->textRing);
     }
     
-    return samplesReceived;
+    return 0;
 }
 
-void SPI_Close(void)
+void InitBinaryDigits(void)
 {
-    if (ftHandle != NULL) {
-        FT_Close(ftHandle);
-        ftHandle = NULL;
+    for (int value = 0; value < 256; value++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            BinaryDigits[value][7 - bit] = ((value >> bit) & 1) ? '1' : '0';
+        }
     }
 }
 
-void PrintBinaryData(const UCHAR* data, int length, FILE* file)
+// Expand bytes MSB first into '0'/'1' characters plus a newline, returns end of text
+char* FormatBinaryData(const UCHAR* data, int length, char* out)
 {
     for (int i = 0; i < length; i++) {
-        for (int bit = 7; bit >= 0; bit--) {
-            fprintf(file, "%d", (data[i] >> bit) & 1);
-        }
+        memcpy(out, BinaryDigits[data[i]], 8);
+        out += 8;
     }
-    fprintf(file, "\n");
+    *out++ = '\n';
+    return out;
 }
 
 double GetElapsedTime(DWORD startTime)
 {
     DWORD currentTime = GET_TIME();
     return (double)(currentTime - startTime) / 1000.0; // Convert to seconds
-}
\ No newline at end of file
+}
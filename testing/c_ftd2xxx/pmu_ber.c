@@ -0,0 +1,285 @@
+/*
+ * pmu_ber.c
+ * Link bit error rate test: frames of a known pattern compared bit by bit
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pmu_ber.h"
+
+#define BER_PAYLOAD_WORDS       5       // Words 2-6 carry the pattern
+#define BER_TOP_POSITIONS       3       // Most frequent error positions printed
+
+enum {
+    BER_UNLOCKED,               // Waiting for a frame to take as the reference
+    BER_CONFIRMING,             // Frames must follow the reference without errors
+    BER_COUNTING                // Every frame is compared and counted
+};
+
+static const char* const BerPatternNames[] = { "prbs", "counter" };
+
+bool Ber_ParsePattern(const char* name, int* pattern)
+{
+    for (int i = 0; i < (int)(sizeof(BerPatternNames) / sizeof(BerPatternNames[0])); i++) {
+        if (strcmp(name, BerPatternNames[i]) == 0) {
+            *pattern = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* Ber_PatternName(int pattern)
+{
+    return BerPatternNames[pattern];
+}
+
+void Ber_Init(BerCheck* check, int pattern)
+{
+    memset(check, 0, sizeof(*check));
+    check->pattern = pattern;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define Ber_Popcount(x) __builtin_popcountll(x)
+#else
+static int Ber_Popcount(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+}
+#endif
+
+// Differing bits of two frames, 64 at a time
+static int Ber_Distance(const unsigned char* a, const unsigned char* b)
+{
+    uint64_t a0, a1, b0, b1;
+    uint32_t a2, b2;
+
+    memcpy(&a0, a, 8);
+    memcpy(&a1, a + 8, 8);
+    memcpy(&a2, a + 16, 4);
+    memcpy(&b0, b, 8);
+    memcpy(&b1, b + 8, 8);
+    memcpy(&b2, b + 16, 4);
+    return Ber_Popcount(a0 ^ b0) + Ber_Popcount(a1 ^ b1) + Ber_Popcount((uint64_t)(a2 ^ b2));
+}
+
+// Next 24 bits of the PRBS-31 sequence, MSB first. The state holds the last
+// 31 bits, the newest in bit 0; every new bit is the XOR of the bits 31 and
+// 28 before it, all of which are in the state for up to 28 new bits.
+static unsigned int Ber_PrbsWord(unsigned int* state)
+{
+    unsigned int word = ((*state >> 7) ^ (*state >> 4)) & 0xFFFFFF;
+    *state = ((*state << 24) | word) & 0x7FFFFFFF;
+    return word;
+}
+
+// Expected frame `number`, the PRBS continuing from state
+static void Ber_Generate(BerCheck* check, unsigned long long number, unsigned char* raw)
+{
+    unsigned int words[FRAME_WORDS];
+
+    words[0] = (unsigned int)(number & 0xFFFFFF);
+    for (int j = 1; j <= BER_PAYLOAD_WORDS; j++) {
+        words[j] = check->pattern == BER_PATTERN_PRBS ? Ber_PrbsWord(&check->prbs) :
+                   (unsigned int)((number + j) & 0xFFFFFF);
+    }
+    Frame_Encode((unsigned int)(number & 0xF), words, raw);
+}
+
+// A received frame becomes the reference the following frames are expected
+// from. False if it cannot be one: a PRBS state of all zeros never occurs.
+static bool Ber_Reference(BerCheck* check, const unsigned char* frame)
+{
+    PmuFrame decoded;
+    Frame_Decode(frame, &decoded);
+    check->prbs = ((decoded.data[4] & 0x7F) << 24) | decoded.data[5];
+    if (check->pattern == BER_PATTERN_PRBS && check->prbs == 0) return false;
+
+    check->number = decoded.data[0];
+    memcpy(check->expected[0], frame, FRAME_BYTES);
+    for (int k = 1; k < BER_CANDIDATES; k++) {
+        Ber_Generate(check, check->number + k, check->expected[k]);
+    }
+    check->confirmed = 0;
+    return true;
+}
+
+// A valid frame further on than the candidates: frames were not read
+static bool Ber_Skipped(const BerCheck* check, const unsigned char* frame)
+{
+    if (!Frame_ChecksumOk(frame)) return false;
+    PmuFrame decoded;
+    Frame_Decode(frame, &decoded);
+    unsigned int step = (decoded.data[0] - (unsigned int)check->number) & 0xFFFFFF;
+    return step >= BER_CANDIDATES;
+}
+
+// The received frame was frame number + step: it becomes expected[0]
+static void Ber_Advance(BerCheck* check, int step)
+{
+    if (step == 0) return;
+    memmove(check->expected[0], check->expected[step], (size_t)(BER_CANDIDATES - step) * FRAME_BYTES);
+    check->number += step;
+    for (int k = BER_CANDIDATES - step; k < BER_CANDIDATES; k++) {
+        Ber_Generate(check, check->number + k, check->expected[k]);
+    }
+}
+
+// One bit error at a compared stream bit, joining the burst going on or
+// starting the next
+static void Ber_Error(BerCheck* check, unsigned long long bit)
+{
+    if (check->burstErrors > 0 && bit - check->lastErrorBit < BER_BURST_GAP_BITS) {
+        if (++check->burstErrors == 2) check->singleBursts--;
+    } else {
+        check->bursts++;
+        check->singleBursts++;
+        check->burstErrors = 1;
+        check->burstStartBit = bit;
+    }
+    check->lastErrorBit = bit;
+
+    if (check->burstErrors > check->maxBurstErrors) {
+        check->maxBurstErrors = check->burstErrors;
+    }
+    if (bit - check->burstStartBit + 1 > check->maxBurstBits) {
+        check->maxBurstBits = bit - check->burstStartBit + 1;
+    }
+}
+
+// Positions of the differing bits, MSB first within each byte as on the wire
+static void Ber_Count(BerCheck* check, const unsigned char* frame, const unsigned char* expected)
+{
+    for (int i = 0; i < FRAME_BYTES; i++) {
+        unsigned char diff = frame[i] ^ expected[i];
+        for (int b = 0; diff != 0; b++, diff <<= 1) {
+            if (diff & 0x80) {
+                check->positions[i * 8 + b]++;
+                Ber_Error(check, check->bits + i * 8 + b);
+            }
+        }
+    }
+}
+
+// Compare framed frames with the pattern
+void Ber_Check(BerCheck* check, const unsigned char* frames, int count)
+{
+    for (int i = 0; i < count; i++) {
+        const unsigned char* frame = frames + (size_t)i * FRAME_BYTES;
+
+        if (check->state == BER_UNLOCKED) {
+            check->uncounted++;
+            if (Ber_Reference(check, frame)) check->state = BER_CONFIRMING;
+            continue;
+        }
+
+        int step = 0;
+        int distance = Ber_Distance(frame, check->expected[0]);
+        for (int k = 1; k < BER_CANDIDATES && distance > 0; k++) {
+            int d = Ber_Distance(frame, check->expected[k]);
+            if (d < distance) {
+                distance = d;
+                step = k;
+            }
+        }
+
+        if (check->state == BER_CONFIRMING) {
+            check->uncounted++;
+            if (distance > 0) {
+                check->state = Ber_Reference(check, frame) ? BER_CONFIRMING : BER_UNLOCKED;
+                continue;
+            }
+            if (step > 0 && ++check->confirmed >= BER_LOCK_FRAMES) {
+                check->state = BER_COUNTING;
+            }
+            Ber_Advance(check, step);
+            continue;
+        }
+
+        // Counter pattern frames a few apart differ in few bits, so a skip is
+        // told by the frame number before any bit is counted as an error
+        if (distance > 0 && Ber_Skipped(check, frame) && Ber_Reference(check, frame)) {
+            check->uncounted++;
+            check->gaps++;
+            continue;
+        }
+        if (distance > BER_SYNC_BITS) {
+            check->uncounted++;
+            check->syncLosses++;
+            check->burstErrors = 0;
+            check->state = Ber_Reference(check, frame) ? BER_CONFIRMING : BER_UNLOCKED;
+            continue;
+        }
+
+        if (distance > 0) {
+            check->errors += distance;
+            check->errorFrames++;
+            Ber_Count(check, frame, check->expected[step]);
+        }
+        check->frames++;
+        check->bits += FRAME_BITS;
+        Ber_Advance(check, step);
+    }
+}
+
+double Ber_Rate(const BerCheck* check)
+{
+    return check->bits ? (double)check->errors / check->bits : 0.0;
+}
+
+// Upper bound of the rate at 95% confidence when no error was seen, 0 if
+// nothing was compared
+double Ber_UpperBound(const BerCheck* check)
+{
+    return check->bits ? 3.0 / check->bits : 0.0;
+}
+
+void Ber_PrintStats(const BerCheck* check)
+{
+    printf("  Pattern: %s, bits compared: %llu in %llu frames\n",
+           Ber_PatternName(check->pattern), check->bits, check->frames);
+    if (check->errors == 0) {
+        printf("  Bit errors: 0 (BER below %.2e at 95%% confidence)\n", Ber_UpperBound(check));
+    } else {
+        printf("  Bit errors: %llu (BER %.3e) in %llu frames\n",
+               check->errors, Ber_Rate(check), check->errorFrames);
+    }
+    printf("  Bursts (errors under %d bits apart): %llu, %llu of a single bit, largest %llu errors over %llu bits\n",
+           BER_BURST_GAP_BITS, check->bursts, check->singleBursts, check->maxBurstErrors, check->maxBurstBits);
+    printf("  Gaps: %lu, lock lost: %lu times, frames not compared: %llu\n",
+           check->gaps, check->syncLosses, check->uncounted);
+    if (check->errors == 0) return;
+
+    // Counter, the six words and the checksum, so a weak field stands out
+    unsigned long long fields[FRAME_WORDS + 2] = { 0 };
+    for (int p = 0; p < FRAME_BITS; p++) {
+        int field = p < 4 ? 0 : p < 148 ? 1 + (p - 4) / 24 : FRAME_WORDS + 1;
+        fields[field] += check->positions[p];
+    }
+    printf("  Errors by field: counter %llu, words", fields[0]);
+    for (int j = 1; j <= FRAME_WORDS; j++) {
+        printf(" %llu", fields[j]);
+    }
+    printf(", checksum %llu\n", fields[FRAME_WORDS + 1]);
+
+    printf("  Most errors at bit");
+    bool taken[FRAME_BITS] = { false };
+    for (int n = 0; n < BER_TOP_POSITIONS; n++) {
+        int top = -1;
+        for (int p = 0; p < FRAME_BITS; p++) {
+            if (!taken[p] && check->positions[p] > 0 && (top < 0 || check->positions[p] > check->positions[top])) {
+                top = p;
+            }
+        }
+        if (top < 0) break;
+        taken[top] = true;
+        printf("%s %d (%llu)", n > 0 ? "," : "", top, check->positions[top]);
+    }
+    printf("\n");
+}
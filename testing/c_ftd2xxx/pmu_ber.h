@@ -0,0 +1,82 @@
+/*
+ * pmu_ber.h
+ * Link bit error rate test: frames of a known pattern compared bit by bit
+ *
+ * For the test the FPGA sends pattern frames instead of samples, in the usual
+ * frame layout (pmu_frame.h) so framing works unchanged. Frame n carries
+ *   bits   0-3    n modulo 16, the rolling counter as always
+ *   word   1      n modulo 2^24
+ *   words  2-6    BER_PATTERN_PRBS: the next 120 bits of the PRBS-31 sequence
+ *                 (x^31 + x^28 + 1, ITU-T O.150), MSB first, continuing from
+ *                 the previous frame; BER_PATTERN_COUNTER: n + 1 to n + 5
+ *                 modulo 2^24
+ *   bits 148-159  the checksum as always
+ *
+ * The checker takes one frame as its reference, generates the frames that
+ * follow it and compares every received frame with the expected ones it can
+ * be: the same frame read again, or one up to FRAMER_MAX_COUNTER_STEP frames
+ * on. The closest is taken, its differing bits are the bit errors. Comparison
+ * runs 64 bits at a time with a population count. Counting starts once
+ * BER_LOCK_FRAMES frames in a row have followed the reference without an
+ * error. Reads skip frames whenever the host reads slower than the FPGA
+ * writes, between batches at least: a frame matching no candidate that
+ * passes its checksum and whose frame number has moved on is such a gap, and
+ * becomes the new reference without interrupting the count. Any other frame
+ * further than BER_SYNC_BITS from all candidates loses the lock, and the
+ * checker starts over from it.
+ *
+ * Errors less than BER_BURST_GAP_BITS apart in the compared bit stream form
+ * one burst.
+ */
+
+#ifndef PMU_BER_H
+#define PMU_BER_H
+
+#include <stdbool.h>
+#include "pmu_frame.h"
+
+#define BER_PATTERN_PRBS        0
+#define BER_PATTERN_COUNTER     1
+
+#define BER_LOCK_FRAMES         3       // Error-free new frames needed before counting
+#define BER_SYNC_BITS           32      // More bit errors than this in a frame loses the lock
+#define BER_BURST_GAP_BITS      1600    // Errors closer than this belong to one burst
+#define BER_CANDIDATES          (FRAMER_MAX_COUNTER_STEP + 1)
+
+typedef struct {
+    int pattern;
+    int state;                          // Unlocked, confirming the reference, or counting
+    int confirmed;                      // Error-free new frames since the reference
+    unsigned char expected[BER_CANDIDATES][FRAME_BYTES];    // Frame number and the ones after it
+    unsigned long long number;          // Frame number of expected[0]
+    unsigned int prbs;                  // PRBS-31 state after the last expected frame
+
+    // Statistics, of the frames compared while counting
+    unsigned long long frames;
+    unsigned long long bits;
+    unsigned long long errors;
+    unsigned long long errorFrames;     // Frames with at least one bit error
+    unsigned long long positions[FRAME_BITS];   // Bit errors by position in the frame
+    unsigned long gaps;                 // References taken again after skipped frames
+    unsigned long syncLosses;
+    unsigned long long uncounted;       // Frames seen while not locked
+
+    // Bursts
+    unsigned long long bursts;
+    unsigned long long singleBursts;    // Bursts of one bit error
+    unsigned long long burstErrors;     // Errors in the burst going on
+    unsigned long long burstStartBit;
+    unsigned long long lastErrorBit;    // Compared stream bit of the last error
+    unsigned long long maxBurstErrors;
+    unsigned long long maxBurstBits;    // Longest burst, first to last error
+} BerCheck;
+
+bool Ber_ParsePattern(const char* name, int* pattern);
+const char* Ber_PatternName(int pattern);
+void Ber_Init(BerCheck* check, int pattern);
+void Ber_Check(BerCheck* check, const unsigned char* frames, int count);
+double Ber_Rate(const BerCheck* check);
+double Ber_UpperBound(const BerCheck* check);
+void Ber_PrintStats(const BerCheck* check);
+
+#endif // PMU_BER_H
@@ -0,0 +1,84 @@
+/*
+ * pmu_calib.c
+ * SPI clock settings found by calibration, stored per FT232H serial number
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pmu_calib.h"
+
+typedef struct {
+    char serial[CALIB_SERIAL_LENGTH];
+    ClockSetting setting;
+} CalibEntry;
+
+// Bit rate on MISO; three-phase clocking stretches each bit to 1.5 periods
+unsigned int Calib_SckHz(const ClockSetting* setting)
+{
+    unsigned int sck = CALIB_MASTER_CLOCK / ((1 + setting->divisor) * 2);
+    return setting->threePhase ? sck * 2 / 3 : sck;
+}
+
+// Parse one line, false for comments and malformed lines
+static bool Calib_ParseLine(const char* line, CalibEntry* entry)
+{
+    unsigned int divisor, threePhase;
+    if (line[0] == '#') return false;
+    if (sscanf(line, "%15s %u %u", entry->serial, &divisor, &threePhase) != 3) return false;
+    if (divisor > 0xFFFF) return false;
+    entry->setting.divisor = divisor;
+    entry->setting.threePhase = threePhase != 0;
+    return true;
+}
+
+static int Calib_ReadAll(const char* path, CalibEntry* entries, int maxEntries)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+
+    char line[128];
+    int count = 0;
+    while (count < maxEntries && fgets(line, sizeof(line), file)) {
+        if (Calib_ParseLine(line, &entries[count])) count++;
+    }
+    fclose(file);
+    return count;
+}
+
+bool Calib_Load(const char* path, const char* serial, ClockSetting* setting)
+{
+    CalibEntry entries[CALIB_MAX_DEVICES];
+    int count = Calib_ReadAll(path, entries, CALIB_MAX_DEVICES);
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].serial, serial) == 0) {
+            *setting = entries[i].setting;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Calib_Save(const char* path, const char* serial, const ClockSetting* setting)
+{
+    CalibEntry entries[CALIB_MAX_DEVICES];
+    int count = Calib_ReadAll(path, entries, CALIB_MAX_DEVICES);
+
+    int slot = 0;
+    while (slot < count && strcmp(entries[slot].serial, serial) != 0) slot++;
+    if (slot == CALIB_MAX_DEVICES) return false;
+    if (slot == count) count++;
+    snprintf(entries[slot].serial, sizeof(entries[slot].serial), "%s", serial);
+    entries[slot].setting = *setting;
+
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+
+    fprintf(file, "# serial divisor three-phase sck-hz\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "%s %u %d %u\n", entries[i].serial, entries[i].setting.divisor,
+                entries[i].setting.threePhase ? 1 : 0, Calib_SckHz(&entries[i].setting));
+    }
+    return fclose(file) == 0;
+}
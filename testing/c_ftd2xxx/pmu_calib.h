@@ -0,0 +1,30 @@
+/*
+ * pmu_calib.h
+ * SPI clock settings found by calibration, stored per FT232H serial number
+ *
+ * The file is plain text, one device per line:
+ *   serial divisor three-phase sck-hz
+ * Lines starting with '#' are comments. Saving a device replaces its line
+ * and keeps every other device's.
+ */
+
+#ifndef PMU_CALIB_H
+#define PMU_CALIB_H
+
+#include <stdbool.h>
+
+#define CALIB_PATH              "SPIClockCalibration.txt"
+#define CALIB_MAX_DEVICES       64
+#define CALIB_SERIAL_LENGTH     16      // FT_GetDeviceInfo serial buffer size
+#define CALIB_MASTER_CLOCK      60000000    // MPSSE clock with divide-by-5 disabled
+
+typedef struct {
+    unsigned int divisor;               // Value sent with 0x86
+    bool threePhase;                    // 0x8C instead of 0x8D, each bit takes 1.5 periods
+} ClockSetting;
+
+unsigned int Calib_SckHz(const ClockSetting* setting);
+bool Calib_Load(const char* path, const char* serial, ClockSetting* setting);
+bool Calib_Save(const char* path, const char* serial, const ClockSetting* setting);
+
+#endif // PMU_CALIB_H
@@ -0,0 +1,112 @@
+/*
+ * pmu_capture.c
+ * Raw capture files: the exact byte stream returned by FT_Read, chunk by chunk
+ */
+
+#include <string.h>
+
+#include "pmu_capture.h"
+
+static const char CaptureMagic[8] = { 'P', 'M', 'U', 'R', 'A', 'W', '0', '1' };
+
+static void Put32(unsigned char* p, unsigned int value)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static void Put64(unsigned char* p, unsigned long long value)
+{
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static unsigned int Get32(const unsigned char* p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+           ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long Get64(const unsigned char* p)
+{
+    return (unsigned long long)Get32(p) | ((unsigned long long)Get32(p + 4) << 32);
+}
+
+bool Capture_WriteHeader(FILE* file, const CaptureHeader* header)
+{
+    unsigned char raw[CAPTURE_HEADER_BYTES];
+
+    memcpy(raw, CaptureMagic, sizeof(CaptureMagic));
+    Put32(raw + 8, CAPTURE_VERSION);
+    Put32(raw + 12, header->flags);
+    Put32(raw + 16, header->spiClockHz);
+    Put32(raw + 20, header->frameBytes);
+    Put64(raw + 24, header->startTime);
+    return fwrite(raw, sizeof(raw), 1, file) == 1;
+}
+
+bool Capture_ReadHeader(FILE* file, CaptureHeader* header)
+{
+    unsigned char raw[CAPTURE_HEADER_BYTES];
+
+    if (fread(raw, sizeof(raw), 1, file) != 1 ||
+        memcmp(raw, CaptureMagic, sizeof(CaptureMagic)) != 0 ||
+        Get32(raw + 8) != CAPTURE_VERSION) {
+        return false;
+    }
+    header->flags = Get32(raw + 12);
+    header->spiClockHz = Get32(raw + 16);
+    header->frameBytes = Get32(raw + 20);
+    header->startTime = Get64(raw + 24);
+    return true;
+}
+
+// Record header for the raw bytes that follow it, CAPTURE_RECORD_BYTES long
+void Capture_EncodeRecord(const CaptureRecord* record, unsigned char* out)
+{
+    Put64(out, record->timeUs);
+    Put32(out + 8, record->length);
+    Put32(out + 12, record->flags);
+}
+
+/*
+ * Read the next record into data. Returns its length, 0 at the end of the
+ * file and -1 if the record is truncated or longer than maxLength.
+ */
+int Capture_ReadRecord(FILE* file, CaptureRecord* record, unsigned char* data, int maxLength)
+{
+    unsigned char raw[CAPTURE_RECORD_BYTES];
+
+    size_t got = fread(raw, 1, sizeof(raw), file);
+    if (got == 0) return 0;
+    if (got != sizeof(raw)) return -1;
+
+    record->timeUs = Get64(raw);
+    record->length = Get32(raw + 8);
+    record->flags = Get32(raw + 12);
+
+    if (record->length == 0 || record->length > (unsigned int)maxLength ||
+        fread(data, 1, record->length, file) != record->length) {
+        return -1;
+    }
+    return (int)record->length;
+}
+
+// Payload of a CAPTURE_GAP record, CAPTURE_GAP_BYTES long
+void Capture_EncodeGap(const CaptureGap* gap, unsigned char* out)
+{
+    Put64(out, gap->startUs);
+    Put64(out + 8, gap->endUs);
+    Put32(out + 16, gap->status);
+    Put32(out + 20, gap->action);
+}
+
+void Capture_DecodeGap(const unsigned char* in, CaptureGap* gap)
+{
+    gap->startUs = Get64(in);
+    gap->endUs = Get64(in + 8);
+    gap->status = Get32(in + 16);
+    gap->action = Get32(in + 20);
+}
@@ -0,0 +1,66 @@
+/*
+ * pmu_capture.h
+ * Raw capture files: the exact byte stream returned by FT_Read, chunk by chunk
+ *
+ * A capture starts with a 32-byte header followed by one record per FT_Read
+ * result. All fields are little-endian:
+ *   header  "PMURAW01", version, flags, SPI clock (Hz), frame bytes,
+ *           wall-clock start time (Unix ns)
+ *   record  host time since the start of the capture (us), length, flags,
+ *           then length raw bytes; with a CAPTURE_GPIO_* flag every frame in
+ *           them is followed by its GPIO bytes (not counted in frame bytes)
+ *   gap     a record flagged CAPTURE_GAP holds no raw bytes but a 24-byte
+ *           marker instead: start and end of the gap (us, same origin as the
+ *           record times), the FT_STATUS that caused it and the recovery taken
+ */
+
+#ifndef PMU_CAPTURE_H
+#define PMU_CAPTURE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#define CAPTURE_VERSION         1
+#define CAPTURE_HEADER_BYTES    32
+#define CAPTURE_RECORD_BYTES    16      // Record header preceding the raw bytes
+#define CAPTURE_GAP_BYTES       24      // Payload of a gap record
+#define CAPTURE_MAX_CHUNK       65536   // Largest FT_Read result recorded
+
+// Header flags
+#define CAPTURE_STREAM          0x01    // Continuous clocking, frames not aligned to reads
+#define CAPTURE_DATA_READY      0x02    // Each frame read on the FPGA's data-ready strobe
+#define CAPTURE_GPIO_LOW        0x04    // Each frame read followed by an ADBUS byte
+#define CAPTURE_GPIO_HIGH       0x08    // and/or an ACBUS byte, in that order
+
+// Record flags
+#define CAPTURE_SHORT           0x01    // Read ended early, the device was flushed after it
+#define CAPTURE_GAP             0x02    // No data but a gap marker, acquisition recovered from an error
+
+typedef struct {
+    unsigned int flags;
+    unsigned int spiClockHz;
+    unsigned int frameBytes;
+    unsigned long long startTime;       // Unix ns at the origin of the record times
+} CaptureHeader;
+
+typedef struct {
+    unsigned long long timeUs;          // Host time the read completed, from capture start
+    unsigned int length;
+    unsigned int flags;
+} CaptureRecord;
+
+typedef struct {
+    unsigned long long startUs;         // Last data read before the fault
+    unsigned long long endUs;           // Device ready again
+    unsigned int status;                // FT_STATUS of the failure, FT_OK for a short or empty read
+    unsigned int action;                // Recovery that succeeded
+} CaptureGap;
+
+bool Capture_WriteHeader(FILE* file, const CaptureHeader* header);
+bool Capture_ReadHeader(FILE* file, CaptureHeader* header);
+void Capture_EncodeRecord(const CaptureRecord* record, unsigned char* out);
+int Capture_ReadRecord(FILE* file, CaptureRecord* record, unsigned char* data, int maxLength);
+void Capture_EncodeGap(const CaptureGap* gap, unsigned char* out);
+void Capture_DecodeGap(const unsigned char* in, CaptureGap* gap);
+
+#endif // PMU_CAPTURE_H
@@ -0,0 +1,200 @@
+/*
+ * pmu_clock.c
+ * Online model of the FPGA frame clock against the host monotonic clock
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "pmu_clock.h"
+#include "pmu_frame.h"
+
+void ClockModel_Init(ClockModel* model, double nominalRate, unsigned int spiClockHz, bool continuous,
+                     bool paced)
+{
+    memset(model, 0, sizeof(*model));
+    model->nominalRate = nominalRate;
+    model->continuous = continuous;
+    model->paced = paced;
+    model->lineNsPerFrame = FRAME_BITS * 1e9 / spiClockHz;
+    model->decay = 1.0 - 1.0 / CLOCK_MODEL_WINDOW;
+}
+
+bool ClockModel_Ready(const ClockModel* model)
+{
+    return model->points >= 2 && model->covIndexIndex > 0.0;
+}
+
+// Host nanoseconds per FPGA frame
+static double ClockModel_Slope(const ClockModel* model)
+{
+    return model->covIndexTime / model->covIndexIndex;
+}
+
+// Best available frame period, 0 if there is none yet
+static double ClockModel_Period(const ClockModel* model)
+{
+    return model->nominalRate > 0.0 ? 1e9 / model->nominalRate
+         : ClockModel_Ready(model) ? ClockModel_Slope(model) : 0.0;
+}
+
+// Host time between the frames of one read: a frame period when paced by the
+// data-ready strobe and the period is known, the SCK line time otherwise
+static double ClockModel_LineNs(const ClockModel* model)
+{
+    double periodNs = model->paced ? ClockModel_Period(model) : 0.0;
+    return periodNs > model->lineNsPerFrame ? periodNs : model->lineNsPerFrame;
+}
+
+// Frames were lost for an unknown time: the next counter step comes from the
+// host time even in stream mode and before the gap estimates are trusted
+void ClockModel_Resume(ClockModel* model)
+{
+    model->resumed = model->started;
+}
+
+// FPGA frames produced after the last one seen, up to timeNs; -1 if unknown
+long long ClockModel_FramesSince(const ClockModel* model, unsigned long long timeNs)
+{
+    double periodNs = ClockModel_Period(model);
+    if (!model->started || periodNs <= 0.0) return -1;
+    if (timeNs <= model->lastNs) return 0;
+    return (long long)((timeNs - model->lastNs) / periodNs);
+}
+
+// Running mean over the first CLOCK_MODEL_WINDOW values, exponential after that
+static void ClockModel_Average(double* mean, unsigned long* count, double value)
+{
+    (*count)++;
+    double weight = *count < CLOCK_MODEL_WINDOW ? 1.0 / *count : 1.0 / CLOCK_MODEL_WINDOW;
+    *mean += (value - *mean) * weight;
+}
+
+static void ClockModel_Update(ClockModel* model, double index, double timeNs)
+{
+    // Early slopes are too rough to judge the jitter by
+    if (model->points >= CLOCK_MODEL_WARMUP) {
+        double residual = timeNs - (model->meanTime + ClockModel_Slope(model) * (index - model->meanIndex));
+        ClockModel_Average(&model->residualSq, &model->residuals, residual * residual);
+    }
+
+    // Exponentially weighted Welford update, older points fade with decay
+    model->weight = model->weight * model->decay + 1.0;
+    double dIndex = index - model->meanIndex;
+    double dTime = timeNs - model->meanTime;
+    model->meanIndex += dIndex / model->weight;
+    model->meanTime += dTime / model->weight;
+    model->covIndexIndex = model->covIndexIndex * model->decay + dIndex * (index - model->meanIndex);
+    model->covIndexTime = model->covIndexTime * model->decay + dIndex * (timeNs - model->meanTime);
+    model->points++;
+}
+
+/*
+ * Assign FPGA frame indices and host times (ns, same origin as lastFrameNs) to
+ * count frames, the last of which left the wire at lastFrameNs. The model is
+ * advanced once per call; the per-frame work is a counter step and one
+ * multiply-add, with no division or model update inside the loop.
+ */
+void ClockModel_Timestamp(ClockModel* model, const unsigned char* frames, int count,
+                          unsigned long long lastFrameNs, unsigned long long* indexOut,
+                          unsigned long long* timeOut)
+{
+    if (count <= 0) return;
+
+    unsigned int counter = Frame_Counter(frames);
+    unsigned long long index;
+
+    if (!model->started) {
+        index = counter;
+        model->started = true;
+    } else if (!Frame_ChecksumOk(frames)) {
+        index = model->frameIndex;
+        counter = model->lastCounter;
+    } else {
+        index = model->frameIndex + ((counter - model->lastCounter) & 0xF);
+
+        // More than 15 frames may have passed since the last batch (an idle SCK
+        // between reads, a flush), the counter alone cannot tell. Estimate the
+        // step from the host time elapsed and take the nearest one with this
+        // counter value, once those estimates have proven good to a few frames.
+        double periodNs = ClockModel_Period(model);
+        if (periodNs > 0.0 && (!model->continuous || model->resumed)) {
+            double firstNs = lastFrameNs - (count - 1) * ClockModel_LineNs(model);
+            double excess = (firstNs - model->lastNs) / periodNs - (double)(index - model->frameIndex);
+            double wraps = floor(excess / 16.0 + 0.5);
+            double error = excess - 16.0 * wraps;
+
+            bool trusted = model->gaps >= CLOCK_MODEL_WARMUP &&
+                           CLOCK_MODEL_WRAP_SIGMAS * sqrt(model->gapErrorSq) < 8.0;
+            if ((trusted || model->resumed) && wraps > 0.0) {
+                index += 16 * (unsigned long long)wraps;
+                model->indexCorrections++;
+            }
+            // A gap of unknown length says nothing about the usual batch gaps
+            if (!model->resumed) {
+                ClockModel_Average(&model->gapErrorSq, &model->gaps, error * error);
+            }
+        }
+        model->resumed = false;
+    }
+
+    // Frames failing their checksum carry no trustworthy counter, they keep the last index
+    unsigned int lastCounter = counter;
+    for (int i = 0; i < count; i++) {
+        const unsigned char* frame = frames + i * FRAME_BYTES;
+        if (i > 0 && Frame_ChecksumOk(frame)) {
+            counter = Frame_Counter(frame);
+            index += (counter - lastCounter) & 0xF;
+            lastCounter = counter;
+        }
+        indexOut[i] = index;
+    }
+    model->frameIndex = index;
+    model->lastCounter = lastCounter;
+    model->lastNs = lastFrameNs;
+
+    ClockModel_Update(model, (double)index, (double)lastFrameNs);
+
+    if (ClockModel_Ready(model)) {
+        double slope = ClockModel_Slope(model);
+        double origin = model->meanTime - slope * model->meanIndex;
+        for (int i = 0; i < count; i++) {
+            timeOut[i] = (unsigned long long)(origin + slope * (double)indexOut[i]);
+        }
+    } else {
+        // Until there is a model, use the time each frame came off the wire
+        double lineNs = ClockModel_LineNs(model);
+        for (int i = 0; i < count; i++) {
+            timeOut[i] = lastFrameNs - (unsigned long long)((count - 1 - i) * lineNs);
+        }
+    }
+    model->framesStamped += count;
+}
+
+double ClockModel_FrameRate(const ClockModel* model)
+{
+    return ClockModel_Ready(model) ? 1e9 / ClockModel_Slope(model) : 0.0;
+}
+
+// FPGA clock relative to the host clock, from the nominal frame rate
+double ClockModel_DriftPpm(const ClockModel* model)
+{
+    if (model->nominalRate <= 0.0 || !ClockModel_Ready(model)) return 0.0;
+    return (ClockModel_FrameRate(model) / model->nominalRate - 1.0) * 1e6;
+}
+
+void ClockModel_PrintStats(const ClockModel* model)
+{
+    printf("  Batches: %lu, frames timestamped: %llu, counter unwraps corrected: %lu\n",
+           model->points, model->framesStamped, model->indexCorrections);
+    if (!ClockModel_Ready(model)) {
+        printf("  Not enough batches for a frame rate estimate\n");
+        return;
+    }
+    printf("  FPGA frame rate: %.3f Hz", ClockModel_FrameRate(model));
+    if (model->nominalRate > 0.0) {
+        printf(" (nominal %.3f Hz, drift %+.1f ppm)", model->nominalRate, ClockModel_DriftPpm(model));
+    }
+    printf("\n  Residual jitter: %.1f us RMS\n", sqrt(model->residualSq) / 1000.0);
+}
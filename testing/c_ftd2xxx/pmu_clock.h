@@ -0,0 +1,73 @@
+/*
+ * pmu_clock.h
+ * Online model of the FPGA frame clock against the host monotonic clock
+ *
+ * The 4-bit frame counter is unwrapped into a cumulative FPGA frame index.
+ * Every batch contributes one point (index of its last frame, host time that
+ * frame came off the wire) to an exponentially weighted linear regression,
+ * whose slope is the FPGA frame period in host nanoseconds. Frames are then
+ * timestamped from the regression line, so read jitter does not show up in
+ * the timestamps and repeated reads of one frame get the same time.
+ *
+ * When SCK idles between batches more than 15 frames can pass unseen by the
+ * counter. Those skipped wraps are restored from the host time between
+ * batches, but only once that estimate has proven accurate to well under 8
+ * frames; in stream mode SCK runs continuously and the counter is taken as is.
+ * Frames read on a data-ready strobe (paced) come off the wire one FPGA frame
+ * period apart rather than one SCK line time.
+ * After acquisition has been interrupted (ClockModel_Resume) the step to the
+ * next batch is taken from the host time in either mode, whatever its accuracy.
+ */
+
+#ifndef PMU_CLOCK_H
+#define PMU_CLOCK_H
+
+#include <stdbool.h>
+
+#define CLOCK_MODEL_WINDOW      1000    // Batches the regression effectively averages over
+#define CLOCK_MODEL_WARMUP      8       // Batches before the jitter estimates are used
+#define CLOCK_MODEL_WRAP_SIGMAS 4.0     // Jitter margin required to fix skipped counter wraps
+
+typedef struct {
+    double nominalRate;                 // Expected FPGA frame rate, 0 if unknown
+    double lineNsPerFrame;              // Host time one frame takes on the wire
+    double decay;                       // Weight older points keep at each update
+    bool continuous;                    // SCK never idles between batches (stream mode)
+    bool paced;                         // One frame read per FPGA frame (data-ready strobe)
+
+    // Weighted regression of host time (ns) on frame index
+    double weight;
+    double meanIndex;
+    double meanTime;
+    double covIndexIndex;
+    double covIndexTime;
+    double residualSq;                  // Mean squared residual over the window (ns^2)
+    unsigned long residuals;
+
+    bool started;
+    unsigned long long frameIndex;      // Unwrapped index of the last frame seen
+    unsigned int lastCounter;
+    unsigned long long lastNs;          // Host time of that frame, as passed in
+    double gapErrorSq;                  // Mean squared error of the batch gap estimates (frames^2)
+    unsigned long gaps;
+    bool resumed;                       // Acquisition was interrupted before the next batch
+
+    // Statistics
+    unsigned long points;
+    unsigned long long framesStamped;
+    unsigned long indexCorrections;     // Counter unwraps fixed from the model
+} ClockModel;
+
+void ClockModel_Init(ClockModel* model, double nominalRate, unsigned int spiClockHz, bool continuous,
+                     bool paced);
+void ClockModel_Timestamp(ClockModel* model, const unsigned char* frames, int count,
+                          unsigned long long lastFrameNs, unsigned long long* indexOut,
+                          unsigned long long* timeOut);
+void ClockModel_Resume(ClockModel* model);
+long long ClockModel_FramesSince(const ClockModel* model, unsigned long long timeNs);
+bool ClockModel_Ready(const ClockModel* model);
+double ClockModel_FrameRate(const ClockModel* model);
+double ClockModel_DriftPpm(const ClockModel* model);
+void ClockModel_PrintStats(const ClockModel* model);
+
+#endif // PMU_CLOCK_H
@@ -0,0 +1,289 @@
+/*
+ * pmu_control.c
+ * Local control socket of the reader daemon
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <afunix.h>
+    #define CLOSE_SOCKET(s) closesocket((SOCKET)(s))
+    #define poll WSAPoll
+    #define SEND_FLAGS 0
+    #ifdef _MSC_VER
+        #pragma comment(lib, "ws2_32.lib")
+    #endif
+#else
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #define CLOSE_SOCKET(s) close((int)(s))
+    #ifdef MSG_NOSIGNAL
+        #define SEND_FLAGS MSG_NOSIGNAL     // A client gone away must not raise SIGPIPE
+    #else
+        #define SEND_FLAGS 0
+    #endif
+#endif
+
+#include "pmu_control.h"
+
+#define CONTROL_BACKLOG         4
+
+static ControlHandle Control_Socket(void)
+{
+#ifdef _WIN32
+    SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+    return s == INVALID_SOCKET ? CONTROL_NONE : (ControlHandle)s;
+#else
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+#endif
+}
+
+// Whether a daemon still listens at the address
+static bool Control_Answers(const struct sockaddr_un* address)
+{
+    ControlHandle probe = Control_Socket();
+    if (probe == CONTROL_NONE) return false;
+    bool answers = connect(probe, (const struct sockaddr*)address, sizeof(*address)) == 0;
+    CLOSE_SOCKET(probe);
+    return answers;
+}
+
+bool Control_Open(ControlSocket* control, const char* path)
+{
+    memset(control, 0, sizeof(*control));
+    control->listener = CONTROL_NONE;
+    for (int c = 0; c < CONTROL_MAX_CLIENTS; c++) {
+        control->clients[c].handle = CONTROL_NONE;
+    }
+    if (strlen(path) >= CONTROL_PATH_LENGTH) {
+        printf("Control socket path %s is too long\n", path);
+        return false;
+    }
+    strcpy(control->path, path);
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        printf("Failed to start Winsock\n");
+        return false;
+    }
+#endif
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    control->listener = Control_Socket();
+    if (control->listener == CONTROL_NONE) {
+        printf("Failed to create the control socket\n");
+        Control_Close(control);
+        return false;
+    }
+    if (bind(control->listener, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        if (Control_Answers(&address)) {
+            printf("Another daemon is listening on %s\n", path);
+            Control_Close(control);
+            return false;
+        }
+        remove(path);
+        if (bind(control->listener, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            printf("Failed to bind the control socket to %s\n", path);
+            Control_Close(control);
+            return false;
+        }
+    }
+    control->bound = true;
+    if (listen(control->listener, CONTROL_BACKLOG) != 0) {
+        printf("Failed to listen on %s\n", path);
+        Control_Close(control);
+        return false;
+    }
+    return true;
+}
+
+static void Control_Disconnect(ControlClient* client)
+{
+    if (client->handle != CONTROL_NONE) {
+        CLOSE_SOCKET(client->handle);
+        client->handle = CONTROL_NONE;
+    }
+    client->length = 0;
+    client->discarding = false;
+}
+
+// Move the first whole line a client sent into command, without its line end
+static bool Control_TakeLine(ControlClient* client, char* command, int size)
+{
+    char* end = memchr(client->pending, '\n', client->length);
+    if (!end) return false;
+
+    int lineLength = (int)(end - client->pending);
+    int copied = lineLength < size - 1 ? lineLength : size - 1;
+    memcpy(command, client->pending, copied);
+    if (copied > 0 && command[copied - 1] == '\r') copied--;
+    command[copied] = '\0';
+
+    client->length -= lineLength + 1;
+    memmove(client->pending, end + 1, client->length);
+    return true;
+}
+
+// A command already received from any client, taking them in turn
+static bool Control_NextCommand(ControlSocket* control, char* command, int size)
+{
+    for (int i = 1; i <= CONTROL_MAX_CLIENTS; i++) {
+        int c = (control->current + i) % CONTROL_MAX_CLIENTS;
+        if (control->clients[c].handle != CONTROL_NONE &&
+            Control_TakeLine(&control->clients[c], command, size)) {
+            control->current = c;
+            control->commands++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void Control_Accept(ControlSocket* control)
+{
+#ifdef _WIN32
+    SOCKET s = accept((SOCKET)control->listener, NULL, NULL);
+    ControlHandle handle = s == INVALID_SOCKET ? CONTROL_NONE : (ControlHandle)s;
+#else
+    ControlHandle handle = accept(control->listener, NULL, NULL);
+#endif
+    if (handle == CONTROL_NONE) return;
+    for (int c = 0; c < CONTROL_MAX_CLIENTS; c++) {
+        if (control->clients[c].handle == CONTROL_NONE) {
+            control->clients[c].handle = handle;
+            control->clients[c].length = 0;
+            control->clients[c].discarding = false;
+            control->connections++;
+            return;
+        }
+    }
+    CLOSE_SOCKET(handle);
+}
+
+static void Control_Receive(ControlClient* client)
+{
+    int received = recv(client->handle, client->pending + client->length,
+                        (int)sizeof(client->pending) - client->length, 0);
+    if (received <= 0) {
+        Control_Disconnect(client);
+        return;
+    }
+    if (client->discarding) {
+        // The rest of an overlong command: drop it up to and with its line end
+        char* end = memchr(client->pending + client->length, '\n', received);
+        if (!end) return;
+        client->discarding = false;
+        int kept = (int)(client->pending + client->length + received - (end + 1));
+        memmove(client->pending, end + 1, kept);
+        client->length = kept;
+        return;
+    }
+    client->length += received;
+    if (client->length == (int)sizeof(client->pending) &&
+        !memchr(client->pending, '\n', client->length)) {
+        // No line end in a full buffer: drop the overlong command
+        client->length = 0;
+        client->discarding = true;
+    }
+}
+
+// Wait up to timeoutMs for a command line: 1 with the command, 0 without one
+// (nothing arrived, a client connected or left, a signal came), -1 if the
+// socket failed
+int Control_Poll(ControlSocket* control, int timeoutMs, char* command, int size)
+{
+    if (Control_NextCommand(control, command, size)) return 1;
+
+    // The listener while a client entry is free, then every client
+    struct pollfd fds[CONTROL_MAX_CLIENTS + 1];
+    int clientOf[CONTROL_MAX_CLIENTS + 1];
+    int count = 0;
+    bool full = true;
+    for (int c = 0; c < CONTROL_MAX_CLIENTS; c++) {
+        full = full && control->clients[c].handle != CONTROL_NONE;
+    }
+    if (!full) {
+        fds[count].fd = control->listener;
+        clientOf[count++] = -1;
+    }
+    for (int c = 0; c < CONTROL_MAX_CLIENTS; c++) {
+        if (control->clients[c].handle == CONTROL_NONE) continue;
+        fds[count].fd = control->clients[c].handle;
+        clientOf[count++] = c;
+    }
+    for (int i = 0; i < count; i++) {
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+
+    int ready = poll(fds, count, timeoutMs);
+    if (ready < 0) {
+#ifndef _WIN32
+        if (errno == EINTR) return 0;
+#endif
+        return -1;
+    }
+    for (int i = 0; i < count && ready > 0; i++) {
+        if (fds[i].revents == 0) continue;
+        if (clientOf[i] < 0) {
+            Control_Accept(control);
+        } else if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            Control_Receive(&control->clients[clientOf[i]]);
+        } else {
+            Control_Disconnect(&control->clients[clientOf[i]]);
+        }
+    }
+    return Control_NextCommand(control, command, size) ? 1 : 0;
+}
+
+// Send one reply line to the client of the last command; false if it has
+// gone away
+bool Control_Reply(ControlSocket* control, const char* text)
+{
+    ControlClient* client = &control->clients[control->current];
+    if (client->handle == CONTROL_NONE) return false;
+
+    char line[CONTROL_LINE_LENGTH + 2];
+    int length = snprintf(line, sizeof(line), "%s\n", text);
+    if (length >= (int)sizeof(line)) {
+        length = (int)sizeof(line) - 1;
+        line[length - 1] = '\n';
+    }
+    for (int sent = 0; sent < length; ) {
+        int n = send(client->handle, line + sent, length - sent, SEND_FLAGS);
+        if (n <= 0) {
+            Control_Disconnect(client);
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+void Control_Close(ControlSocket* control)
+{
+    for (int c = 0; c < CONTROL_MAX_CLIENTS; c++) {
+        Control_Disconnect(&control->clients[c]);
+    }
+    if (control->listener != CONTROL_NONE) {
+        CLOSE_SOCKET(control->listener);
+        control->listener = CONTROL_NONE;
+    }
+    if (control->bound) {
+        remove(control->path);
+        control->bound = false;
+    }
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
@@ -0,0 +1,53 @@
+/*
+ * pmu_control.h
+ * Local control socket of the reader daemon
+ *
+ * A Unix domain stream socket at a file system path; Windows 10 (1803) and
+ * later have them too, through Winsock (link with ws2_32). Up to
+ * CONTROL_MAX_CLIENTS clients stay connected at once, e.g. the test sequencer
+ * and a status monitor; further ones wait in the listen backlog. Commands are
+ * text lines, each answered by one reply line to the client that sent it.
+ * Control_Poll waits at most the given time, so the caller's loop can watch
+ * other things in between.
+ *
+ * A socket file left behind by a daemon that did not exit cleanly is removed
+ * when nothing answers on it; a path another daemon still listens on fails.
+ */
+
+#ifndef PMU_CONTROL_H
+#define PMU_CONTROL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CONTROL_LINE_LENGTH     256     // Longest command, longer ones are dropped
+#define CONTROL_MAX_CLIENTS     4
+#define CONTROL_PATH_LENGTH     108     // sun_path of struct sockaddr_un
+#define CONTROL_NONE            (-1)
+
+// Socket descriptor, or SOCKET on Windows (kept out of this header)
+typedef intptr_t ControlHandle;
+
+typedef struct {
+    ControlHandle handle;               // CONTROL_NONE for a free entry
+    char pending[CONTROL_LINE_LENGTH];  // Received, not yet a whole line
+    int length;
+    bool discarding;                    // Inside an overlong line, dropped up to its end
+} ControlClient;
+
+typedef struct {
+    ControlHandle listener;
+    char path[CONTROL_PATH_LENGTH];
+    bool bound;                         // The socket file is ours to remove
+    ControlClient clients[CONTROL_MAX_CLIENTS];
+    int current;                        // Client of the last command, replies go there
+    unsigned long connections;
+    unsigned long commands;
+} ControlSocket;
+
+bool Control_Open(ControlSocket* control, const char* path);
+int Control_Poll(ControlSocket* control, int timeoutMs, char* command, int size);
+bool Control_Reply(ControlSocket* control, const char* text);
+void Control_Close(ControlSocket* control);
+
+#endif // PMU_CONTROL_H
@@ -0,0 +1,384 @@
+/*
+ * pmu_daemon.c
+ * Resident capture service of ft232h_spi_reader (--daemon)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+#include "pmu_daemon.h"
+#include "pmu_control.h"
+#include "pmu_time.h"
+
+#define DAEMON_POLL_MS          20      // Longest the control loop waits on the socket
+
+// Capture runs of the daemon and what it keeps between them
+typedef struct {
+    CaptureSettings* settings;
+    ControlSocket control;
+    CaptureRun run;
+    PMU_THREAD monitorThread;
+    bool armed;                         // Pipelines set up, buffers allocated for the next run
+    bool running;
+    atomic_bool finished;               // Every thread of the run has ended
+    bool quit;
+    unsigned long runs;
+    double startMs;                     // Start command to threads running, last run
+    long lastSamples;                   // Collected by the last finished run
+    bool lastReadError;
+} Daemon;
+
+// Waits out a run so the control loop never blocks on it
+static PMU_THREAD_RET PMU_THREAD_CALL Daemon_MonitorThread(void* arg)
+{
+    Daemon* daemon = (Daemon*)arg;
+    JoinCapture(&daemon->run);
+    atomic_store_explicit(&daemon->finished, true, memory_order_release);
+    return 0;
+}
+
+// A run overwrites the output files like a new process would, through the
+// handles already open
+static bool TruncateFile(FILE* file)
+{
+    if (!file) return true;
+    fflush(file);
+    rewind(file);
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), 0) == 0;
+#else
+    return ftruncate(fileno(file), 0) == 0;
+#endif
+}
+
+static void FlushPipelineFiles(Pipeline* pipeline)
+{
+    FILE* files[] = { pipeline->outputFile, pipeline->counterFile, pipeline->timeFile,
+                      pipeline->gapFile, pipeline->markerFile, pipeline->triggerFile };
+    for (int f = 0; f < (int)(sizeof(files) / sizeof(files[0])); f++) {
+        if (files[f]) fflush(files[f]);
+    }
+}
+
+// Prepare the next run while idle, so a start only has to launch the threads
+static bool Daemon_Arm(Daemon* daemon)
+{
+    InitPipelines(daemon->settings, true);
+    daemon->armed = AllocatePipelines(daemon->settings);
+    if (!daemon->armed) printf("Daemon: Failed to allocate ring buffers\n");
+    return daemon->armed;
+}
+
+static void Daemon_Disarm(Daemon* daemon)
+{
+    if (daemon->armed) FreePipelines(daemon->settings);
+    daemon->armed = false;
+}
+
+static long Daemon_Samples(const Daemon* daemon)
+{
+    long samples = 0;
+    for (int d = 0; d < daemon->settings->pipelineCount; d++) {
+        samples += atomic_load_explicit(&Pipelines[d].framesDecoded, memory_order_acquire);
+    }
+    return samples;
+}
+
+// A whole decimal number and nothing after it
+static bool Daemon_ParseNumber(const char* text, int* number)
+{
+    char* end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || value < INT_MIN || value > INT_MAX) {
+        return false;
+    }
+    *number = (int)value;
+    return true;
+}
+
+static void Daemon_Start(Daemon* daemon, const char* arguments, char* reply, int size)
+{
+    CaptureSettings* settings = daemon->settings;
+    unsigned long long requestNs = Time_NowNs();
+    if (daemon->running) {
+        snprintf(reply, size, "ERR run %lu is still going", daemon->runs);
+        return;
+    }
+    int totalSamples = settings->totalSamples;
+    if (arguments[0] != '\0' && (!Daemon_ParseNumber(arguments, &totalSamples) || totalSamples < 0)) {
+        snprintf(reply, size, "ERR invalid sample count %.64s", arguments);
+        return;
+    }
+    if (!daemon->armed && !Daemon_Arm(daemon)) {
+        snprintf(reply, size, "ERR no ring buffers");
+        return;
+    }
+    
+    // A count given with the command is for this run only
+    for (int d = 0; d < settings->pipelineCount; d++) {
+        Pipelines[d].totalSamples = totalSamples;
+    }
+    
+    Pipeline* pipeline = &Pipelines[0];
+    bool filesOk = TruncateFile(pipeline->outputFile) && TruncateFile(pipeline->counterFile) &&
+                   TruncateFile(pipeline->timeFile) && TruncateFile(pipeline->gapFile) &&
+                   TruncateFile(pipeline->markerFile) && TruncateFile(pipeline->triggerFile);
+    if (!filesOk) {
+        snprintf(reply, size, "ERR failed to truncate the output files");
+        return;
+    }
+    WriteFileHeaders(settings);
+    
+    // The run was prepared well before, its time origin is now
+    unsigned long long startNs = Time_NowNs();
+    unsigned long long wallStartNs = Time_WallNs();
+    for (int d = 0; d < settings->pipelineCount; d++) {
+        Pipelines[d].startNs = startNs;
+        Pipelines[d].wallStartNs = wallStartNs;
+    }
+    atomic_store_explicit(&daemon->finished, false, memory_order_relaxed);
+    bool started = StartCapture(&daemon->run, settings);
+    if (started && !Thread_Start(&daemon->monitorThread, Daemon_MonitorThread, daemon)) {
+        // The run is stopped here instead of by the monitor
+        StopRequested = 1;
+        JoinCapture(&daemon->run);
+        started = false;
+    }
+    if (!started) {
+        // Nothing of the run is left running; the daemon stays up for the next start
+        printf("Daemon: Failed to start pipeline threads\n");
+        for (int d = 0; d < DeviceCount; d++) {
+            SPI_FlushPipeline(&Devices[d]);
+        }
+        FreePipelines(settings);
+        daemon->armed = false;
+        Daemon_Arm(daemon);
+        StopRequested = 0;
+        snprintf(reply, size, "ERR failed to start pipeline threads");
+        return;
+    }
+    daemon->armed = false;
+    daemon->running = true;
+    daemon->runs++;
+    daemon->startMs = (Time_NowNs() - requestNs) / 1e6;
+    printf("\nDaemon: Run %lu started in %.3f ms\n", daemon->runs, daemon->startMs);
+    snprintf(reply, size, "OK run %lu started in %.3f ms", daemon->runs, daemon->startMs);
+}
+
+// Statistics of the run that just ended, then the next one prepared
+static void Daemon_Finish(Daemon* daemon)
+{
+    Thread_Join(daemon->monitorThread);
+    daemon->running = false;
+    daemon->lastSamples = 0;
+    for (int d = 0; d < daemon->settings->pipelineCount; d++) {
+        daemon->lastSamples += CollectedSamples(&Pipelines[d]);
+    }
+    daemon->lastReadError = PrintCaptureResults(&daemon->run);
+    FlushPipelineFiles(&Pipelines[0]);
+    printf("Daemon: Run %lu finished, %ld samples\n", daemon->runs, daemon->lastSamples);
+    
+    // Batches still queued when the run was stopped must not reach the next one
+    for (int d = 0; d < DeviceCount; d++) {
+        SPI_FlushPipeline(&Devices[d]);
+    }
+    FreePipelines(daemon->settings);
+    Daemon_Arm(daemon);
+}
+
+static void Daemon_Stop(Daemon* daemon, char* reply, int size)
+{
+    if (!daemon->running) {
+        snprintf(reply, size, "ERR no run going");
+        return;
+    }
+    StopRequested = 1;
+    while (!atomic_load_explicit(&daemon->finished, memory_order_acquire)) {
+        THREAD_SLEEP_MS(1);
+    }
+    Daemon_Finish(daemon);
+    StopRequested = 0;
+    snprintf(reply, size, "OK run %lu stopped, %ld samples%s", daemon->runs, daemon->lastSamples,
+             daemon->lastReadError ? ", read error" : "");
+}
+
+static void Daemon_Status(Daemon* daemon, char* reply, int size)
+{
+    const CaptureSettings* settings = daemon->settings;
+    const SpiDevice* device = &Devices[0];
+    if (daemon->running) {
+        snprintf(reply, size, "OK running run=%lu samples=%ld seconds=%.3f",
+                 daemon->runs, Daemon_Samples(daemon), (Time_NowNs() - Pipelines[0].startNs) / 1e9);
+    } else {
+        snprintf(reply, size, "OK idle runs=%lu samples=%ld read-error=%d start-ms=%.3f total=%d batch=%d "
+                 "inflight=%d divisor=%u three-phase=%d latency=%u usb-transfer=%lu",
+                 daemon->runs, daemon->lastSamples, daemon->lastReadError ? 1 : 0, daemon->startMs,
+                 settings->totalSamples, settings->batchSize, settings->inflight, device->clock.divisor,
+                 device->clock.threePhase ? 1 : 0, device->config.latencyMs,
+                 (unsigned long)device->config.usbTransferSize);
+    }
+}
+
+// KEY=VALUE settings for the following runs, all checked before any applies
+static void Daemon_Reconfigure(Daemon* daemon, char* arguments, char* reply, int size)
+{
+    if (daemon->running) {
+        snprintf(reply, size, "ERR stop run %lu first", daemon->runs);
+        return;
+    }
+    CaptureSettings next = *daemon->settings;
+    ClockSetting clock = Devices[0].clock;
+    ULONG transferSize = Devices[0].config.usbTransferSize;
+    UCHAR latencyMs = Devices[0].config.latencyMs;
+    bool clockChanged = false, usbChanged = false;
+    
+    for (char* key = strtok(arguments, " \t"); key; key = strtok(NULL, " \t")) {
+        char* value = strchr(key, '=');
+        int number = -1;                // Out of range for every key unless a whole number follows
+        if (value && !Daemon_ParseNumber(value + 1, &number)) number = -1;
+        if (value) *value = '\0';
+        if (strcmp(key, "total") == 0 && number >= 0) {
+            next.totalSamples = number;
+        } else if (strcmp(key, "batch") == 0 && number > 0 && number <= MAX_BATCH_SIZE) {
+            next.batchSize = number;
+        } else if (strcmp(key, "inflight") == 0 && number >= 1 && number <= MAX_INFLIGHT_BATCHES) {
+            next.inflight = number;
+        } else if (strcmp(key, "divisor") == 0 && number >= 0 && number <= 0xFFFF) {
+            clock.divisor = (unsigned int)number;
+            clockChanged = true;
+        } else if (strcmp(key, "three-phase") == 0 && (number == 0 || number == 1)) {
+            clock.threePhase = number == 1;
+            clockChanged = true;
+        } else if (strcmp(key, "latency") == 0 && number >= 1 && number <= 255) {
+            latencyMs = (UCHAR)number;
+            usbChanged = true;
+        } else if (strcmp(key, "usb-transfer") == 0 && number >= 64 && number <= SPI_USB_TRANSFER_MAX &&
+                   number % 64 == 0) {
+            transferSize = (ULONG)number;
+            usbChanged = true;
+        } else {
+            snprintf(reply, size, "ERR invalid setting %.64s%s%.64s", key, value ? "=" : "", value ? value + 1 : "");
+            return;
+        }
+    }
+    
+    // Flow control as on the command line: never more bytes outstanding than the RX budget
+    int unitBytes = next.stream ? STREAM_CHUNK_BYTES : next.batchSize * RecordBytes;
+    if (next.inflight > INFLIGHT_BYTES_MAX / unitBytes && next.inflight > 1) {
+        snprintf(reply, size, "ERR %d requests of %d bytes exceed the RX budget", next.inflight, unitBytes);
+        return;
+    }
+    
+    Daemon_Disarm(daemon);
+    *daemon->settings = next;
+    bool ok = true;
+    for (int d = 0; d < DeviceCount; d++) {
+        if (clockChanged) ok = SPI_SetClock(&Devices[d], &clock) && ok;
+        if (usbChanged) ok = SPI_SetUsbParameters(&Devices[d], transferSize, latencyMs) && ok;
+    }
+    if (!Daemon_Arm(daemon)) {
+        snprintf(reply, size, "ERR no ring buffers");
+    } else if (!ok) {
+        snprintf(reply, size, "ERR device settings failed");
+    } else {
+        printf("Daemon: Reconfigured, total %d, batch %d, %d in flight, SCK %.3f MHz\n",
+               next.totalSamples, next.batchSize, next.inflight, Devices[0].clockHz / 1e6);
+        snprintf(reply, size, "OK");
+    }
+}
+
+static void Daemon_Command(Daemon* daemon, char* command, char* reply, int size)
+{
+    char* arguments = command + strcspn(command, " \t");
+    if (*arguments != '\0') *arguments++ = '\0';
+    arguments += strspn(arguments, " \t");
+    
+    if (strcmp(command, "start") == 0) {
+        Daemon_Start(daemon, arguments, reply, size);
+    } else if (strcmp(command, "stop") == 0) {
+        Daemon_Stop(daemon, reply, size);
+    } else if (strcmp(command, "status") == 0) {
+        Daemon_Status(daemon, reply, size);
+    } else if (strcmp(command, "reconfigure") == 0) {
+        Daemon_Reconfigure(daemon, arguments, reply, size);
+    } else if (strcmp(command, "shutdown") == 0) {
+        if (daemon->running) Daemon_Stop(daemon, reply, size);
+        daemon->quit = true;
+        snprintf(reply, size, "OK shutting down");
+    } else {
+        snprintf(reply, size, "ERR unknown command %.64s", command);
+    }
+}
+
+// Keep the devices open and configured and the output files open, and run
+// captures on request from the control socket until shut down or Ctrl+C
+int Daemon_Run(CaptureSettings* settings, const char* socketPath)
+{
+    static Daemon daemon;
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.settings = settings;
+    
+    // The socket first, so a second daemon leaves the first one's files alone
+    if (!Control_Open(&daemon.control, socketPath)) {
+        CloseDevices();
+        return 1;
+    }
+    InitPipelines(settings, false);
+    if (!OpenOutputFiles(settings) || !Daemon_Arm(&daemon)) {
+        printf("Failed to open output files\n");
+        Control_Close(&daemon.control);
+        ClosePipelineFiles(&Pipelines[0]);
+        CloseDevices();
+        return 1;
+    }
+    
+    InstallSignalHandlers();
+    printf("Daemon: Listening on %s (start [N], stop, status, reconfigure KEY=VALUE..., shutdown)\n",
+           socketPath);
+    fflush(stdout);
+    
+    char command[CONTROL_LINE_LENGTH];
+    char reply[CONTROL_LINE_LENGTH];
+    while (!daemon.quit) {
+        if (daemon.running && atomic_load_explicit(&daemon.finished, memory_order_acquire)) {
+            Daemon_Finish(&daemon);
+        }
+        // Ctrl+C ends the daemon, after the run it also ended
+        if (StopRequested && !daemon.running) break;
+        
+        int polled = Control_Poll(&daemon.control, DAEMON_POLL_MS, command, sizeof(command));
+        if (polled < 0) {
+            printf("Daemon: Control socket failed\n");
+            break;
+        }
+        if (polled == 0) continue;
+        
+        Daemon_Command(&daemon, command, reply, sizeof(reply));
+        Control_Reply(&daemon.control, reply);
+        fflush(stdout);
+    }
+    
+    if (daemon.running) {
+        StopRequested = 1;
+        while (!atomic_load_explicit(&daemon.finished, memory_order_acquire)) {
+            THREAD_SLEEP_MS(1);
+        }
+        Daemon_Finish(&daemon);
+    }
+    printf("Daemon: %lu runs, %lu control commands, shutting down\n", daemon.runs, daemon.control.commands);
+    Control_Close(&daemon.control);
+    Daemon_Disarm(&daemon);
+    ClosePipelineFiles(&Pipelines[0]);
+    CloseDevices();
+    return 0;
+}
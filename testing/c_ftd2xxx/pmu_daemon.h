@@ -0,0 +1,35 @@
+/*
+ * pmu_daemon.h
+ * Resident capture service of ft232h_spi_reader (--daemon)
+ *
+ * Every run of the program pays for opening and setting up the devices, more
+ * than 100 ms of resets and settling sleeps, before the first frame is read.
+ * The daemon pays it once: the devices stay open and configured, the output
+ * files open, and the next run's pipelines are set up and their ring buffers
+ * allocated and pre-faulted while idle, so a start only truncates the files
+ * and launches the threads, well under a millisecond with empty files. The
+ * control socket (pmu_control.h) takes one command per line and answers
+ * each with a line starting OK or ERR:
+ *   start [N]        Capture N frames (default totalSamples, 0 until stopped)
+ *   stop             End the run, answer once its files are complete
+ *   status           Running with the frames decoded so far, or idle with the
+ *                    last run's result and the settings
+ *   reconfigure KEY=VALUE...
+ *                    For the following runs while idle: total, batch, inflight,
+ *                    divisor, three-phase (0 or 1), latency, usb-transfer
+ *   shutdown         Stop any run and exit, as Ctrl+C does
+ * Each run overwrites the output files and prints its statistics as a normal
+ * run would. Batches still queued when a run is stopped are purged before the
+ * next one. --record and --replay do not apply.
+ */
+
+#ifndef PMU_DAEMON_H
+#define PMU_DAEMON_H
+
+#include "pmu_pipeline.h"
+
+#define DAEMON_SOCKET_PATH      "ft232h_spi_reader.sock"
+
+int Daemon_Run(CaptureSettings* settings, const char* socketPath);
+
+#endif // PMU_DAEMON_H
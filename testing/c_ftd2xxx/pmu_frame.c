@@ -0,0 +1,338 @@
+/*
+ * pmu_frame.c
+ * PMU frame layout, checksum and software framing of a continuous bit stream
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pmu_frame.h"
+
+// Bytes needed to check FRAMER_LOCK_FRAMES frames at any bit shift
+#define FRAMER_WINDOW   (FRAMER_LOCK_FRAMES * FRAME_BYTES + 1)
+
+// 24-bit data word j starts at bit 4 + 24j, i.e. in the low nibble of byte 3j
+static unsigned int Frame_Word(const unsigned char* raw, int j)
+{
+    const unsigned char* p = raw + 3 * j;
+    return ((unsigned int)(p[0] & 0x0F) << 20) | ((unsigned int)p[1] << 12) |
+           ((unsigned int)p[2] << 4) | (p[3] >> 4);
+}
+
+unsigned int Frame_Counter(const unsigned char* raw)
+{
+    return raw[0] >> 4;
+}
+
+unsigned int Frame_ComputeChecksum(const unsigned char* raw)
+{
+    unsigned int sum = Frame_Counter(raw);
+    for (int j = 0; j < FRAME_WORDS; j++) {
+        unsigned int word = Frame_Word(raw, j);
+        sum += (word >> 12) + (word & 0xFFF);
+    }
+    return sum & 0xFFF;
+}
+
+static unsigned int Frame_ReceivedChecksum(const unsigned char* raw)
+{
+    return ((unsigned int)(raw[18] & 0x0F) << 8) | raw[19];
+}
+
+bool Frame_ChecksumOk(const unsigned char* raw)
+{
+    return Frame_ComputeChecksum(raw) == Frame_ReceivedChecksum(raw);
+}
+
+void Frame_Decode(const unsigned char* raw, PmuFrame* frame)
+{
+    frame->counter = Frame_Counter(raw);
+    for (int j = 0; j < FRAME_WORDS; j++) {
+        frame->data[j] = Frame_Word(raw, j);
+    }
+    frame->checksum = Frame_ReceivedChecksum(raw);
+    frame->checksumOk = Frame_ComputeChecksum(raw) == frame->checksum;
+}
+
+// Pack a counter and FRAME_WORDS data words into a frame with its checksum
+void Frame_Encode(unsigned int counter, const unsigned int* words, unsigned char* raw)
+{
+    memset(raw, 0, FRAME_BYTES);
+    raw[0] = (unsigned char)((counter & 0xF) << 4);
+    for (int j = 0; j < FRAME_WORDS; j++) {
+        unsigned char* p = raw + 3 * j;
+        p[0] |= (words[j] >> 20) & 0x0F;
+        p[1] = (unsigned char)(words[j] >> 12);
+        p[2] = (unsigned char)(words[j] >> 4);
+        p[3] = (unsigned char)((words[j] & 0x0F) << 4);
+    }
+    unsigned int checksum = Frame_ComputeChecksum(raw);
+    raw[18] |= (checksum >> 8) & 0x0F;
+    raw[19] = (unsigned char)checksum;
+}
+
+void Framer_Init(Framer* framer)
+{
+    memset(framer, 0, sizeof(*framer));
+}
+
+// Forget the frame boundary and any buffered bytes, e.g. after a purge.
+// Dropped bytes still count as stream bytes.
+void Framer_Reset(Framer* framer)
+{
+    framer->streamBytes += framer->length;
+    framer->bytesSkipped += framer->length - framer->history;
+    framer->length = 0;
+    framer->history = 0;
+    framer->locked = false;
+    framer->resyncing = false;      // Bytes were dropped, this is not a slip
+}
+
+// Copy one frame starting `shift` bits into src
+static void Framer_Extract(const unsigned char* src, int shift, unsigned char* dst)
+{
+    if (shift == 0) {
+        memcpy(dst, src, FRAME_BYTES);
+        return;
+    }
+    for (int i = 0; i < FRAME_BYTES; i++) {
+        dst[i] = (unsigned char)((src[i] << shift) | (src[i + 1] >> (8 - shift)));
+    }
+}
+
+static bool Framer_IsBlank(const unsigned char* raw)
+{
+    // An idle low line passes the checksum, it must never be locked onto
+    for (int i = 0; i < FRAME_BYTES; i++) {
+        if (raw[i] != 0) return false;
+    }
+    return true;
+}
+
+static bool Framer_CountersPlausible(const unsigned char* frames, int count)
+{
+    for (int k = 1; k < count; k++) {
+        unsigned int step = (Frame_Counter(frames + k * FRAME_BYTES) -
+                             Frame_Counter(frames + (k - 1) * FRAME_BYTES)) & 0xF;
+        if (step > FRAMER_MAX_COUNTER_STEP) return false;
+    }
+    return true;
+}
+
+/*
+ * Look for a frame boundary among the 160 bit offsets starting in the first
+ * FRAME_BYTES bytes of the buffer. Instead of extracting candidate frames bit
+ * by bit, the window is shifted once per sub-byte offset and all 20 byte
+ * offsets are then checked on the shifted copy.
+ */
+static bool Framer_Search(Framer* framer, int* position)
+{
+    unsigned char shifted[FRAME_BYTES + FRAMER_WINDOW];
+
+    for (int shift = 0; shift < 8; shift++) {
+        for (int i = 0; i < FRAME_BYTES + FRAMER_WINDOW - 1; i++) {
+            shifted[i] = shift == 0 ? framer->buffer[i] :
+                (unsigned char)((framer->buffer[i] << shift) | (framer->buffer[i + 1] >> (8 - shift)));
+        }
+
+        for (int start = 0; start < FRAME_BYTES; start++) {
+            const unsigned char* frames = shifted + start;
+            int good = 0;
+            while (good < FRAMER_LOCK_FRAMES &&
+                   Frame_ChecksumOk(frames + good * FRAME_BYTES) &&
+                   !Framer_IsBlank(frames + good * FRAME_BYTES)) {
+                good++;
+            }
+            if (good == FRAMER_LOCK_FRAMES && Framer_CountersPlausible(frames, good)) {
+                framer->shift = shift;
+                *position = start;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// A failing frame followed by more failures at the same alignment means the
+// boundary has moved; a single failure is a bit error in that frame only
+static bool Framer_Slipped(const Framer* framer, int position)
+{
+    unsigned char frame[FRAME_BYTES];
+
+    for (int k = 1; k < FRAMER_SLIP_FRAMES; k++) {
+        Framer_Extract(framer->buffer + position + k * FRAME_BYTES, framer->shift, frame);
+        if (Frame_ChecksumOk(frame)) return false;
+    }
+    return true;
+}
+
+static void Framer_Locked(Framer* framer, int position)
+{
+    unsigned long long lockBit = (framer->streamBytes + position) * 8 + framer->shift;
+
+    framer->locked = true;
+    framer->locks++;
+    framer->lockBitOffset = (unsigned int)(lockBit % FRAME_BITS);
+
+    if (framer->resyncing) {
+        // Round to whole frames, the remainder is how far the boundary moved
+        long long moved = (long long)(lockBit - framer->slipBit);
+        long long lost = (moved + FRAME_BITS / 2) / FRAME_BITS;
+        FramerSlip* slip = &framer->slipLog[framer->resyncs % FRAMER_SLIP_LOG];
+
+        slip->streamBit = framer->slipBit;
+        slip->bitShift = (int)(moved - lost * FRAME_BITS);
+        slip->framesLost = (unsigned long)lost;
+        framer->resyncs++;
+        framer->framesLost += slip->framesLost;
+        if (slip->bitShift != 0) {
+            framer->slips++;
+        }
+        framer->resyncing = false;
+    }
+}
+
+/*
+ * Feed stream bytes and receive aligned frames. Returns the number of frames
+ * written to out (at most maxFrames); *consumed is set to the input bytes
+ * taken, which is less than length only when out is full.
+ *
+ * While locked, only one checksum is computed per frame. A failing frame is
+ * held back until the next FRAMER_SLIP_FRAMES - 1 frames have arrived: if they
+ * fail as well the lock is dropped and the boundary searched again starting
+ * just before the failing frame, so re-framing costs one search per slip.
+ */
+int Framer_Process(Framer* framer, const unsigned char* in, int length,
+                   unsigned char* out, int maxFrames, int* consumed)
+{
+    int used = 0;
+    int frames = 0;
+
+    while (frames < maxFrames) {
+        int space = FRAMER_BUFFER_SIZE - framer->length;
+        int take = length - used < space ? length - used : space;
+        memcpy(framer->buffer + framer->length, in + used, take);
+        framer->length += take;
+        framer->bytesIn += take;
+        used += take;
+
+        int position = framer->history;
+        bool starved = false;       // More input is needed before going on
+        if (!framer->locked) {
+            if (framer->length < FRAME_BYTES + FRAMER_WINDOW) {
+                break;      // Not enough bytes to search yet
+            }
+            if (Framer_Search(framer, &position)) {
+                Framer_Locked(framer, position);
+            } else {
+                position = FRAME_BYTES;
+            }
+            framer->bytesSkipped += position;
+        }
+
+        int needed = FRAME_BYTES + (framer->shift ? 1 : 0);
+        while (framer->locked && frames < maxFrames) {
+            if (framer->length - position < needed) {
+                starved = true;
+                break;
+            }
+            unsigned char* frame = out + frames * FRAME_BYTES;
+            Framer_Extract(framer->buffer + position, framer->shift, frame);
+            if (framer->frameStarts) {
+                framer->frameStarts[frames] = framer->streamBytes + position;
+            }
+            if (!Frame_ChecksumOk(frame)) {
+                if (framer->length - position < needed + (FRAMER_SLIP_FRAMES - 1) * FRAME_BYTES) {
+                    starved = true;
+                    break;
+                }
+                if (Framer_Slipped(framer, position)) {
+                    // Search from one byte early so a boundary that moved back is still found
+                    framer->slipBit = (framer->streamBytes + position) * 8 + framer->shift;
+                    framer->resyncing = true;
+                    framer->locked = false;
+                    if (position > 0) position--;
+                    break;
+                }
+                framer->checksumErrors++;
+            }
+            frames++;
+            position += FRAME_BYTES;
+        }
+
+        // Keep the unprocessed tail for the next pass, plus the last byte of the
+        // previous frame while locked so a resync can still search from before it
+        framer->history = (framer->locked && position > 0) ? 1 : 0;
+        int drop = position - framer->history;
+        memmove(framer->buffer, framer->buffer + drop, framer->length - drop);
+        framer->length -= drop;
+        framer->streamBytes += drop;
+
+        if (used == length && (framer->locked ? starved
+                                              : framer->length < FRAME_BYTES + FRAMER_WINDOW)) {
+            break;
+        }
+    }
+
+    framer->framesOut += frames;
+    *consumed = used;
+    return frames;
+}
+
+/*
+ * Zero-copy fast path: while locked on a byte boundary with nothing buffered,
+ * the leading frames of in that pass their checksum are taken where they are.
+ * Returns how many (at most maxFrames), 0 when in must go through
+ * Framer_Process, which then also handles the first failing frame.
+ */
+int Framer_Aligned(Framer* framer, const unsigned char* in, int length, int maxFrames)
+{
+    if (!framer->locked || framer->shift != 0 || framer->length != framer->history) return 0;
+
+    int frames = 0;
+    while (frames < maxFrames && (frames + 1) * FRAME_BYTES <= length &&
+           Frame_ChecksumOk(in + frames * FRAME_BYTES)) {
+        frames++;
+    }
+    if (frames == 0) return 0;
+
+    // in follows the buffered history byte in the stream
+    for (int i = 0; framer->frameStarts && i < frames; i++) {
+        framer->frameStarts[i] = framer->streamBytes + framer->length + (unsigned long long)i * FRAME_BYTES;
+    }
+
+    // Same state Framer_Process leaves behind: only the last byte is kept
+    int bytes = frames * FRAME_BYTES;
+    framer->streamBytes += framer->history + bytes - 1;
+    framer->buffer[0] = in[bytes - 1];
+    framer->length = 1;
+    framer->history = 1;
+    framer->bytesIn += bytes;
+    framer->framesOut += frames;
+    return frames;
+}
+
+// Most recent re-framing event, NULL if the lock has never been lost
+const FramerSlip* Framer_LastSlip(const Framer* framer)
+{
+    if (framer->resyncs == 0) return NULL;
+    return &framer->slipLog[(framer->resyncs - 1) % FRAMER_SLIP_LOG];
+}
+
+void Framer_PrintStats(const Framer* framer)
+{
+    printf("  Stream bytes: %llu, frames: %llu, skipped while searching: %llu bytes\n",
+           framer->bytesIn, framer->framesOut, framer->bytesSkipped);
+    printf("  Frame locks: %lu (last at stream bit offset %u), checksum errors: %llu\n",
+           framer->locks, framer->lockBitOffset, framer->checksumErrors);
+    printf("  Re-framed: %lu times (%lu bit slips, %lu error bursts), frames lost: %llu\n",
+           framer->resyncs, framer->slips, framer->resyncs - framer->slips, framer->framesLost);
+
+    unsigned long first = framer->resyncs > FRAMER_SLIP_LOG ? framer->resyncs - FRAMER_SLIP_LOG : 0;
+    for (unsigned long n = first; n < framer->resyncs; n++) {
+        const FramerSlip* slip = &framer->slipLog[n % FRAMER_SLIP_LOG];
+        printf("    #%lu at stream bit %llu: boundary %+d bits, %lu frames lost\n",
+               n + 1, slip->streamBit, slip->bitShift, slip->framesLost);
+    }
+}
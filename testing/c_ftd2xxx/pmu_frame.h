@@ -0,0 +1,80 @@
+/*
+ * pmu_frame.h
+ * PMU frame layout, checksum and software framing of a continuous bit stream
+ *
+ * Each frame is 160 bits, MSB first (see USBSPI_CSData6x24Bin.m):
+ *   bits   0-3    rolling 4-bit counter
+ *   bits   4-147  six 24-bit data words
+ *   bits 148-159  12-bit checksum: counter plus both 12-bit halves of every
+ *                 data word, modulo 4096
+ */
+
+#ifndef PMU_FRAME_H
+#define PMU_FRAME_H
+
+#include <stdbool.h>
+
+#define FRAME_BITS              160
+#define FRAME_BYTES             20
+#define FRAME_WORDS             6
+
+#define FRAMER_LOCK_FRAMES      3       // Consecutive good frames needed to lock
+#define FRAMER_MAX_COUNTER_STEP 3       // Largest counter step accepted while locking
+#define FRAMER_BUFFER_SIZE      4096    // Stream bytes held between calls
+#define FRAMER_SLIP_FRAMES      2       // Consecutive checksum failures that drop the lock
+#define FRAMER_SLIP_LOG         16      // Most recent re-framing events kept
+
+typedef struct {
+    unsigned int counter;
+    unsigned int data[FRAME_WORDS];
+    unsigned int checksum;              // Checksum carried by the frame
+    bool checksumOk;
+} PmuFrame;
+
+// One loss of alignment and the re-framing that followed it
+typedef struct {
+    unsigned long long streamBit;       // Where the first failing frame started
+    int bitShift;                       // Boundary movement, e.g. +1 after an extra SCK edge
+    unsigned long framesLost;           // Frame slots not emitted while re-framing
+} FramerSlip;
+
+typedef struct {
+    bool locked;
+    bool resyncing;                     // Lock was lost to checksum failures
+    int shift;                          // Bit shift of the frame boundary within a byte
+    unsigned char buffer[FRAMER_BUFFER_SIZE];
+    int length;                         // Valid bytes in buffer
+    int history;                        // Leading bytes of buffer already framed
+    unsigned long long streamBytes;     // Stream bytes already dropped from buffer
+    unsigned long long slipBit;         // Stream bit of the failing frame while resyncing
+    unsigned long long* frameStarts;    // Optional, set by the caller: stream byte each frame
+                                        // of the last call starts in, maxFrames entries
+
+    // Statistics
+    unsigned long long bytesIn;
+    unsigned long long framesOut;
+    unsigned long long bytesSkipped;    // Discarded while searching for a boundary
+    unsigned long long checksumErrors;
+    unsigned long locks;
+    unsigned int lockBitOffset;         // Stream bit offset (mod 160) of the last lock
+    unsigned long resyncs;              // Locks lost to consecutive checksum failures
+    unsigned long slips;                // Resyncs that found the boundary moved
+    unsigned long long framesLost;
+    FramerSlip slipLog[FRAMER_SLIP_LOG];    // Indexed by resync number
+} Framer;
+
+unsigned int Frame_ComputeChecksum(const unsigned char* raw);
+unsigned int Frame_Counter(const unsigned char* raw);
+bool Frame_ChecksumOk(const unsigned char* raw);
+void Frame_Decode(const unsigned char* raw, PmuFrame* frame);
+void Frame_Encode(unsigned int counter, const unsigned int* words, unsigned char* raw);
+
+void Framer_Init(Framer* framer);
+void Framer_Reset(Framer* framer);
+int Framer_Process(Framer* framer, const unsigned char* in, int length,
+                   unsigned char* out, int maxFrames, int* consumed);
+int Framer_Aligned(Framer* framer, const unsigned char* in, int length, int maxFrames);
+const FramerSlip* Framer_LastSlip(const Framer* framer);
+void Framer_PrintStats(const Framer* framer);
+
+#endif // PMU_FRAME_H
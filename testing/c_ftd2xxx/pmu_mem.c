@@ -0,0 +1,102 @@
+/*
+ * pmu_mem.c
+ * Counted heap allocation and page-aligned buffers
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <malloc.h>
+#else
+    #include <sys/mman.h>
+#endif
+
+#include "pmu_mem.h"
+
+static atomic_ulong Allocations;
+
+void* Mem_Alloc(size_t size)
+{
+    atomic_fetch_add_explicit(&Allocations, 1, memory_order_relaxed);
+    return malloc(size);
+}
+
+void* Mem_Calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&Allocations, 1, memory_order_relaxed);
+    return calloc(count, size);
+}
+
+void Mem_Free(void* block)
+{
+    free(block);
+}
+
+// Rounded up to whole pages, so neighbouring buffers never share a page
+void* Mem_AllocPages(size_t size)
+{
+    size = (size + MEM_PAGE_SIZE - 1) & ~(size_t)(MEM_PAGE_SIZE - 1);
+    atomic_fetch_add_explicit(&Allocations, 1, memory_order_relaxed);
+#ifdef _WIN32
+    return _aligned_malloc(size, MEM_PAGE_SIZE);
+#else
+    void* block;
+    return posix_memalign(&block, MEM_PAGE_SIZE, size) == 0 ? block : NULL;
+#endif
+}
+
+void Mem_FreePages(void* block)
+{
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+unsigned long Mem_Allocations(void)
+{
+    return atomic_load_explicit(&Allocations, memory_order_relaxed);
+}
+
+// Touches every page, so the first write on the hot path does not fault
+void Mem_Prefault(void* block, size_t size)
+{
+    volatile unsigned char* bytes = (volatile unsigned char*)block;
+    for (size_t offset = 0; offset < size; offset += MEM_PAGE_SIZE) {
+        bytes[offset] = bytes[offset];
+    }
+    if (size > 0) {
+        bytes[size - 1] = bytes[size - 1];
+    }
+}
+
+// Keeps the pages resident, false without the privilege or above the lock limit
+bool Mem_Lock(void* block, size_t size)
+{
+#ifdef _WIN32
+    if (VirtualLock(block, size)) return true;
+    
+    // The default working set only allows a few locked pages, grow it and retry
+    SIZE_T minimum, maximum;
+    HANDLE process = GetCurrentProcess();
+    if (!GetProcessWorkingSetSize(process, &minimum, &maximum) ||
+        !SetProcessWorkingSetSize(process, minimum + size, maximum + size)) {
+        return false;
+    }
+    return VirtualLock(block, size) != 0;
+#else
+    return mlock(block, size) == 0;
+#endif
+}
+
+void Mem_Unlock(void* block, size_t size)
+{
+#ifdef _WIN32
+    VirtualUnlock(block, size);
+#else
+    munlock(block, size);
+#endif
+}
@@ -0,0 +1,32 @@
+/*
+ * pmu_mem.h
+ * Counted heap allocation and page-aligned buffers
+ *
+ * Every allocation made by the reader goes through these functions, so the
+ * pipeline can check that nothing is allocated once capturing has started:
+ * compare Mem_Allocations() before and after.
+ *
+ * Buffers the hot path works on can be touched page by page up front
+ * (Mem_Prefault) and kept resident (Mem_Lock), so a capture never waits on a
+ * page fault.
+ */
+
+#ifndef PMU_MEM_H
+#define PMU_MEM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MEM_PAGE_SIZE           4096
+
+void* Mem_Alloc(size_t size);
+void* Mem_Calloc(size_t count, size_t size);
+void Mem_Free(void* block);
+void* Mem_AllocPages(size_t size);
+void Mem_FreePages(void* block);
+unsigned long Mem_Allocations(void);
+void Mem_Prefault(void* block, size_t size);
+bool Mem_Lock(void* block, size_t size);
+void Mem_Unlock(void* block, size_t size);
+
+#endif // PMU_MEM_H
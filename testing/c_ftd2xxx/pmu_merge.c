@@ -0,0 +1,260 @@
+/*
+ * pmu_merge.c
+ * Merge stage of a capture from several devices (--device)
+ *
+ * Takes the formatted frames from every device's text ring and writes them as
+ * one stream to the output files of the first pipeline, ordered by host frame
+ * time, or for links reading one FPGA by its frame counter (see MergeAlign).
+ * Gap lines, each starting with its device's serial number, go out as they
+ * arrive.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "pmu_pipeline.h"
+#include "pmu_time.h"
+
+#define MERGE_MAX_WAIT_MS       200     // Longest wait on a silent device before merging without it
+#define MERGE_PROGRESS_MS       500     // Progress line interval of the merged output
+
+// Read position of the merge in one device's text ring
+typedef struct {
+    RingSlot* slot;             // Slot being merged, NULL until the next one arrives
+    int next;                   // Its next frame
+    bool ended;
+    unsigned long long missingSinceUs;  // When the link ran out of frames, 0 while it has some
+    bool aligned;               // indexOffset is known, by counter only
+    long long indexOffset;      // Turns the link's FPGA frame indexes into the common ones
+} MergeSource;
+
+// Host time (TEXT_TIMES) or FPGA frame index (TEXT_INDEXES) of a frame in a merged text slot
+static unsigned long long MergeSlotValue(const Pipeline* pipeline, const RingSlot* slot, int array, int frame)
+{
+    unsigned long long value;
+    memcpy(&value, slot->data + pipeline->batchSize * TEXT_FRAME_BYTES +
+                   ((size_t)array * pipeline->batchSize + frame) * sizeof(value), sizeof(value));
+    return value;
+}
+
+// What the merge orders by: host time, or the FPGA frame index common to all links
+static unsigned long long MergeKey(const Merger* merger, const Pipeline* pipeline, const MergeSource* source)
+{
+    if (!merger->byCounter) {
+        return MergeSlotValue(pipeline, source->slot, TEXT_TIMES, source->next);
+    }
+    return MergeSlotValue(pipeline, source->slot, TEXT_INDEXES, source->next) + source->indexOffset;
+}
+
+/*
+ * Number a link's frames like the other links. All links of one FPGA see the
+ * same 4-bit counter, so its unwrapped index differs from theirs by a multiple
+ * of 16, taken from the host time of the nearest frame already numbered: one
+ * in another link's slot at hand or the last one written. The first link to
+ * deliver frames sets the numbering; a link is aligned again after a gap.
+ */
+static void MergeAlign(Merger* merger, MergeSource* sources, int d)
+{
+    const Pipeline* pipeline = &merger->pipelines[d];
+    MergeSource* source = &sources[d];
+    double index = (double)MergeSlotValue(pipeline, source->slot, TEXT_INDEXES, source->next);
+    double timeNs = (double)MergeSlotValue(pipeline, source->slot, TEXT_TIMES, source->next);
+    bool found = merger->written;
+    double refIndex = (double)merger->lastIndex;
+    double refNs = (double)merger->lastNs;
+    double distance = found ? fabs(timeNs - refNs) : 0.0;
+    double periodNs = merger->periodNs;
+    
+    for (int e = 0; e < merger->count; e++) {
+        const Pipeline* other = &merger->pipelines[e];
+        const MergeSource* aligned = &sources[e];
+        if (e == d || !aligned->aligned || aligned->slot == NULL) continue;
+        
+        int last = aligned->slot->samples - 1;
+        for (int i = aligned->next; i <= last; i++) {
+            double otherNs = (double)MergeSlotValue(other, aligned->slot, TEXT_TIMES, i);
+            if (!found || fabs(timeNs - otherNs) < distance) {
+                found = true;
+                distance = fabs(timeNs - otherNs);
+                refIndex = (double)MergeSlotValue(other, aligned->slot, TEXT_INDEXES, i) + aligned->indexOffset;
+                refNs = otherNs;
+            }
+        }
+        
+        // Until enough has been written, the frame period comes from the slot itself
+        unsigned long long span = MergeSlotValue(other, aligned->slot, TEXT_INDEXES, last) -
+                                  MergeSlotValue(other, aligned->slot, TEXT_INDEXES, aligned->next);
+        if (periodNs == 0.0 && span > 0) {
+            periodNs = ((double)MergeSlotValue(other, aligned->slot, TEXT_TIMES, last) -
+                        (double)MergeSlotValue(other, aligned->slot, TEXT_TIMES, aligned->next)) / span;
+        }
+    }
+    
+    source->indexOffset = 0;
+    if (found) {
+        double predicted = refIndex + (periodNs > 0.0 ? (timeNs - refNs) / periodNs : 0.0);
+        source->indexOffset = 16 * llround((predicted - index) / 16.0);
+    }
+    source->aligned = true;
+}
+
+// A run of frames with one common index ends, count it by the links it was read on
+static void MergeCloseSet(Merger* merger)
+{
+    if (merger->setMask == 0) return;
+    merger->sets++;
+    if (merger->setMask == (1u << merger->count) - 1) {
+        merger->setsComplete++;
+    }
+    merger->setMask = 0;
+}
+
+// One frame's lines from a device's text slot, FrameTimes.txt gets the device as third column
+static void MergeWriteFrame(Pipeline* output, const Pipeline* pipeline, const MergeSource* source,
+                            unsigned long long frameIndex)
+{
+    const char* binText = (const char*)source->slot->data;
+    const char* counterText = binText + pipeline->batchSize * BIN_LINE_LENGTH;
+    const char* timeText = counterText + pipeline->batchSize * CNT_LINE_LENGTH;
+    
+    if (output->outputFile) {
+        fwrite(binText + source->next * BIN_LINE_LENGTH, BIN_LINE_LENGTH, 1, output->outputFile);
+    }
+    if (BYTES_PER_SAMPLE >= 19 && output->counterFile) {
+        fwrite(counterText + source->next * CNT_LINE_LENGTH, CNT_LINE_LENGTH, 1, output->counterFile);
+    }
+    if (output->timeFile) {
+        // The host time as formatted by the decoder, the frame index as numbered by the merge
+        fwrite(timeText + source->next * TIME_LINE_LENGTH, TIME_LINE_LENGTH - 13, 1, output->timeFile);
+        fprintf(output->timeFile, "%012llu %d\n", frameIndex % 1000000000000ULL, pipeline->deviceIndex);
+    }
+    if (output->markerFile) {
+        const char* markerText = timeText + pipeline->batchSize * TIME_LINE_LENGTH;
+        fwrite(markerText + source->next * (MarkerBytes * 8 + 1), MarkerBytes * 8 + 1, 1, output->markerFile);
+    }
+}
+
+// Output stage of several devices: writes their frames in order of host frame
+// time, or of FPGA frame index when the links read one FPGA. The next frame can
+// only be known with a frame from every device at hand; a device silent for
+// longer than MERGE_MAX_WAIT_MS is not waited for, so its recovery does not
+// stall the others behind full rings.
+PMU_THREAD_RET PMU_THREAD_CALL MergeWriterThread(void* arg)
+{
+    Merger* merger = (Merger*)arg;
+    Pipeline* output = &merger->pipelines[0];
+    MergeSource sources[MAX_DEVICES];
+    int active = merger->count;
+    unsigned long long lastKey = 0;
+    unsigned long long lastProgressUs = Time_NowUs();
+    
+    memset(sources, 0, sizeof(sources));
+    
+    while (active > 0) {
+        int best = -1;
+        int waiting = 0;
+        unsigned long long bestKey = 0;
+        unsigned long long nowUs = Time_NowUs();
+        
+        for (int d = 0; d < merger->count; d++) {
+            Pipeline* pipeline = &merger->pipelines[d];
+            MergeSource* source = &sources[d];
+            
+            // Gap lines go straight out, an empty slot ends the device
+            while (!source->ended && source->slot == NULL) {
+                RingSlot* slot = Ring_TryBeginRead(&pipeline->textRing);
+                if (slot == NULL) break;
+                if (slot->samples == 0) {
+                    Ring_EndRead(&pipeline->textRing);
+                    source->ended = true;
+                    active--;
+                } else if (slot->samples == TEXT_GAP_MARKER) {
+                    if (output->gapFile) {
+                        fputs((const char*)slot->data, output->gapFile);
+                    }
+                    Ring_EndRead(&pipeline->textRing);
+                    source->aligned = false;
+                } else {
+                    source->slot = slot;
+                    source->next = 0;
+                    if (merger->byCounter && !source->aligned) {
+                        MergeAlign(merger, sources, d);
+                    }
+                }
+            }
+            
+            if (source->ended) continue;
+            if (source->slot == NULL) {
+                if (source->missingSinceUs == 0) source->missingSinceUs = nowUs;
+                if (nowUs - source->missingSinceUs < MERGE_MAX_WAIT_MS * 1000ULL) waiting++;
+                continue;
+            }
+            source->missingSinceUs = 0;
+            unsigned long long key = MergeKey(merger, pipeline, source);
+            if (best < 0 || key < bestKey) {
+                best = d;
+                bestKey = key;
+            }
+        }
+        
+        if (best < 0 || waiting > 0) {
+            if (active > 0) THREAD_SLEEP_MS(1);
+            continue;
+        }
+        
+        Pipeline* pipeline = &merger->pipelines[best];
+        MergeSource* source = &sources[best];
+        unsigned long long frameIndex = merger->byCounter ? bestKey :
+                                        MergeSlotValue(pipeline, source->slot, TEXT_INDEXES, source->next);
+        MergeWriteFrame(output, pipeline, source, frameIndex);
+        merger->framesMerged++;
+        if (bestKey < lastKey) {
+            merger->outOfOrder++;
+        } else {
+            lastKey = bestKey;
+        }
+        
+        // The numbering the next link to align is fitted to
+        if (merger->byCounter) {
+            unsigned long long timeNs = MergeSlotValue(pipeline, source->slot, TEXT_TIMES, source->next);
+            if (!merger->written) {
+                merger->firstIndex = frameIndex;
+                merger->firstNs = timeNs;
+                merger->written = true;
+            } else if (frameIndex != merger->setIndex) {
+                MergeCloseSet(merger);
+            }
+            merger->lastIndex = frameIndex;
+            merger->lastNs = timeNs;
+            merger->setIndex = frameIndex;
+            merger->setMask |= 1u << best;
+            if (frameIndex > merger->firstIndex + 16 && timeNs > merger->firstNs) {
+                merger->periodNs = (double)(timeNs - merger->firstNs) / (frameIndex - merger->firstIndex);
+            }
+        }
+        
+        if (++source->next == source->slot->samples) {
+            pipeline->totalSamplesCollected += source->slot->samples;
+            pipeline->batchCount++;
+            Ring_EndRead(&pipeline->textRing);
+            source->slot = NULL;
+        }
+        
+        // Progress reporting, per device
+        if (nowUs - lastProgressUs >= MERGE_PROGRESS_MS * 1000ULL) {
+            lastProgressUs = nowUs;
+            printf("Merged %llu frames (%.0f smp/s), out of order %llu:", merger->framesMerged,
+                   merger->framesMerged / GetElapsedTime(output->startTime), merger->outOfOrder);
+            for (int d = 0; d < merger->count; d++) {
+                Pipeline* each = &merger->pipelines[d];
+                printf(" %s %d, rings %u/%u", each->device->serial, each->totalSamplesCollected,
+                       ReadRing_Occupancy(&each->readRing), Ring_Occupancy(&each->textRing));
+            }
+            printf("\n");
+        }
+    }
+    MergeCloseSet(merger);
+    
+    return 0;
+}
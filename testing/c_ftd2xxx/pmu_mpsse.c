@@ -0,0 +1,162 @@
+/*
+ * pmu_mpsse.c
+ * MPSSE command programs for frame reads, built once and cached by frame count
+ */
+
+#include <string.h>
+
+#include "pmu_mpsse.h"
+#include "pmu_mem.h"
+
+// GPIO bytes read after every frame
+int Mpsse_MarkerBytes(const MpsseFrame* frame)
+{
+    return ((frame->gpioMarkers & MPSSE_GPIO_LOW) ? 1 : 0) + ((frame->gpioMarkers & MPSSE_GPIO_HIGH) ? 1 : 0);
+}
+
+// Bytes returned per frame read: the frame followed by its GPIO bytes
+int Mpsse_ResponseBytes(const MpsseFrame* frame)
+{
+    return frame->frameBytes + Mpsse_MarkerBytes(frame);
+}
+
+// Bytes per frame: optional data-ready wait, optional CS assert, the clock-in
+// command, optional CS release, optional GPIO reads
+static int Mpsse_FrameLength(const MpsseFrame* frame)
+{
+    return 3 + (frame->csToggle ? 6 : 0) + (frame->dataReady != MPSSE_READY_NONE ? 2 : 0) +
+           Mpsse_MarkerBytes(frame);
+}
+
+// Program length for the given frame count, -1 if the description is invalid
+int Mpsse_ProgramLength(const MpsseFrame* frame, int frames)
+{
+    if (frame->mode < 0 || frame->mode > 3 || frames < 0 ||
+        frame->dataReady < MPSSE_READY_NONE || frame->dataReady > MPSSE_READY_FALLING ||
+        (frame->gpioMarkers & ~(MPSSE_GPIO_LOW | MPSSE_GPIO_HIGH)) != 0 ||
+        frame->frameBytes < 1 || frame->frameBytes > MPSSE_MAX_FRAME_BYTES) {
+        return -1;
+    }
+    return frames * Mpsse_FrameLength(frame) + (frame->sendImmediate ? 1 : 0);
+}
+
+// Writes the program reading `frames` frames to out, returns its length or -1
+// if the description is invalid or the program does not fit in capacity
+int Mpsse_Build(const MpsseFrame* frame, int frames, unsigned char* out, int capacity)
+{
+    int length = Mpsse_ProgramLength(frame, frames);
+    if (length < 0 || length > capacity) return -1;
+    
+    bool cpol = frame->mode >= 2;
+    bool cpha = (frame->mode & 1) != 0;
+    unsigned char idle = cpol ? MPSSE_PIN_SCK : 0;
+    unsigned char asserted = idle | (frame->csActiveHigh ? frame->csPin : 0);
+    unsigned char released = idle | (frame->csActiveHigh ? 0 : frame->csPin);
+    unsigned char opcode = cpol != cpha ? MPSSE_BYTES_IN_FALLING : MPSSE_BYTES_IN_RISING;
+    int index = 0;
+    
+    for (int i = 0; i < frames; i++) {
+        // Waiting for the opposite level first makes it an edge, so a strobe
+        // still high after a short read does not start a second one
+        if (frame->dataReady == MPSSE_READY_RISING) {
+            out[index++] = MPSSE_WAIT_IO_LOW;
+            out[index++] = MPSSE_WAIT_IO_HIGH;
+        } else if (frame->dataReady == MPSSE_READY_FALLING) {
+            out[index++] = MPSSE_WAIT_IO_HIGH;
+            out[index++] = MPSSE_WAIT_IO_LOW;
+        }
+        
+        if (frame->csToggle) {
+            out[index++] = MPSSE_SET_BITS_LOW;
+            out[index++] = asserted;
+            out[index++] = frame->direction;
+        }
+        
+        out[index++] = opcode;
+        out[index++] = (frame->frameBytes - 1) & 0xFF;          // Length - 1, low byte
+        out[index++] = ((frame->frameBytes - 1) >> 8) & 0xFF;   // High byte
+        
+        if (frame->csToggle) {
+            out[index++] = MPSSE_SET_BITS_LOW;
+            out[index++] = released;
+            out[index++] = frame->direction;
+        }
+        
+        // Sampled as the frame ends, before the next one starts
+        if (frame->gpioMarkers & MPSSE_GPIO_LOW) {
+            out[index++] = MPSSE_GET_BITS_LOW;
+        }
+        if (frame->gpioMarkers & MPSSE_GPIO_HIGH) {
+            out[index++] = MPSSE_GET_BITS_HIGH;
+        }
+    }
+    
+    if (frame->sendImmediate) {
+        out[index++] = MPSSE_SEND_IMMEDIATE;
+    }
+    
+    return index;
+}
+
+// Allocates every entry for programs of up to maxFrames frames
+bool Mpsse_CacheCreate(MpsseCache* cache, const MpsseFrame* frame, int maxFrames)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->frame = *frame;
+    cache->maxFrames = maxFrames;
+    
+    int capacity = Mpsse_ProgramLength(frame, maxFrames);
+    if (capacity < 0) return false;
+    
+    for (int i = 0; i < MPSSE_CACHE_ENTRIES; i++) {
+        cache->entries[i].bytes = (unsigned char*)Mem_Alloc(capacity);
+        if (!cache->entries[i].bytes) {
+            Mpsse_CacheDestroy(cache);
+            return false;
+        }
+    }
+    return true;
+}
+
+void Mpsse_CacheDestroy(MpsseCache* cache)
+{
+    for (int i = 0; i < MPSSE_CACHE_ENTRIES; i++) {
+        Mem_Free(cache->entries[i].bytes);
+        cache->entries[i].bytes = NULL;
+    }
+    cache->last = NULL;
+}
+
+// Program for the given frame count, NULL if it exceeds the cache's maximum
+const MpsseProgram* Mpsse_CacheGet(MpsseCache* cache, int frames)
+{
+    cache->uses++;
+    if (cache->last && cache->last->frames == frames) {
+        cache->last->lastUse = cache->uses;
+        return cache->last;
+    }
+    if (frames < 1 || frames > cache->maxFrames) return NULL;
+    
+    // Another cached size, or the least recently used entry rebuilt
+    MpsseProgram* program = &cache->entries[0];
+    for (int i = 0; i < MPSSE_CACHE_ENTRIES; i++) {
+        if (cache->entries[i].frames == frames) {
+            program = &cache->entries[i];
+            break;
+        }
+        if (cache->entries[i].lastUse < program->lastUse) {
+            program = &cache->entries[i];
+        }
+    }
+    
+    if (program->frames != frames) {
+        program->frames = frames;
+        program->length = Mpsse_Build(&cache->frame, frames, program->bytes,
+                                      Mpsse_ProgramLength(&cache->frame, cache->maxFrames));
+        cache->builds++;
+    }
+    
+    program->lastUse = cache->uses;
+    cache->last = program;
+    return program;
+}
@@ -0,0 +1,83 @@
+/*
+ * pmu_mpsse.h
+ * MPSSE command programs for frame reads, built once and cached by frame count
+ *
+ * A frame description (SPI mode, chip select handling, frame length, trailing
+ * send-immediate, optional wait for a data-ready strobe, optional GPIO reads
+ * after each frame) compiles into the byte sequence that reads a given number
+ * of frames. Each GPIO read returns one byte right after the frame, so every
+ * frame arrives as Mpsse_ResponseBytes bytes. Mpsse_Build writes the program
+ * into a caller buffer and fails rather than overrun it. An MpsseCache keeps
+ * the programs for a few frame counts in buffers allocated up front, so
+ * queuing a batch of a size seen recently costs one comparison and a write,
+ * and a new size is built in place without allocating.
+ */
+
+#ifndef PMU_MPSSE_H
+#define PMU_MPSSE_H
+
+#include <stdbool.h>
+
+#define MPSSE_CACHE_ENTRIES     4       // Frame counts kept, least recently used replaced
+#define MPSSE_MAX_FRAME_BYTES   65536   // Longest clock-in a single command can carry
+
+// MPSSE opcodes used by the programs
+#define MPSSE_SET_BITS_LOW      0x80    // Value and direction of ADBUS0-7
+#define MPSSE_GET_BITS_LOW      0x81    // Read ADBUS0-7 back as one byte
+#define MPSSE_GET_BITS_HIGH     0x83    // Read ACBUS0-7 back as one byte
+#define MPSSE_BYTES_IN_RISING   0x20    // Clock bytes in, MSB first, sampled on the rising edge
+#define MPSSE_BYTES_IN_FALLING  0x24    // Same, sampled on the falling edge
+#define MPSSE_SEND_IMMEDIATE    0x87    // Flush the partial USB packet now
+#define MPSSE_WAIT_IO_HIGH      0x88    // Stall until GPIOL1 (ADBUS5) is high
+#define MPSSE_WAIT_IO_LOW       0x89    // Stall until GPIOL1 is low
+
+#define MPSSE_PIN_SCK           0x01    // ADBUS0
+#define MPSSE_PIN_GPIOL1        0x20    // ADBUS5, the pin the wait commands watch
+
+// Edge of the FPGA's data-ready strobe on GPIOL1 that starts each frame read
+#define MPSSE_READY_NONE        0       // Read back to back, no wait
+#define MPSSE_READY_RISING      1       // Wait for low, then for high
+#define MPSSE_READY_FALLING     2       // Wait for high, then for low
+
+// GPIO bytes sampled after every frame read, in this order
+#define MPSSE_GPIO_LOW          0x01    // ADBUS (0x81): GPIOL0-3 on ADBUS4-7
+#define MPSSE_GPIO_HIGH         0x02    // ACBUS (0x83): GPIOH0-7
+
+typedef struct {
+    int mode;                   // SPI mode 0-3: CPOL sets the SCK idle level, CPOL^CPHA the sampling edge
+    bool csToggle;              // Assert CS before and release it after every frame
+    bool csActiveHigh;          // CS level while asserted
+    unsigned char csPin;        // CS bit on ADBUS, e.g. 0x08 for ADBUS3
+    unsigned char direction;    // ADBUS direction written with every CS change
+    int frameBytes;             // Bytes clocked in per frame, 1 to MPSSE_MAX_FRAME_BYTES
+    bool sendImmediate;         // End the program with 0x87
+    int dataReady;              // MPSSE_READY_*; GPIOL1 must be an input in direction
+    int gpioMarkers;            // MPSSE_GPIO_* bits, 0 for none
+} MpsseFrame;
+
+typedef struct {
+    unsigned char* bytes;
+    int length;
+    int frames;                 // Frames the program reads, 0 for an unused entry
+    unsigned long lastUse;
+} MpsseProgram;
+
+typedef struct {
+    MpsseFrame frame;
+    int maxFrames;
+    MpsseProgram entries[MPSSE_CACHE_ENTRIES];
+    MpsseProgram* last;         // Entry returned last time
+    unsigned long uses;
+    unsigned long builds;       // Uses that had to build their program
+} MpsseCache;
+
+int Mpsse_MarkerBytes(const MpsseFrame* frame);
+int Mpsse_ResponseBytes(const MpsseFrame* frame);
+int Mpsse_ProgramLength(const MpsseFrame* frame, int frames);
+int Mpsse_Build(const MpsseFrame* frame, int frames, unsigned char* out, int capacity);
+
+bool Mpsse_CacheCreate(MpsseCache* cache, const MpsseFrame* frame, int maxFrames);
+void Mpsse_CacheDestroy(MpsseCache* cache);
+const MpsseProgram* Mpsse_CacheGet(MpsseCache* cache, int frames);
+
+#endif // PMU_MPSSE_H
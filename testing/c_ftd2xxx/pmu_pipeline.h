@@ -0,0 +1,238 @@
+/*
+ * pmu_pipeline.h
+ * Capture pipeline of ft232h_spi_reader, shared by the modules it is built from
+ *
+ * Every device is read by a Pipeline: a reader thread filling the read ring,
+ * a decoder framing and formatting into the text ring, and a writer, or with
+ * several devices the merge writer (pmu_merge.c) taking all their text rings.
+ * A CaptureSettings describes one capture; StartCapture launches its threads
+ * and JoinCapture waits for them. The stages and the capture setup are in
+ * ft232h_spi_reader.c, which main runs once and the daemon (pmu_daemon.h)
+ * run after run on the same open devices and output files.
+ */
+
+#ifndef PMU_PIPELINE_H
+#define PMU_PIPELINE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <signal.h>
+
+#include "pmu_thread.h"
+#include "spsc_ring.h"
+#include "read_ring.h"
+#include "pmu_spi.h"
+#include "pmu_frame.h"
+#include "pmu_capture.h"
+#include "pmu_clock.h"
+#include "pmu_calib.h"
+#include "pmu_trigger.h"
+
+// Configuration
+#define BYTES_PER_SAMPLE        20      // 160 bits = 20 bytes
+#define DATA_BUFFER_SIZE        131072  // Data buffer size
+
+// Calculate optimal batch size based on USB buffer limits
+#define BYTES_PER_CMD           3       // Each read command is 3 bytes
+#define MAX_BATCH_SIZE          ((SPI_USB_TRANSFER_MAX - 1024) / (BYTES_PER_CMD + BYTES_PER_SAMPLE))
+#define OPTIMAL_BATCH_SIZE      2000    // Conservative batch size
+
+// Command pipelining: batches queued in the FT232H ahead of the one being read
+#define DEFAULT_INFLIGHT        2
+#define MAX_INFLIGHT_BATCHES    8
+#define INFLIGHT_BYTES_MAX      DATA_BUFFER_SIZE    // RX bytes outstanding at most
+
+// Several devices (--device), each read by its own pipeline
+#define MAX_DEVICES             4
+
+// What the merge orders the devices' frames by
+enum {
+    MERGE_AUTO,                 // Counter for the channels of one chip, time otherwise
+    MERGE_TIME,                 // Host frame time, for independent FPGAs
+    MERGE_COUNTER               // FPGA frame index, for links reading the same FPGA
+};
+
+// Continuous-clock streaming: maximum-length clock-in commands, framed in software
+#define STREAM_CHUNK_BYTES      65536   // Largest length a 0x20 command can carry
+
+// Pipeline between acquisition, decoding and file output
+#define RING_SLOTS              8       // Batch slots per ring
+#define BIN_LINE_LENGTH         (BYTES_PER_SAMPLE * 8 + 1)  // Bits plus newline
+#define CNT_LINE_LENGTH         (3 * 8 + 1)                 // 24 counter bits plus newline
+#define TIME_LINE_LENGTH        (10 + 1 + 9 + 1 + 12 + 1)   // "sssssssss.nnnnnnnnn iiiiiiiiiiii\n"
+#define MARKER_LINE_LENGTH      (2 * 8 + 1)                 // Both GPIO bytes at most, plus newline
+#define TEXT_FRAME_BYTES        (BIN_LINE_LENGTH + CNT_LINE_LENGTH + TIME_LINE_LENGTH + MARKER_LINE_LENGTH)
+#define TEXT_TIMES              0       // Merged text slots: host time per frame after the lines,
+#define TEXT_INDEXES            1       // then the FPGA frame index per frame
+#define TEXT_GAP_MARKER         (-1)    // Text ring slot holding a Gaps.txt line instead of frames
+#define TEXT_TRIGGER_MARKER     (-2)    // Text ring slot holding a Triggers.txt line
+
+// Recovery steps in escalating order; a failure that comes back before a
+// batch has been read completely is taken one step further
+enum {
+    RECOVER_RETRY,              // Purge everything queued and queue it again
+    RECOVER_RESYNC,             // Purge, repeat the 0xAA/0xAB handshake, reconfigure
+    RECOVER_REOPEN,             // Close and reopen the device by serial number
+    RECOVER_ACTIONS,
+    RECOVER_FATAL = RECOVER_ACTIONS    // Not a device fault, retrying cannot help
+};
+
+// Error recovery state, owned by the acquisition thread
+typedef struct {
+    int failures;                       // Recoveries since the last complete batch
+    unsigned long long lastDataNs;      // When data last arrived (from pipeline->startNs)
+    unsigned long actions[RECOVER_ACTIONS];
+    unsigned long long gapNs;           // Time without data, all recoveries together
+} Supervisor;
+
+// Batches completing later than the device can keep clocking, acquisition thread only
+typedef struct {
+    unsigned long batches;              // Batches checked against their deadline
+    unsigned long misses;
+    unsigned long long lastDoneNs;      // Previous completion, 0 after a pause or a gap
+    unsigned long long worstLateNs;     // Largest overshoot of a deadline
+    bool ringFull;                      // The read ring was full when the batch was read
+    unsigned long ringFullMisses;       // Misses of such batches, the host was too slow
+} DeadlineStats;
+
+// Reads set aside while the read ring is full (--backpressure=spill), in
+// capture record format (pmu_capture.h); acquisition thread only
+typedef struct {
+    FILE* file;                         // Temporary, NULL unless spilling is enabled
+    ReadSlot slot;                      // Reads go here rather than into the ring
+    long readPos;                       // Oldest record not back in the ring
+    long writePos;                      // End of the records
+    bool failed;                        // The file could not be written, blocking instead
+    unsigned long slots;
+    unsigned long long bytes;
+    long highWater;                     // Largest backlog, bytes
+} Spill;
+
+typedef struct {
+    int totalSamples;
+    int batchSize;
+    int inflight;               // Batches (or stream chunks) kept queued in the FT232H
+    bool stream;                // Continuous clocking with software framing
+    SpiDevice* device;          // FT232H being read, NULL for a replay
+    int deviceIndex;            // Position in the --device list
+    bool merged;                // One of several devices, written by MergeWriterThread
+    char label[CALIB_SERIAL_LENGTH + 2];    // "SERIAL: " before messages when merged
+    Framer framer;              // Frame boundary tracking and bit-slip recovery
+    FILE* outputFile;
+    FILE* counterFile;
+    ReadRing readRing;          // Reader -> decoder and recorder: FT_Read results in place
+    SpscRing textRing;          // Decoder -> writer: formatted output lines
+    FILE* recordFile;           // Raw capture being written, NULL when not recording
+    unsigned long long recordBytes;
+    bool recordError;
+    FILE* replayFile;           // Raw capture read instead of the device
+    bool replayRealtime;        // Keep the recorded timing rather than running flat out
+    unsigned long long replayBytes;
+    unsigned long replayRecords;
+    unsigned long long startNs;         // Origin of slot and capture timestamps
+    unsigned long long wallStartNs;     // Unix time at startNs
+    unsigned int spiClockHz;            // SCK the bytes were clocked with
+    ClockModel clock;                   // FPGA frame clock, owned by the decoder
+    unsigned long long* frameIndex;     // Decoder scratch: FPGA frame index per frame
+    unsigned long long* frameTimeNs;    // Decoder scratch: host time per frame
+    UCHAR* frameScratch;                // Decoder scratch: frames the framer had to move
+    UCHAR* markerFrames;                // Decoder scratch: a slot's frames without their markers
+    unsigned short* markers;            // GPIO markers by frame read, markerCapacity of them
+    unsigned long markerCapacity;
+    unsigned long long markerReads;     // Frame reads split so far
+    unsigned long long* frameStarts;    // Decoder scratch: stream byte per frame (Framer)
+    unsigned short* frameMarkers;       // Decoder scratch: GPIO marker per frame
+    Supervisor supervisor;              // Error recovery, acquisition thread only
+    DeadlineStats deadline;             // Late batches, acquisition thread only
+    Spill spill;                        // Backlog on disk, acquisition thread only
+    bool memoryLocked;                  // Ring buffers are locked (--mlock worked)
+    FILE* gapFile;                      // Gap markers, one line per recovery
+    unsigned long gaps;                 // Gap markers decoded
+    unsigned long long gapFramesLost;   // Frames the FPGA produced during the gaps, estimated
+    bool triggered;                     // Only the trigger windows are written (--trigger)
+    Trigger trigger;                    // Frame history and conditions, owned by the decoder
+    FILE* triggerFile;                  // One line per trigger window
+    atomic_int framesDecoded;           // Published by the decoder for the reader
+    atomic_int framesDropped;           // Raw frames the framer could not use
+    atomic_ullong bytesDecoded;         // Raw bytes the decoder has finished with
+    FILE* timeFile;
+    FILE* markerFile;                   // GPIO markers per frame, with --markers
+    DWORD startTime;
+    int totalSamplesCollected;  // Updated by the writer thread only
+    int batchCount;
+    bool readError;
+} Pipeline;
+
+// Merge stage of several devices' pipelines, the first one holds the output files
+typedef struct {
+    Pipeline* pipelines;
+    int count;
+    bool byCounter;                     // Links of one FPGA, ordered by frame index
+    unsigned long long framesMerged;
+    unsigned long long outOfOrder;      // Frames that came after a newer one
+    
+    // Common FPGA frame numbering, by counter only
+    bool written;                       // A frame has been written
+    unsigned long long firstIndex, firstNs;     // The first frame written
+    unsigned long long lastIndex, lastNs;       // The last one
+    double periodNs;                    // FPGA frame period between them, 0 until known
+    unsigned long long setIndex;        // Index of the run of frames being written
+    unsigned int setMask;               // Links the run has frames from
+    unsigned long long sets;            // FPGA frames written
+    unsigned long long setsComplete;    // Of those, frames read on every link
+} Merger;
+
+// One capture as the command line sets it up, or the daemon's reconfigure
+typedef struct {
+    int totalSamples;                   // 0 captures until stopped
+    int batchSize;
+    int inflight;
+    bool stream;
+    bool writeOutput;
+    const char* recordPath;             // NULL when not recording
+    FILE* replayFile;                   // NULL when reading the devices
+    CaptureHeader replayHeader;
+    bool replayRealtime;
+    double nominalFrameRate;            // --frame-rate, 0 if not given
+    bool triggered;
+    Trigger trigger;                    // Conditions, each pipeline gets a copy
+    int mergeBy;
+    int pipelineCount;
+} CaptureSettings;
+
+// Threads of a running capture and the merge stage they share
+typedef struct {
+    const CaptureSettings* settings;
+    PMU_THREAD writerThread, recorderThread;
+    PMU_THREAD decoderThreads[MAX_DEVICES], readerThreads[MAX_DEVICES];
+    Merger merger;
+    unsigned long long runStartNs;
+    unsigned long allocationsBefore;
+    double elapsedSec;
+    unsigned long captureAllocations;
+} CaptureRun;
+
+extern SpiDevice Devices[MAX_DEVICES];      // The FT232Hs being read (pmu_spi.h)
+extern int DeviceCount;                     // Devices open
+extern Pipeline Pipelines[MAX_DEVICES];     // One per device
+extern volatile sig_atomic_t StopRequested;  // Ctrl+C or a stop command, every stage ends at it
+extern int MarkerBytes;                     // GPIO bytes read after each frame (--markers)
+extern int RecordBytes;                     // Bytes read per frame, the frame and its markers
+
+void InitPipelines(const CaptureSettings* settings, bool keepFiles);
+void WriteFileHeaders(const CaptureSettings* settings);
+bool OpenOutputFiles(const CaptureSettings* settings);
+void ClosePipelineFiles(Pipeline* pipeline);
+bool AllocatePipelines(const CaptureSettings* settings);
+void FreePipelines(const CaptureSettings* settings);
+void InstallSignalHandlers(void);
+bool StartCapture(CaptureRun* run, const CaptureSettings* settings);
+void JoinCapture(CaptureRun* run);
+int CollectedSamples(Pipeline* pipeline);
+bool PrintCaptureResults(const CaptureRun* run);
+void CloseDevices(void);
+double GetElapsedTime(DWORD startTime);
+
+PMU_THREAD_RET PMU_THREAD_CALL MergeWriterThread(void* arg);
+
+#endif // PMU_PIPELINE_H
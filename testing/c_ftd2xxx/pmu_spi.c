@@ -0,0 +1,812 @@
+/*
+ * pmu_spi.c
+ * FT232H MPSSE SPI acquisition shared by the readers
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pmu_spi.h"
+#include "pmu_mem.h"
+#include "pmu_thread.h"
+
+#define TRANSFER_MARGIN_MS      100     // Added to twice the line time of a batch
+#define RX_EVENT_MAX_WAIT_MS    5       // Bounds the cost of a missed notification
+#define SYNC_TIMEOUT_MS         50      // Wait for the MPSSE to echo a bad command
+#define CHIP_CMD_FIFO           1024    // Command bytes the chip may still execute after a purge
+#define POLL_BASE_WAIT_MS       5       // Legacy poll mode: sleep before the first poll
+#define POLL_MAX_RETRIES        10      // Legacy poll mode: 1 ms polls without data
+
+static bool SPI_Setup(SpiDevice* device);
+static int SPI_ReadPolled(SpiDevice* device, int numFrames, UCHAR* dataBuffer, int bufferSize);
+static int SPI_ReadWithEvents(SpiDevice* device, UCHAR* dataBuffer, int expectedBytes);
+
+void SPI_DefaultConfig(SpiConfig* config, const MpsseFrame* frame, int maxBatchFrames)
+{
+    memset(config, 0, sizeof(*config));
+    config->frame = *frame;
+    config->maxBatchFrames = maxBatchFrames;
+    config->clock.divisor = SPI_DEFAULT_DIVISOR;
+    config->clock.threePhase = false;
+    config->useCalibration = true;
+    config->usbTransferSize = SPI_USB_TRANSFER_MAX;
+    config->latencyMs = SPI_DEFAULT_LATENCY_MS;
+    config->timeoutMs = SPI_DEFAULT_TIMEOUT_MS;
+    config->waitMode = WAIT_EVENT;
+    config->transport = TRANSPORT_D2XX;
+    config->readyHz = SPI_DEFAULT_READY_HZ;
+}
+
+// Two- and four-channel Hi-Speed chips; the driver lists each channel as a
+// device of its own, with A, B, ... appended to the chip's serial number
+static bool SPI_IsMultiChannel(DWORD type)
+{
+    switch (type) {
+    case FT_DEVICE_2232H:
+    case FT_DEVICE_4232H:
+    case FT_DEVICE_2232HP:
+    case FT_DEVICE_4232HP:
+    case FT_DEVICE_2233HP:
+    case FT_DEVICE_4233HP:
+    case FT_DEVICE_2232HA:
+    case FT_DEVICE_4232HA:
+    case FT_DEVICE_2232HPN:
+    case FT_DEVICE_4232HPN:
+    case FT_DEVICE_2233HPN:
+    case FT_DEVICE_4233HPN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static const char* SPI_ChipName(DWORD type)
+{
+    switch (type) {
+    case FT_DEVICE_4232H:
+    case FT_DEVICE_4232HP:
+    case FT_DEVICE_4233HP:
+    case FT_DEVICE_4232HA:
+    case FT_DEVICE_4232HPN:
+    case FT_DEVICE_4233HPN:
+        return "FT4232H";
+    default:
+        return "FT2232H";
+    }
+}
+
+// Channel letter of a multi-channel chip's device, 0 for a single-channel one
+static char SPI_Channel(DWORD type, const char* serial)
+{
+    size_t length = strlen(serial);
+    return SPI_IsMultiChannel(type) && length > 0 ? serial[length - 1] : 0;
+}
+
+// Only channels A and B of the multi-channel chips have an MPSSE
+static bool SPI_HasMpsse(DWORD type, const char* serial)
+{
+    char channel = SPI_Channel(type, serial);
+    if (channel != 0) return channel == 'A' || channel == 'B';
+    return type == FT_DEVICE_232H || type == FT_DEVICE_232HP || type == FT_DEVICE_233HP ||
+           type == FT_DEVICE_232HPN || type == FT_DEVICE_233HPN;
+}
+
+// Index of the first MPSSE device not already open, index 0 if there is none
+static int SPI_FindMpsse(const TransportInfo* devices, int numDevs)
+{
+    for (int i = 0; i < numDevs; i++) {
+        if (!devices[i].opened && SPI_HasMpsse(devices[i].type, devices[i].serial)) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// Serial numbers of the SPI links behind serial, as the transport sees them:
+// the device itself if one has that serial number, otherwise the MPSSE
+// channels of the two- or four-channel chip it names. Returns how many were found.
+int SPI_FindChannels(int transport, const char* serial, char channels[][CALIB_SERIAL_LENGTH], int maxChannels)
+{
+    TransportInfo devices[TRANSPORT_MAX_DEVICES];
+    size_t length = strlen(serial);
+    int found = 0;
+
+    int numDevs = Transport_List(transport, devices, TRANSPORT_MAX_DEVICES);
+    for (int i = 0; i < numDevs; i++) {
+        const char* deviceSerial = devices[i].serial;
+        if (strcmp(deviceSerial, serial) == 0) {
+            snprintf(channels[0], CALIB_SERIAL_LENGTH, "%s", serial);
+            return 1;
+        }
+        if (found < maxChannels && strlen(deviceSerial) == length + 1 &&
+            strncmp(deviceSerial, serial, length) == 0 && SPI_IsMultiChannel(devices[i].type) &&
+            SPI_HasMpsse(devices[i].type, deviceSerial)) {
+            snprintf(channels[found++], CALIB_SERIAL_LENGTH, "%s", deviceSerial);
+        }
+    }
+    return found;
+}
+
+// Open the configured device, or the first one with an MPSSE, and set it up for the configured frames
+bool SPI_Open(SpiDevice* device, const SpiConfig* config)
+{
+    FT_STATUS ftStatus;
+    TransportInfo devices[TRANSPORT_MAX_DEVICES];
+
+    memset(device, 0, sizeof(*device));
+    device->config = *config;
+    device->clock = config->clock;
+    device->clockHz = Calib_SckHz(&config->clock);
+    device->waitMode = config->waitMode;
+
+    Histogram_Init(&device->latency.write, "write");
+    Histogram_Init(&device->latency.wait, "wait");
+    Histogram_Init(&device->latency.read, "read");
+    Histogram_Init(&device->latency.batch, "batch");
+
+    if (!Transport_Create(&device->transport, config->transport)) {
+        SPI_Close(device);
+        return false;
+    }
+    device->input = (UCHAR*)Mem_Alloc(SPI_INPUT_BUFFER_SIZE);
+    if (!device->input || !Mpsse_CacheCreate(&device->programs, &config->frame, config->maxBatchFrames)) {
+        printf("Error: Failed to allocate SPI buffers\n");
+        SPI_Close(device);
+        return false;
+    }
+
+    // Check for FTDI devices
+    int numDevs = Transport_List(config->transport, devices, TRANSPORT_MAX_DEVICES);
+    if (numDevs <= 0) {
+        printf("Error: No FTDI devices found\n");
+        SPI_Close(device);
+        return false;
+    }
+
+    printf("Found %d FTDI device(s)\n", numDevs);
+
+    ftStatus = Transport_Open(&device->transport, config->serial, SPI_FindMpsse(devices, numDevs));
+    if (ftStatus != FT_OK) {
+        if (config->serial[0] != '\0') {
+            printf("Error: Failed to open FTDI device %s\n", config->serial);
+        } else {
+            printf("Error: Failed to open FTDI device\n");
+        }
+        SPI_Close(device);
+        return false;
+    }
+
+    // Use the clock calibrated for this device, if any
+    device->type = device->transport.type;
+    snprintf(device->serial, sizeof(device->serial), "%s", device->transport.serial);
+    if (device->serial[0] != '\0') {
+        device->channel = SPI_Channel(device->type, device->serial);
+        if (device->channel != 0) {
+            printf("Device serial number: %s (%s channel %c)\n", device->serial,
+                   SPI_ChipName(device->type), device->channel);
+        } else {
+            printf("Device serial number: %s\n", device->serial);
+        }
+        if (config->useCalibration) {
+            device->clockCalibrated = Calib_Load(CALIB_PATH, device->serial, &device->clock);
+        }
+    }
+
+    if (!SPI_Setup(device)) {
+        SPI_Close(device);
+        return false;
+    }
+    return true;
+}
+
+void SPI_Close(SpiDevice* device)
+{
+    Transport_Destroy(&device->transport);
+    Mpsse_CacheDestroy(&device->programs);
+    Mem_Free(device->input);
+    device->input = NULL;
+}
+
+// Reset and configure an open device for SPI reads, also after a reopen
+static bool SPI_Setup(SpiDevice* device)
+{
+    FT_STATUS ftStatus;
+    Transport* transport = &device->transport;
+
+    // Reset device
+    ftStatus = Transport_Reset(transport);
+    if (ftStatus != FT_OK) {
+        printf("Error: Failed to reset device\n");
+        return false;
+    }
+
+    // Purge buffers
+    DWORD bytesInQueue;
+    ftStatus = Transport_QueueStatus(transport, &bytesInQueue);
+    if (ftStatus == FT_OK && bytesInQueue > 0) {
+        DWORD bytesRead;
+        if (bytesInQueue > SPI_INPUT_BUFFER_SIZE) bytesInQueue = SPI_INPUT_BUFFER_SIZE;
+        Transport_Read(transport, device->input, bytesInQueue, &bytesRead);
+    }
+
+    // Set USB parameters for high performance
+    ftStatus = Transport_SetUsbParameters(transport, device->config.usbTransferSize);
+    if (ftStatus != FT_OK) {
+        printf("Warning: Failed to set USB parameters\n");
+    }
+
+    // Disable event and error characters
+    ftStatus = Transport_DisableChars(transport);
+    if (ftStatus != FT_OK) {
+        printf("Warning: Failed to set characters\n");
+    }
+
+    // Long enough for the largest batches
+    ftStatus = Transport_SetTimeouts(transport, device->config.timeoutMs, device->config.timeoutMs);
+    if (ftStatus != FT_OK) {
+        printf("Warning: Failed to set timeouts\n");
+    }
+
+    // Short latency timer, a partial packet is not held back for long
+    ftStatus = Transport_SetLatencyTimer(transport, device->config.latencyMs);
+    if (ftStatus != FT_OK) {
+        printf("Warning: Failed to set latency timer\n");
+    }
+
+    // Reset controller
+    ftStatus = Transport_SetBitMode(transport, 0x00, 0x00);
+    if (ftStatus != FT_OK) {
+        printf("Error: Failed to reset bit mode\n");
+        return false;
+    }
+
+    // Enable MPSSE mode
+    ftStatus = Transport_SetBitMode(transport, 0x00, 0x02);
+    if (ftStatus != FT_OK) {
+        printf("Error: Failed to enable MPSSE mode\n");
+        return false;
+    }
+
+    // Wait for MPSSE to initialize
+    THREAD_SLEEP_MS(50);
+
+    // Synchronize MPSSE interface
+    if (!SPI_SynchronizeMPSSE(device)) {
+        printf("Error: Failed to synchronize MPSSE\n");
+        return false;
+    }
+
+    // Configure SPI interface
+    if (!SPI_ConfigureSPI(device)) {
+        printf("Error: Failed to configure SPI\n");
+        return false;
+    }
+
+    // Register for RX notifications, the poll mode still works without them
+    device->rxEventEnabled = Transport_EnableRxEvent(transport);
+    if (!device->rxEventEnabled && device->waitMode == WAIT_EVENT) {
+        printf("Warning: Failed to set event notification, using poll mode\n");
+        device->waitMode = WAIT_POLL;
+    }
+
+    return true;
+}
+
+// Send an invalid opcode and wait for the MPSSE to answer 0xFA and the opcode
+static bool SPI_EchoBadCommand(SpiDevice* device, UCHAR opcode)
+{
+    FT_STATUS ftStatus;
+    DWORD bytesWritten, bytesRead, bytesInQueue;
+    unsigned long long deadline = Time_NowUs() + SYNC_TIMEOUT_MS * 1000ULL;
+    DWORD received = 0;
+    UCHAR* input = device->input;
+
+    ftStatus = Transport_Write(&device->transport, &opcode, 1, &bytesWritten);
+    if (ftStatus != FT_OK || bytesWritten != 1) return false;
+
+    // Stale data from before a purge may still arrive ahead of the answer
+    do {
+        THREAD_SLEEP_MS(1);
+        ftStatus = Transport_QueueStatus(&device->transport, &bytesInQueue);
+        if (ftStatus != FT_OK) return false;
+        if (bytesInQueue > SPI_INPUT_BUFFER_SIZE - received) {
+            bytesInQueue = SPI_INPUT_BUFFER_SIZE - received;
+        }
+        if (bytesInQueue > 0) {
+            ftStatus = Transport_Read(&device->transport, input + received, bytesInQueue, &bytesRead);
+            if (ftStatus != FT_OK) return false;
+            received += bytesRead;
+        }
+        for (DWORD i = 1; i < received; i++) {
+            if (input[i - 1] == 0xFA && input[i] == opcode) return true;
+        }
+    } while (received < SPI_INPUT_BUFFER_SIZE && Time_NowUs() < deadline);
+
+    return false;
+}
+
+// Bad command handshake: both invalid opcodes must be echoed, proving the
+// command and data streams are in step again
+bool SPI_SynchronizeMPSSE(SpiDevice* device)
+{
+    return SPI_EchoBadCommand(device, 0xAA) && SPI_EchoBadCommand(device, 0xAB);
+}
+
+// Clocking, SCK and the idle pin levels of the configured SPI mode and CS policy
+bool SPI_ConfigureSPI(SpiDevice* device)
+{
+    FT_STATUS ftStatus;
+    DWORD bytesWritten;
+    UCHAR command[16];
+    int bufferIndex = 0;
+    const MpsseFrame* frame = &device->config.frame;
+
+    // Disable clock divide by 5
+    command[bufferIndex++] = 0x8A;
+
+    // Turn off adaptive clocking
+    command[bufferIndex++] = 0x97;
+
+    // Three-phase data clocking only if calibration chose it
+    command[bufferIndex++] = device->clock.threePhase ? 0x8C : 0x8D;
+
+    ftStatus = Transport_Write(&device->transport, command, bufferIndex, &bytesWritten);
+    if (ftStatus != FT_OK) return false;
+
+    bufferIndex = 0;
+
+    // Set clock divisor, 6MHz unless configured or calibrated otherwise
+    command[bufferIndex++] = 0x86; // Set clock divisor command
+    command[bufferIndex++] = device->clock.divisor & 0xFF;        // Low byte
+    command[bufferIndex++] = (device->clock.divisor >> 8) & 0xFF; // High byte
+    device->clockHz = Calib_SckHz(&device->clock);
+
+    // SCK at its idle level for the mode; CS released if it is toggled per
+    // frame, otherwise asserted for continuous operation
+    bool csAsserted = !frame->csToggle;
+    UCHAR value = frame->mode >= 2 ? MPSSE_PIN_SCK : 0;
+    if (csAsserted == frame->csActiveHigh) value |= frame->csPin;
+    command[bufferIndex++] = MPSSE_SET_BITS_LOW;
+    command[bufferIndex++] = value;
+    command[bufferIndex++] = frame->direction;  // e.g. 0x0B: SCK, MOSI, CS out, MISO in
+
+    // Set high byte pins
+    command[bufferIndex++] = 0x82; // Set data bits high byte
+    command[bufferIndex++] = 0x00; // Value
+    command[bufferIndex++] = 0x00; // Direction
+
+    ftStatus = Transport_Write(&device->transport, command, bufferIndex, &bytesWritten);
+    if (ftStatus != FT_OK) return false;
+
+    THREAD_SLEEP_MS(20);
+
+    // Turn off loopback
+    command[0] = 0x85;
+    ftStatus = Transport_Write(&device->transport, command, 1, &bytesWritten);
+    if (ftStatus != FT_OK) return false;
+
+    THREAD_SLEEP_MS(30);
+
+    return true;
+}
+
+// Switch SCK between batches, nothing may be queued in the device
+bool SPI_SetClock(SpiDevice* device, const ClockSetting* setting)
+{
+    FT_STATUS ftStatus;
+    DWORD bytesWritten;
+    UCHAR command[5];
+    int bufferIndex = 0;
+
+    command[bufferIndex++] = 0x8A;
+    command[bufferIndex++] = setting->threePhase ? 0x8C : 0x8D;
+    command[bufferIndex++] = 0x86;
+    command[bufferIndex++] = setting->divisor & 0xFF;
+    command[bufferIndex++] = (setting->divisor >> 8) & 0xFF;
+
+    ftStatus = Transport_Write(&device->transport, command, bufferIndex, &bytesWritten);
+    if (ftStatus != FT_OK || bytesWritten != (DWORD)bufferIndex) return false;
+
+    device->clock = *setting;
+    device->clockHz = Calib_SckHz(setting);
+    return true;
+}
+
+// Switch the SPI mode, and with it the edge MISO is sampled on, between
+// batches; nothing may be queued in the device. The programs are rebuilt.
+bool SPI_SetMode(SpiDevice* device, int mode)
+{
+    MpsseFrame frame = device->config.frame;
+    frame.mode = mode;
+    if (Mpsse_ProgramLength(&frame, 1) < 0) return false;
+
+    Mpsse_CacheDestroy(&device->programs);
+    device->config.frame = frame;
+    if (!Mpsse_CacheCreate(&device->programs, &frame, device->config.maxBatchFrames)) return false;
+    return SPI_ConfigureSPI(device);
+}
+
+// Change the USB transfer size and latency timer of the open device; kept for
+// a reopen too
+bool SPI_SetUsbParameters(SpiDevice* device, ULONG transferSize, UCHAR latencyMs)
+{
+    device->config.usbTransferSize = transferSize;
+    device->config.latencyMs = latencyMs;
+    device->lastStatus = Transport_SetUsbParameters(&device->transport, transferSize);
+    if (device->lastStatus == FT_OK) {
+        device->lastStatus = Transport_SetLatencyTimer(&device->transport, latencyMs);
+    }
+    return device->lastStatus == FT_OK;
+}
+
+int SPI_ReceiveBatch(SpiDevice* device, int numFrames, UCHAR* dataBuffer, int bufferSize)
+{
+    if (!SPI_QueueBatch(device, numFrames)) {
+        return -1;
+    }
+
+    return SPI_CollectBatch(device, numFrames, dataBuffer, bufferSize);
+}
+
+// Write the read commands for one batch without waiting for its data. The
+// command program comes from the cache, built only the first time a batch
+// size is seen; it ends with send-immediate, so the last partial USB packet
+// does not wait for the latency timer.
+bool SPI_QueueBatch(SpiDevice* device, int numFrames)
+{
+    FT_STATUS ftStatus;
+    DWORD bytesWritten;
+
+    const MpsseProgram* program = Mpsse_CacheGet(&device->programs, numFrames);
+    if (!program) {
+        printf("Error: No command program for %d frames (at most %d)\n", numFrames,
+               device->config.maxBatchFrames);
+        device->lastStatus = FT_INVALID_PARAMETER;
+        return false;
+    }
+
+    // Send all commands at once
+    unsigned long long writeStart = Time_NowNs();
+    ftStatus = Transport_Write(&device->transport, program->bytes, program->length, &bytesWritten);
+    Histogram_Record(&device->latency.write, Time_NowNs() - writeStart);
+    if (ftStatus != FT_OK || bytesWritten != (DWORD)program->length) {
+        printf("Error: Failed to write commands\n");
+        device->lastStatus = ftStatus;
+        return false;
+    }
+    device->queuedBytes += (unsigned long long)numFrames * Mpsse_ResponseBytes(&device->config.frame);
+
+    return true;
+}
+
+// The oldest queued read has been collected. One that failed stays counted,
+// its bytes may still be on their way for SPI_FlushPipeline to drain.
+static void SPI_Dequeue(SpiDevice* device, int numBytes)
+{
+    device->queuedBytes = device->queuedBytes > (unsigned long long)numBytes ?
+                          device->queuedBytes - numBytes : 0;
+    if (device->queuedBytes == 0) device->streamQueued = false;
+}
+
+// Wait for and read the data of the oldest queued batch, returns the complete
+// frames received or -1
+int SPI_CollectBatch(SpiDevice* device, int numFrames, UCHAR* dataBuffer, int bufferSize)
+{
+    int frameBytes = Mpsse_ResponseBytes(&device->config.frame);
+    int expectedBytes = numFrames * frameBytes;
+    int totalBytesRead;
+    if (device->waitMode == WAIT_EVENT) {
+        totalBytesRead = SPI_ReadWithEvents(device, dataBuffer,
+                                            expectedBytes < bufferSize ? expectedBytes : bufferSize);
+    } else {
+        totalBytesRead = SPI_ReadPolled(device, numFrames, dataBuffer, bufferSize);
+    }
+    if (totalBytesRead < 0) {
+        return -1;
+    }
+    SPI_Dequeue(device, expectedBytes);
+
+    // Calculate number of complete frames received
+    int framesReceived = totalBytesRead / frameBytes;
+
+    if (framesReceived < numFrames) {
+        printf("Warning: Expected %d samples (%d bytes), got %d samples (%d bytes)\n",
+               numFrames, expectedBytes, framesReceived, totalBytesRead);
+    }
+
+    return framesReceived;
+}
+
+// Queue one continuous clock-in command of numBytes (at most 65536), sampled
+// on the edge of the configured mode; CS stays as SPI_ConfigureSPI left it
+bool SPI_QueueStream(SpiDevice* device, int numBytes)
+{
+    FT_STATUS ftStatus;
+    DWORD bytesWritten;
+    UCHAR command[4];
+    MpsseFrame chunk = device->config.frame;
+
+    chunk.csToggle = false;
+    chunk.dataReady = MPSSE_READY_NONE;
+    chunk.gpioMarkers = 0;
+    chunk.frameBytes = numBytes;
+    chunk.sendImmediate = true;
+    int length = Mpsse_Build(&chunk, 1, command, sizeof(command));
+    if (length < 0) {
+        device->lastStatus = FT_INVALID_PARAMETER;
+        return false;
+    }
+
+    unsigned long long writeStart = Time_NowNs();
+    ftStatus = Transport_Write(&device->transport, command, length, &bytesWritten);
+    Histogram_Record(&device->latency.write, Time_NowNs() - writeStart);
+    device->lastStatus = ftStatus;
+    if (ftStatus != FT_OK || bytesWritten != (DWORD)length) return false;
+    device->queuedBytes += numBytes;
+    device->streamQueued = true;
+    return true;
+}
+
+// Split the collection of one batch into time spent waiting and time in reads
+static void SPI_RecordLatency(SpiDevice* device, unsigned long long startNs, unsigned long long readNs)
+{
+    unsigned long long totalNs = Time_NowNs() - startNs;
+    Histogram_Record(&device->latency.wait, totalNs - readNs);
+    Histogram_Record(&device->latency.read, readNs);
+    Histogram_Record(&device->latency.batch, totalNs);
+}
+
+// Read exactly numBytes of queued stream data, returns bytes read or -1
+int SPI_CollectBytes(SpiDevice* device, UCHAR* buffer, int numBytes)
+{
+    if (device->waitMode == WAIT_EVENT) {
+        int bytesRead = SPI_ReadWithEvents(device, buffer, numBytes);
+        if (bytesRead >= 0) SPI_Dequeue(device, numBytes);
+        return bytesRead;
+    }
+
+    // Poll mode relies on the driver read timeout set up in SPI_Open, the
+    // wait happens inside the read
+    DWORD bytesRead;
+    unsigned long long start = Time_NowNs();
+    FT_STATUS ftStatus = Transport_Read(&device->transport, buffer, numBytes, &bytesRead);
+    unsigned long long readNs = Time_NowNs() - start;
+    if (ftStatus != FT_OK) {
+        printf("Error: Failed to read data\n");
+        device->lastStatus = ftStatus;
+        return -1;
+    }
+    SPI_RecordLatency(device, start, readNs);
+    SPI_Dequeue(device, numBytes);
+    return (int)bytesRead;
+}
+
+// Drop queued commands and any data still on its way, so the next batch starts
+// on a frame boundary again. False if the device did not accept the purge.
+bool SPI_FlushPipeline(SpiDevice* device)
+{
+    if (Transport_Purge(&device->transport, FT_PURGE_RX | FT_PURGE_TX) != FT_OK) return false;
+
+    // Commands already inside the chip still execute after the purge, up to
+    // all the reads queued. One stream chunk is a single command clocking up
+    // to 65536 bytes; frame reads are a command each, so a command FIFO holds
+    // only so many of them. Their data is dropped as it comes, until nothing
+    // more has come for a frame time and a latency timer period.
+    unsigned long long drainNs;
+    if (device->streamQueued) {
+        drainNs = device->queuedBytes * 8 * 1000000000ULL / device->clockHz;
+    } else {
+        int commandBytes = Mpsse_ProgramLength(&device->config.frame, 1) -
+                           (device->config.frame.sendImmediate ? 1 : 0);
+        unsigned long long fifoBytes = (unsigned long long)(CHIP_CMD_FIFO / commandBytes) *
+                                       Mpsse_ResponseBytes(&device->config.frame);
+        unsigned long long drainBytes = device->queuedBytes < fifoBytes ? device->queuedBytes : fifoBytes;
+        drainNs = SPI_LineNs(device, (int)drainBytes);
+    }
+    device->queuedBytes = 0;
+    device->streamQueued = false;
+
+    unsigned long long quietNs = SPI_LineNs(device, Mpsse_ResponseBytes(&device->config.frame)) +
+                                 (device->config.latencyMs + 2) * 1000000ULL;
+    unsigned long long lastDataNs = Time_NowNs();
+    unsigned long long endNs = lastDataNs + drainNs + 2000000ULL;
+    while (Time_NowNs() < endNs && Time_NowNs() - lastDataNs < quietNs) {
+        THREAD_SLEEP_MS(1);
+        DWORD bytesInQueue;
+        if (Transport_QueueStatus(&device->transport, &bytesInQueue) != FT_OK) return false;
+        if (bytesInQueue > 0) {
+            if (Transport_Purge(&device->transport, FT_PURGE_RX) != FT_OK) return false;
+            lastDataNs = Time_NowNs();
+        }
+    }
+    return Transport_Purge(&device->transport, FT_PURGE_RX) == FT_OK;
+}
+
+// Flush, then prove with the bad command handshake that the MPSSE parses
+// commands from the start again, and restore the SPI settings
+bool SPI_Resync(SpiDevice* device)
+{
+    return SPI_FlushPipeline(device) && SPI_SynchronizeMPSSE(device) && SPI_ConfigureSPI(device);
+}
+
+// Close the device and open it again by the serial number it had when first
+// opened, e.g. after it dropped off the bus; the SPI clock in use is kept.
+// False for a device without one: by index, another adapter could take its
+// place.
+bool SPI_Reopen(SpiDevice* device)
+{
+    if (device->serial[0] == '\0') {
+        printf("Error: Cannot reopen a device without a serial number\n");
+        device->lastStatus = FT_DEVICE_NOT_FOUND;
+        return false;
+    }
+
+    Transport_Close(&device->transport);
+    device->queuedBytes = 0;
+    device->streamQueued = false;
+
+    // Opening rescans, a device that re-enumerated is not in the old list
+    if (Transport_Open(&device->transport, device->serial, 0) != FT_OK) {
+        return false;
+    }
+
+    return SPI_Setup(device);
+}
+
+// Legacy completion: fixed sleep scaled by batch size, then poll with 1 ms sleeps
+static int SPI_ReadPolled(SpiDevice* device, int numFrames, UCHAR* dataBuffer, int bufferSize)
+{
+    FT_STATUS ftStatus;
+    DWORD bytesRead, bytesInQueue;
+    int expectedBytes = numFrames * Mpsse_ResponseBytes(&device->config.frame);
+    unsigned long long start = Time_NowNs();
+    unsigned long long readNs = 0;
+
+    // Wait for data with adaptive timing
+    THREAD_SLEEP_MS(POLL_BASE_WAIT_MS + numFrames / 100);
+
+    // Read data with retry mechanism; paced by a data-ready strobe the batch
+    // trickles in over its line time, one more poll per millisecond of it
+    int totalBytesRead = 0;
+    int retries = 0;
+    int maxRetries = POLL_MAX_RETRIES;
+    if (device->config.frame.dataReady != MPSSE_READY_NONE) {
+        maxRetries += (int)(SPI_LineNs(device, expectedBytes) / 1000000);
+    }
+
+    while (totalBytesRead < expectedBytes && retries < maxRetries) {
+        ftStatus = Transport_QueueStatus(&device->transport, &bytesInQueue);
+        if (ftStatus != FT_OK) {
+            printf("Error: Failed to get queue status\n");
+            device->lastStatus = ftStatus;
+            return -1;
+        }
+
+        if (bytesInQueue > 0) {
+            DWORD bytesToRead = bytesInQueue;
+            if (totalBytesRead + bytesToRead > (DWORD)bufferSize) {
+                bytesToRead = bufferSize - totalBytesRead;
+            }
+
+            unsigned long long readStart = Time_NowNs();
+            ftStatus = Transport_Read(&device->transport, dataBuffer + totalBytesRead, bytesToRead, &bytesRead);
+            readNs += Time_NowNs() - readStart;
+            if (ftStatus != FT_OK) {
+                printf("Error: Failed to read data\n");
+                device->lastStatus = ftStatus;
+                return -1;
+            }
+
+            totalBytesRead += bytesRead;
+        } else {
+            // No data available, wait a bit and retry
+            THREAD_SLEEP_MS(1);
+            retries++;
+        }
+    }
+
+    SPI_RecordLatency(device, start, readNs);
+    return totalBytesRead;
+}
+
+// Event-driven completion: wakes on each RX notification and only gives up at a
+// deadline derived from the SPI clock, so slow but healthy batches are not cut short
+static int SPI_ReadWithEvents(SpiDevice* device, UCHAR* dataBuffer, int expectedBytes)
+{
+    FT_STATUS ftStatus;
+    DWORD bytesRead, bytesInQueue;
+    DWORD timeoutMs = SPI_TransferTimeoutMs(device, expectedBytes);
+    unsigned long long deadline = Time_NowUs() + (unsigned long long)timeoutMs * 1000;
+    unsigned long long start = Time_NowNs();
+    unsigned long long readNs = 0;
+    int totalBytesRead = 0;
+
+    while (totalBytesRead < expectedBytes) {
+        ftStatus = Transport_QueueStatus(&device->transport, &bytesInQueue);
+        if (ftStatus != FT_OK) {
+            printf("Error: Failed to get queue status\n");
+            device->lastStatus = ftStatus;
+            return -1;
+        }
+
+        if (bytesInQueue > 0) {
+            // Never read past this batch, the next one may already be queued
+            DWORD bytesToRead = bytesInQueue;
+            if (bytesToRead > (DWORD)(expectedBytes - totalBytesRead)) {
+                bytesToRead = expectedBytes - totalBytesRead;
+            }
+
+            unsigned long long readStart = Time_NowNs();
+            ftStatus = Transport_Read(&device->transport, dataBuffer + totalBytesRead, bytesToRead, &bytesRead);
+            readNs += Time_NowNs() - readStart;
+            if (ftStatus != FT_OK) {
+                printf("Error: Failed to read data\n");
+                device->lastStatus = ftStatus;
+                return -1;
+            }
+
+            totalBytesRead += bytesRead;
+            continue;
+        }
+
+        unsigned long long now = Time_NowUs();
+        if (now >= deadline) {
+            printf("Warning: Batch timed out after %lu ms\n", (unsigned long)timeoutMs);
+            break;
+        }
+
+        DWORD waitMs = (DWORD)((deadline - now + 999) / 1000);
+        Transport_WaitRx(&device->transport, waitMs < RX_EVENT_MAX_WAIT_MS ? waitMs : RX_EVENT_MAX_WAIT_MS);
+    }
+
+    SPI_RecordLatency(device, start, readNs);
+    return totalBytesRead;
+}
+
+// Time the frames of numBytes take to arrive: their bits at the configured
+// SCK, or one data-ready strobe period per frame if that is longer
+unsigned long long SPI_LineNs(const SpiDevice* device, int numBytes)
+{
+    unsigned long long lineNs = (unsigned long long)numBytes * 8 * 1000000000ULL / device->clockHz;
+    const MpsseFrame* frame = &device->config.frame;
+    if (frame->dataReady != MPSSE_READY_NONE && device->config.readyHz > 0) {
+        int responseBytes = Mpsse_ResponseBytes(frame);
+        int frames = (numBytes + responseBytes - 1) / responseBytes;
+        unsigned long long strobeNs = (unsigned long long)(frames * 1e9 / device->config.readyHz);
+        if (strobeNs > lineNs) lineNs = strobeNs;
+    }
+    return lineNs;
+}
+
+// Twice the line time of the bytes, plus margin
+DWORD SPI_TransferTimeoutMs(const SpiDevice* device, int numBytes)
+{
+    unsigned long long lineMs = SPI_LineNs(device, numBytes) / 1000000;
+    return (DWORD)(2 * lineMs + TRANSFER_MARGIN_MS);
+}
+
+const char* SPI_StatusName(FT_STATUS status)
+{
+    switch (status) {
+    case FT_OK:                     return "short-read";
+    case FT_INVALID_HANDLE:         return "FT_INVALID_HANDLE";
+    case FT_DEVICE_NOT_FOUND:       return "FT_DEVICE_NOT_FOUND";
+    case FT_DEVICE_NOT_OPENED:      return "FT_DEVICE_NOT_OPENED";
+    case FT_IO_ERROR:               return "FT_IO_ERROR";
+    case FT_INSUFFICIENT_RESOURCES: return "FT_INSUFFICIENT_RESOURCES";
+    case FT_INVALID_PARAMETER:      return "FT_INVALID_PARAMETER";
+    case FT_FAILED_TO_WRITE_DEVICE: return "FT_FAILED_TO_WRITE_DEVICE";
+    case FT_OTHER_ERROR:            return "FT_OTHER_ERROR";
+    case FT_DEVICE_LIST_NOT_READY:  return "FT_DEVICE_LIST_NOT_READY";
+    default:                        return "FT_ERROR";
+    }
+}
+
+void SPI_PrintLatency(const SpiDevice* device)
+{
+    Histogram_PrintHeader();
+    Histogram_Print(&device->latency.write);
+    Histogram_Print(&device->latency.wait);
+    Histogram_Print(&device->latency.read);
+    Histogram_Print(&device->latency.batch);
+}
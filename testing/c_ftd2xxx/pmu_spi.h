@@ -0,0 +1,123 @@
+/*
+ * pmu_spi.h
+ * FT232H MPSSE SPI acquisition shared by the readers
+ *
+ * An SpiDevice is one FT232H, or one MPSSE channel (A or B) of an FT2232H or
+ * FT4232H, set up to read frames as its SpiConfig describes: SPI mode, chip
+ * select policy and frame length (an MpsseFrame), SCK, USB transfer size,
+ * latency timer and how the completion of a batch is waited for. SPI_Open
+ * finds and opens the device, by serial number when several are plugged in
+ * (SPI_FindChannels lists the channels of a chip), takes the clock calibrated
+ * for its serial number if asked to, proves with the bad command handshake
+ * that the MPSSE is in step and configures it. The channels of one chip are
+ * independent devices, each with its own command pipeline.
+ *
+ * With frame.dataReady set, every frame read waits for an edge of the FPGA's
+ * data-ready strobe on GPIOL1, so each new frame is read exactly once and the
+ * strobe rather than SCK paces the batches: readyHz then goes into the read
+ * timeouts and SPI_LineNs. With frame.gpioMarkers set, every frame read
+ * returns the frame followed by its GPIO bytes (Mpsse_ResponseBytes), and the
+ * collect buffers must hold that much per frame.
+ *
+ * The USB side is a Transport (pmu_transport.h), the backend the config
+ * names; nothing here calls D2XX directly.
+ *
+ * Batches are queued (SPI_QueueBatch) ahead of being collected
+ * (SPI_CollectBatch), so several can be in flight in the device;
+ * SPI_ReceiveBatch does both. The command programs come from a cache built
+ * once per batch size (pmu_mpsse.h). Every batch's write, wait and read times
+ * go into the device's histograms, and a failed call leaves its D2XX status in
+ * lastStatus for the caller's error recovery: SPI_FlushPipeline, SPI_Resync
+ * and SPI_Reopen, in escalating order.
+ */
+
+#ifndef PMU_SPI_H
+#define PMU_SPI_H
+
+#include <stdbool.h>
+
+#include "pmu_transport.h"
+#include "pmu_mpsse.h"
+#include "pmu_calib.h"
+#include "pmu_time.h"
+
+// Completion of a batch read
+#define WAIT_POLL               0       // Fixed sleep, then poll the queue (legacy)
+#define WAIT_EVENT              1       // Sleep on FT_EVENT_RXCHAR until the bytes arrive
+
+#define SPI_DEFAULT_DIVISOR     4       // Uncalibrated default, 60/((1+4)*2) = 6MHz
+#define SPI_USB_TRANSFER_MAX    65536   // Largest USB transfer size
+#define SPI_DEFAULT_LATENCY_MS  2       // Latency timer, flushes a partial USB packet
+#define SPI_DEFAULT_TIMEOUT_MS  5000    // Driver read and write timeouts
+#define SPI_INPUT_BUFFER_SIZE   131072  // Stale bytes drained while synchronizing
+#define SPI_MAX_CHANNELS        2       // MPSSE channels of an FT2232H or FT4232H
+#define SPI_DEFAULT_READY_HZ    1000    // Data-ready strobe rate assumed if none is given
+
+typedef struct {
+    char serial[CALIB_SERIAL_LENGTH];   // Device to open, empty for the first with an MPSSE
+    MpsseFrame frame;           // SPI mode, chip select policy, frame length
+    int maxBatchFrames;         // Largest batch that will be queued
+    ClockSetting clock;         // SCK, unless calibrated for the device
+    bool useCalibration;        // Take the clock saved for the device's serial number
+    ULONG usbTransferSize;      // FT_SetUSBParameters, both directions
+    UCHAR latencyMs;            // FT_SetLatencyTimer
+    DWORD timeoutMs;            // FT_SetTimeouts, both directions
+    int waitMode;               // WAIT_EVENT or WAIT_POLL
+    int transport;              // TRANSPORT_D2XX
+    double readyHz;             // Data-ready strobe rate with frame.dataReady, its lowest if unsure
+} SpiConfig;
+
+// Per-batch latencies, recorded by the thread driving the device
+typedef struct {
+    Histogram write;            // FT_Write of the batch's commands
+    Histogram wait;             // Waiting for the batch's bytes to arrive
+    Histogram read;             // FT_Read calls moving the bytes
+    Histogram batch;            // Whole collection of a batch, wait plus read
+} SpiLatency;
+
+typedef struct {
+    Transport transport;        // USB access, transport.open false while closed
+    SpiConfig config;
+    char serial[CALIB_SERIAL_LENGTH];   // Empty if the device has none
+    FT_DEVICE type;             // FT_DEVICE_232H, or the chip the channel belongs to
+    char channel;               // 'A' or 'B' on a multi-channel chip, 0 otherwise
+    ClockSetting clock;         // SCK in use
+    unsigned int clockHz;
+    bool clockCalibrated;       // clock came from the calibration file
+    int waitMode;               // The configured one, or poll without RX events
+    bool rxEventEnabled;
+    FT_STATUS lastStatus;       // Cause of the last failed SPI_* call
+    unsigned long long queuedBytes;     // Response bytes queued and not yet collected
+    bool streamQueued;          // Stream chunks among them rather than frame reads
+    MpsseCache programs;        // Batch read commands by batch size
+    SpiLatency latency;
+    UCHAR* input;               // SPI_INPUT_BUFFER_SIZE bytes
+} SpiDevice;
+
+void SPI_DefaultConfig(SpiConfig* config, const MpsseFrame* frame, int maxBatchFrames);
+int SPI_FindChannels(int transport, const char* serial, char channels[][CALIB_SERIAL_LENGTH], int maxChannels);
+bool SPI_Open(SpiDevice* device, const SpiConfig* config);
+void SPI_Close(SpiDevice* device);
+
+bool SPI_SynchronizeMPSSE(SpiDevice* device);
+bool SPI_ConfigureSPI(SpiDevice* device);
+bool SPI_SetClock(SpiDevice* device, const ClockSetting* setting);
+bool SPI_SetMode(SpiDevice* device, int mode);
+bool SPI_SetUsbParameters(SpiDevice* device, ULONG transferSize, UCHAR latencyMs);
+
+int SPI_ReceiveBatch(SpiDevice* device, int numFrames, UCHAR* dataBuffer, int bufferSize);
+bool SPI_QueueBatch(SpiDevice* device, int numFrames);
+int SPI_CollectBatch(SpiDevice* device, int numFrames, UCHAR* dataBuffer, int bufferSize);
+bool SPI_QueueStream(SpiDevice* device, int numBytes);
+int SPI_CollectBytes(SpiDevice* device, UCHAR* buffer, int numBytes);
+
+bool SPI_FlushPipeline(SpiDevice* device);
+bool SPI_Resync(SpiDevice* device);
+bool SPI_Reopen(SpiDevice* device);
+
+unsigned long long SPI_LineNs(const SpiDevice* device, int numBytes);
+DWORD SPI_TransferTimeoutMs(const SpiDevice* device, int numBytes);
+const char* SPI_StatusName(FT_STATUS status);
+void SPI_PrintLatency(const SpiDevice* device);
+
+#endif // PMU_SPI_H
@@ -0,0 +1,51 @@
+/*
+ * pmu_thread.c
+ * Scheduling controls for the acquisition thread: CPU pinning and real-time priority
+ */
+
+#ifndef _WIN32
+    #define _GNU_SOURCE         // pthread_setaffinity_np, CPU_SET
+#endif
+
+#include <string.h>
+
+#include "pmu_thread.h"
+
+// Pins the calling thread to one CPU, false if the CPU does not exist or
+// the call is not allowed
+bool Thread_PinToCpu(int cpu)
+{
+#ifdef _WIN32
+    if (cpu < 0 || cpu >= (int)(sizeof(DWORD_PTR) * 8)) return false;
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// Moves the calling thread to the real-time class: SCHED_FIFO at the given
+// priority (clamped to the valid range), or time-critical priority on Windows.
+// Without the privilege (CAP_SYS_NICE or an rtprio limit) it stays as it was.
+bool Thread_SetRealtime(int priority)
+{
+#ifdef _WIN32
+    (void)priority;
+    return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#else
+    struct sched_param param;
+    int minPriority = sched_get_priority_min(SCHED_FIFO);
+    int maxPriority = sched_get_priority_max(SCHED_FIFO);
+    
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority < minPriority ? minPriority :
+                           priority > maxPriority ? maxPriority : priority;
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#endif
+}
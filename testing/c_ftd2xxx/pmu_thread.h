@@ -0,0 +1,59 @@
+/*
+ * pmu_thread.h
+ * Minimal thread and atomics portability layer for the SPI readers
+ *
+ * Windows builds use CreateThread, everything else uses pthreads.
+ * Atomics come from C11 <stdatomic.h> (gcc/MinGW, clang, MSVC 17.5+).
+ * CPU pinning and real-time priority are in pmu_thread.c.
+ */
+
+#ifndef PMU_THREAD_H
+#define PMU_THREAD_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    typedef HANDLE PMU_THREAD;
+    typedef DWORD PMU_THREAD_RET;
+    #define PMU_THREAD_CALL WINAPI
+    #define THREAD_YIELD() SwitchToThread()
+    #define THREAD_SLEEP_MS(ms) Sleep(ms)
+#else
+    #include <pthread.h>
+    #include <sched.h>
+    #include <unistd.h>
+    typedef pthread_t PMU_THREAD;
+    typedef void* PMU_THREAD_RET;
+    #define PMU_THREAD_CALL
+    #define THREAD_YIELD() sched_yield()
+    #define THREAD_SLEEP_MS(ms) usleep((ms) * 1000)
+#endif
+
+typedef PMU_THREAD_RET (PMU_THREAD_CALL *PMU_THREAD_FN)(void* arg);
+
+static inline bool Thread_Start(PMU_THREAD* thread, PMU_THREAD_FN fn, void* arg)
+{
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, fn, arg) == 0;
+#endif
+}
+
+static inline void Thread_Join(PMU_THREAD thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+bool Thread_PinToCpu(int cpu);
+bool Thread_SetRealtime(int priority);
+
+#endif // PMU_THREAD_H
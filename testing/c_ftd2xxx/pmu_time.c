@@ -0,0 +1,152 @@
+/*
+ * pmu_time.c
+ * Monotonic nanosecond clock and log-bucketed latency histograms
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+#include "pmu_time.h"
+
+unsigned long long Time_NowNs(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+
+    // Split to keep counter * 1e9 from overflowing
+    unsigned long long ticks = (unsigned long long)counter.QuadPart;
+    unsigned long long hz = (unsigned long long)frequency.QuadPart;
+    return ticks / hz * 1000000000ULL + ticks % hz * 1000000000ULL / hz;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+unsigned long long Time_NowUs(void)
+{
+    return Time_NowNs() / 1000;
+}
+
+// Unix time in nanoseconds
+unsigned long long Time_WallNs(void)
+{
+#ifdef _WIN32
+    FILETIME fileTime;
+    GetSystemTimePreciseAsFileTime(&fileTime);
+    unsigned long long ticks = ((unsigned long long)fileTime.dwHighDateTime << 32) | fileTime.dwLowDateTime;
+    return (ticks - 116444736000000000ULL) * 100;     // 100 ns ticks since 1601
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+// User plus kernel time of all threads of the process
+unsigned long long Time_CpuNs(void)
+{
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+    unsigned long long kernelTicks = ((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    unsigned long long userTicks = ((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (kernelTicks + userTicks) * 100;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+void Histogram_Init(Histogram* histogram, const char* name)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->name = name;
+    histogram->minNs = ~0ULL;
+}
+
+// Values below 2 * HISTOGRAM_SUB_BUCKETS are exact, above that each power of
+// two is split into HISTOGRAM_SUB_BUCKETS equal buckets
+static int Histogram_Bucket(unsigned long long ns)
+{
+    int shift = 0;
+    while ((ns >> shift) >= 2 * HISTOGRAM_SUB_BUCKETS) {
+        shift++;
+    }
+    int bucket = shift * HISTOGRAM_SUB_BUCKETS + (int)(ns >> shift);
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value that falls into a bucket
+static unsigned long long Histogram_BucketLimit(int bucket)
+{
+    if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (unsigned long long)bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    unsigned long long base = (unsigned long long)(bucket % HISTOGRAM_SUB_BUCKETS +
+                                                   HISTOGRAM_SUB_BUCKETS) << shift;
+    return base + (1ULL << shift) - 1;
+}
+
+void Histogram_Record(Histogram* histogram, unsigned long long ns)
+{
+    histogram->counts[Histogram_Bucket(ns)]++;
+    histogram->count++;
+    histogram->sumNs += ns;
+    if (ns < histogram->minNs) histogram->minNs = ns;
+    if (ns > histogram->maxNs) histogram->maxNs = ns;
+}
+
+// Upper edge of the bucket holding the given percentile, never above the maximum
+unsigned long long Histogram_Percentile(const Histogram* histogram, double percent)
+{
+    if (histogram->count == 0) return 0;
+
+    unsigned long long rank = (unsigned long long)(histogram->count * percent / 100.0);
+    if (rank >= histogram->count) rank = histogram->count - 1;
+
+    unsigned long long seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if (seen > rank) {
+            unsigned long long limit = Histogram_BucketLimit(bucket);
+            return limit < histogram->maxNs ? limit : histogram->maxNs;
+        }
+    }
+    return histogram->maxNs;
+}
+
+void Histogram_PrintHeader(void)
+{
+    printf("  %-10s %10s %10s %10s %10s %10s %10s   (us)\n",
+           "", "count", "mean", "p50", "p99", "p99.9", "max");
+}
+
+void Histogram_Print(const Histogram* histogram)
+{
+    if (histogram->count == 0) {
+        printf("  %-10s %10d %10s %10s %10s %10s %10s\n", histogram->name, 0, "-", "-", "-", "-", "-");
+        return;
+    }
+    printf("  %-10s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           histogram->name, histogram->count,
+           (double)histogram->sumNs / histogram->count / 1000.0,
+           Histogram_Percentile(histogram, 50.0) / 1000.0,
+           Histogram_Percentile(histogram, 99.0) / 1000.0,
+           Histogram_Percentile(histogram, 99.9) / 1000.0,
+           histogram->maxNs / 1000.0);
+}
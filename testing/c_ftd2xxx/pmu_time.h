@@ -0,0 +1,41 @@
+/*
+ * pmu_time.h
+ * Monotonic nanosecond clock and log-bucketed latency histograms
+ *
+ * Time_NowNs uses QueryPerformanceCounter on Windows and CLOCK_MONOTONIC
+ * everywhere else, so durations are wall time and never jump with the
+ * system clock; Time_WallNs is only for labelling when a capture started.
+ * Time_CpuNs is the CPU time used by the whole process, all threads.
+ * Histograms keep 32 linear sub-buckets per power of two
+ * (at most 1/32 relative error) from 1 ns up to several hours, in a fixed
+ * array, so recording is cheap and never allocates.
+ */
+
+#ifndef PMU_TIME_H
+#define PMU_TIME_H
+
+#define HISTOGRAM_SUB_BITS      5
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       (44 * HISTOGRAM_SUB_BUCKETS)    // Up to 2^48 ns
+
+typedef struct {
+    const char* name;
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    unsigned long long count;
+    unsigned long long sumNs;
+    unsigned long long minNs;
+    unsigned long long maxNs;
+} Histogram;
+
+unsigned long long Time_NowNs(void);
+unsigned long long Time_NowUs(void);
+unsigned long long Time_WallNs(void);
+unsigned long long Time_CpuNs(void);
+
+void Histogram_Init(Histogram* histogram, const char* name);
+void Histogram_Record(Histogram* histogram, unsigned long long ns);
+unsigned long long Histogram_Percentile(const Histogram* histogram, double percent);
+void Histogram_PrintHeader(void);
+void Histogram_Print(const Histogram* histogram);
+
+#endif // PMU_TIME_H
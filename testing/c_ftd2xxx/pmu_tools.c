@@ -0,0 +1,588 @@
+/*
+ * pmu_tools.c
+ * Device measurements of ft232h_spi_reader run instead of a capture
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pmu_tools.h"
+#include "pmu_pipeline.h"
+#include "pmu_mem.h"
+#include "pmu_time.h"
+#include "pmu_ber.h"
+
+#define BENCH_BATCHES           50      // Batches per wait mode in --bench-wait
+
+// USB tuning sweep: every combination of the values below
+#define SWEEP_NEAR_BEST         0.98    // Within this share of the best rate, less CPU wins
+#define SWEEP_OUT_PATH          "USBSweep.csv"
+
+// Clock calibration: every divisor from 0 (30 MHz) up to the default, with and
+// without three-phase clocking
+#define CALIBRATE_BATCHES       10      // Batches measured per clock setting
+#define CALIBRATE_MAX_DIVISOR   SPI_DEFAULT_DIVISOR
+#define CALIBRATE_SETTINGS      ((CALIBRATE_MAX_DIVISOR + 1) * 2)
+
+// Link bit error rate test: the calibration's clock settings on both SCK edges
+#define BER_EDGES               2
+#define BER_OUT_PATH            "BERTest.csv"
+
+static const ULONG SweepTransferSizes[] = { 4096, 16384, 65536 };
+static const UCHAR SweepLatencies[] = { 1, 2, 16 };
+static const int SweepBatchSizes[] = { 100, 500, 2000 };
+static const int SweepInflight[] = { 1, 2, 4 };
+
+// Compare the batch-to-batch gap (time SCK is idle per batch) of both wait modes
+void Tools_WaitBenchmark(SpiDevice* device, int batchSize)
+{
+    static const int modes[2] = { WAIT_POLL, WAIT_EVENT };
+    static const char* modeNames[2] = { "poll", "event" };
+    double lineMs = SPI_LineNs(device, batchSize * BYTES_PER_SAMPLE) / 1e6;
+    int savedMode = device->waitMode;
+    
+    UCHAR* buffer = (UCHAR*)Mem_Alloc(batchSize * BYTES_PER_SAMPLE);
+    if (!buffer) {
+        printf("Failed to allocate benchmark buffer\n");
+        return;
+    }
+    
+    printf("\n=== WAIT MODE BENCHMARK ===\n");
+    printf("%d batches of %d samples per mode, line time %.2f ms per batch\n\n",
+           BENCH_BATCHES, batchSize, lineMs);
+    printf("Mode    Avg batch ms  Avg gap ms  Max gap ms  Short batches  Samples/s\n");
+    
+    for (int m = 0; m < 2; m++) {
+        if (modes[m] == WAIT_EVENT && !device->rxEventEnabled) {
+            printf("%-6s  (event notification not available)\n", modeNames[m]);
+            continue;
+        }
+        
+        // Start each mode from empty queues
+        THREAD_SLEEP_MS(20);
+        Transport_Purge(&device->transport, FT_PURGE_RX | FT_PURGE_TX);
+        device->waitMode = modes[m];
+        
+        double sumBatchMs = 0.0, sumGapMs = 0.0, maxGapMs = 0.0;
+        int shortBatches = 0;
+        long samples = 0;
+        unsigned long long modeStart = Time_NowUs();
+        
+        for (int b = 0; b < BENCH_BATCHES; b++) {
+            unsigned long long batchStart = Time_NowUs();
+            int received = SPI_ReceiveBatch(device, batchSize, buffer, batchSize * BYTES_PER_SAMPLE);
+            double batchMs = (Time_NowUs() - batchStart) / 1000.0;
+            
+            if (received < 0) {
+                printf("Error: Benchmark batch failed\n");
+                break;
+            }
+            if (received < batchSize) shortBatches++;
+            
+            // Idle time is measured against the bytes actually clocked in
+            double gapMs = batchMs - lineMs * received / batchSize;
+            samples += received;
+            sumBatchMs += batchMs;
+            sumGapMs += gapMs;
+            if (gapMs > maxGapMs) maxGapMs = gapMs;
+        }
+        
+        double totalSec = (Time_NowUs() - modeStart) / 1e6;
+        printf("%-6s  %12.2f  %10.2f  %10.2f  %13d  %9.0f\n",
+               modeNames[m], sumBatchMs / BENCH_BATCHES, sumGapMs / BENCH_BATCHES, maxGapMs,
+               shortBatches, samples / totalSec);
+    }
+    
+    device->waitMode = savedMode;
+    Mem_Free(buffer);
+}
+
+// One combination of the USB sweep and what it achieved
+typedef struct {
+    ULONG transferSize;
+    UCHAR latencyMs;
+    int batchSize;
+    int inflight;
+    double framesPerSec;
+    double cpuPercent;          // Whole process, so D2XX (or simulator) threads count too
+    double p50Ms, p99Ms, maxMs; // From writing a batch's commands to having its data
+    int shortBatches;
+    bool failed;
+    bool recommended;
+} SweepResult;
+
+// Pipelined batch reads with one setting for measureMs, without decoding
+static void SweepMeasure(SpiDevice* device, SweepResult* result, UCHAR* buffer, int measureMs)
+{
+    static Histogram latency;
+    unsigned long long queuedNs[MAX_INFLIGHT_BATCHES];
+    int head = 0, pending = 0;
+    long long frames = 0;
+    
+    Histogram_Init(&latency, "batch");
+    if (!SPI_SetUsbParameters(device, result->transferSize, result->latencyMs) ||
+        !SPI_FlushPipeline(device)) {
+        result->failed = true;
+        return;
+    }
+    
+    unsigned long long startNs = Time_NowNs();
+    unsigned long long endNs = startNs + measureMs * 1000000ULL;
+    unsigned long long cpuStartNs = Time_CpuNs();
+    unsigned long long nowNs = startNs;
+    
+    while (nowNs < endNs && !StopRequested) {
+        while (pending < result->inflight) {
+            queuedNs[(head + pending) % MAX_INFLIGHT_BATCHES] = Time_NowNs();
+            if (!SPI_QueueBatch(device, result->batchSize)) {
+                result->failed = true;
+                return;
+            }
+            pending++;
+        }
+        
+        int received = SPI_CollectBatch(device, result->batchSize, buffer, result->batchSize * BYTES_PER_SAMPLE);
+        nowNs = Time_NowNs();
+        if (received < 0) {
+            result->failed = true;
+            return;
+        }
+        Histogram_Record(&latency, nowNs - queuedNs[head]);
+        head = (head + 1) % MAX_INFLIGHT_BATCHES;
+        pending--;
+        frames += received;
+        
+        if (received < result->batchSize) {
+            result->shortBatches++;
+            SPI_FlushPipeline(device);
+            pending = 0;
+        }
+    }
+    
+    double seconds = (nowNs - startNs) / 1e9;
+    result->framesPerSec = frames / seconds;
+    result->cpuPercent = (Time_CpuNs() - cpuStartNs) / 1e7 / seconds;
+    result->p50Ms = Histogram_Percentile(&latency, 50.0) / 1e6;
+    result->p99Ms = Histogram_Percentile(&latency, 99.0) / 1e6;
+    result->maxMs = latency.maxNs / 1e6;
+    
+    // Batches still queued are not part of the measurement
+    SPI_FlushPipeline(device);
+}
+
+// Grid over the USB transfer size, latency timer, batch size and batches in
+// flight. The recommendation is the cheapest (CPU, then p99 latency) of the
+// error-free combinations within SWEEP_NEAR_BEST of the highest frame rate.
+void Tools_UsbSweep(SpiDevice* device, int measureMs)
+{
+    static SweepResult results[sizeof(SweepTransferSizes) / sizeof(SweepTransferSizes[0]) *
+                               sizeof(SweepLatencies) / sizeof(SweepLatencies[0]) *
+                               sizeof(SweepBatchSizes) / sizeof(SweepBatchSizes[0]) *
+                               sizeof(SweepInflight) / sizeof(SweepInflight[0])];
+    int resultCount = 0;
+    
+    int maxBatch = 0;
+    for (size_t b = 0; b < sizeof(SweepBatchSizes) / sizeof(SweepBatchSizes[0]); b++) {
+        if (SweepBatchSizes[b] > maxBatch) maxBatch = SweepBatchSizes[b];
+    }
+    UCHAR* buffer = (UCHAR*)Mem_Alloc(maxBatch * BYTES_PER_SAMPLE);
+    if (!buffer) {
+        printf("Failed to allocate sweep buffer\n");
+        return;
+    }
+    
+    printf("\n=== USB TRANSFER SWEEP ===\n");
+    printf("%d ms per combination, SCK %.3f MHz, %s wait\n\n", measureMs, device->clockHz / 1e6,
+           device->waitMode == WAIT_EVENT ? "event" : "poll");
+    printf("Transfer  Latency  Batch  In flight   Frames/s  Line use   CPU %%   p50 ms   p99 ms   "
+           "Max ms  Short\n");
+    
+    for (size_t t = 0; t < sizeof(SweepTransferSizes) / sizeof(SweepTransferSizes[0]); t++) {
+        for (size_t l = 0; l < sizeof(SweepLatencies) / sizeof(SweepLatencies[0]); l++) {
+            for (size_t b = 0; b < sizeof(SweepBatchSizes) / sizeof(SweepBatchSizes[0]); b++) {
+                for (size_t f = 0; f < sizeof(SweepInflight) / sizeof(SweepInflight[0]); f++) {
+                    // Same RX budget as the capture itself
+                    if (SweepInflight[f] * SweepBatchSizes[b] * BYTES_PER_SAMPLE > INFLIGHT_BYTES_MAX ||
+                        StopRequested) {
+                        continue;
+                    }
+                    
+                    SweepResult* result = &results[resultCount++];
+                    memset(result, 0, sizeof(*result));
+                    result->transferSize = SweepTransferSizes[t];
+                    result->latencyMs = SweepLatencies[l];
+                    result->batchSize = SweepBatchSizes[b];
+                    result->inflight = SweepInflight[f];
+                    SweepMeasure(device, result, buffer, measureMs);
+                    
+                    printf("%8lu  %7u  %5d  %9d  ", (unsigned long)result->transferSize,
+                           result->latencyMs, result->batchSize, result->inflight);
+                    if (result->failed) {
+                        printf("(failed)\n");
+                    } else {
+                        printf("%9.0f  %7.1f%%  %6.1f  %7.2f  %7.2f  %7.2f  %5d\n",
+                               result->framesPerSec,
+                               result->framesPerSec * BYTES_PER_SAMPLE * 8 * 100.0 / device->clockHz,
+                               result->cpuPercent, result->p50Ms, result->p99Ms, result->maxMs,
+                               result->shortBatches);
+                    }
+                }
+            }
+        }
+    }
+    
+    double bestRate = 0.0;
+    for (int i = 0; i < resultCount; i++) {
+        if (!results[i].failed && results[i].shortBatches == 0 && results[i].framesPerSec > bestRate) {
+            bestRate = results[i].framesPerSec;
+        }
+    }
+    SweepResult* best = NULL;
+    for (int i = 0; i < resultCount; i++) {
+        SweepResult* result = &results[i];
+        if (result->failed || result->shortBatches > 0 ||
+            result->framesPerSec < bestRate * SWEEP_NEAR_BEST) {
+            continue;
+        }
+        if (!best || result->cpuPercent < best->cpuPercent ||
+            (result->cpuPercent == best->cpuPercent && result->p99Ms < best->p99Ms)) {
+            best = result;
+        }
+    }
+    if (best) best->recommended = true;
+    
+    FILE* file = fopen(SWEEP_OUT_PATH, "w");
+    if (file) {
+        fprintf(file, "transfer_bytes,latency_ms,batch_frames,inflight,frames_per_s,line_use,"
+                      "cpu_percent,p50_ms,p99_ms,max_ms,short_batches,failed,recommended\n");
+        for (int i = 0; i < resultCount; i++) {
+            const SweepResult* result = &results[i];
+            fprintf(file, "%lu,%u,%d,%d,%.0f,%.4f,%.2f,%.3f,%.3f,%.3f,%d,%d,%d\n",
+                    (unsigned long)result->transferSize, result->latencyMs, result->batchSize,
+                    result->inflight, result->framesPerSec,
+                    result->framesPerSec * BYTES_PER_SAMPLE * 8 / device->clockHz, result->cpuPercent,
+                    result->p50Ms, result->p99Ms, result->maxMs, result->shortBatches,
+                    result->failed ? 1 : 0, result->recommended ? 1 : 0);
+        }
+        fclose(file);
+        printf("\nResults written to %s\n", SWEEP_OUT_PATH);
+    } else {
+        printf("\nError: Failed to write %s\n", SWEEP_OUT_PATH);
+    }
+    
+    if (best) {
+        printf("Recommended: %d --inflight=%d --usb-transfer=%lu --latency=%u "
+               "(%.0f frames/s, %.1f%% CPU, p99 %.2f ms)\n",
+               best->batchSize, best->inflight, (unsigned long)best->transferSize, best->latencyMs,
+               best->framesPerSec, best->cpuPercent, best->p99Ms);
+    } else {
+        printf("No combination ran without errors or short batches\n");
+    }
+    
+    Mem_Free(buffer);
+}
+
+// The clock settings calibration and the link test go through, fastest SCK first
+static int CalibrationSettings(ClockSetting* settings)
+{
+    int settingCount = 0;
+    for (unsigned int divisor = 0; divisor <= CALIBRATE_MAX_DIVISOR; divisor++) {
+        for (int threePhase = 0; threePhase <= 1; threePhase++) {
+            settings[settingCount].divisor = divisor;
+            settings[settingCount].threePhase = threePhase != 0;
+            settingCount++;
+        }
+    }
+    
+    // Fastest SCK first
+    for (int i = 1; i < settingCount; i++) {
+        ClockSetting setting = settings[i];
+        int j = i;
+        while (j > 0 && Calib_SckHz(&settings[j - 1]) < Calib_SckHz(&setting)) {
+            settings[j] = settings[j - 1];
+            j--;
+        }
+        settings[j] = setting;
+    }
+    return settingCount;
+}
+
+// Step through the clock settings from the fastest down, measure the checksum
+// pass rate and throughput of each, keep the fastest error-free one and store
+// it for this device's serial number
+void Tools_CalibrateClock(SpiDevice* device, int batchSize)
+{
+    ClockSetting settings[CALIBRATE_SETTINGS];
+    int settingCount = CalibrationSettings(settings);
+    
+    UCHAR* buffer = (UCHAR*)Mem_Alloc(batchSize * BYTES_PER_SAMPLE);
+    UCHAR* frames = (UCHAR*)Mem_Alloc(batchSize * BYTES_PER_SAMPLE);
+    Framer* framer = (Framer*)Mem_Alloc(sizeof(Framer));
+    if (!buffer || !frames || !framer) {
+        printf("Failed to allocate calibration buffers\n");
+        Mem_Free(buffer);
+        Mem_Free(frames);
+        Mem_Free(framer);
+        return;
+    }
+    
+    ClockSetting original = device->clock;
+    ClockSetting best;
+    double bestRate = 0.0;
+    bool found = false;
+    
+    printf("\n=== SPI CLOCK CALIBRATION ===\n");
+    printf("%d batches of %d samples per setting\n\n", CALIBRATE_BATCHES, batchSize);
+    printf("Divisor  3-phase  SCK MHz    Frames  Bad frames  Pass rate  Samples/s  Result\n");
+    
+    for (int s = 0; s < settingCount && !StopRequested; s++) {
+        const ClockSetting* setting = &settings[s];
+        SPI_FlushPipeline(device);
+        if (!SPI_SetClock(device, setting)) {
+            printf("Error: Failed to set the SPI clock\n");
+            break;
+        }
+        Framer_Init(framer);
+        
+        long received = 0;
+        int shortBatches = 0;
+        bool failed = false;
+        unsigned long long start = Time_NowNs();
+        
+        for (int b = 0; b < CALIBRATE_BATCHES; b++) {
+            int samples = SPI_ReceiveBatch(device, batchSize, buffer, batchSize * BYTES_PER_SAMPLE);
+            if (samples < 0) {
+                failed = true;
+                break;
+            }
+            if (samples < batchSize) {
+                // Let the rest of the batch go before the next one starts
+                shortBatches++;
+                SPI_FlushPipeline(device);
+            }
+            received += samples;
+            
+            int offset = 0;
+            int length = samples * BYTES_PER_SAMPLE;
+            while (offset < length) {
+                int consumed;
+                int count = Framer_Process(framer, buffer + offset, length - offset,
+                                           frames, batchSize, &consumed);
+                offset += consumed;
+                if (consumed == 0 && count == 0) break;
+            }
+        }
+        double seconds = (Time_NowNs() - start) / 1e9;
+        
+        // Every frame after the initial lock must pass its checksum
+        unsigned long long good = framer->framesOut;
+        unsigned long long bad = received > (long)good ? received - good : 0;
+        bool errorFree = !failed && shortBatches == 0 && good > 0 &&
+                         framer->checksumErrors == 0 && framer->resyncs == 0;
+        double rate = seconds > 0.0 ? received / seconds : 0.0;
+        
+        printf("%7u  %7s  %7.3f  %8ld  %10llu  %8.4f%%  %9.0f  %s\n",
+               setting->divisor, setting->threePhase ? "yes" : "no", Calib_SckHz(setting) / 1e6,
+               received, bad, received > 0 ? good * 100.0 / received : 0.0, rate,
+               failed ? "read failed" : errorFree ? "ok" : "errors");
+        
+        if (errorFree && rate > bestRate) {
+            best = *setting;
+            bestRate = rate;
+            found = true;
+        }
+    }
+    
+    SPI_FlushPipeline(device);
+    if (!found) {
+        printf("\nNo error-free setting found, keeping divisor %u\n", original.divisor);
+        SPI_SetClock(device, &original);
+    } else {
+        SPI_SetClock(device, &best);
+        printf("\nFastest error-free setting: divisor %u%s, SCK %.3f MHz, %.0f samples/s\n",
+               best.divisor, best.threePhase ? " with three-phase clocking" : "",
+               Calib_SckHz(&best) / 1e6, bestRate);
+        if (device->serial[0] == '\0') {
+            printf("Device has no serial number, setting not saved\n");
+        } else if (Calib_Save(CALIB_PATH, device->serial, &best)) {
+            printf("Saved for device %s in %s\n", device->serial, CALIB_PATH);
+        } else {
+            printf("Error: Failed to save the calibration to %s\n", CALIB_PATH);
+        }
+    }
+    
+    Mem_Free(buffer);
+    Mem_Free(frames);
+    Mem_Free(framer);
+}
+
+// One clock setting and SCK edge of the link test and what it measured
+typedef struct {
+    ClockSetting clock;
+    int mode;                   // SPI mode the setting was measured in
+    BerCheck check;
+    unsigned long resyncs;      // Framer locks lost to checksum failures
+    int shortBatches;
+    bool failed;
+} BerResult;
+
+// Sampling edge of an SPI mode: CPOL^CPHA clear samples on the rising edge
+static const char* BerEdgeName(int mode)
+{
+    return (((mode >> 1) ^ mode) & 1) ? "falling" : "rising";
+}
+
+// With the FPGA sending a test pattern (pmu_ber.h), read for measureMs at
+// every clock setting of the calibration on both SCK sampling edges and count
+// the bit errors. Reports the fastest error-free setting without saving it
+// and leaves the clock and SPI mode as they were.
+void Tools_BerTest(SpiDevice* device, int batchSize, int measureMs, int pattern)
+{
+    ClockSetting settings[CALIBRATE_SETTINGS];
+    int settingCount = CalibrationSettings(settings);
+    int resultCount = 0;
+    
+    UCHAR* buffer = (UCHAR*)Mem_Alloc(batchSize * BYTES_PER_SAMPLE);
+    UCHAR* frames = (UCHAR*)Mem_Alloc(batchSize * BYTES_PER_SAMPLE);
+    Framer* framer = (Framer*)Mem_Alloc(sizeof(Framer));
+    BerResult* results = (BerResult*)Mem_Alloc(sizeof(BerResult) * CALIBRATE_SETTINGS * BER_EDGES);
+    if (!buffer || !frames || !framer || !results) {
+        printf("Failed to allocate link test buffers\n");
+        Mem_Free(buffer);
+        Mem_Free(frames);
+        Mem_Free(framer);
+        Mem_Free(results);
+        return;
+    }
+    
+    ClockSetting original = device->clock;
+    int originalMode = device->config.frame.mode;
+    
+    printf("\n=== LINK BIT ERROR RATE TEST ===\n");
+    printf("Pattern %s, %d ms per setting, batches of %d frames\n\n",
+           Ber_PatternName(pattern), measureMs, batchSize);
+    printf("Divisor  3-phase  Edge     SCK MHz         Bits  Errors  BER        Bursts  Largest  Gaps  Resyncs  Lock lost\n");
+    
+    for (int s = 0; s < settingCount && !StopRequested; s++) {
+        for (int e = 0; e < BER_EDGES && !StopRequested; e++) {
+            BerResult* result = &results[resultCount];
+            memset(result, 0, sizeof(*result));
+            result->clock = settings[s];
+            result->mode = (originalMode & 2) | e;
+            
+            SPI_FlushPipeline(device);
+            if (!SPI_SetMode(device, result->mode) || !SPI_SetClock(device, &result->clock)) {
+                printf("Error: Failed to set SPI mode %d at divisor %u\n", result->mode, result->clock.divisor);
+                s = settingCount;
+                break;
+            }
+            resultCount++;
+            Framer_Init(framer);
+            Ber_Init(&result->check, pattern);
+            
+            unsigned long long start = Time_NowNs();
+            while (Time_NowNs() - start < (unsigned long long)measureMs * 1000000ULL && !StopRequested) {
+                int samples = SPI_ReceiveBatch(device, batchSize, buffer, batchSize * BYTES_PER_SAMPLE);
+                if (samples < 0) {
+                    result->failed = true;
+                    break;
+                }
+                if (samples < batchSize) {
+                    // Let the rest of the batch go before the next one starts
+                    result->shortBatches++;
+                    SPI_FlushPipeline(device);
+                }
+                
+                int offset = 0;
+                int length = samples * BYTES_PER_SAMPLE;
+                while (offset < length) {
+                    int consumed;
+                    int count = Framer_Process(framer, buffer + offset, length - offset,
+                                               frames, batchSize, &consumed);
+                    Ber_Check(&result->check, frames, count);
+                    offset += consumed;
+                    if (consumed == 0 && count == 0) break;
+                }
+            }
+            result->resyncs = framer->resyncs;
+            
+            const BerCheck* check = &result->check;
+            char rate[16];
+            if (check->bits == 0) {
+                snprintf(rate, sizeof(rate), "-");
+            } else if (check->errors == 0) {
+                snprintf(rate, sizeof(rate), "<%.2e", Ber_UpperBound(check));
+            } else {
+                snprintf(rate, sizeof(rate), "%.3e", Ber_Rate(check));
+            }
+            printf("%7u  %7s  %-7s  %7.3f  %11llu  %6llu  %-9s  %6llu  %7llu  %4lu  %7lu  %9lu%s\n",
+                   result->clock.divisor, result->clock.threePhase ? "yes" : "no",
+                   BerEdgeName(result->mode), Calib_SckHz(&result->clock) / 1e6,
+                   check->bits, check->errors, rate, check->bursts, check->maxBurstErrors,
+                   check->gaps, result->resyncs, check->syncLosses, result->failed ? "  read failed" : "");
+        }
+    }
+    
+    SPI_FlushPipeline(device);
+    SPI_SetMode(device, originalMode);
+    SPI_SetClock(device, &original);
+    
+    // Settings with errors in detail
+    const BerResult* best = NULL;
+    for (int i = 0; i < resultCount; i++) {
+        const BerResult* result = &results[i];
+        const BerCheck* check = &result->check;
+        bool errorFree = !result->failed && result->shortBatches == 0 && check->bits > 0 &&
+                         check->errors == 0 && check->syncLosses == 0 && result->resyncs == 0;
+        if (errorFree && !best) best = result;
+        if (errorFree || check->bits == 0) continue;
+        
+        printf("\nDivisor %u%s, %s edge:\n", result->clock.divisor,
+               result->clock.threePhase ? " three-phase" : "", BerEdgeName(result->mode));
+        Ber_PrintStats(check);
+    }
+    
+    FILE* file = fopen(BER_OUT_PATH, "w");
+    if (file) {
+        fprintf(file, "divisor,three_phase,spi_mode,edge,sck_hz,frames,bits,errors,ber,error_frames,"
+                      "bursts,single_bursts,max_burst_errors,max_burst_bits,gaps,sync_losses,resyncs,"
+                      "short_batches,failed");
+        for (int p = 0; p < FRAME_BITS; p++) {
+            fprintf(file, ",bit%d", p);
+        }
+        fprintf(file, "\n");
+        for (int i = 0; i < resultCount; i++) {
+            const BerResult* result = &results[i];
+            const BerCheck* check = &result->check;
+            fprintf(file, "%u,%d,%d,%s,%u,%llu,%llu,%llu,%.3e,%llu,%llu,%llu,%llu,%llu,%lu,%lu,%lu,%d,%d",
+                    result->clock.divisor, result->clock.threePhase ? 1 : 0, result->mode,
+                    BerEdgeName(result->mode), Calib_SckHz(&result->clock), check->frames, check->bits,
+                    check->errors, Ber_Rate(check), check->errorFrames, check->bursts, check->singleBursts,
+                    check->maxBurstErrors, check->maxBurstBits, check->gaps, check->syncLosses, result->resyncs,
+                    result->shortBatches, result->failed ? 1 : 0);
+            for (int p = 0; p < FRAME_BITS; p++) {
+                fprintf(file, ",%llu", check->positions[p]);
+            }
+            fprintf(file, "\n");
+        }
+        fclose(file);
+        printf("\nResults written to %s\n", BER_OUT_PATH);
+    } else {
+        printf("\nError: Failed to write %s\n", BER_OUT_PATH);
+    }
+    
+    if (best) {
+        printf("Fastest error-free setting: divisor %u%s, SPI mode %d (%s edge), SCK %.3f MHz, "
+               "BER below %.2e\n",
+               best->clock.divisor, best->clock.threePhase ? " with three-phase clocking" : "",
+               best->mode, BerEdgeName(best->mode), Calib_SckHz(&best->clock) / 1e6,
+               Ber_UpperBound(&best->check));
+    } else {
+        printf("No setting ran without bit errors\n");
+    }
+    
+    Mem_Free(buffer);
+    Mem_Free(frames);
+    Mem_Free(framer);
+    Mem_Free(results);
+}
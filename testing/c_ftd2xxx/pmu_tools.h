@@ -0,0 +1,35 @@
+/*
+ * pmu_tools.h
+ * Device measurements of ft232h_spi_reader run instead of a capture
+ *
+ *   Tools_WaitBenchmark   Batch-to-batch gap of both wait modes (--bench-wait)
+ *   Tools_UsbSweep        Every combination of USB transfer size, latency
+ *                         timer, batch size and batches in flight, written to
+ *                         USBSweep.csv with a recommendation (--sweep)
+ *   Tools_CalibrateClock  Fastest SPI clock setting whose frames all pass
+ *                         their checksum, saved for the device's serial number
+ *                         in SPIClockCalibration.txt (--calibrate, pmu_calib.h)
+ *   Tools_BerTest         Bit error rate at every setting of the calibration
+ *                         on both SCK edges, with the FPGA sending pattern
+ *                         frames (--ber, pmu_ber.h), written to BERTest.csv
+ *
+ * The calibration only sees the frames that fail their checksum; the link
+ * test qualifies the cable and clock before a long capture by counting the
+ * bit errors themselves. Sampling MISO on the opposite SCK edge can leave a
+ * slow MISO line more time to settle. Each tool stops early on StopRequested.
+ */
+
+#ifndef PMU_TOOLS_H
+#define PMU_TOOLS_H
+
+#include "pmu_spi.h"
+
+#define SWEEP_DEFAULT_MS        500     // Measuring time per combination
+#define BER_DEFAULT_MS          1000    // Measuring time per setting
+
+void Tools_WaitBenchmark(SpiDevice* device, int batchSize);
+void Tools_UsbSweep(SpiDevice* device, int measureMs);
+void Tools_CalibrateClock(SpiDevice* device, int batchSize);
+void Tools_BerTest(SpiDevice* device, int batchSize, int measureMs, int pattern);
+
+#endif // PMU_TOOLS_H
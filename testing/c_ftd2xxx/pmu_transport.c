@@ -0,0 +1,289 @@
+/*
+ * pmu_transport.c
+ * Backend selection and the D2XX backend
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pmu_transport.h"
+#include "pmu_mem.h"
+
+static const char* const TransportNames[TRANSPORT_KINDS] = { "d2xx" };
+
+// The backend of a kind, NULL if it was not built in
+const TransportOps* Transport_Backend(int kind)
+{
+    switch (kind) {
+    case TRANSPORT_D2XX:
+        return &D2xxTransport;
+    default:
+        return NULL;
+    }
+}
+
+const char* Transport_Name(int kind)
+{
+    return kind >= 0 && kind < TRANSPORT_KINDS ? TransportNames[kind] : "unknown";
+}
+
+// Devices the backend sees, -1 if it cannot list them
+int Transport_List(int kind, TransportInfo* devices, int maxDevices)
+{
+    const TransportOps* ops = Transport_Backend(kind);
+    return ops ? ops->list(devices, maxDevices) : -1;
+}
+
+bool Transport_Create(Transport* transport, int kind)
+{
+    memset(transport, 0, sizeof(*transport));
+    transport->ops = Transport_Backend(kind);
+    if (!transport->ops) {
+        printf("Error: The %s transport is not built in\n", Transport_Name(kind));
+        return false;
+    }
+    return transport->ops->create(transport);
+}
+
+void Transport_Destroy(Transport* transport)
+{
+    if (!transport->ops) return;
+    Transport_Close(transport);
+    transport->ops->destroy(transport);
+    transport->ops = NULL;
+    transport->state = NULL;
+}
+
+// Open the device with this serial number, or the index-th of the listing if
+// serial is NULL or empty
+FT_STATUS Transport_Open(Transport* transport, const char* serial, int index)
+{
+    transport->type = FT_DEVICE_UNKNOWN;
+    transport->serial[0] = '\0';
+    FT_STATUS status = transport->ops->open(transport, serial && serial[0] != '\0' ? serial : NULL, index);
+    transport->open = (status == FT_OK);
+    return status;
+}
+
+void Transport_Close(Transport* transport)
+{
+    if (transport->open) {
+        transport->ops->close(transport);
+        transport->open = false;
+    }
+}
+
+// D2XX: FT_Read and FT_Write on a handle, received bytes announced by
+// FT_EVENT_RXCHAR
+typedef struct {
+    FT_HANDLE handle;
+#ifdef _WIN32
+    HANDLE rxEvent;
+#else
+    EVENT_HANDLE rxEvent;
+    bool rxEventCreated;
+#endif
+} D2xxState;
+
+static int D2xx_List(TransportInfo* devices, int maxDevices)
+{
+    DWORD numDevs;
+    int count = 0;
+
+    if (FT_CreateDeviceInfoList(&numDevs) != FT_OK) return -1;
+
+    for (DWORD i = 0; i < numDevs && count < maxDevices; i++) {
+        DWORD flags, type, id, locId;
+        char serial[TRANSPORT_SERIAL_LENGTH];
+        char description[64];
+        FT_HANDLE handle;
+        TransportInfo* device = &devices[count++];
+        memset(device, 0, sizeof(*device));
+        if (FT_GetDeviceInfoDetail(i, &flags, &type, &id, &locId, serial, description, &handle) != FT_OK) {
+            device->type = FT_DEVICE_UNKNOWN;
+            device->opened = true;
+            continue;
+        }
+        device->type = (FT_DEVICE)type;
+        snprintf(device->serial, sizeof(device->serial), "%s", serial);
+        device->opened = (flags & FT_FLAGS_OPENED) != 0;
+    }
+    return count;
+}
+
+static bool D2xx_Create(Transport* transport)
+{
+    transport->state = Mem_Calloc(1, sizeof(D2xxState));
+    return transport->state != NULL;
+}
+
+static void D2xx_Destroy(Transport* transport)
+{
+    D2xxState* state = (D2xxState*)transport->state;
+#ifdef _WIN32
+    if (state->rxEvent != NULL) CloseHandle(state->rxEvent);
+#else
+    if (state->rxEventCreated) {
+        pthread_cond_destroy(&state->rxEvent.eCondVar);
+        pthread_mutex_destroy(&state->rxEvent.eMutex);
+    }
+#endif
+    Mem_Free(state);
+}
+
+static FT_STATUS D2xx_Open(Transport* transport, const char* serial, int index)
+{
+    D2xxState* state = (D2xxState*)transport->state;
+    FT_STATUS status;
+
+    if (serial) {
+        status = FT_OpenEx((PVOID)serial, FT_OPEN_BY_SERIAL_NUMBER, &state->handle);
+    } else {
+        status = FT_Open(index, &state->handle);
+    }
+    if (status != FT_OK) {
+        state->handle = NULL;
+        return status;
+    }
+
+    DWORD deviceId;
+    char description[64];
+    if (FT_GetDeviceInfo(state->handle, &transport->type, &deviceId, transport->serial, description,
+                         NULL) != FT_OK) {
+        transport->serial[0] = '\0';
+    }
+    return FT_OK;
+}
+
+static void D2xx_Close(Transport* transport)
+{
+    D2xxState* state = (D2xxState*)transport->state;
+    FT_Close(state->handle);
+    state->handle = NULL;
+}
+
+static FT_STATUS D2xx_Reset(Transport* transport)
+{
+    return FT_ResetDevice(((D2xxState*)transport->state)->handle);
+}
+
+static FT_STATUS D2xx_Purge(Transport* transport, ULONG mask)
+{
+    return FT_Purge(((D2xxState*)transport->state)->handle, mask);
+}
+
+static FT_STATUS D2xx_SetUsbParameters(Transport* transport, ULONG transferSize)
+{
+    return FT_SetUSBParameters(((D2xxState*)transport->state)->handle, transferSize, transferSize);
+}
+
+static FT_STATUS D2xx_SetLatencyTimer(Transport* transport, UCHAR latencyMs)
+{
+    return FT_SetLatencyTimer(((D2xxState*)transport->state)->handle, latencyMs);
+}
+
+static FT_STATUS D2xx_SetTimeouts(Transport* transport, DWORD readMs, DWORD writeMs)
+{
+    return FT_SetTimeouts(((D2xxState*)transport->state)->handle, readMs, writeMs);
+}
+
+static FT_STATUS D2xx_DisableChars(Transport* transport)
+{
+    return FT_SetChars(((D2xxState*)transport->state)->handle, 0, false, 0, false);
+}
+
+static FT_STATUS D2xx_SetBitMode(Transport* transport, UCHAR mask, UCHAR mode)
+{
+    return FT_SetBitMode(((D2xxState*)transport->state)->handle, mask, mode);
+}
+
+static FT_STATUS D2xx_QueueStatus(Transport* transport, DWORD* bytesInQueue)
+{
+    return FT_GetQueueStatus(((D2xxState*)transport->state)->handle, bytesInQueue);
+}
+
+static FT_STATUS D2xx_Read(Transport* transport, UCHAR* buffer, DWORD length, DWORD* bytesRead)
+{
+    return FT_Read(((D2xxState*)transport->state)->handle, buffer, length, bytesRead);
+}
+
+static FT_STATUS D2xx_Write(Transport* transport, const UCHAR* buffer, DWORD length, DWORD* bytesWritten)
+{
+    return FT_Write(((D2xxState*)transport->state)->handle, (LPVOID)buffer, length, bytesWritten);
+}
+
+static bool D2xx_EnableRxEvent(Transport* transport)
+{
+    D2xxState* state = (D2xxState*)transport->state;
+    FT_STATUS ftStatus;
+
+#ifdef _WIN32
+    if (state->rxEvent == NULL) {
+        state->rxEvent = CreateEvent(NULL, FALSE, FALSE, NULL);     // Auto-reset
+        if (state->rxEvent == NULL) return false;
+    }
+    ftStatus = FT_SetEventNotification(state->handle, FT_EVENT_RXCHAR, state->rxEvent);
+#else
+    if (!state->rxEventCreated) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_mutex_init(&state->rxEvent.eMutex, NULL);
+        pthread_cond_init(&state->rxEvent.eCondVar, &attr);
+        pthread_condattr_destroy(&attr);
+        state->rxEventCreated = true;
+    }
+    ftStatus = FT_SetEventNotification(state->handle, FT_EVENT_RXCHAR, (PVOID)&state->rxEvent);
+#endif
+
+    return ftStatus == FT_OK;
+}
+
+static void D2xx_WaitRx(Transport* transport, DWORD timeoutMs)
+{
+    D2xxState* state = (D2xxState*)transport->state;
+#ifdef _WIN32
+    WaitForSingleObject(state->rxEvent, timeoutMs);
+#else
+    EVENT_HANDLE* event = &state->rxEvent;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // The driver signals with eMutex held, so the queue must not be checked
+    // under it; a notification lost in between costs at most one short wait
+    pthread_mutex_lock(&event->eMutex);
+    if (!event->iVar) {
+        pthread_cond_timedwait(&event->eCondVar, &event->eMutex, &deadline);
+    }
+    event->iVar = 0;
+    pthread_mutex_unlock(&event->eMutex);
+#endif
+}
+
+const TransportOps D2xxTransport = {
+    "d2xx",
+    D2xx_List,
+    D2xx_Create,
+    D2xx_Destroy,
+    D2xx_Open,
+    D2xx_Close,
+    D2xx_Reset,
+    D2xx_Purge,
+    D2xx_SetUsbParameters,
+    D2xx_SetLatencyTimer,
+    D2xx_SetTimeouts,
+    D2xx_DisableChars,
+    D2xx_SetBitMode,
+    D2xx_QueueStatus,
+    D2xx_Read,
+    D2xx_Write,
+    D2xx_EnableRxEvent,
+    D2xx_WaitRx
+};
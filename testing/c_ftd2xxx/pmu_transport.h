@@ -0,0 +1,150 @@
+/*
+ * pmu_transport.h
+ * USB transport under the SPI acquisition: the byte pipe to and from an
+ * FTDI chip's MPSSE
+ *
+ * pmu_spi.c drives the MPSSE through a Transport, never through a USB library
+ * directly. A backend supplies the calls as a TransportOps table:
+ *   d2xx      FTDI's D2XX driver (ftd2xx.h), or d2xx_sim.c linked in its
+ *             place for the simulated FT232H and FPGA
+ * A backend presents the D2XX model: reads come from a host-side receive
+ * queue that fills in the background, errors are FT_STATUS codes, and the
+ * channels of a two- or four-channel chip are devices of their own with A,
+ * B, ... appended to the chip's serial number.
+ *
+ * Transport_Create sets up a backend's state once; Transport_Open and
+ * Transport_Close can then be repeated, e.g. to reopen a device that dropped
+ * off the bus, without allocating.
+ */
+
+#ifndef PMU_TRANSPORT_H
+#define PMU_TRANSPORT_H
+
+#include <stdbool.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include "ftd2xx.h"
+#else
+    #include <ftd2xx.h>
+#endif
+
+#define TRANSPORT_D2XX          0
+#define TRANSPORT_KINDS         1
+
+#define TRANSPORT_SERIAL_LENGTH 16      // Serial number with channel letter and terminator
+#define TRANSPORT_MAX_DEVICES   16      // Devices a listing returns at most
+
+// One entry of a device listing
+typedef struct {
+    FT_DEVICE type;
+    char serial[TRANSPORT_SERIAL_LENGTH];   // Empty if unreadable
+    bool opened;                        // Already open, here or by another process
+} TransportInfo;
+
+typedef struct Transport Transport;
+
+typedef struct {
+    const char* name;
+    int (*list)(TransportInfo* devices, int maxDevices);
+    bool (*create)(Transport* transport);
+    void (*destroy)(Transport* transport);
+    FT_STATUS (*open)(Transport* transport, const char* serial, int index);
+    void (*close)(Transport* transport);
+    FT_STATUS (*reset)(Transport* transport);
+    FT_STATUS (*purge)(Transport* transport, ULONG mask);
+    FT_STATUS (*setUsbParameters)(Transport* transport, ULONG transferSize);
+    FT_STATUS (*setLatencyTimer)(Transport* transport, UCHAR latencyMs);
+    FT_STATUS (*setTimeouts)(Transport* transport, DWORD readMs, DWORD writeMs);
+    FT_STATUS (*disableChars)(Transport* transport);
+    FT_STATUS (*setBitMode)(Transport* transport, UCHAR mask, UCHAR mode);
+    FT_STATUS (*queueStatus)(Transport* transport, DWORD* bytesInQueue);
+    FT_STATUS (*read)(Transport* transport, UCHAR* buffer, DWORD length, DWORD* bytesRead);
+    FT_STATUS (*write)(Transport* transport, const UCHAR* buffer, DWORD length, DWORD* bytesWritten);
+    bool (*enableRxEvent)(Transport* transport);
+    void (*waitRx)(Transport* transport, DWORD timeoutMs);
+} TransportOps;
+
+struct Transport {
+    const TransportOps* ops;
+    void* state;                        // The backend's, from create
+    bool open;
+    FT_DEVICE type;                     // Of the open device
+    char serial[TRANSPORT_SERIAL_LENGTH];
+};
+
+extern const TransportOps D2xxTransport;
+
+const TransportOps* Transport_Backend(int kind);
+const char* Transport_Name(int kind);
+int Transport_List(int kind, TransportInfo* devices, int maxDevices);
+
+bool Transport_Create(Transport* transport, int kind);
+void Transport_Destroy(Transport* transport);
+FT_STATUS Transport_Open(Transport* transport, const char* serial, int index);
+void Transport_Close(Transport* transport);
+
+static inline FT_STATUS Transport_Reset(Transport* transport)
+{
+    return transport->ops->reset(transport);
+}
+
+static inline FT_STATUS Transport_Purge(Transport* transport, ULONG mask)
+{
+    return transport->ops->purge(transport, mask);
+}
+
+static inline FT_STATUS Transport_SetUsbParameters(Transport* transport, ULONG transferSize)
+{
+    return transport->ops->setUsbParameters(transport, transferSize);
+}
+
+static inline FT_STATUS Transport_SetLatencyTimer(Transport* transport, UCHAR latencyMs)
+{
+    return transport->ops->setLatencyTimer(transport, latencyMs);
+}
+
+static inline FT_STATUS Transport_SetTimeouts(Transport* transport, DWORD readMs, DWORD writeMs)
+{
+    return transport->ops->setTimeouts(transport, readMs, writeMs);
+}
+
+static inline FT_STATUS Transport_DisableChars(Transport* transport)
+{
+    return transport->ops->disableChars(transport);
+}
+
+static inline FT_STATUS Transport_SetBitMode(Transport* transport, UCHAR mask, UCHAR mode)
+{
+    return transport->ops->setBitMode(transport, mask, mode);
+}
+
+static inline FT_STATUS Transport_QueueStatus(Transport* transport, DWORD* bytesInQueue)
+{
+    return transport->ops->queueStatus(transport, bytesInQueue);
+}
+
+static inline FT_STATUS Transport_Read(Transport* transport, UCHAR* buffer, DWORD length, DWORD* bytesRead)
+{
+    return transport->ops->read(transport, buffer, length, bytesRead);
+}
+
+static inline FT_STATUS Transport_Write(Transport* transport, const UCHAR* buffer, DWORD length,
+                                        DWORD* bytesWritten)
+{
+    return transport->ops->write(transport, buffer, length, bytesWritten);
+}
+
+// Receive notifications for Transport_WaitRx; without them it only sleeps
+static inline bool Transport_EnableRxEvent(Transport* transport)
+{
+    return transport->ops->enableRxEvent(transport);
+}
+
+// Sleep until bytes arrive or timeoutMs elapses
+static inline void Transport_WaitRx(Transport* transport, DWORD timeoutMs)
+{
+    transport->ops->waitRx(transport, timeoutMs);
+}
+
+#endif // PMU_TRANSPORT_H
@@ -0,0 +1,335 @@
+/*
+ * pmu_trigger.c
+ * Triggered capture: a history of recent frames and the conditions that pick
+ * the parts of it worth keeping
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmu_trigger.h"
+#include "pmu_mem.h"
+
+static const char* const TriggerNames[] = { "above", "below", "slope", "checksum", "counter", "external" };
+
+void Trigger_Init(Trigger* trigger)
+{
+    memset(trigger, 0, sizeof(*trigger));
+    trigger->preNs = TRIGGER_DEFAULT_PRE_MS * 1000000ULL;
+    trigger->postNs = TRIGGER_DEFAULT_POST_MS * 1000000ULL;
+}
+
+// Whole-string number, decimal or 0x hex
+static bool Trigger_ParseNumber(const char* text, long long* value)
+{
+    char* end;
+    *value = strtoll(text, &end, 0);
+    return end != text && *end == '\0';
+}
+
+// One condition as described in pmu_trigger.h, false if the spec is not one
+bool Trigger_AddCondition(Trigger* trigger, const char* spec)
+{
+    if (trigger->conditionCount == TRIGGER_MAX_CONDITIONS) return false;
+
+    TriggerCondition condition;
+    memset(&condition, 0, sizeof(condition));
+    condition.type = -1;
+    const char* colon = strchr(spec, ':');
+    size_t nameLength = colon ? (size_t)(colon - spec) : strlen(spec);
+    for (int i = 0; i < (int)(sizeof(TriggerNames) / sizeof(TriggerNames[0])); i++) {
+        if (strlen(TriggerNames[i]) == nameLength && strncmp(spec, TriggerNames[i], nameLength) == 0) {
+            condition.type = i;
+        }
+    }
+
+    switch (condition.type) {
+    case TRIGGER_ABOVE:
+    case TRIGGER_BELOW:
+    case TRIGGER_SLOPE: {
+        char* end;
+        if (!colon) return false;
+        long channel = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != ':' || channel < 1 || channel > FRAME_WORDS) return false;
+        if (!Trigger_ParseNumber(end + 1, &condition.threshold) || condition.threshold < 0) return false;
+        condition.word = (int)channel - 1;
+        break;
+    }
+    case TRIGGER_CHECKSUM:
+        if (!colon || !Trigger_ParseNumber(colon + 1, &condition.threshold) || condition.threshold < 1) {
+            return false;
+        }
+        break;
+    case TRIGGER_COUNTER:
+        condition.threshold = 1;
+        if (colon && (!Trigger_ParseNumber(colon + 1, &condition.threshold) || condition.threshold < 1)) {
+            return false;
+        }
+        break;
+    case TRIGGER_EXTERNAL:
+        if (colon) return false;
+        break;
+    default:
+        return false;
+    }
+
+    snprintf(condition.spec, sizeof(condition.spec), "%s", spec);
+    trigger->conditions[trigger->conditionCount++] = condition;
+    return true;
+}
+
+// History of capacity frames. It has to hold the pre-trigger time plus the
+// frames of one Trigger_Append: the caller writes the pending frames out after
+// every append, before the next one.
+bool Trigger_Create(Trigger* trigger, unsigned long capacity)
+{
+    trigger->capacity = capacity;
+    trigger->frames = (unsigned char*)Mem_Alloc((size_t)capacity * FRAME_BYTES);
+    trigger->timeNs = (unsigned long long*)Mem_Alloc(capacity * sizeof(unsigned long long));
+    trigger->index = (unsigned long long*)Mem_Alloc(capacity * sizeof(unsigned long long));
+    trigger->markers = (unsigned short*)Mem_Alloc(capacity * sizeof(unsigned short));
+    return trigger->frames && trigger->timeNs && trigger->index && trigger->markers;
+}
+
+void Trigger_Destroy(Trigger* trigger)
+{
+    Mem_Free(trigger->frames);
+    Mem_Free(trigger->timeNs);
+    Mem_Free(trigger->index);
+    Mem_Free(trigger->markers);
+    trigger->frames = NULL;
+    trigger->timeNs = NULL;
+    trigger->index = NULL;
+    trigger->markers = NULL;
+}
+
+// markers may be NULL when the frames carry none
+void Trigger_Append(Trigger* trigger, const unsigned char* frames, int count,
+                    const unsigned long long* index, const unsigned long long* timeNs,
+                    const unsigned short* markers)
+{
+    for (int i = 0; i < count; i++) {
+        unsigned long position = (unsigned long)((trigger->appended + i) % trigger->capacity);
+        memcpy(trigger->frames + (size_t)position * FRAME_BYTES, frames + (size_t)i * FRAME_BYTES, FRAME_BYTES);
+        trigger->index[position] = index[i];
+        trigger->timeNs[position] = timeNs[i];
+        trigger->markers[position] = markers ? markers[i] : 0;
+    }
+    trigger->appended += count;
+}
+
+static unsigned long long Trigger_Before(unsigned long long timeNs, unsigned long long spanNs)
+{
+    return timeNs > spanNs ? timeNs - spanNs : 0;
+}
+
+// A condition fired: extends the open window, or opens one reaching back to
+// fromNs through the frames still held and not written. True if it opened one.
+static bool Trigger_Fire(Trigger* trigger, int condition, unsigned long long fromNs,
+                         unsigned long long toNs, unsigned long long eventNs)
+{
+    trigger->conditions[condition].fired++;
+    if (trigger->open) {
+        if (toNs > trigger->windowEndNs) trigger->windowEndNs = toNs;
+        return false;
+    }
+
+    unsigned long long oldest = trigger->appended > trigger->capacity ? trigger->appended - trigger->capacity : 0;
+    unsigned long long first = trigger->scanned;
+    while (first > oldest && first > trigger->writeEnd &&
+           trigger->timeNs[(first - 1) % trigger->capacity] >= fromNs) {
+        first--;
+    }
+    trigger->writeNext = first;
+    trigger->writeEnd = trigger->scanned;
+    trigger->open = true;
+    trigger->windowEndNs = toNs;
+    trigger->windows++;
+
+    trigger->event.condition = condition;
+    trigger->event.timeNs = eventNs;
+    trigger->event.index = trigger->scanned > 0 ? trigger->index[(trigger->scanned - 1) % trigger->capacity] : 0;
+    trigger->event.framesBefore = trigger->framesWritten;
+    return true;
+}
+
+// The first condition the frame fires, -1 if none. A repeated read of an FPGA
+// frame changes nothing, so crossings and slopes are taken between FPGA frames.
+static int Trigger_Check(Trigger* trigger, unsigned long position)
+{
+    PmuFrame frame;
+    Frame_Decode(trigger->frames + (size_t)position * FRAME_BYTES, &frame);
+    unsigned long long index = trigger->index[position];
+    int fired = -1;
+
+    if (trigger->primed && index != trigger->lastIndex) {
+        long long step = (long long)(index - trigger->lastIndex);
+        for (int c = 0; c < trigger->conditionCount; c++) {
+            const TriggerCondition* condition = &trigger->conditions[c];
+            long long last = trigger->lastWords[condition->word];
+            long long value = frame.data[condition->word];
+            bool fires = false;
+
+            switch (condition->type) {
+            case TRIGGER_ABOVE:
+                fires = last < condition->threshold && value >= condition->threshold;
+                break;
+            case TRIGGER_BELOW:
+                fires = last >= condition->threshold && value < condition->threshold;
+                break;
+            case TRIGGER_SLOPE:
+                fires = step > 0 && llabs(value - last) > condition->threshold * step;
+                break;
+            case TRIGGER_COUNTER:
+                // A step back is a discontinuity too
+                fires = step < 0 || step > condition->threshold;
+                break;
+            }
+            if (fires && fired < 0) fired = c;
+        }
+    }
+
+    memcpy(trigger->lastWords, frame.data, sizeof(trigger->lastWords));
+    trigger->lastIndex = index;
+    trigger->primed = true;
+    return fired;
+}
+
+/*
+ * Check the frames appended since the last scan. Returns TRIGGER_FLUSH when a
+ * window has closed with frames still to write, before anything after it is
+ * looked at, and TRIGGER_OPENED as soon as a window opens; write the pending
+ * frames and scan again until TRIGGER_DONE.
+ */
+int Trigger_Scan(Trigger* trigger)
+{
+    for (;;) {
+        if (!trigger->open && trigger->writeNext < trigger->writeEnd) return TRIGGER_FLUSH;
+
+        if (trigger->requested) {
+            trigger->requested = false;
+            if (Trigger_Fire(trigger, trigger->requestCondition, trigger->requestFromNs,
+                             trigger->requestToNs, trigger->requestNs)) {
+                return TRIGGER_OPENED;
+            }
+            continue;
+        }
+
+        if (trigger->scanned == trigger->appended) return TRIGGER_DONE;
+
+        unsigned long position = (unsigned long)(trigger->scanned % trigger->capacity);
+        unsigned long long timeNs = trigger->timeNs[position];
+        if (trigger->open && timeNs > trigger->windowEndNs) {
+            trigger->open = false;
+            continue;
+        }
+
+        int condition = Trigger_Check(trigger, position);
+        trigger->scanned++;
+        if (trigger->open) trigger->writeEnd = trigger->scanned;
+        if (condition >= 0 && Trigger_Fire(trigger, condition, Trigger_Before(timeNs, trigger->preNs),
+                                           timeNs + trigger->postNs, timeNs)) {
+            return TRIGGER_OPENED;
+        }
+    }
+}
+
+// Frames to write next, contiguous in the history from *position; 0 if none
+int Trigger_Pending(const Trigger* trigger, int maxFrames, unsigned long* position)
+{
+    unsigned long long count = trigger->writeEnd - trigger->writeNext;
+    *position = (unsigned long)(trigger->writeNext % trigger->capacity);
+    if (count > trigger->capacity - *position) count = trigger->capacity - *position;
+    if (count > (unsigned long long)maxFrames) count = maxFrames;
+    return (int)count;
+}
+
+void Trigger_Written(Trigger* trigger, int count)
+{
+    trigger->writeNext += count;
+    trigger->framesWritten += count;
+}
+
+// A window for a condition that is not a frame, opened by the next scan.
+// Requests before that scan widen the first one.
+static void Trigger_RequestWindow(Trigger* trigger, int condition, unsigned long long fromNs,
+                                  unsigned long long toNs, unsigned long long eventNs)
+{
+    if (trigger->requested) {
+        trigger->conditions[condition].fired++;
+        if (fromNs < trigger->requestFromNs) trigger->requestFromNs = fromNs;
+        if (toNs > trigger->requestToNs) trigger->requestToNs = toNs;
+        return;
+    }
+    trigger->requested = true;
+    trigger->requestCondition = condition;
+    trigger->requestFromNs = fromNs;
+    trigger->requestToNs = toNs;
+    trigger->requestNs = eventNs;
+}
+
+// Checksum failures the framer counted in data read up to timeNs
+void Trigger_ChecksumErrors(Trigger* trigger, unsigned long long errors, unsigned long long timeNs)
+{
+    if (errors == 0) return;
+    for (int c = 0; c < trigger->conditionCount; c++) {
+        TriggerCondition* condition = &trigger->conditions[c];
+        if (condition->type != TRIGGER_CHECKSUM) continue;
+        if (timeNs - condition->burstStartNs > TRIGGER_BURST_MS * 1000000ULL) {
+            condition->burstStartNs = timeNs;
+            condition->burstErrors = 0;
+        }
+        condition->burstErrors += errors;
+        if (condition->burstErrors >= (unsigned long long)condition->threshold) {
+            condition->burstErrors = 0;
+            Trigger_RequestWindow(trigger, c, Trigger_Before(timeNs, trigger->preNs),
+                                  timeNs + trigger->postNs, timeNs);
+        }
+    }
+}
+
+// Acquisition stopped from startNs to endNs: a counter discontinuity whose
+// window covers the gap, and the frames after it are not compared with the
+// ones before
+void Trigger_Gap(Trigger* trigger, unsigned long long startNs, unsigned long long endNs)
+{
+    trigger->primed = false;
+    for (int c = 0; c < trigger->conditionCount; c++) {
+        if (trigger->conditions[c].type == TRIGGER_COUNTER) {
+            Trigger_RequestWindow(trigger, c, Trigger_Before(startNs, trigger->preNs),
+                                  endNs + trigger->postNs, startNs);
+            return;
+        }
+    }
+}
+
+// Fire the first condition of the given type at the newest frame, false if
+// there is none (e.g. no "external" condition was given)
+bool Trigger_Request(Trigger* trigger, int type)
+{
+    for (int c = 0; c < trigger->conditionCount; c++) {
+        if (trigger->conditions[c].type == type) {
+            unsigned long long timeNs = trigger->appended > 0 ?
+                trigger->timeNs[(trigger->appended - 1) % trigger->capacity] : 0;
+            Trigger_RequestWindow(trigger, c, Trigger_Before(timeNs, trigger->preNs),
+                                  timeNs + trigger->postNs, timeNs);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Trigger_PrintStats(const Trigger* trigger, unsigned long long framesDecoded)
+{
+    printf("  Window: %.3f s before to %.3f s after a trigger, history of %lu frames (%.1f MB)\n",
+           trigger->preNs / 1e9, trigger->postNs / 1e9, trigger->capacity,
+           trigger->capacity * (FRAME_BYTES + 2.0 * sizeof(unsigned long long) + sizeof(unsigned short)) /
+           1048576.0);
+    for (int c = 0; c < trigger->conditionCount; c++) {
+        printf("  %-24s fired %lu times\n", trigger->conditions[c].spec, trigger->conditions[c].fired);
+    }
+    printf("  Windows written: %lu, frames written: %llu of %llu decoded (%.2f%%)\n",
+           trigger->windows, trigger->framesWritten, framesDecoded,
+           framesDecoded ? trigger->framesWritten * 100.0 / framesDecoded : 0.0);
+}
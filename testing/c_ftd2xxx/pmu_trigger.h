@@ -0,0 +1,129 @@
+/*
+ * pmu_trigger.h
+ * Triggered capture: a history of recent frames and the conditions that pick
+ * the parts of it worth keeping
+ *
+ * Every decoded frame is appended to the history, a ring holding the raw
+ * frame with its host time and FPGA frame index, sized for the pre-trigger
+ * time at the fastest rate frames can be read. Trigger_Scan then checks the
+ * new frames against the conditions:
+ *   above:CH:LEVEL   data word CH (1-6) rises to LEVEL or more
+ *   below:CH:LEVEL   data word CH falls below LEVEL
+ *   slope:CH:DELTA   data word CH changes by more than DELTA per FPGA frame
+ *   checksum:N       N frames fail their checksum within TRIGGER_BURST_MS
+ *   counter[:STEP]   the FPGA frame index jumps by more than STEP (default 1),
+ *                    or acquisition stopped for a gap
+ *   external         asked for from outside (Trigger_Request)
+ * LEVEL and DELTA are raw 24-bit counts, decimal or 0x hex. A condition that
+ * fires opens a window from preNs before the frame to postNs after it; one
+ * firing inside an open window extends it. The caller writes out the frames
+ * the windows cover (Trigger_Pending / Trigger_Written) and nothing else.
+ *
+ * Checksum errors and gaps are not frames: the decoder reports them with
+ * Trigger_ChecksumErrors and Trigger_Gap, and an external trigger with
+ * Trigger_Request, each taking effect at the next Trigger_Scan.
+ */
+
+#ifndef PMU_TRIGGER_H
+#define PMU_TRIGGER_H
+
+#include <stdbool.h>
+#include "pmu_frame.h"
+
+#define TRIGGER_MAX_CONDITIONS  8
+#define TRIGGER_BURST_MS        100     // Window the checksum errors of a burst fall within
+#define TRIGGER_DEFAULT_PRE_MS  500
+#define TRIGGER_DEFAULT_POST_MS 500
+#define TRIGGER_SPEC_LENGTH     48
+
+enum {
+    TRIGGER_ABOVE,
+    TRIGGER_BELOW,
+    TRIGGER_SLOPE,
+    TRIGGER_CHECKSUM,
+    TRIGGER_COUNTER,
+    TRIGGER_EXTERNAL
+};
+
+// Trigger_Scan results
+enum {
+    TRIGGER_DONE,               // Every frame appended has been checked
+    TRIGGER_FLUSH,              // Write the pending frames before a new window opens
+    TRIGGER_OPENED              // A window opened, see event; its frames are pending
+};
+
+typedef struct {
+    int type;
+    int word;                   // Data word 0-5, level and slope only
+    long long threshold;        // Level, change per frame, errors per burst or index step
+    char spec[TRIGGER_SPEC_LENGTH];     // As given on the command line
+    unsigned long long burstStartNs;    // Checksum errors counted towards a burst since then
+    unsigned long long burstErrors;
+    unsigned long fired;
+} TriggerCondition;
+
+// What opened the last window
+typedef struct {
+    int condition;
+    unsigned long long timeNs;          // Host time of the frame, or of the gap or request
+    unsigned long long index;           // FPGA frame index of the newest frame checked
+    unsigned long long framesBefore;    // Frames written before the window
+} TriggerEvent;
+
+typedef struct {
+    TriggerCondition conditions[TRIGGER_MAX_CONDITIONS];
+    int conditionCount;
+    unsigned long long preNs;
+    unsigned long long postNs;
+
+    // Frame history, appended counts every frame ever added
+    unsigned char* frames;
+    unsigned long long* timeNs;
+    unsigned long long* index;
+    unsigned short* markers;            // GPIO marker bits per frame, 0 without markers
+    unsigned long capacity;
+    unsigned long long appended;
+    unsigned long long scanned;         // Frames checked against the conditions
+    unsigned long long writeNext;       // First frame of the windows not written yet
+    unsigned long long writeEnd;        // End of the frames the windows cover so far
+
+    // Window being written
+    bool open;
+    unsigned long long windowEndNs;
+    TriggerEvent event;
+
+    // Conditions that are not frames, applied by the next scan
+    bool requested;
+    int requestCondition;
+    unsigned long long requestFromNs;
+    unsigned long long requestToNs;
+    unsigned long long requestNs;       // When it happened
+
+    // Previous frame, for crossings, slopes and counter steps
+    bool primed;
+    unsigned int lastWords[FRAME_WORDS];
+    unsigned long long lastIndex;
+
+    // Statistics
+    unsigned long windows;
+    unsigned long long framesWritten;
+} Trigger;
+
+void Trigger_Init(Trigger* trigger);
+bool Trigger_AddCondition(Trigger* trigger, const char* spec);
+bool Trigger_Create(Trigger* trigger, unsigned long capacity);
+void Trigger_Destroy(Trigger* trigger);
+
+void Trigger_Append(Trigger* trigger, const unsigned char* frames, int count,
+                    const unsigned long long* index, const unsigned long long* timeNs,
+                    const unsigned short* markers);
+int Trigger_Scan(Trigger* trigger);
+int Trigger_Pending(const Trigger* trigger, int maxFrames, unsigned long* position);
+void Trigger_Written(Trigger* trigger, int count);
+
+void Trigger_ChecksumErrors(Trigger* trigger, unsigned long long errors, unsigned long long timeNs);
+void Trigger_Gap(Trigger* trigger, unsigned long long startNs, unsigned long long endNs);
+bool Trigger_Request(Trigger* trigger, int type);
+void Trigger_PrintStats(const Trigger* trigger, unsigned long long framesDecoded);
+
+#endif // PMU_TRIGGER_H
@@ -0,0 +1,228 @@
+/*
+ * read_ring.c
+ * Ring of page-aligned read buffers, filled in place by FT_Read and shared
+ * read-only by several consumers
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "read_ring.h"
+#include "pmu_mem.h"
+#include "pmu_time.h"
+
+// Spin this many times (yielding) before falling back to 1 ms sleeps
+#define RING_SPIN_LIMIT 200
+
+bool ReadRing_Create(ReadRing* ring, const char* name, unsigned int slotCount,
+                     unsigned int slotSize, int consumers)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->name = name;
+    ring->slotCount = slotCount;
+    ring->consumers = consumers;
+    if (consumers < 1 || consumers > READ_RING_MAX_CONSUMERS) return false;
+
+    // Whole pages per slot, so every slot starts page-aligned
+    ring->slotSize = (slotSize + MEM_PAGE_SIZE - 1) & ~(unsigned int)(MEM_PAGE_SIZE - 1);
+    ring->slots = (ReadSlot*)Mem_Calloc(slotCount, sizeof(ReadSlot));
+    ring->storage = (unsigned char*)Mem_AllocPages((size_t)slotCount * ring->slotSize);
+    if (!ring->slots || !ring->storage) {
+        ReadRing_Destroy(ring);
+        return false;
+    }
+
+    for (unsigned int i = 0; i < slotCount; i++) {
+        ring->slots[i].data = ring->storage + (size_t)i * ring->slotSize;
+        atomic_init(&ring->slots[i].refs, 0);
+        atomic_init(&ring->slots[i].holders, 0);
+        atomic_init(&ring->slots[i].claims, 0);
+        atomic_init(&ring->slots[i].seq, 0);
+    }
+
+    atomic_init(&ring->head, 0);
+    return true;
+}
+
+void ReadRing_Destroy(ReadRing* ring)
+{
+    Mem_Free(ring->slots);
+    Mem_FreePages(ring->storage);
+    ring->slots = NULL;
+    ring->storage = NULL;
+}
+
+static void ReadRing_Backoff(int* spins)
+{
+    if (++(*spins) < RING_SPIN_LIMIT) {
+        THREAD_YIELD();
+    } else {
+        THREAD_SLEEP_MS(1);
+    }
+}
+
+// Next slot to fill, waits until every consumer has released it
+ReadSlot* ReadRing_Acquire(ReadRing* ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ReadSlot* slot = &ring->slots[head % ring->slotCount];
+
+    if (atomic_load_explicit(&slot->refs, memory_order_acquire) > 0) {
+        int spins = 0;
+        unsigned long long waitStartNs = Time_NowNs();
+        ring->producerStalls++;
+        do {
+            ReadRing_Backoff(&spins);
+        } while (atomic_load_explicit(&slot->refs, memory_order_acquire) > 0);
+        ring->producerWaitNs += Time_NowNs() - waitStartNs;
+    }
+
+    return slot;
+}
+
+// Next slot to fill if every consumer has released it, NULL otherwise
+ReadSlot* ReadRing_TryAcquire(ReadRing* ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ReadSlot* slot = &ring->slots[head % ring->slotCount];
+
+    if (atomic_load_explicit(&slot->refs, memory_order_acquire) > 0) {
+        ring->producerStalls++;
+        return NULL;
+    }
+    return slot;
+}
+
+/*
+ * Next slot to fill, taken back from the consumers if they still hold it: its
+ * data, the oldest in the ring, is lost to every consumer that has not
+ * claimed it yet. A slot a consumer is reading is passed over, its
+ * publication number left unused, and the one after it taken instead.
+ */
+ReadSlot* ReadRing_Overwrite(ReadRing* ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ReadSlot* slot = &ring->slots[head % ring->slotCount];
+
+    if (atomic_load_explicit(&slot->refs, memory_order_acquire) == 0) return slot;
+
+    ring->producerStalls++;
+    while (atomic_load_explicit(&slot->refs, memory_order_acquire) > 0) {
+        unsigned int claims = 0;
+        if (atomic_compare_exchange_strong_explicit(&slot->claims, &claims, READ_SLOT_TAKEN,
+                                                    memory_order_acq_rel, memory_order_relaxed)) {
+            // No claim left means every consumer that had one has released it;
+            // the others lose the data
+            unsigned int holders = atomic_load_explicit(&slot->holders, memory_order_relaxed);
+            ring->slotsTaken++;
+            for (int c = 0; c < ring->consumers; c++) {
+                if ((holders & (1u << c)) && !(slot->flags & ring->markerFlags)) {
+                    ring->bytesLost[c] += slot->length;
+                }
+            }
+            atomic_store_explicit(&slot->holders, 0, memory_order_relaxed);
+            atomic_store_explicit(&slot->refs, 0, memory_order_relaxed);
+            break;
+        }
+        if (claims != 0) {
+            // At most one slot per consumer is being read, so this ends
+            ring->slotsPassed++;
+            atomic_store_explicit(&ring->head, ++head, memory_order_release);
+            slot = &ring->slots[head % ring->slotCount];
+        }
+    }
+
+    return slot;
+}
+
+void ReadRing_Publish(ReadRing* ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ReadSlot* slot = &ring->slots[head % ring->slotCount];
+    atomic_store_explicit(&slot->refs, ring->consumers, memory_order_relaxed);
+    atomic_store_explicit(&slot->holders, (1u << ring->consumers) - 1, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, head, memory_order_relaxed);
+    atomic_store_explicit(&slot->claims, 0, memory_order_release);
+
+    unsigned int occupancy = ReadRing_Occupancy(ring);
+    ring->occupancySum += occupancy;
+    ring->occupancySamples++;
+    if (occupancy > ring->highWater) {
+        ring->highWater = occupancy;
+    }
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Oldest slot this consumer has not released yet, waits for the producer if
+// needed. Slots the producer took back are skipped and counted in skipped[].
+const ReadSlot* ReadRing_Next(ReadRing* ring, int consumer)
+{
+    unsigned int claim = 1u << consumer;
+
+    for (;;) {
+        unsigned int cursor = ring->cursor[consumer];
+
+        if (atomic_load_explicit(&ring->head, memory_order_acquire) == cursor) {
+            int spins = 0;
+            ring->consumerStalls[consumer]++;
+            do {
+                ReadRing_Backoff(&spins);
+            } while (atomic_load_explicit(&ring->head, memory_order_acquire) == cursor);
+        }
+
+        // Once claimed the slot cannot be taken; if it already was, or has
+        // been refilled since, its data is gone. An older publication number
+        // means the producer passed the slot over and nothing was lost.
+        ReadSlot* slot = &ring->slots[cursor % ring->slotCount];
+        unsigned int claims = atomic_fetch_or_explicit(&slot->claims, claim, memory_order_acq_rel);
+        int age = (int)(cursor - atomic_load_explicit(&slot->seq, memory_order_relaxed));
+        if (!(claims & READ_SLOT_TAKEN) && age == 0) {
+            return slot;
+        }
+        atomic_fetch_and_explicit(&slot->claims, ~claim, memory_order_relaxed);
+        ring->cursor[consumer]++;
+        if (age <= 0) ring->skipped[consumer]++;
+    }
+}
+
+void ReadRing_Release(ReadRing* ring, int consumer)
+{
+    unsigned int cursor = ring->cursor[consumer]++;
+    ReadSlot* slot = &ring->slots[cursor % ring->slotCount];
+    atomic_fetch_and_explicit(&slot->holders, ~(1u << consumer), memory_order_relaxed);
+    atomic_fetch_sub_explicit(&slot->refs, 1, memory_order_release);
+    atomic_fetch_and_explicit(&slot->claims, ~(1u << consumer), memory_order_release);
+}
+
+// Slots held by at least one consumer
+unsigned int ReadRing_Occupancy(ReadRing* ring)
+{
+    unsigned int held = 0;
+    for (unsigned int i = 0; i < ring->slotCount; i++) {
+        if (atomic_load_explicit(&ring->slots[i].refs, memory_order_relaxed) > 0) held++;
+    }
+    return held;
+}
+
+void ReadRing_PrintStats(const ReadRing* ring)
+{
+    double avgOccupancy = ring->occupancySamples ?
+        (double)ring->occupancySum / ring->occupancySamples : 0.0;
+
+    printf("  %-8s slots %u x %u bytes, avg occupancy %.2f, high water %u, producer stalls %lu "
+           "(%.1f ms waiting), consumer stalls", ring->name, ring->slotCount, ring->slotSize, avgOccupancy,
+           ring->highWater, ring->producerStalls, ring->producerWaitNs / 1e6);
+    for (int c = 0; c < ring->consumers; c++) {
+        printf(" %lu", ring->consumerStalls[c]);
+    }
+    printf("\n");
+    if (ring->slotsTaken > 0) {
+        printf("  %-8s %lu slots overwritten before every consumer had them, %lu passed over while "
+               "being read, bytes lost", ring->name, ring->slotsTaken, ring->slotsPassed);
+        for (int c = 0; c < ring->consumers; c++) {
+            printf(" %llu", ring->bytesLost[c]);
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,84 @@
+/*
+ * read_ring.h
+ * Ring of page-aligned read buffers, filled in place by FT_Read and shared
+ * read-only by several consumers
+ *
+ * The producer takes the next free slot (ReadRing_Acquire), reads straight
+ * into it and publishes it to all consumers at once (ReadRing_Publish), which
+ * sets the slot's reference count to the number of consumers. Each consumer
+ * walks the published slots in order with its own cursor (ReadRing_Next) and
+ * drops its reference when done (ReadRing_Release); the slot is recycled once
+ * the last reference is gone. Nothing is allocated or copied after
+ * ReadRing_Create.
+ *
+ * A producer that must not wait for slow consumers can test for a free slot
+ * (ReadRing_TryAcquire) or take the oldest slot back (ReadRing_Overwrite).
+ * Consumers claim a slot in ReadRing_Next before reading it; a slot no
+ * consumer is reading can be taken, and the consumers that had not claimed it
+ * skip it, counting the skipped slots so they can account for the data lost.
+ * One that is being read is passed over instead. The producer counts the bytes
+ * each consumer lost that way, leaving out slots whose flags include
+ * markerFlags (records without data).
+ */
+
+#ifndef READ_RING_H
+#define READ_RING_H
+
+#include <stdbool.h>
+#include "pmu_thread.h"
+
+#define READ_RING_MAX_CONSUMERS 4
+#define READ_SLOT_TAKEN         0x80000000u     // Claims bit: the producer took the slot back
+
+typedef struct {
+    unsigned char* data;        // Page-aligned, slotSize bytes
+    int length;                 // Bytes read into the slot, 0 marks end of stream
+    unsigned int flags;         // Capture record flags (CAPTURE_SHORT)
+    unsigned long batchMs;      // Time the producer spent filling the slot
+    unsigned long long timeNs;  // Host time the read completed
+    atomic_int refs;            // Consumers still holding the slot
+    atomic_uint holders;        // The same, bit per consumer
+    atomic_uint claims;         // Consumers reading it (bit per consumer), or READ_SLOT_TAKEN
+    atomic_uint seq;            // Publication number of the data in the slot
+} ReadSlot;
+
+typedef struct {
+    const char* name;
+    ReadSlot* slots;
+    unsigned char* storage;
+    unsigned int slotCount;
+    unsigned int slotSize;
+    int consumers;
+    unsigned int markerFlags;   // Slot flags of records that carry no data
+
+    atomic_uint head;                               // Slots published by the producer
+    unsigned int cursor[READ_RING_MAX_CONSUMERS];   // Next slot, written by its consumer only
+
+    // Statistics (each field is written by one side only)
+    unsigned long producerStalls;   // Times the producer found the next slot still held
+    unsigned long long producerWaitNs;  // Time it then waited for the consumers
+    unsigned long slotsTaken;       // Slots taken back by ReadRing_Overwrite
+    unsigned long long bytesLost[READ_RING_MAX_CONSUMERS];  // Data bytes each consumer lost with them
+    unsigned long slotsPassed;      // Slots ReadRing_Overwrite left to a consumer reading them
+    unsigned long consumerStalls[READ_RING_MAX_CONSUMERS];
+    unsigned long skipped[READ_RING_MAX_CONSUMERS];     // Taken slots each consumer skipped
+    unsigned long occupancySum;     // Held slots, sampled at each publish
+    unsigned long occupancySamples;
+    unsigned int highWater;
+} ReadRing;
+
+bool ReadRing_Create(ReadRing* ring, const char* name, unsigned int slotCount,
+                     unsigned int slotSize, int consumers);
+void ReadRing_Destroy(ReadRing* ring);
+
+ReadSlot* ReadRing_Acquire(ReadRing* ring);
+ReadSlot* ReadRing_TryAcquire(ReadRing* ring);
+ReadSlot* ReadRing_Overwrite(ReadRing* ring);
+void ReadRing_Publish(ReadRing* ring);
+const ReadSlot* ReadRing_Next(ReadRing* ring, int consumer);
+void ReadRing_Release(ReadRing* ring, int consumer);
+
+unsigned int ReadRing_Occupancy(ReadRing* ring);
+void ReadRing_PrintStats(const ReadRing* ring);
+
+#endif // READ_RING_H
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""
+sim_check.py
+Regression check of the SPI readers against the simulated D2XX library
+
+Builds ft232h_spi_reader and basic_spi_receiver with d2xx_sim.c in a
+temporary directory, with the "Without hardware" line of each header, and
+runs the reader through these cases:
+  clean    --data-ready capture: every frame has a valid checksum and is read
+           once, the counter only skips frames where a deadline was missed,
+           and Gaps.txt stays empty
+  faults   the same with a USB I/O error every 300 ms, recorded: every counter
+           jump is in Gaps.txt or a missed deadline, and every Gaps.txt entry
+           is a jump of the frame index
+  replay   the recording decoded again: the output files are byte-identical
+  slips    --stream with an SCK slip every 5000 frames: every frame written has
+           a valid checksum after re-framing
+
+Needs gcc and Python 3 only. Prints one line per check and exits with 1 if
+any failed.
+
+Usage: python3 sim_check.py [--keep]
+  --keep  Leave the build directory with the last run's files
+"""
+
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+FRAMES = 20000
+BATCH = 100
+FRAME_RATE = 10000
+OUTPUTS = ["SPIBin.txt", "CounterOutput.txt", "FrameTimes.txt", "Gaps.txt"]
+RUN_TIMEOUT_S = 120
+
+failures = []
+
+
+def check(name, ok, detail=""):
+    print("%-6s %s%s" % ("ok" if ok else "FAIL", name, " (%s)" % detail if detail else ""))
+    if not ok:
+        failures.append(name)
+
+
+# The build line for the simulator from a reader's header comment
+def build_line(source):
+    with open(os.path.join(HERE, source)) as f:
+        for line in f:
+            match = re.search(r"Without hardware: (gcc .*)$", line)
+            if match:
+                return match.group(1).split()
+    raise RuntimeError("No \"Without hardware\" line in " + source)
+
+
+def build(work, source):
+    command = build_line(source)
+    result = subprocess.run(command, cwd=work, capture_output=True, text=True)
+    check("build " + source, result.returncode == 0, result.stderr.strip()[-200:])
+    return result.returncode == 0
+
+
+def run(work, args, env=None):
+    environment = dict(os.environ)
+    environment.update(env or {})
+    result = subprocess.run(["./ft232h_spi_reader_sim"] + [str(a) for a in args], cwd=work,
+                            env=environment, capture_output=True, text=True, timeout=RUN_TIMEOUT_S)
+    return result.returncode, result.stdout
+
+
+def read_lines(work, name):
+    with open(os.path.join(work, name)) as f:
+        return f.read().splitlines()
+
+
+# Counter, checksum match, frame index and bits of every frame written
+def read_frames(work):
+    frames = []
+    bins = read_lines(work, "SPIBin.txt")
+    times = read_lines(work, "FrameTimes.txt")
+    for bits, time in zip(bins, times):
+        counter = int(bits[0:4], 2)
+        total = counter + sum(int(bits[4 + 12 * k:16 + 12 * k], 2) for k in range(12))
+        valid = total % 4096 == int(bits[148:160], 2)
+        frames.append((counter, valid, int(time.split()[1]), bits))
+    return frames, len(bins), len(times)
+
+
+# Lines of Gaps.txt by the number of frames written before each gap
+def read_gaps(work):
+    return {int(line.split()[0]): line for line in read_lines(work, "Gaps.txt") if not line.startswith("#")}
+
+
+def deadline_misses(output):
+    match = re.search(r"Deadline misses: (\d+) of", output)
+    return int(match.group(1)) if match else 0
+
+
+# Counter checks shared by the clean and faulted runs
+def check_capture(name, work, code, output, faults):
+    frames, bins, times = read_frames(work)
+    gaps = read_gaps(work)
+    check(name + ": exit status", code == 0, "exit %d" % code)
+    check(name + ": frames written", bins == FRAMES and times == FRAMES,
+          "SPIBin.txt %d, FrameTimes.txt %d lines" % (bins, times))
+    invalid = sum(1 for frame in frames if not frame[1])
+    check(name + ": checksums", invalid == 0, "%d invalid" % invalid)
+
+    repeats = 0
+    unexplained = 0
+    mismatched = 0
+    for k in range(1, len(frames)):
+        step = (frames[k][0] - frames[k - 1][0]) % 16
+        index_step = frames[k][2] - frames[k - 1][2]
+        if k not in gaps:
+            # The same counter with other data is 15 frames missed, not a repeat
+            repeated = frames[k][3] == frames[k - 1][3]
+            repeats += repeated
+            unexplained += step != 1 and not repeated
+        if index_step % 16 != step:
+            mismatched += 1
+    misses = deadline_misses(output)
+    check(name + ": each frame read once", repeats == 0, "%d repeated counters" % repeats)
+    check(name + ": counter jumps", unexplained <= misses,
+          "%d outside Gaps.txt, %d deadline misses" % (unexplained, misses))
+    check(name + ": frame index follows the counter", mismatched == 0, "%d frames" % mismatched)
+
+    if faults:
+        unmarked = [k for k in gaps if k == 0 or k >= len(frames) or frames[k][2] - frames[k - 1][2] <= 1]
+        check(name + ": gaps recorded", len(gaps) > 0, "%d in Gaps.txt" % len(gaps))
+        check(name + ": each gap skips frames", not unmarked, "none at frames %s" % unmarked[:5])
+    else:
+        check(name + ": no gaps", not gaps, "%d in Gaps.txt" % len(gaps))
+
+
+def main():
+    keep = "--keep" in sys.argv[1:]
+    work = tempfile.mkdtemp(prefix="pmu_sim_check_")
+    for name in os.listdir(HERE):
+        if name.endswith((".c", ".h")):
+            shutil.copy(os.path.join(HERE, name), work)
+
+    try:
+        if build(work, "ft232h_spi_reader.c") and build(work, "basic_spi_receiver.c"):
+            paced = [FRAMES, BATCH, "--data-ready", "--frame-rate=%d" % FRAME_RATE]
+
+            code, output = run(work, paced)
+            check_capture("clean", work, code, output, faults=False)
+
+            code, output = run(work, paced + ["--record=faults.cap"],
+                               {"PMU_SIM_FAULT": "io", "PMU_SIM_FAULT_EVERY": "300"})
+            check_capture("faults", work, code, output, faults=True)
+            recorded = {name: open(os.path.join(work, name), "rb").read() for name in OUTPUTS}
+
+            code, output = run(work, [FRAMES, BATCH, "--frame-rate=%d" % FRAME_RATE, "--replay=faults.cap"])
+            check("replay: exit status", code == 0, "exit %d" % code)
+            for name in OUTPUTS:
+                replayed = open(os.path.join(work, name), "rb").read()
+                check("replay: %s identical" % name, replayed == recorded[name])
+
+            code, output = run(work, [FRAMES, BATCH, "--stream"], {"PMU_SIM_SLIP_EVERY": "5000"})
+            frames, bins, times = read_frames(work)
+            invalid = sum(1 for frame in frames if not frame[1])
+            check("slips: exit status", code == 0, "exit %d" % code)
+            check("slips: frames written", bins == FRAMES and times == FRAMES,
+                  "SPIBin.txt %d, FrameTimes.txt %d lines" % (bins, times))
+            check("slips: checksums after re-framing", invalid == 0, "%d invalid" % invalid)
+            slips = re.search(r"Re-framed: (\d+) times", output)
+            check("slips: stream re-framed", slips is not None and int(slips.group(1)) > 0,
+                  "Re-framed: %s times" % (slips.group(1) if slips else "?"))
+    finally:
+        if keep:
+            print("Files kept in " + work)
+        else:
+            shutil.rmtree(work, ignore_errors=True)
+
+    print("%d checks failed" % len(failures) if failures else "All checks passed")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
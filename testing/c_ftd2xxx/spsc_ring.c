@@ -0,0 +1,138 @@
+/*
+ * spsc_ring.c
+ * Single-producer/single-consumer lock-free ring of preallocated batch slots
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc_ring.h"
+#include "pmu_mem.h"
+
+// Spin this many times (yielding) before falling back to 1 ms sleeps
+#define RING_SPIN_LIMIT 200
+
+bool Ring_Create(SpscRing* ring, const char* name, unsigned int slotCount, unsigned int slotSize)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->name = name;
+    ring->slotCount = slotCount;
+    ring->slotSize = slotSize;
+
+    ring->slots = (RingSlot*)Mem_Calloc(slotCount, sizeof(RingSlot));
+    ring->storage = (unsigned char*)Mem_Alloc((size_t)slotCount * slotSize);
+    if (!ring->slots || !ring->storage) {
+        Ring_Destroy(ring);
+        return false;
+    }
+
+    for (unsigned int i = 0; i < slotCount; i++) {
+        ring->slots[i].data = ring->storage + (size_t)i * slotSize;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return true;
+}
+
+void Ring_Destroy(SpscRing* ring)
+{
+    Mem_Free(ring->slots);
+    Mem_Free(ring->storage);
+    ring->slots = NULL;
+    ring->storage = NULL;
+}
+
+static void Ring_Backoff(int* spins)
+{
+    if (++(*spins) < RING_SPIN_LIMIT) {
+        THREAD_YIELD();
+    } else {
+        THREAD_SLEEP_MS(1);
+    }
+}
+
+RingSlot* Ring_BeginWrite(SpscRing* ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= ring->slotCount) {
+        int spins = 0;
+        ring->producerStalls++;
+        do {
+            Ring_Backoff(&spins);
+            tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        } while (head - tail >= ring->slotCount);
+    }
+
+    return &ring->slots[head % ring->slotCount];
+}
+
+void Ring_EndWrite(SpscRing* ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed) + 1;
+    unsigned int occupancy = head - atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    ring->occupancySum += occupancy;
+    ring->occupancySamples++;
+    if (occupancy > ring->highWater) {
+        ring->highWater = occupancy;
+    }
+
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+}
+
+RingSlot* Ring_BeginRead(SpscRing* ring)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        int spins = 0;
+        ring->consumerStalls++;
+        do {
+            Ring_Backoff(&spins);
+            head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        } while (head == tail);
+    }
+
+    return &ring->slots[tail % ring->slotCount];
+}
+
+// Oldest published slot, NULL instead of waiting if there is none
+RingSlot* Ring_TryBeginRead(SpscRing* ring)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        ring->consumerStalls++;
+        return NULL;
+    }
+    return &ring->slots[tail % ring->slotCount];
+}
+
+void Ring_EndRead(SpscRing* ring)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+unsigned int Ring_Occupancy(SpscRing* ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+void Ring_PrintStats(const SpscRing* ring)
+{
+    double avgOccupancy = ring->occupancySamples ?
+        (double)ring->occupancySum / ring->occupancySamples : 0.0;
+
+    printf("  %-8s slots %u, avg occupancy %.2f, high water %u, "
+           "producer stalls %lu, consumer stalls %lu\n",
+           ring->name, ring->slotCount, avgOccupancy, ring->highWater,
+           ring->producerStalls, ring->consumerStalls);
+}
@@ -0,0 +1,56 @@
+/*
+ * spsc_ring.h
+ * Single-producer/single-consumer lock-free ring of preallocated batch slots
+ *
+ * The producer fills a slot in place (Ring_BeginWrite / Ring_EndWrite) and the
+ * consumer processes it in place (Ring_BeginRead / Ring_EndRead, or
+ * Ring_TryBeginRead not to wait on an empty ring), so batches move between
+ * pipeline stages without copies. Each side only ever writes its own index,
+ * which makes acquire/release ordering on head/tail sufficient.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdbool.h>
+#include "pmu_thread.h"
+
+typedef struct {
+    unsigned char* data;        // Slot payload (slotSize bytes)
+    int samples;                // Frames held in the slot, 0 marks end of stream
+    unsigned long batch;        // Batch sequence number
+    unsigned long batchMs;      // Time the producer spent filling the slot
+    unsigned long long timeNs;  // Host time the last frame came off the wire
+} RingSlot;
+
+typedef struct {
+    const char* name;
+    RingSlot* slots;
+    unsigned char* storage;
+    unsigned int slotCount;
+    unsigned int slotSize;
+
+    atomic_uint head;           // Slots published by the producer
+    atomic_uint tail;           // Slots released by the consumer
+
+    // Statistics (each field is written by one side only)
+    unsigned long producerStalls;   // Times the producer found the ring full
+    unsigned long consumerStalls;   // Times the consumer found the ring empty
+    unsigned long occupancySum;     // Sum of occupancy sampled at each publish
+    unsigned long occupancySamples;
+    unsigned int highWater;         // Maximum occupancy seen
+} SpscRing;
+
+bool Ring_Create(SpscRing* ring, const char* name, unsigned int slotCount, unsigned int slotSize);
+void Ring_Destroy(SpscRing* ring);
+
+RingSlot* Ring_BeginWrite(SpscRing* ring);
+void Ring_EndWrite(SpscRing* ring);
+RingSlot* Ring_BeginRead(SpscRing* ring);
+RingSlot* Ring_TryBeginRead(SpscRing* ring);
+void Ring_EndRead(SpscRing* ring);
+
+unsigned int Ring_Occupancy(SpscRing* ring);
+void Ring_PrintStats(const SpscRing* ring);
+
+#endif // SPSC_RING_H